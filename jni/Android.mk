@@ -20,11 +20,89 @@ LOCAL_MODULE    := btutil
 LOCAL_SRC_FILES := btutil.c
 include $(BUILD_STATIC_LIBRARY)
 
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdstorage
+LOCAL_SRC_FILES := wd_storage.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdsamples
+LOCAL_SRC_FILES := wd_samples.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdlistener
+LOCAL_SRC_FILES := wd_listener.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdfilter
+LOCAL_SRC_FILES := wd_filter.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdhci
+LOCAL_SRC_FILES := wd_hci.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdlinkmon
+LOCAL_SRC_FILES := wd_linkmon.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdfusion
+LOCAL_SRC_FILES := wd_fusion.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdclock
+LOCAL_SRC_FILES := wd_clock.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdgateway
+LOCAL_SRC_FILES := wd_gateway.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdshm
+LOCAL_SRC_FILES := wd_shm.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdjournal
+LOCAL_SRC_FILES := wd_journal.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdsession
+LOCAL_SRC_FILES := wd_session.c
+include $(BUILD_STATIC_LIBRARY)
+
+# aux, which will be built statically
+include $(CLEAR_VARS)
+LOCAL_MODULE    := wdpool
+LOCAL_SRC_FILES := wd_pool.c
+include $(BUILD_STATIC_LIBRARY)
+
 # second lib, which will depend on and include the first one
 include $(CLEAR_VARS)
 LOCAL_MODULE    := BTL
 LOCAL_SRC_FILES := BTL.c
-LOCAL_STATIC_LIBRARIES := hci btutil
+LOCAL_STATIC_LIBRARIES := wdhci hci btutil wdstorage wdsamples wdlistener wdfilter wdlinkmon wdfusion wdclock wdgateway wdshm wdjournal wdsession wdpool
 LOCAL_LDLIBS := -L$(SYSROOT)/usr/lib -llog
 include $(BUILD_SHARED_LIBRARY)  
 LOCAL_CFLAGS := -g
\ No newline at end of file
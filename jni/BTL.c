@@ -29,19 +29,34 @@
 #include <jni.h>
 #include <sys/ioctl.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
+#include <sys/poll.h>
 
 #include "bluetooth.h"
 #include "l2cap.h"
 #include "btutil.h"
 #include "hci.h"
+#include "hci_lib.h"
 #include "android/log.h"
 #include "wii_droid_defs.h"
+#include "wd_storage.h"
+#include "wd_samples.h"
+#include "wd_listener.h"
+#include "wd_hci.h"
+#include "wd_linkmon.h"
+#include "wd_fusion.h"
+#include "wd_clock.h"
+#include "wd_gateway.h"
+#include "wd_journal.h"
+#include "wd_session.h"
+#include "wd_pool.h"
 
 #define GENERAL_ERROR				-1
 #define NEGATIVE_DEVICE_COUNT		-2
@@ -52,42 +67,143 @@
 #define BATTERY_LOW					-7
 #define OPERATION_SUCCESSFUL 		1
 
+/* How often a board going away looks again for a read or write its callers wait for (ms) */
+#define WD_BOARD_DRAIN_POLL			100
+/* How long connecting waits for the board to answer the status request (ms) */
+#define WD_STATUS_TIMEOUT			2000
+
 /* Variable Definition */
 struct wiimote *wiimote_obj = NULL;
+/* Guards wiimote_obj, the refs and the listeners of the boards, board_cond is signalled as the 
+ * last ref goes */
+pthread_mutex_t board_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t board_cond = PTHREAD_COND_INITIALIZER;
 
 int isCalibrationDataValid = FALSE;
 struct balance_cal cal_data;
 
 int isBalanceDataValid = FALSE;
-struct wd_balance_mesg *balance_mesg;
-
-int blnShouldRouterThreadContinue = 1;
-int blnShouldStatusThreadContinue = 1;
 
 int blnIsRouterThreadWorking = 0;
 int blnIsStatusThreadWorking = 0;
+int blnIsBatteryThreadWorking = 0;
+int blnIsSupervisorThreadWorking = 0;
 
 int intBatteryLevel = 0;
 
+/* Sessions set aside by holdBoard for the platform, and the fusion running over them. Both are 
+ * under fusion_mutex, which is taken before board_mutex. */
+pthread_mutex_t fusion_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct wiimote *held_boards[WD_FUSION_MAX_BOARDS];
+int held_count = 0;
+struct wd_fusion *fusion = NULL;
+/* Serves the streams to other processes once startGateway has been called */
+struct wd_gateway *gateway = NULL;
+/* Clients of wiimote_obj, which outlives the last one for a while */
+struct wd_session session;
+/* Session slots for wiimote_obj and the held boards, made as the library loads */
+struct wd_pool pool;
+
+/* Battery byte thresholds per board model. Not all boards report the same byte when their 
+   batteries are weak, so these are kept conservative; the all-zero corner signature seen in 
+   wd_process_ext is the final word on a starving board. */
+const struct wd_battery_profile wd_battery_profiles[] = 
+{
+	{ "Nintendo RVL-WBC-01", 0x83, 0x7A, 0x69 },	/* Balance board */
+	{ "Nintendo RVL-CNT-01", 0xD0, 0x30, 0x18 },	/* Wiimote */
+	{ NULL, 0, 0, 0 }
+};
+
 JavaVM* jvm = 0;
+/* Local Bluetooth controller, opened on the first discovery */
+struct wd_hci hci_ctl;
+/* The adapters new boards are spread over, and the contexts of those other than hci_ctl's */
+struct wd_hci_adapters hci_adapters;
+struct wd_hci hci_links[WD_HCI_MAX_ADAPTERS];
+
+static jint wd_fetch_calibration(JNIEnv* env, jobject thiz);
+static jint wd_read_samples(JNIEnv* env, jobject buffer, int tap, const struct timespec *deadline);
+static void wd_deadline(struct timespec *deadline, int timeout);
+static int wd_status_count(struct wiimote *wiimote);
+static int wd_wait_status(struct wiimote *wiimote, int count, int timeout);
+static int wd_apply_supervision_timeout(struct wiimote *wiimote);
+static void wd_rank_candidates(int num_rsp, int *order);
+static struct wd_hci *wd_hci_for_adapter(int dev_id);
+static int wd_stream_watchdog(struct wiimote *wiimote, int *strikes);
+static int wd_held_index(const bdaddr_t *bdaddr);
+static void wd_fusion_drop(void);
+static void *wd_slot_create(struct wd_pool_slot *slot);
+static struct wiimote *wd_swap_board(struct wiimote *wiimote);
+static struct wd_listener *wd_swap_listener(struct wiimote *wiimote, struct wd_listener *listener);
+static void wd_drop_listener(struct wd_listener *listener);
+static struct wiimote *wd_board_get(void);
+static void wd_board_put(struct wiimote *wiimote);
+static void wd_board_drain(struct wiimote *wiimote);
+static struct wd_sample_ring *wd_hold_samples(void);
+static void wd_slot_destroy(void *data);
+static void wd_drain_pipe(int fd);
+static void wd_release_board(void *arg);
+static void wd_board_idle(void *arg);
+static int wd_register_natives(JNIEnv *env);
+static jint wd_jni_intConnect(JNIEnv* env, jobject thiz, int scantime);
+static jint wd_jni_startReadingData(JNIEnv* env, jobject thiz);
+static jint wd_jni_getCalibrationData(JNIEnv* env, jobject thiz);
+static jint wd_jni_disconnect();
+static void wd_jni_stopGateway();
+static jint wd_jni_releaseBoards();
 
 jint JNI_OnLoad(JavaVM *vm, void *reserved)
 {
+	JNIEnv *env;
+	int i;
+
 	jvm = vm;
+	/* The natives are bound here once, not looked up by name on their first call */
+	if ((*vm)->GetEnv(vm, (void **)&env, JNI_VERSION_1_2) != JNI_OK)
+		return JNI_ERR;
+	if (wd_register_natives(env) || wd_listener_cache_ids(env))
+		return JNI_ERR;
+	if (wd_hci_init(&hci_ctl) || wd_hci_adapters_init(&hci_adapters))
+		return JNI_ERR;
+	for (i = 0; i < WD_HCI_MAX_ADAPTERS; i++) 
+	{
+		if (wd_hci_init(&hci_links[i]))
+			return JNI_ERR;
+	}
+	if (wd_session_init(&session, &wd_release_board, &wd_board_idle, NULL))
+		return JNI_ERR;
+	/* Connecting only hands the threads of a slot their jobs, they are all started here */
+	if (wd_pool_init(&pool, WD_FUSION_MAX_BOARDS + 1, &wd_slot_create, &wd_slot_destroy))
+		return JNI_ERR;
 	//native lib loaded
 	return JNI_VERSION_1_2; //1_2 1_4
 }
 
 void JNI_OnUnload(JavaVM *vm, void *reserved)
 {
+	int i;
+
+	/* Whatever is lingering goes now, so do a board which never made it to the session and the 
+	 * held ones. Their slots are free afterwards, and the pool joins every thread. */
+	wd_jni_stopGateway();
+	wd_session_destroy(&session);
+	wd_release_board(NULL);
+	wd_jni_releaseBoards();
+	wd_pool_destroy(&pool);
 	jvm = 0;
+	for (i = 0; i < WD_HCI_MAX_ADAPTERS; i++) 
+	{
+		wd_hci_destroy(&hci_links[i]);
+	}
+	wd_hci_adapters_destroy(&hci_adapters);
+	wd_hci_destroy(&hci_ctl);
 	//__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Loaded revision 36");
 	//native lib unloaded
 }
 
 /* Reads LIB version
 */
-jstring Java_iEpi_Scale_BoardInterface_intReadVersion( JNIEnv* env,jobject thiz )
+static jstring wd_jni_intReadVersion( JNIEnv* env,jobject thiz )
 {
     return (*env)->NewStringUTF(env, 
 				"Wii Balance Board Controller for Android. v1.0 (C)2011 Mohammad Hashemian, m.hashemian@gmail.com");
@@ -100,11 +216,19 @@ jstring Java_iEpi_Scale_BoardInterface_intReadVersion( JNIEnv* env,jobject thiz
 		0 if there is no device to connect to, 
 		1 if the connection established successfully.		
 */
-jint Java_iEpi_Scale_BoardInterface_ConnectCalibrateRead(JNIEnv* env, jobject thiz, int scantime)
+static jint wd_jni_ConnectCalibrateRead(JNIEnv* env, jobject thiz, int scantime)
 {
+	struct wiimote *wiimote;
 	int intLoopCounter = 0;
 	
-	jint result = Java_iEpi_Scale_BoardInterface_intConnect(env, thiz, scantime);
+	// A session still up (lingering, or held by another client) is taken as it is
+	if(wd_session_retain(&session) > 0)
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Reusing the current session ...");
+		return OPERATION_SUCCESSFUL;
+	}
+	
+	jint result = wd_jni_intConnect(env, thiz, scantime);
 	if(result != OPERATION_SUCCESSFUL)
 	{
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Connection failed with error %d ...", result);
@@ -112,45 +236,32 @@ jint Java_iEpi_Scale_BoardInterface_ConnectCalibrateRead(JNIEnv* env, jobject th
 	}
 
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Connection successful, continue ...");
-	sleep(2);
+	// Held until the end, a disconnect from another thread meanwhile waits for us. It has to be 
+	// let go before disconnecting or opening the session, which may wait for it too.
+	if((wiimote = wd_board_get()) == NULL)
+		return NO_CONNECTION_CREATED;
 	
-	// Retrieve calibration data from the board ...
-	int blnFinishedCalibration = FALSE;
-	for(intLoopCounter = 0;intLoopCounter < MAX_CAL_TRIAL && !blnFinishedCalibration;intLoopCounter++)
+	// A board we have already met has its calibration data on disk. In that case samples are 
+	// calibrated from the very first one, and the cached data is only confirmed with a single read 
+	// report later.
+	int blnCalibrationCached = FALSE;
+	if(wd_load_cached_calibration(wiimote, &cal_data) == 0)
 	{
-		result = Java_iEpi_Scale_BoardInterface_getCalibrationData(env, thiz);
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Calibration data result is %d ...", result);
-		if(result == OPERATION_SUCCESSFUL)
-			if(Java_iEpi_Scale_BoardInterface_getIsCalibrationDataValid() == TRUE)
-				blnFinishedCalibration = TRUE;
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Using cached calibration data ...");
+		isCalibrationDataValid = TRUE;
+		blnCalibrationCached = TRUE;
+		wd_sample_ring_set_calibration(wiimote->samples, &cal_data);
 	}
 
-	if(blnFinishedCalibration == FALSE)
-	{
-		Java_iEpi_Scale_BoardInterface_disconnect();
-		return result;
-	}
-	
-	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Making sure the battery level is enough ...");
-	sleep(2);
-	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Battery level was %.2X ...", intBatteryLevel);
-	// Currently this section is deactivated, as when I tested the program on few boards, 
-	// turned out that not all of them return the same value as battery level when they have a low battery. So for now, 
-	// instead of checking this here, I check it in the Java code whether the value I get from sensors is minimum or not 
-	// (-50 KG). If the board returns -50 or below, most probably there is an issue with the battery. 
-	if(0)//intBatteryLevel < 0x00)
-	{
-		Java_iEpi_Scale_BoardInterface_disconnect();
-		return BATTERY_LOW;
-	}
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Going to read data from the board ...");
 	//
-	// Start reading data from the board ...
+	// Start reading data from the board before anything else. Until the calibration data is 
+	// known, the samples are kept raw in the sample ring and calibrated once it arrives ...
 	//
 	int blnStartedReading = FALSE;
 	for(intLoopCounter = 0;intLoopCounter < MAX_READ_TRIAL && !blnStartedReading;intLoopCounter++)
 	{
-		result = Java_iEpi_Scale_BoardInterface_startReadingData(env, thiz);
+		result = wd_jni_startReadingData(env, thiz);
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: report result is %d ...", result);
 		if(result == OPERATION_SUCCESSFUL)
 			blnStartedReading = TRUE;
@@ -161,11 +272,100 @@ jint Java_iEpi_Scale_BoardInterface_ConnectCalibrateRead(JNIEnv* env, jobject th
 	//
 	if(blnStartedReading == FALSE)
 	{
-		Java_iEpi_Scale_BoardInterface_disconnect();
+		wd_board_put(wiimote);
+		wd_jni_disconnect();
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Reading failed. Returning error ...");
 		return result;
 	}
+
+	//
+	// The board is streaming now, the calibration data is read next to the stream. Make sure the 
+	// cached calibration still belongs to the board, or retrieve it from the board ...
+	//
+	if(blnCalibrationCached && wd_validate_calibration(wiimote, &cal_data))
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Cached calibration data is stale, reading it again ...");
+		wd_cal_cache_remove(&wiimote->bdaddr);
+		blnCalibrationCached = FALSE;
+	}
+	if(!blnCalibrationCached)
+	{
+		result = wd_fetch_calibration(env, thiz);
+		if(result != OPERATION_SUCCESSFUL)
+		{
+			wd_board_put(wiimote);
+			wd_jni_disconnect();
+			return result;
+		}
+	}
+
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Making sure the battery level is enough ...");
+	int intStatusCount = wd_status_count(wiimote);
+	if (wd_request_status(wiimote))
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Status request failed, relying on the periodic poll ...");
+	}
+	else if (wd_wait_status(wiimote, intStatusCount, WD_STATUS_TIMEOUT))
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: No status report yet, relying on the periodic poll ...");
+	}
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Battery level was %.2X ...", intBatteryLevel);
+	// Not all boards return the same value as battery level when they have a low battery, so the level 
+	// is judged against the profile of the board model (see wd_battery_profiles). Only a critical level 
+	// or the all-zero sensor signature stops the connection here; a low level is left to the Java code.
+	if(wiimote->state.battery_event >= WD_BATTERY_CRITICAL)
+	{
+		wd_board_put(wiimote);
+		wd_jni_disconnect();
+		return BATTERY_LOW;
+	}
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Done. Connection successful. ");
+	wd_board_put(wiimote);
+	wd_session_open(&session);
+	return OPERATION_SUCCESSFUL;
+}
+
+/* Reads the calibration data from the board, retrying up to MAX_CAL_TRIAL times.
+	Returns:
+		OPERATION_SUCCESSFUL	If the calibration data is valid,
+		the last error			Otherwise.
+*/
+static jint wd_fetch_calibration(JNIEnv* env, jobject thiz)
+{
+	int intLoopCounter;
+	jint result = GENERAL_ERROR;
+
+	for(intLoopCounter = 0;intLoopCounter < MAX_CAL_TRIAL;intLoopCounter++)
+	{
+		result = wd_jni_getCalibrationData(env, thiz);
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "StartupModule: Calibration data result is %d ...", result);
+		if(result == OPERATION_SUCCESSFUL)
+			if(isCalibrationDataValid == TRUE)
+				return OPERATION_SUCCESSFUL;
+	}
+	return result;
+}
+
+/* Tells the driver where it can keep its files (e.g. the calibration cache). Java should pass 
+   the files directory of the application.
+*/
+static jint wd_jni_setStorageDirectory(JNIEnv* env, jobject thiz, jstring path)
+{
+	const char *dir = (*env)->GetStringUTFChars(env, path, NULL);
+	int ret;
+
+	if (!dir)
+		return GENERAL_ERROR;
+	ret = wd_storage_set_dir(dir);
+	(*env)->ReleaseStringUTFChars(env, path, dir);
+	if (ret)
+		return GENERAL_ERROR;
+
+	/* Whatever a session killed with the process left behind goes to the sample logs */
+	if ((ret = wd_journal_recover_all()) > 0) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "setStorageDirectory: %d samples recovered from the journals", ret);
+	}
 	return OPERATION_SUCCESSFUL;
 }
 
@@ -177,92 +377,85 @@ jint Java_iEpi_Scale_BoardInterface_ConnectCalibrateRead(JNIEnv* env, jobject th
 		NO_BT_DEV_FOUND					If there is 0 device found
 		SUCCESSFUL_DISCOVERY			The operation was successful
 */
-jint Java_iEpi_Scale_BoardInterface_intConnect( JNIEnv* env,jobject thiz, int scantime )
+static jint wd_jni_intConnect( JNIEnv* env,jobject thiz, int scantime )
 {
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Entered the discovery function - Revision 39"); 
 	//---
-	bdaddr_t 	btDevAddr, dev;
-	bdaddr_t 	src, dst, dst_first;
+	bdaddr_t 	dst;
 	uint8_t 	class[3];
 	char 		strAddr[18];
 	//-------------		
-	bacpy(&btDevAddr, BDADDR_ANY);
-	ba2str(&btDevAddr, strAddr);
-	//
-	// link to device
-	//
-	int devId = hci_devid(strAddr);
-	if (devId < 0) 
-	{
-		devId = hci_get_route(NULL);
-		hci_devba(devId, &src);
-	}
-	else
-	{
-		bacpy(&src, &btDevAddr);
-	}
-		
 	//
-	// open socket
+	// The controller stays open between the calls, only the first one has to find it
 	//
-	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: trying to open the socket ...");
-	int sock = hci_open_dev(devId);
-	if (devId < 0 || sock < 0) 
+	pthread_mutex_lock(&hci_ctl.mutex);
+	if (wd_hci_open(&hci_ctl))
 	{
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Failed to open the socket.");
+		pthread_mutex_unlock(&hci_ctl.mutex);
 		return SOCKET_OPEN_FAILURE;
 	}
 		
 	int length  = scantime;
 	int flags   = IREQ_CACHE_FLUSH;
-	int max_rsp = 255;
-	inquiry_info *info;
-	info = (inquiry_info*)malloc(max_rsp * sizeof(inquiry_info));
+	inquiry_info *info = hci_ctl.results;
 	//
     // start searching for nearby devices
     //
-	int num_rsp = hci_inquiry(devId, 
+	int num_rsp = wd_hci_inquiry(&hci_ctl, 
 			length, //The inquiry lasts for at most 1.28 * length seconds
-			max_rsp, //at most max_rsp devices will be returned
-			NULL, 
-			&info, 
 			flags);
 			
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Finished inquiry");
 	if (num_rsp < 0)
 	{
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Negative number of devices discovered: %d",num_rsp);
-		close(sock);
+		pthread_mutex_unlock(&hci_ctl.mutex);
 		return NEGATIVE_DEVICE_COUNT;
 	}
 	else if(num_rsp == 0)
 	{
-		close(sock);
+		pthread_mutex_unlock(&hci_ctl.mutex);
 		return NO_BT_DEV_FOUND;
 	}
 
+	//
+	// nearest first, boards connected before ahead of strangers
+	//
+	int order[WD_HCI_MAX_RSP];
+	wd_rank_candidates(num_rsp, order);
+
 	int rsp_counter,j, err = -1, found = -1;
 	for (rsp_counter = 0; rsp_counter < num_rsp; rsp_counter++) 
 	{
+		int candidate = order[rsp_counter];
+		//
+		// Boards held for the platform are connected already
+		//
+		pthread_mutex_lock(&fusion_mutex);
+		int held = wd_held_index(&(info+candidate)->bdaddr);
+		pthread_mutex_unlock(&fusion_mutex);
+		if (held >= 0)
+			continue;
 		//
 		// read remote name
 		//
 		char name[248] = {0};
 		memset(name, 0, sizeof(name));
-		if (hci_read_remote_name(sock, &(info+rsp_counter)->bdaddr, sizeof(name), name, 0) < 0)
+		if (wd_hci_read_remote_name(&hci_ctl, &(info+candidate)->bdaddr, name, sizeof(name)) < 0)
 		        strcpy(name, "[unknown]");
 		//
 		// read class
 		//
-		memcpy(class, (info+rsp_counter)->dev_class, 3);
+		memcpy(class, (info+candidate)->dev_class, 3);
 		//
 		// read Bluetooth remote address
 		//
-		bacpy(&dst, &(info+rsp_counter)->bdaddr);
+		bacpy(&dst, &(info+candidate)->bdaddr);
 		ba2str(&dst, strAddr);
 
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "found another device called %s\n", name);
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Device address is: %s\n", strAddr);
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Device address is: %s, RSSI %d\n", strAddr, hci_ctl.rssi[candidate]);
 		//
 		// Compare the name of the recently found device with the Nintendo Balance Board name ...
 		//
@@ -271,52 +464,73 @@ jint Java_iEpi_Scale_BoardInterface_intConnect( JNIEnv* env,jobject thiz, int sc
 		   (strcmp(strAddr,"A4:C0:E1:93:D2:FC") == 0))
 		{
 			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Found a balance board ...");
-			struct sockaddr_l2 remote_addr;
+			pthread_mutex_unlock(&hci_ctl.mutex);
 			int ctl_socket = -1, int_socket = -1; // Control and Interrupt socket.
-		
-			//
-			// Connect to Wiimote 
+			struct wd_hci_adapter adapter;
+			struct wd_hci *link_hci = NULL;
+			struct wiimote *wiimote, *previous;
+
 			//
+			// Through the least loaded adapter, the discovering one if that fails
 			//
-			// Control Channel
-			// 
-			memset(&remote_addr, 0, sizeof remote_addr);
-			remote_addr.l2_family = AF_BLUETOOTH;
-			remote_addr.l2_bdaddr = (info+rsp_counter)->bdaddr;
-			remote_addr.l2_psm = htobs(CTL_PSM);
-			if ((ctl_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) 
-			{
-				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Socket creation error (control socket).");
-				goto ERR_HND;
-			}
-			if (connect(ctl_socket, (struct sockaddr *)&remote_addr, sizeof remote_addr)) 
+			if (wd_hci_pick_adapter(&hci_adapters, &adapter) == 0)
+				link_hci = wd_hci_for_adapter(adapter.dev_id);
+			if (!link_hci) 
 			{
-				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Cannot connect to control socket.");
-				goto ERR_HND;
+				link_hci = &hci_ctl;
+				bacpy(&adapter.bdaddr, &hci_ctl.bdaddr);
 			}
-
+		
 			//
-			// Interrupt Channel
+			// Connect to Wiimote 
 			//
-			remote_addr.l2_psm = htobs(INT_PSM);
-			if ((int_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) 
+			if (wd_l2cap_connect(&adapter.bdaddr, &dst, &ctl_socket, &int_socket)) 
 			{
-				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Error in creating interrupt socket.");
-				goto ERR_HND;
-			}
-			if (connect(int_socket, (struct sockaddr *)&remote_addr, sizeof remote_addr)) 
-			{
-				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Cannot connect to interrupt socket.");
-				goto ERR_HND;
+				// Out of reach after all, try the next one
+				found = candidate;
+				pthread_mutex_lock(&hci_ctl.mutex);
+				continue;
 			}
 		
-			if ((wiimote_obj = wd_create_new_wii(ctl_socket, int_socket, flags)) == NULL) 
+			if ((wiimote = wd_create_new_wii(ctl_socket, int_socket, flags | WD_FLAG_RECONNECT)) == NULL) 
 			{
 				// Raises its own error 
 				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Error in creating a new Wii device.");
 				goto ERR_HND;
 			}
+			wiimote->battery_profile = wd_find_battery_profile(name);
+			bacpy(&wiimote->bdaddr, &dst);
+			bacpy(&wiimote->adapter, &adapter.bdaddr);
+			wiimote->hci = link_hci;
+			wd_apply_supervision_timeout(wiimote);
+			if (gateway)
+				wd_gateway_attach(gateway, 0, wiimote->samples);
+
+			/* Nothing depends on the monitor, the session goes on without it */
+			if ((wiimote->linkmon = malloc(sizeof *wiimote->linkmon)) != NULL) 
+			{
+				if (wd_linkmon_start(wiimote->linkmon, link_hci, &dst)) 
+				{
+					free(wiimote->linkmon);
+					wiimote->linkmon = NULL;
+				}
+			}
+
+			/* Same for the journal, the samples are only less safe without it */
+			if ((wiimote->journal = malloc(sizeof *wiimote->journal)) != NULL) 
+			{
+				if (wd_journal_open(wiimote->journal, &dst)) 
+				{
+					free(wiimote->journal);
+					wiimote->journal = NULL;
+				}
+				else
+					wd_sample_ring_set_journal(wiimote->samples, wiimote->journal);
+			}
 		
+			/* Callers only get to see the board once it is set up */
+			if ((previous = wd_swap_board(wiimote)) != NULL)
+				wd_disconnect(previous);
 			return OPERATION_SUCCESSFUL;
 		
 		ERR_HND:
@@ -336,15 +550,158 @@ jint Java_iEpi_Scale_BoardInterface_intConnect( JNIEnv* env,jobject thiz, int sc
 				}
 			}
 			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "intConnect: Returning WII_CONNECTION_CREATION_ERR ...");
-			close(sock);
 			return WII_CONNECTION_CREATION_ERR;
 		}
 	}
-	if (sock >= 0) 
-		close(sock);
-	bt_free(info);
+	pthread_mutex_unlock(&hci_ctl.mutex);
     //-------------
-    return NO_CONNECTION_CREATED;
+    return (found >= 0) ? WII_CONNECTION_CREATION_ERR : NO_CONNECTION_CREATED;
+}
+
+/* Returns the controller context of adapter dev_id, opening one if needed; NULL if the adapter 
+   cannot be opened. The free context picked stays locked until it is open, and the contexts are 
+   locked in order, so two connects cannot pick the same one for different adapters.
+*/
+static struct wd_hci *wd_hci_for_adapter(int dev_id)
+{
+	struct wd_hci *hci = NULL;
+	int i, err;
+
+	pthread_mutex_lock(&hci_ctl.mutex);
+	err = (hci_ctl.dd >= 0) && (hci_ctl.dev_id == dev_id);
+	pthread_mutex_unlock(&hci_ctl.mutex);
+	if (err)
+		return &hci_ctl;
+	for (i = 0; i < WD_HCI_MAX_ADAPTERS; i++) 
+	{
+		pthread_mutex_lock(&hci_links[i].mutex);
+		if ((hci_links[i].dd >= 0) && (hci_links[i].dev_id == dev_id)) 
+		{
+			pthread_mutex_unlock(&hci_links[i].mutex);
+			if (hci)
+				pthread_mutex_unlock(&hci->mutex);
+			return &hci_links[i];
+		}
+		if (!hci && (hci_links[i].dd < 0)) 
+		{
+			hci = &hci_links[i];
+			continue;
+		}
+		pthread_mutex_unlock(&hci_links[i].mutex);
+	}
+	if (!hci)
+		return NULL;
+
+	err = wd_hci_open_dev(hci, dev_id);
+	pthread_mutex_unlock(&hci->mutex);
+	return err ? NULL : hci;
+}
+
+/* Orders the results of the last inquiry for connection attempts: by RSSI, with 
+   WD_RANK_CACHED_BONUS for the boards which have their calibration data cached, i.e. which have 
+   been used on this phone before. Must be called with the hci_ctl mutex held.
+*/
+static void wd_rank_candidates(int num_rsp, int *order)
+{
+	unsigned char data[WD_CAL_CACHE_DATA_LEN];
+	int score[WD_HCI_MAX_RSP];
+	int i, j, candidate;
+
+	for (i = 0; i < num_rsp; i++) 
+	{
+		score[i] = (hci_ctl.rssi[i] == WD_HCI_NO_RSSI) ? WD_RANK_UNKNOWN_RSSI : hci_ctl.rssi[i];
+		if (wd_cal_cache_load(&hci_ctl.results[i].bdaddr, data) == 0)
+			score[i] += WD_RANK_CACHED_BONUS;
+
+		/* Insertion, ties keep the order of the inquiry */
+		for (j = i; (j > 0) && (score[order[j - 1]] < score[i]); j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	for (i = 0; i < num_rsp; i++) 
+	{
+		candidate = order[i];
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_rank_candidates: %d. result %d, score %d", i + 1, candidate, score[candidate]);
+	}
+}
+
+/* Opens the control and interrupt channels to the board, through the local adapter src (NULL for 
+   any).
+	Returns:
+		-1 if any of the channels cannot be connected, in which case both are closed,
+		 0 otherwise.
+*/
+int wd_l2cap_connect(const bdaddr_t *src, const bdaddr_t *bdaddr, int *ctl_socket, int *int_socket)
+{
+	struct sockaddr_l2 local_addr, remote_addr;
+
+	*ctl_socket = -1;
+	*int_socket = -1;
+
+	memset(&local_addr, 0, sizeof local_addr);
+	local_addr.l2_family = AF_BLUETOOTH;
+	bacpy(&local_addr.l2_bdaddr, src ? src : BDADDR_ANY);
+
+	//
+	// Control Channel
+	// 
+	memset(&remote_addr, 0, sizeof remote_addr);
+	remote_addr.l2_family = AF_BLUETOOTH;
+	bacpy(&remote_addr.l2_bdaddr, bdaddr);
+	remote_addr.l2_psm = htobs(CTL_PSM);
+	if ((*ctl_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Socket creation error (control socket).");
+		goto ERR_HND;
+	}
+	if (bind(*ctl_socket, (struct sockaddr *)&local_addr, sizeof local_addr)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Cannot bind control socket to the adapter.");
+		goto ERR_HND;
+	}
+	if (connect(*ctl_socket, (struct sockaddr *)&remote_addr, sizeof remote_addr)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Cannot connect to control socket.");
+		goto ERR_HND;
+	}
+
+	//
+	// Interrupt Channel
+	//
+	remote_addr.l2_psm = htobs(INT_PSM);
+	if ((*int_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Error in creating interrupt socket.");
+		goto ERR_HND;
+	}
+	if (wd_clock_enable_kernel_stamps(*int_socket)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: No kernel receive times on the interrupt socket.");
+	}
+	if (bind(*int_socket, (struct sockaddr *)&local_addr, sizeof local_addr)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Cannot bind interrupt socket to the adapter.");
+		goto ERR_HND;
+	}
+	if (connect(*int_socket, (struct sockaddr *)&remote_addr, sizeof remote_addr)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Cannot connect to interrupt socket.");
+		goto ERR_HND;
+	}
+	return 0;
+
+ERR_HND:
+	if (*ctl_socket != -1) 
+	{
+		close(*ctl_socket);
+		*ctl_socket = -1;
+	}
+	if (*int_socket != -1) 
+	{
+		close(*int_socket);
+		*int_socket = -1;
+	}
+	return -1;
 }
 
 /* Requests the calibration data from the board and fills the related variables with the received 
@@ -353,194 +710,1277 @@ jint Java_iEpi_Scale_BoardInterface_intConnect( JNIEnv* env,jobject thiz, int sc
    	GENERAL_ERROR			If getting calibration data fails.
 	OPERATION_SUCCESSFUL 	Otherwise   	
 */
-jint Java_iEpi_Scale_BoardInterface_getCalibrationData( JNIEnv* env, jobject thiz)
+static jint wd_jni_getCalibrationData( JNIEnv* env, jobject thiz)
 {
+	struct wiimote *wiimote;
+
 	isCalibrationDataValid = FALSE;
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Discover: Getting balance board calibration data.");
-	unsigned char buf[24];
+	unsigned char buf[WD_BALANCE_CAL_LEN];
 
-	if (wd_read(wiimote_obj, WD_RW_REG, 0xa40024, 24, buf)) 
+	if ((wiimote = wd_board_get()) == NULL)
+		return GENERAL_ERROR;
+	if (wd_read(wiimote, WD_RW_REG, WD_BALANCE_CAL_OFFSET, WD_BALANCE_CAL_LEN, buf)) 
 	{
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Read error (balancecal)");
+		wd_board_put(wiimote);
 		return GENERAL_ERROR;
 	}
 	
-	(&cal_data)->right_top[0]    = ((uint16_t)buf[0]<<8 | (uint16_t)buf[1]);
-	(&cal_data)->right_bottom[0] = ((uint16_t)buf[2]<<8 | (uint16_t)buf[3]);
-	(&cal_data)->left_top[0]     = ((uint16_t)buf[4]<<8 | (uint16_t)buf[5]);
-	(&cal_data)->left_bottom[0]  = ((uint16_t)buf[6]<<8 | (uint16_t)buf[7]);
-	(&cal_data)->right_top[1]    = ((uint16_t)buf[8]<<8 | (uint16_t)buf[9]);
-	(&cal_data)->right_bottom[1] = ((uint16_t)buf[10]<<8 | (uint16_t)buf[11]);
-	(&cal_data)->left_top[1]     = ((uint16_t)buf[12]<<8 | (uint16_t)buf[13]);
-	(&cal_data)->left_bottom[1]  = ((uint16_t)buf[14]<<8 | (uint16_t)buf[15]);
-	(&cal_data)->right_top[2]    = ((uint16_t)buf[16]<<8 | (uint16_t)buf[17]);
-	(&cal_data)->right_bottom[2] = ((uint16_t)buf[18]<<8 | (uint16_t)buf[19]);
-	(&cal_data)->left_top[2]     = ((uint16_t)buf[20]<<8 | (uint16_t)buf[21]);
-	(&cal_data)->left_bottom[2]  = ((uint16_t)buf[22]<<8 | (uint16_t)buf[23]);
+	wd_parse_balance_cal(buf, &cal_data);
 	isCalibrationDataValid = TRUE;
 
+	// Samples buffered while the calibration data was on its way become available now ...
+	wd_sample_ring_set_calibration(wiimote->samples, &cal_data);
+
+	// Calibration is factory data, keep it for the next time we meet this board ...
+	if (wd_cal_cache_store(&wiimote->bdaddr, buf)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Could not cache the calibration data.");
+	}
+
+	wd_board_put(wiimote);
 	return OPERATION_SUCCESSFUL;
 }
 
+/* Fills balance_cal from the raw calibration block (WD_BALANCE_CAL_LEN bytes, big endian).
+*/
+void wd_parse_balance_cal(const unsigned char *buf, struct balance_cal *balance_cal)
+{
+	balance_cal->right_top[0]    = ((uint16_t)buf[0]<<8 | (uint16_t)buf[1]);
+	balance_cal->right_bottom[0] = ((uint16_t)buf[2]<<8 | (uint16_t)buf[3]);
+	balance_cal->left_top[0]     = ((uint16_t)buf[4]<<8 | (uint16_t)buf[5]);
+	balance_cal->left_bottom[0]  = ((uint16_t)buf[6]<<8 | (uint16_t)buf[7]);
+	balance_cal->right_top[1]    = ((uint16_t)buf[8]<<8 | (uint16_t)buf[9]);
+	balance_cal->right_bottom[1] = ((uint16_t)buf[10]<<8 | (uint16_t)buf[11]);
+	balance_cal->left_top[1]     = ((uint16_t)buf[12]<<8 | (uint16_t)buf[13]);
+	balance_cal->left_bottom[1]  = ((uint16_t)buf[14]<<8 | (uint16_t)buf[15]);
+	balance_cal->right_top[2]    = ((uint16_t)buf[16]<<8 | (uint16_t)buf[17]);
+	balance_cal->right_bottom[2] = ((uint16_t)buf[18]<<8 | (uint16_t)buf[19]);
+	balance_cal->left_top[2]     = ((uint16_t)buf[20]<<8 | (uint16_t)buf[21]);
+	balance_cal->left_bottom[2]  = ((uint16_t)buf[22]<<8 | (uint16_t)buf[23]);
+}
+
+/* Fills balance_cal from the calibration cache, if the board has been seen before.
+	Returns:
+		-1 if there is no cached calibration data for the board,
+		 0 otherwise.
+*/
+int wd_load_cached_calibration(wiimote_t *wiimote, struct balance_cal *balance_cal)
+{
+	unsigned char buf[WD_BALANCE_CAL_LEN];
+
+	if (wd_cal_cache_load(&wiimote->bdaddr, buf))
+		return -1;
+	wd_parse_balance_cal(buf, balance_cal);
+	return 0;
+}
+
+/* Confirms the calibration data against the board by reading its first row (0 KG) only, which 
+   takes a single read report instead of the two needed for the whole block.
+	Returns:
+		-1 if the read fails or the data does not match,
+		 0 otherwise.
+*/
+int wd_validate_calibration(wiimote_t *wiimote, const struct balance_cal *balance_cal)
+{
+	unsigned char buf[WD_BALANCE_CAL_LEN];
+	struct balance_cal board_cal;
+
+	memset(buf, 0, sizeof buf);
+	if (wd_read(wiimote, WD_RW_REG, WD_BALANCE_CAL_OFFSET, WD_BALANCE_CAL_CHECK_LEN, buf)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_validate_calibration: Read error (balancecal)");
+		return -1;
+	}
+	wd_parse_balance_cal(buf, &board_cal);
+
+	if ((board_cal.right_top[0] != balance_cal->right_top[0]) ||
+	    (board_cal.right_bottom[0] != balance_cal->right_bottom[0]) ||
+	    (board_cal.left_top[0] != balance_cal->left_top[0]) ||
+	    (board_cal.left_bottom[0] != balance_cal->left_bottom[0])) 
+	{
+		return -1;
+	}
+	return 0;
+}
+
 /* Sets the report mode of the board to continuously report the weight.
    Returns:
    	GENERAL_ERROR			If setting the report mode fails.
 	OPERATION_SUCCESSFUL 	Otherwise
 */
-jint Java_iEpi_Scale_BoardInterface_startReadingData( JNIEnv* env, jobject thiz)
+static jint wd_jni_startReadingData( JNIEnv* env, jobject thiz)
 {
+	struct wiimote *wiimote;
+	jint ret = OPERATION_SUCCESSFUL;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return GENERAL_ERROR;
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Now is the time to set the report mode.");
 	unsigned char report_mode = 0;
 	toggle_bit(report_mode, WD_RPT_BALANCE);
-	if (wd_update_rpt_mode(wiimote_obj, report_mode))
+	if (wd_update_rpt_mode(wiimote, report_mode))
 	{
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Error setting report mode\n");
-		return GENERAL_ERROR;
+		ret = GENERAL_ERROR;
 	}
-	return OPERATION_SUCCESSFUL;
+	wd_board_put(wiimote);
+	return ret;
 }
 
 /* Stops the device from reporting the weight continuously.
 */ 
-void Java_iEpi_Scale_BoardInterface_stopReadingData( JNIEnv* env, jobject thiz)
+static void wd_jni_stopReadingData( JNIEnv* env, jobject thiz)
 {
+	struct wiimote *wiimote;
+
 	// If the object for WiiMote is not created, return.
-	if (!wiimote_obj)
+	if ((wiimote = wd_board_get()) == NULL)
 		return;
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Now is the time to set the report mode.");
 	unsigned char report_mode = 0;
 	toggle_bit(report_mode, 0x00);
-	if (wd_update_rpt_mode(wiimote_obj, report_mode))
+	if (wd_update_rpt_mode(wiimote, report_mode))
 	{
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Error setting report mode\n");
 	}
+	wd_board_put(wiimote);
 }
 
-/* Disconnects from the board and releases the created resources.
+/* Ends the session of the board, the threads are joined once it is over.
 */
-jint Java_iEpi_Scale_BoardInterface_disconnect()
+static void wd_release_board(void *arg)
 {
-	blnShouldRouterThreadContinue = 0;
-	blnShouldStatusThreadContinue = 0;
-	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Disconnect called.");
-	if (wiimote_obj) 
-	{
-		if (wiimote_obj->int_socket != -1) 
-		{
-			if (close(wiimote_obj->int_socket)) 
-			{
-				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Error in closing interrupt socket.");
-				//return GENERAL_ERROR;
-			}
-		}
-
-		if (wiimote_obj->ctl_socket != -1) 
-		{
-			if (close(wiimote_obj->ctl_socket))
-			{
-				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Error in closing control socket.");
-				//return GENERAL_ERROR;
-			}
-		}
-		
-		int result1 = pthread_kill(wiimote_obj->router_thread,SIGUSR1);
-		int result2 = pthread_kill(wiimote_obj->status_thread,SIGUSR1);
-		
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Router thread is killed and the result is: %.2X", result1);
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Router thread is killed and the result is: %.2X", result2);
-		
-		/* Close threads *
-		pthread_cancel(wiimote_obj->router_thread);
-		if (pthread_join(wiimote_obj->router_thread, &pthread_ret)) 
-		{
-			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (router thread)");
-			return GENERAL_ERROR;
-		}
-		else if (!((pthread_ret == PTHREAD_CANCELED) && (pthread_ret == NULL))) 
-		{
-			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "BAD RETURN VALUE FROM ROUTER THREAD");
-			return GENERAL_ERROR;
-		}
-
-		pthread_cancel(wiimote_obj->status_thread);
-		if (pthread_join(wiimote_obj->status_thread, &pthread_ret)) 
-		{
-			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (STATUS THREAD)");
-			return GENERAL_ERROR;
-		}
-		else if (!((pthread_ret == PTHREAD_CANCELED) && (pthread_ret == NULL))) 
-		{
-			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "BAD RETURN VALUE FROM STATUS THREAD");
-			return GENERAL_ERROR;
-		}
-
-		/* Close Pipes */
-		if (close(wiimote_obj->mesg_pipe[0]) || close(wiimote_obj->mesg_pipe[1])) 
-		{
-			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "PIPE CLOSE ERROR (MESSAGE PIPE)");
-			//return GENERAL_ERROR;
-		}
-		if (close(wiimote_obj->status_pipe[0]) || close(wiimote_obj->status_pipe[1])) 
-		{
-			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "PIPE CLOSE ERROR (STATUS PIPE)");
-			//return GENERAL_ERROR;
-		}
-		if (close(wiimote_obj->rw_pipe[0]) || close(wiimote_obj->rw_pipe[1])) 
-		{
-			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "PIPE CLOSE ERROR (RW PIPE)");
-			//return GENERAL_ERROR;
-		}
-		free(wiimote_obj);
-	}
+	struct wiimote *wiimote;
 
-	return OPERATION_SUCCESSFUL;
+	/* Gone for the callers first, those still inside a JNI call or on its samples are waited 
+	 * for by the disconnect */
+	if ((wiimote = wd_swap_board(NULL)) != NULL)
+		wd_disconnect(wiimote);
 }
 
-/* Returns whether balance board weight values are valid or not
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getIsBalanceDataValid()
+/* Makes wiimote the connected board. Callers still holding the one before keep it until they 
+   put it, see wd_board_drain.
+   Returns:
+	the board connected before, if any.
+*/
+static struct wiimote *wd_swap_board(struct wiimote *wiimote)
 {
-	return isBalanceDataValid;
-}
+	struct wiimote *previous;
 
-/* Returns the top right value of the board
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getTopRightValue()
-{
-	return balance_mesg->right_top;
+	pthread_mutex_lock(&board_mutex);
+	previous = wiimote_obj;
+	wiimote_obj = wiimote;
+	pthread_mutex_unlock(&board_mutex);
+	return previous;
 }
 
-/* Returns the top left value of the board
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getTopLeftValue()
+/* Takes hold of the connected board for a JNI call, to be let go with wd_board_put. The board 
+   is not disconnected before then.
+   Returns:
+	NULL if there is no board,
+	the board otherwise.
+*/
+static struct wiimote *wd_board_get(void)
 {
-	return balance_mesg->left_top;
-}
+	struct wiimote *wiimote;
 
-/* Returns the bottom right value of the board
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getBottomRightValue()
-{
-	return balance_mesg->right_bottom;
+	pthread_mutex_lock(&board_mutex);
+	if ((wiimote = wiimote_obj) != NULL)
+		wiimote->refs++;
+	pthread_mutex_unlock(&board_mutex);
+	return wiimote;
 }
 
-/* Returns the bottom left value of the board
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getBottomLeftValue()
+static void wd_board_put(struct wiimote *wiimote)
 {
-	return balance_mesg->left_bottom;
+	pthread_mutex_lock(&board_mutex);
+	if (--wiimote->refs == 0)
+		pthread_cond_broadcast(&board_cond);
+	pthread_mutex_unlock(&board_mutex);
 }
 
-jint Java_iEpi_Scale_BoardInterface_getBatteryLevel()
+/* Waits for the callers still holding a board which is no longer the connected one. A read or 
+   write they wait for is cancelled, the router which would answer it is gone.
+*/
+static void wd_board_drain(struct wiimote *wiimote)
 {
-	return intBatteryLevel;
-}
+	struct timespec deadline;
 
-/* Creates a new Wiimote object based on the connection information provided.
+	pthread_mutex_lock(&board_mutex);
+	while (wiimote->refs) 
+	{
+		if ((wiimote->rw_status != RW_IDLE) && wd_cancel_rw(wiimote)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_board_drain: RW cancel error");
+		}
+		wd_deadline(&deadline, WD_BOARD_DRAIN_POLL);
+		pthread_cond_timedwait(&board_cond, &board_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&board_mutex);
+}
+
+/* Makes listener the one of the board. The listener taken out is the caller's alone, to be 
+   stopped with wd_drop_listener once board_mutex is let go, as its thread may be inside a JNI call.
+   Returns:
+	the listener registered before, if any.
 */
-wiimote_t *wd_create_new_wii(int ctl_socket, int int_socket, int flags)
+static struct wd_listener *wd_swap_listener(struct wiimote *wiimote, struct wd_listener *listener)
+{
+	struct wd_listener *previous;
+
+	pthread_mutex_lock(&board_mutex);
+	previous = wiimote->listener;
+	wiimote->listener = listener;
+	pthread_mutex_unlock(&board_mutex);
+	return previous;
+}
+
+static void wd_drop_listener(struct wd_listener *listener)
+{
+	if (listener) 
+	{
+		wd_listener_stop(listener);
+		free(listener);
+	}
+}
+
+/* Takes hold of the sample ring of the connected board, so that a disconnect meanwhile waits for 
+   the caller to let it go with wd_sample_ring_release.
+   Returns:
+	NULL if there is no board, or it is being disconnected,
+	the ring otherwise.
+*/
+static struct wd_sample_ring *wd_hold_samples(void)
+{
+	struct wd_sample_ring *ring = NULL;
+
+	pthread_mutex_lock(&board_mutex);
+	if (wiimote_obj && wiimote_obj->samples && (wd_sample_ring_acquire(wiimote_obj->samples) == 0))
+		ring = wiimote_obj->samples;
+	pthread_mutex_unlock(&board_mutex);
+	return ring;
+}
+
+/* The last client has gone: nobody is left to take the samples. Called with the session mutex 
+   let go, the listener is only taken out if no client has come back meanwhile. It is stopped 
+   here, its thread may be in a callback which retains the session.
+*/
+static void wd_board_idle(void *arg)
+{
+	struct wiimote *wiimote;
+	struct wd_listener *listener = NULL;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return;
+	/* A client coming back registers its listener with wd_swap_listener, which waits for us */
+	pthread_mutex_lock(&board_mutex);
+	if (wd_session_clients(&session) == 0) 
+	{
+		listener = wiimote->listener;
+		wiimote->listener = NULL;
+	}
+	pthread_mutex_unlock(&board_mutex);
+	wd_drop_listener(listener);
+	wd_board_put(wiimote);
+}
+
+/* Disconnects from the board and releases the created resources, whoever else holds them.
+*/
+static jint wd_jni_disconnect()
+{
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Disconnect called.");
+	wd_session_close(&session);
+	/* A session which never made it to the end of ConnectCalibrateRead */
+	wd_release_board(NULL);
+
+	return OPERATION_SUCCESSFUL;
+}
+
+/* Takes the session of the board, if there is one, without connecting.
+   Returns:
+	OPERATION_SUCCESSFUL	if the board is there to be used,
+	GENERAL_ERROR			otherwise.
+*/
+static jint wd_jni_intAttach()
+{
+	return (wd_session_retain(&session) > 0) ? OPERATION_SUCCESSFUL : GENERAL_ERROR;
+}
+
+/* Gives the session back. The board stays connected for the linger time after the last 
+   client, see setSessionLinger.
+*/
+static jint wd_jni_intRelease()
+{
+	return (wd_session_release(&session) >= 0) ? OPERATION_SUCCESSFUL : GENERAL_ERROR;
+}
+
+static jint wd_jni_setSessionLinger(JNIEnv* env, jobject thiz, jint linger)
+{
+	return wd_session_set_linger(&session, linger) ? GENERAL_ERROR : OPERATION_SUCCESSFUL;
+}
+
+/* Stops the threads of a session, disconnects it from its board and gives its slot back to the 
+   pool.
+*/
+void wd_disconnect(struct wiimote *wiimote)
+{
+	wiimote->router_continue = 0;
+	wiimote->status_continue = 0;
+
+	/* The battery thread may be in the middle of a status request, so wake it up and wait for it 
+	 * before the sockets go away. */
+	pthread_mutex_lock(&wiimote->battery_mutex);
+	wiimote->battery_continue = 0;
+	pthread_cond_signal(&wiimote->battery_cond);
+	pthread_mutex_unlock(&wiimote->battery_mutex);
+	wd_worker_wait(&wiimote->slot->worker[WD_WORKER_BATTERY]);
+
+	/* Same for the supervisor, which may be reconnecting. This also releases the router 
+	 * thread if it is waiting for the link to come back. */
+	pthread_mutex_lock(&wiimote->link_mutex);
+	wiimote->supervisor_continue = 0;
+	pthread_cond_broadcast(&wiimote->link_cond);
+	pthread_mutex_unlock(&wiimote->link_mutex);
+	wd_worker_wait(&wiimote->slot->worker[WD_WORKER_SUPERVISOR]);
+
+	/* A shut down socket wakes the router up from its read, and it quits on the error. The 
+	 * status thread is woken with a message it ignores, and a cancel in case it is waiting for 
+	 * a read or write the router will never answer. Both are waited for before anything of 
+	 * theirs goes away. */
+	if (wiimote->int_socket != -1)
+		shutdown(wiimote->int_socket, SHUT_RDWR);
+	if (wiimote->ctl_socket != -1)
+		shutdown(wiimote->ctl_socket, SHUT_RDWR);
+	wd_worker_wait(&wiimote->slot->worker[WD_WORKER_ROUTER]);
+
+	/* JNI calls which took the board before it was swapped out cannot wait for it any more, 
+	 * they are waited for before anything they look at goes away. */
+	wd_board_drain(wiimote);
+
+	/* No more samples for Java */
+	wd_drop_listener(wd_swap_listener(wiimote, NULL));
+	if (wiimote->linkmon) 
+	{
+		wd_linkmon_stop(wiimote->linkmon);
+		free(wiimote->linkmon);
+		wiimote->linkmon = NULL;
+	}
+
+	struct wd_status_mesg wake;
+	memset(&wake, 0, sizeof wake);
+	wake.type = WD_MESG_UNKNOWN;
+	wd_cancel_rw(wiimote);
+	if (write(wiimote->status_pipe[1], &wake, sizeof wake) != sizeof wake)
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Pipe write error (status)");
+	}
+	wd_worker_wait(&wiimote->slot->worker[WD_WORKER_STATUS]);
+
+	if (wiimote->int_socket != -1) 
+	{
+		if (close(wiimote->int_socket)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Error in closing interrupt socket.");
+			//return GENERAL_ERROR;
+		}
+	}
+
+	if (wiimote->ctl_socket != -1) 
+	{
+		if (close(wiimote->ctl_socket))
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Error in closing control socket.");
+			//return GENERAL_ERROR;
+		}
+	}
+	
+	wiimote->int_socket = -1;
+	wiimote->ctl_socket = -1;
+	
+	/* The pipes stay with the slot, empty for the next session */
+	wd_drain_pipe(wiimote->mesg_pipe[0]);
+	wd_drain_pipe(wiimote->status_pipe[0]);
+	wd_drain_pipe(wiimote->rw_pipe[0]);
+	if (wiimote->journal) 
+	{
+		/* Off the ring first, so that the router is not in the middle of a sample */
+		wd_sample_ring_set_journal(wiimote->samples, NULL);
+		wd_journal_close(wiimote->journal);
+		free(wiimote->journal);
+		wiimote->journal = NULL;
+	}
+	if (wiimote->samples) 
+	{
+		if (gateway)
+			wd_gateway_detach(gateway, wiimote->samples);
+		wd_sample_ring_close(wiimote->samples);
+		wd_sample_ring_destroy(wiimote->samples);
+		free(wiimote->samples);
+		wiimote->samples = NULL;
+	}
+	if (wiimote->clock) 
+	{
+		wd_clock_destroy(wiimote->clock);
+		free(wiimote->clock);
+		wiimote->clock = NULL;
+	}
+	wd_pool_give(&pool, wiimote->slot);
+}
+
+/* Fills the direct buffer with the calibrated samples received since the last call, one 
+   WD_SAMPLE_RECORD_LEN bytes record per sample (see wd_samples.h).
+   Returns:
+   	GENERAL_ERROR			If there is no connection or the buffer is not a direct one,
+	the number of samples	Otherwise.
+*/
+static jint wd_jni_readSamples(JNIEnv* env, jobject thiz, jobject buffer)
+{
+	return wd_read_samples(env, buffer, -1, NULL);
+}
+
+/* Fills the direct buffer with the samples not read yet, from the given tap or from the full 
+   rate stream if tap is -1. If there is none, waits until the (CLOCK_REALTIME) deadline for the 
+   first one; a NULL deadline does not wait at all.
+*/
+static jint wd_read_samples(JNIEnv* env, jobject buffer, int tap, const struct timespec *deadline)
+{
+	struct wd_sample samples[64];
+	struct wd_sample_ring *ring;
+	unsigned char *records;
+	jlong capacity;
+	uint32_t wakeups;
+	int max, count, total = 0, i;
+
+	records = (*env)->GetDirectBufferAddress(env, buffer);
+	capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+	if (!records || capacity < WD_SAMPLE_RECORD_LEN)
+		return GENERAL_ERROR;
+	/* Held until the last sample is copied, a disconnect meanwhile waits for it */
+	if ((ring = wd_hold_samples()) == NULL)
+		return GENERAL_ERROR;
+
+	max = capacity / WD_SAMPLE_RECORD_LEN;
+	if (deadline) 
+	{
+		wakeups = wd_sample_ring_wakeups(ring);
+		if (tap < 0)
+			count = wd_sample_ring_wait_unread(ring, &wakeups, deadline);
+		else
+			count = wd_sample_ring_wait_tap(ring, tap, &wakeups, deadline);
+		if (count == -1) 
+		{
+			wd_sample_ring_release(ring);
+			return GENERAL_ERROR;
+		}
+	}
+	while (total < max) 
+	{
+		if (tap < 0)
+			count = wd_sample_ring_read(ring, samples, (max - total) < 64 ? (max - total) : 64);
+		else
+			count = wd_sample_ring_read_tap(ring, tap, samples, (max - total) < 64 ? (max - total) : 64);
+		if (count < 0) 
+		{
+			total = GENERAL_ERROR;
+			break;
+		}
+		if (count == 0)
+			break;
+		for (i = 0; i < count; i++, total++) 
+		{
+			wd_sample_pack(&samples[i], records + total * WD_SAMPLE_RECORD_LEN);
+		}
+	}
+	wd_sample_ring_release(ring);
+	return total;
+}
+
+/* Blocks until the deadline, timeout milliseconds from now, unless samples arrive earlier. Then 
+   works as readSamples.
+   Returns:
+   	GENERAL_ERROR			If there is no connection, or the board is disconnected while waiting,
+	0						On timeout,
+	the number of samples	Otherwise.
+*/
+static jint wd_jni_awaitSamples(JNIEnv* env, jobject thiz, jobject buffer, jint timeout)
+{
+	struct timespec deadline;
+
+	wd_deadline(&deadline, timeout);
+	return wd_read_samples(env, buffer, -1, &deadline);
+}
+
+/* Adds an output that emits frequency samples per second, each the average of the full rate 
+   samples over its period.
+   Returns:
+   	GENERAL_ERROR			If there is no connection, the frequency is not valid or no tap is left,
+	the tap number			Otherwise, to be passed to readTap and awaitTap.
+*/
+static jint wd_jni_addTap(JNIEnv* env, jobject thiz, jint frequency)
+{
+	struct wd_sample_ring *ring;
+	int tap;
+
+	if ((ring = wd_hold_samples()) == NULL)
+		return GENERAL_ERROR;
+	tap = wd_sample_ring_add_tap(ring, frequency);
+	wd_sample_ring_release(ring);
+	return (tap < 0) ? GENERAL_ERROR : tap;
+}
+
+/* Same as readSamples, for the samples of a tap.
+*/
+static jint wd_jni_readTap(JNIEnv* env, jobject thiz, jint tap, jobject buffer)
+{
+	return wd_read_samples(env, buffer, tap, NULL);
+}
+
+/* Same as awaitSamples, for the samples of a tap.
+*/
+static jint wd_jni_awaitTap(JNIEnv* env, jobject thiz, jint tap, jobject buffer, jint timeout)
+{
+	struct timespec deadline;
+
+	wd_deadline(&deadline, timeout);
+	return wd_read_samples(env, buffer, tap, &deadline);
+}
+
+/* Blocks until the total weight has been steady (see WD_STABLE_WINDOW) on the samples that 
+   arrive from now on, for at most timeout milliseconds.
+   Returns:
+	The mean of the steady weights in KG,
+	NaN on timeout, if there is no connection or the board is disconnected while waiting.
+*/
+static jfloat wd_jni_awaitStableWeight(JNIEnv* env, jobject thiz, jint timeout)
+{
+	struct wd_sample samples[64];
+	struct wd_sample_ring *ring;
+	struct wd_stability stability;
+	struct timespec deadline;
+	uint32_t cursor, wakeups;
+	float weight = NAN;
+	int count, i, steady = 0;
+
+	if ((ring = wd_hold_samples()) == NULL)
+		return NAN;
+
+	wd_deadline(&deadline, timeout);
+	wd_stability_reset(&stability);
+	cursor = wd_sample_ring_cursor(ring);
+	wakeups = wd_sample_ring_wakeups(ring);
+	while (!steady && (wd_sample_ring_wait(ring, cursor, &wakeups, &deadline) == 1)) 
+	{
+		while (!steady && (count = wd_sample_ring_read_cursor(ring, &cursor, samples, 64)) > 0) 
+		{
+			for (i = 0; i < count && !steady; i++) 
+			{
+				steady = wd_stability_feed(&stability, &samples[i], &weight);
+			}
+		}
+	}
+	wd_sample_ring_release(ring);
+	return steady ? weight : NAN;
+}
+
+/* Sets deadline to timeout milliseconds from now, on CLOCK_REALTIME as pthread_cond_timedwait 
+   expects.
+*/
+static void wd_deadline(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) 
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Returns the number of status reports taken in so far, for wd_wait_status.
+*/
+static int wd_status_count(struct wiimote *wiimote)
+{
+	int count;
+
+	pthread_mutex_lock(&wiimote->state_mutex);
+	count = wiimote->status_count;
+	pthread_mutex_unlock(&wiimote->state_mutex);
+	return count;
+}
+
+/* Waits up to timeout milliseconds for a status report after the count ones seen before. The 
+   battery level and the extension of the board are known once it is in.
+   Returns:
+	-1 on timeout,
+	 0 otherwise.
+*/
+static int wd_wait_status(struct wiimote *wiimote, int count, int timeout)
+{
+	struct timespec deadline;
+	int ret = 0;
+
+	wd_deadline(&deadline, timeout);
+	pthread_mutex_lock(&wiimote->state_mutex);
+	while ((wiimote->status_count == count) && !ret) 
+	{
+		if (pthread_cond_timedwait(&wiimote->state_cond, &wiimote->state_mutex, &deadline) == ETIMEDOUT)
+			ret = (wiimote->status_count == count) ? -1 : 0;
+	}
+	pthread_mutex_unlock(&wiimote->state_mutex);
+	return ret;
+}
+
+/* Registers the listener Java calls back with the samples, in place of the one registered before. 
+   The samples are written to buffer, a direct buffer that is reused for every call, and the 
+   listener is called at most maxFrequency times per second (0 for no limit). A NULL listener 
+   only removes the current one.
+   Returns:
+   	GENERAL_ERROR			If there is no connection or the listener cannot be registered,
+	OPERATION_SUCCESSFUL	Otherwise.
+*/
+static jint wd_jni_intSetSampleListener(JNIEnv* env, jobject thiz, jobject listener, jobject buffer, jint maxFrequency)
+{
+	struct wiimote *wiimote;
+	struct wd_listener *new_listener;
+	jint ret = GENERAL_ERROR;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return GENERAL_ERROR;
+	if (!wiimote->samples)
+		goto CODA;
+
+	wd_drop_listener(wd_swap_listener(wiimote, NULL));
+	if (!listener) 
+	{
+		ret = OPERATION_SUCCESSFUL;
+		goto CODA;
+	}
+
+	if ((new_listener = malloc(sizeof *new_listener)) == NULL)
+		goto CODA;
+	if (wd_listener_start(new_listener, jvm, env, wiimote->samples, listener, buffer, maxFrequency)) 
+	{
+		free(new_listener);
+		goto CODA;
+	}
+	/* The last call wins, a listener another one has registered meanwhile goes */
+	wd_drop_listener(wd_swap_listener(wiimote, new_listener));
+	ret = OPERATION_SUCCESSFUL;
+
+CODA:
+	wd_board_put(wiimote);
+	return ret;
+}
+
+/* Sets the chain of filters the samples of this session go through, see wd_filter.h. types holds 
+   one WD_FILTER_* per stage, params WD_FILTER_PARAMS values per stage. Empty arrays remove the 
+   filters.
+   Returns:
+   	GENERAL_ERROR			If there is no connection or the chain is not valid,
+	OPERATION_SUCCESSFUL	Otherwise.
+*/
+static jint wd_jni_setFilters(JNIEnv* env, jobject thiz, jintArray types, jfloatArray params)
+{
+	jint stages[WD_FILTER_MAX_STAGES];
+	jfloat values[WD_FILTER_MAX_STAGES * WD_FILTER_PARAMS];
+	struct wiimote *wiimote;
+	jint ret = GENERAL_ERROR;
+	int count;
+
+	count = (*env)->GetArrayLength(env, types);
+	if ((count > WD_FILTER_MAX_STAGES) || ((*env)->GetArrayLength(env, params) != count * WD_FILTER_PARAMS))
+		return GENERAL_ERROR;
+	(*env)->GetIntArrayRegion(env, types, 0, count, stages);
+	(*env)->GetFloatArrayRegion(env, params, 0, count * WD_FILTER_PARAMS, values);
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return GENERAL_ERROR;
+	if (wiimote->samples && (wd_sample_ring_set_filters(wiimote->samples, stages, values, count) == 0))
+		ret = OPERATION_SUCCESSFUL;
+	wd_board_put(wiimote);
+	return ret;
+}
+
+/* Returns the state of the link to the board (enum wd_link_state)
+*/ 
+static jint wd_jni_getLinkState()
+{
+	struct wiimote *wiimote;
+	jint state;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return WD_LINK_LOST;
+	state = wiimote->link_state;
+	wd_board_put(wiimote);
+	return state;
+}
+
+/* Sets how long the controller waits for the board before dropping the link, in milliseconds 
+   (up to 40900), 0 for the controller default from the next connection on. Kept for the 
+   reconnections of the session.
+*/
+static jint wd_jni_setSupervisionTimeout(JNIEnv* env, jobject thiz, jint timeout)
+{
+	struct wiimote *wiimote;
+	jint ret = OPERATION_SUCCESSFUL;
+
+	if ((timeout < 0) || (timeout > 40900) || ((wiimote = wd_board_get()) == NULL))
+		return GENERAL_ERROR;
+	wiimote->supervision_timeout = timeout;
+	if (timeout && wd_apply_supervision_timeout(wiimote))
+		ret = GENERAL_ERROR;
+	wd_board_put(wiimote);
+	return ret;
+}
+
+/* Sets how long the stream may stay silent, in milliseconds, before the watchdog flags it as 
+   stalled. 0 turns the watchdog off, from the next report on.
+*/
+static jint wd_jni_setWatchdogTimeout(JNIEnv* env, jobject thiz, jint timeout)
+{
+	struct wiimote *wiimote;
+
+	if ((timeout < 0) || ((wiimote = wd_board_get()) == NULL))
+		return GENERAL_ERROR;
+	wiimote->watchdog_timeout = timeout;
+	wd_board_put(wiimote);
+	return OPERATION_SUCCESSFUL;
+}
+
+/* Returns the alerts (WD_LINK_ALERT_*) of the last reading of the link monitor
+*/ 
+static jint wd_jni_getLinkAlerts()
+{
+	struct wiimote *wiimote;
+	jint alerts = 0;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return 0;
+	if (wiimote->linkmon)
+		alerts = wd_linkmon_alerts(wiimote->linkmon);
+	wd_board_put(wiimote);
+	return alerts;
+}
+
+/* Fills the direct buffer with the readings of the link monitor filed since the last call, 
+   WD_LINKMON_RECORD_LEN bytes each.
+*/
+static jint wd_jni_readLinkStats(JNIEnv* env, jobject thiz, jobject buffer)
+{
+	struct wd_link_point points[WD_LINKMON_HISTORY];
+	struct wiimote *wiimote;
+	unsigned char *records;
+	jlong capacity;
+	int count, i;
+
+	records = (*env)->GetDirectBufferAddress(env, buffer);
+	capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+	if (!records || capacity < WD_LINKMON_RECORD_LEN)
+		return GENERAL_ERROR;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return GENERAL_ERROR;
+	count = capacity / WD_LINKMON_RECORD_LEN;
+	if (wiimote->linkmon)
+		count = wd_linkmon_read(wiimote->linkmon, points, count < WD_LINKMON_HISTORY ? count : WD_LINKMON_HISTORY);
+	else
+		count = GENERAL_ERROR;
+	wd_board_put(wiimote);
+	for (i = 0; i < count; i++) 
+	{
+		wd_linkmon_pack(&points[i], records + i * WD_LINKMON_RECORD_LEN);
+	}
+	return count;
+}
+
+/* Fills state with a snapshot of the board (WD_STATE_* indices): the raw values of the last 
+   report, the battery, the link and the calibration data, all in one call.
+   Returns:
+	GENERAL_ERROR			If state is too short,
+	OPERATION_SUCCESSFUL	Otherwise.
+*/
+static jint wd_jni_readState(JNIEnv* env, jobject thiz, jintArray state)
+{
+	jint snapshot[WD_STATE_LEN];
+	struct wiimote *wiimote;
+	int i;
+
+	if (!state || ((*env)->GetArrayLength(env, state) < WD_STATE_LEN))
+		return GENERAL_ERROR;
+
+	memset(snapshot, 0, sizeof snapshot);
+	snapshot[WD_STATE_BALANCE_VALID] = isBalanceDataValid;
+	snapshot[WD_STATE_BATTERY_LEVEL] = intBatteryLevel;
+	snapshot[WD_STATE_BATTERY_EVENT] = WD_BATTERY_OK;
+	snapshot[WD_STATE_LINK_STATE] = WD_LINK_LOST;
+	if ((wiimote = wd_board_get()) != NULL) 
+	{
+		/* The last report, as wd_update_state left it */
+		pthread_mutex_lock(&wiimote->state_mutex);
+		if (wiimote->state.ext_type == WD_EXT_BALANCE) 
+		{
+			snapshot[WD_STATE_RIGHT_TOP] = wiimote->state.ext.balance.right_top;
+			snapshot[WD_STATE_RIGHT_BOTTOM] = wiimote->state.ext.balance.right_bottom;
+			snapshot[WD_STATE_LEFT_TOP] = wiimote->state.ext.balance.left_top;
+			snapshot[WD_STATE_LEFT_BOTTOM] = wiimote->state.ext.balance.left_bottom;
+		}
+		pthread_mutex_unlock(&wiimote->state_mutex);
+		snapshot[WD_STATE_BATTERY_EVENT] = wiimote->state.battery_event;
+		snapshot[WD_STATE_LINK_STATE] = wiimote->link_state;
+		if (wiimote->linkmon)
+			snapshot[WD_STATE_LINK_ALERTS] = wd_linkmon_alerts(wiimote->linkmon);
+		wd_board_put(wiimote);
+	}
+	snapshot[WD_STATE_CAL_VALID] = isCalibrationDataValid;
+	for (i = 0; i < 3; i++) 
+	{
+		snapshot[WD_STATE_CAL + i] = cal_data.right_top[i];
+		snapshot[WD_STATE_CAL + 3 + i] = cal_data.right_bottom[i];
+		snapshot[WD_STATE_CAL + 6 + i] = cal_data.left_top[i];
+		snapshot[WD_STATE_CAL + 9 + i] = cal_data.left_bottom[i];
+	}
+	(*env)->SetIntArrayRegion(env, state, 0, WD_STATE_LEN, snapshot);
+	return OPERATION_SUCCESSFUL;
+}
+
+/* Returns the last battery event (enum wd_battery_event) raised by the battery monitor
+*/ 
+static jint wd_jni_getBatteryEvent()
+{
+	struct wiimote *wiimote;
+	jint event;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return WD_BATTERY_OK;
+	event = wiimote->state.battery_event;
+	wd_board_put(wiimote);
+	return event;
+}
+
+/* Returns the report period of the board fitted by the time base, in milliseconds; 0 until it 
+   is known or if there is no connection.
+*/
+static jfloat wd_jni_getReportPeriod()
+{
+	struct wd_clock_stats stats;
+	struct wiimote *wiimote;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return 0;
+	stats.period = 0;
+	if (wiimote->clock)
+		wd_clock_get_stats(wiimote->clock, &stats);
+	wd_board_put(wiimote);
+	return stats.period;
+}
+
+/* Returns what to add to the sample timestamps, in nanoseconds, to get the wall clock time 
+   (nanoseconds since the epoch). Taken once, when the session started.
+*/
+static jlong wd_jni_getWallClockOffset()
+{
+	struct wiimote *wiimote;
+	jlong offset = 0;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return 0;
+	if (wiimote->clock)
+		offset = wiimote->clock->wall_offset;
+	wd_board_put(wiimote);
+	return offset;
+}
+
+/* Sets how short gaps in the stream are bridged (WD_GAP_FILL_*), and the longest gap that is, in 
+   milliseconds. Longer gaps are flagged, see wd_samples.h.
+*/
+static jint wd_jni_setGapFill(JNIEnv* env, jobject thiz, jint mode, jint maxGap)
+{
+	struct wiimote *wiimote;
+	jint ret = GENERAL_ERROR;
+
+	if ((wiimote = wd_board_get()) == NULL)
+		return GENERAL_ERROR;
+	if (wiimote->samples && (wd_sample_ring_set_gap_fill(wiimote->samples, mode, maxGap) == 0))
+		ret = OPERATION_SUCCESSFUL;
+	wd_board_put(wiimote);
+	return ret;
+}
+
+/* Fills the direct buffer with the statistics of the session, in the WD_SESSION_RECORD_LEN bytes 
+   layout described in wii_droid_defs.h.
+*/
+static jint wd_jni_readSessionStats(JNIEnv* env, jobject thiz, jobject buffer)
+{
+	struct wd_clock_stats clock_stats;
+	struct wd_sample_ring *ring;
+	unsigned char *record;
+	struct wiimote *wiimote;
+	int32_t values[5];
+	int32_t stalls;
+
+	record = (*env)->GetDirectBufferAddress(env, buffer);
+	if (!record || (*env)->GetDirectBufferCapacity(env, buffer) < WD_SESSION_RECORD_LEN)
+		return GENERAL_ERROR;
+	if ((wiimote = wd_board_get()) == NULL)
+		return GENERAL_ERROR;
+	if (!wiimote->samples || !wiimote->clock) 
+	{
+		wd_board_put(wiimote);
+		return GENERAL_ERROR;
+	}
+
+	wd_clock_get_stats(wiimote->clock, &clock_stats);
+	memcpy(record, &clock_stats.reports, 4);
+	memcpy(record + 4, &clock_stats.kernel_stamps, 4);
+	memcpy(record + 8, &clock_stats.resyncs, 4);
+	memcpy(record + 12, &clock_stats.period, 4);
+	memcpy(record + 16, &clock_stats.jitter, 4);
+
+	ring = wiimote->samples;
+	pthread_mutex_lock(&ring->mutex);
+	values[0] = ring->gaps;
+	values[1] = ring->filled_gaps;
+	values[2] = ring->synthetic;
+	values[3] = ring->dropped;
+	values[4] = wiimote->reconnect_count;
+	memcpy(record + 20, values, sizeof values);
+	memcpy(record + 40, &ring->gap_time, 8);
+	memcpy(record + 48, &ring->longest_gap, 8);
+	pthread_mutex_unlock(&ring->mutex);
+
+	pthread_mutex_lock(&wiimote->link_mutex);
+	stalls = wiimote->stall_count;
+	pthread_mutex_unlock(&wiimote->link_mutex);
+	wd_board_put(wiimote);
+	memcpy(record + 56, &stalls, 4);
+	return OPERATION_SUCCESSFUL;
+}
+
+/* Starts serving the sample streams to the other processes of the device, on the abstract UNIX 
+   socket name (WD_GW_DEFAULT_NAME if null); see wd_gateway.h for the protocol. Stream 0 is the 
+   connected board, the held boards follow.
+*/
+static jint wd_jni_startGateway(JNIEnv* env, jobject thiz, jstring name)
+{
+	const char *socket_name = NULL;
+	struct wiimote *wiimote;
+	int i, err;
+
+	if (gateway)
+		return OPERATION_SUCCESSFUL;
+	if ((gateway = malloc(sizeof *gateway)) == NULL)
+		return GENERAL_ERROR;
+	if (name)
+		socket_name = (*env)->GetStringUTFChars(env, name, NULL);
+	err = wd_gateway_start(gateway, socket_name);
+	if (socket_name)
+		(*env)->ReleaseStringUTFChars(env, name, socket_name);
+	if (err) 
+	{
+		free(gateway);
+		gateway = NULL;
+		return SOCKET_OPEN_FAILURE;
+	}
+
+	if ((wiimote = wd_board_get()) != NULL) 
+	{
+		if (wiimote->samples)
+			wd_gateway_attach(gateway, 0, wiimote->samples);
+		wd_board_put(wiimote);
+	}
+	pthread_mutex_lock(&fusion_mutex);
+	for (i = 0; i < held_count; i++) 
+	{
+		wd_gateway_attach(gateway, i + 1, held_boards[i]->samples);
+	}
+	pthread_mutex_unlock(&fusion_mutex);
+	return OPERATION_SUCCESSFUL;
+}
+
+/* Lets the applications running as user uid connect to the gateway, which otherwise only takes 
+   the processes of this one.
+*/
+static jint wd_jni_allowGatewayUser(JNIEnv* env, jobject thiz, jint uid)
+{
+	if (!gateway || wd_gateway_allow(gateway, (uid_t)uid))
+		return GENERAL_ERROR;
+	return OPERATION_SUCCESSFUL;
+}
+
+/* Hangs up on every client and stops serving.
+*/
+static void wd_jni_stopGateway()
+{
+	if (gateway) 
+	{
+		wd_gateway_stop(gateway);
+		free(gateway);
+		gateway = NULL;
+	}
+}
+
+/* Returns the index of the held board at bdaddr, -1 if it is not held.
+   Must be called with fusion_mutex held.
+*/
+static int wd_held_index(const bdaddr_t *bdaddr)
+{
+	int i;
+
+	for (i = 0; i < held_count; i++) 
+	{
+		if (!bacmp(&held_boards[i]->bdaddr, bdaddr))
+			return i;
+	}
+	return -1;
+}
+
+/* Sets the connected board aside for the platform. The session keeps streaming, and the next 
+   intConnect looks for another board. The board must be calibrated already, the weights of an 
+   uncalibrated board are not fused.
+   Returns:
+   	GENERAL_ERROR		If there is no connected board, it is not calibrated or 
+   						WD_FUSION_MAX_BOARDS are held already,
+	the index of the board on the platform otherwise.
+*/
+static jint wd_jni_holdBoard()
+{
+	struct wiimote *wiimote;
+	int index;
+
+	pthread_mutex_lock(&fusion_mutex);
+	if (fusion) 
+	{
+		pthread_mutex_unlock(&fusion_mutex);
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "holdBoard: The platform is running, stop it first.");
+		return GENERAL_ERROR;
+	}
+	/* Taken from the callers at once, the session has nothing left to release afterwards */
+	pthread_mutex_lock(&board_mutex);
+	wiimote = wiimote_obj;
+	if (!wiimote || !wiimote->samples || !wiimote->samples->has_cal || (held_count == WD_FUSION_MAX_BOARDS)) 
+	{
+		pthread_mutex_unlock(&board_mutex);
+		pthread_mutex_unlock(&fusion_mutex);
+		return GENERAL_ERROR;
+	}
+	wiimote_obj = NULL;
+	pthread_mutex_unlock(&board_mutex);
+
+	index = held_count++;
+	held_boards[index] = wiimote;
+	if (gateway) 
+	{
+		wd_gateway_detach(gateway, wiimote->samples);
+		wd_gateway_attach(gateway, index + 1, wiimote->samples);
+	}
+	pthread_mutex_unlock(&fusion_mutex);
+	/* What is left belongs to the held board */
+	isCalibrationDataValid = FALSE;
+	isBalanceDataValid = FALSE;
+	intBatteryLevel = 0;
+	return index;
+}
+
+/* Stops the platform if it is running.
+   Must be called with fusion_mutex held.
+*/
+static void wd_fusion_drop(void)
+{
+	if (fusion) 
+	{
+		wd_fusion_stop(fusion);
+		free(fusion);
+		fusion = NULL;
+	}
+}
+
+/* Stops the platform, the held boards keep streaming.
+*/
+static void wd_jni_stopFusion()
+{
+	pthread_mutex_lock(&fusion_mutex);
+	wd_fusion_drop();
+	pthread_mutex_unlock(&fusion_mutex);
+}
+
+/* Starts fusing the held boards into one platform, at rate points per second (0 for 
+   WD_FUSION_RATE). geometry holds x, y (mm) and angle (degrees) of every held board, in the 
+   order they have been held; see struct wd_fusion_geometry.
+*/
+static jint wd_jni_startFusion(JNIEnv* env, jobject thiz, jfloatArray geometry, jint rate)
+{
+	struct wd_fusion_geometry places[WD_FUSION_MAX_BOARDS];
+	struct wd_sample_ring *rings[WD_FUSION_MAX_BOARDS];
+	jfloat values[3 * WD_FUSION_MAX_BOARDS];
+	jint ret = GENERAL_ERROR;
+	int i;
+
+	pthread_mutex_lock(&fusion_mutex);
+	if (!held_count || !geometry || ((*env)->GetArrayLength(env, geometry) != 3 * held_count))
+		goto CODA;
+	(*env)->GetFloatArrayRegion(env, geometry, 0, 3 * held_count, values);
+	for (i = 0; i < held_count; i++) 
+	{
+		places[i].x = values[3 * i];
+		places[i].y = values[3 * i + 1];
+		places[i].angle = values[3 * i + 2];
+		rings[i] = held_boards[i]->samples;
+	}
+
+	wd_fusion_drop();
+	if ((fusion = malloc(sizeof *fusion)) == NULL)
+		goto CODA;
+	if (wd_fusion_start(fusion, rings, places, held_count, rate)) 
+	{
+		free(fusion);
+		fusion = NULL;
+		goto CODA;
+	}
+	ret = OPERATION_SUCCESSFUL;
+
+CODA:
+	pthread_mutex_unlock(&fusion_mutex);
+	return ret;
+}
+
+/* Fills the direct buffer with the platform points fused since the last call, 
+   WD_FUSED_RECORD_LEN bytes each (see wd_fusion.h).
+*/
+static jint wd_jni_readFused(JNIEnv* env, jobject thiz, jobject buffer)
+{
+	struct wd_fused points[64];
+	unsigned char *records;
+	jlong capacity;
+	int max, count, total = 0, i;
+
+	records = (*env)->GetDirectBufferAddress(env, buffer);
+	capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+	if (!records || capacity < WD_FUSED_RECORD_LEN)
+		return GENERAL_ERROR;
+
+	/* Not stopped under us */
+	pthread_mutex_lock(&fusion_mutex);
+	if (!fusion) 
+	{
+		pthread_mutex_unlock(&fusion_mutex);
+		return GENERAL_ERROR;
+	}
+	max = capacity / WD_FUSED_RECORD_LEN;
+	while ((total < max) && (count = wd_fusion_read(fusion, points, (max - total) < 64 ? (max - total) : 64)) > 0) 
+	{
+		for (i = 0; i < count; i++) 
+		{
+			wd_fusion_pack(&points[i], records + (total + i) * WD_FUSED_RECORD_LEN);
+		}
+		total += count;
+	}
+	pthread_mutex_unlock(&fusion_mutex);
+	return total;
+}
+
+/* Stops the platform and disconnects from every held board.
+*/
+static jint wd_jni_releaseBoards()
+{
+	struct wiimote *boards[WD_FUSION_MAX_BOARDS];
+	int count;
+
+	/* Taken off the platform at once, the disconnects join threads and go without the mutex */
+	pthread_mutex_lock(&fusion_mutex);
+	wd_fusion_drop();
+	count = held_count;
+	memcpy(boards, held_boards, count * sizeof *boards);
+	memset(held_boards, 0, sizeof held_boards);
+	held_count = 0;
+	pthread_mutex_unlock(&fusion_mutex);
+
+	while (count) 
+	{
+		count--;
+		wd_disconnect(boards[count]);
+	}
+	return OPERATION_SUCCESSFUL;
+}
+
+/* Every native method of iEpi.Scale.BoardInterface, bound by JNI_OnLoad */
+static JNINativeMethod wd_natives[] = 
+{
+	{ "intReadVersion",			"()Ljava/lang/String;",						(void *)&wd_jni_intReadVersion },
+	{ "ConnectCalibrateRead",	"(I)I",										(void *)&wd_jni_ConnectCalibrateRead },
+	{ "intConnect",				"(I)I",										(void *)&wd_jni_intConnect },
+	{ "setStorageDirectory",	"(Ljava/lang/String;)I",					(void *)&wd_jni_setStorageDirectory },
+	{ "getCalibrationData",		"()I",										(void *)&wd_jni_getCalibrationData },
+	{ "startReadingData",		"()I",										(void *)&wd_jni_startReadingData },
+	{ "stopReadingData",		"()V",										(void *)&wd_jni_stopReadingData },
+	{ "disconnect",				"()I",										(void *)&wd_jni_disconnect },
+	{ "intAttach",				"()I",										(void *)&wd_jni_intAttach },
+	{ "intRelease",				"()I",										(void *)&wd_jni_intRelease },
+	{ "setSessionLinger",		"(I)I",										(void *)&wd_jni_setSessionLinger },
+	{ "readState",				"([I)I",									(void *)&wd_jni_readState },
+	{ "getBatteryEvent",		"()I",										(void *)&wd_jni_getBatteryEvent },
+	{ "readSamples",			"(Ljava/nio/ByteBuffer;)I",					(void *)&wd_jni_readSamples },
+	{ "awaitSamples",			"(Ljava/nio/ByteBuffer;I)I",				(void *)&wd_jni_awaitSamples },
+	{ "addTap",					"(I)I",										(void *)&wd_jni_addTap },
+	{ "readTap",				"(ILjava/nio/ByteBuffer;)I",				(void *)&wd_jni_readTap },
+	{ "awaitTap",				"(ILjava/nio/ByteBuffer;I)I",				(void *)&wd_jni_awaitTap },
+	{ "awaitStableWeight",		"(I)F",										(void *)&wd_jni_awaitStableWeight },
+	{ "intSetSampleListener",	"(L" WD_LISTENER_CLASS ";Ljava/nio/ByteBuffer;I)I",	(void *)&wd_jni_intSetSampleListener },
+	{ "setFilters",				"([I[F)I",									(void *)&wd_jni_setFilters },
+	{ "getLinkState",			"()I",										(void *)&wd_jni_getLinkState },
+	{ "setSupervisionTimeout",	"(I)I",										(void *)&wd_jni_setSupervisionTimeout },
+	{ "setWatchdogTimeout",		"(I)I",										(void *)&wd_jni_setWatchdogTimeout },
+	{ "getLinkAlerts",			"()I",										(void *)&wd_jni_getLinkAlerts },
+	{ "readLinkStats",			"(Ljava/nio/ByteBuffer;)I",					(void *)&wd_jni_readLinkStats },
+	{ "getReportPeriod",		"()F",										(void *)&wd_jni_getReportPeriod },
+	{ "getWallClockOffset",		"()J",										(void *)&wd_jni_getWallClockOffset },
+	{ "setGapFill",				"(II)I",									(void *)&wd_jni_setGapFill },
+	{ "readSessionStats",		"(Ljava/nio/ByteBuffer;)I",					(void *)&wd_jni_readSessionStats },
+	{ "startGateway",			"(Ljava/lang/String;)I",					(void *)&wd_jni_startGateway },
+	{ "stopGateway",			"()V",										(void *)&wd_jni_stopGateway },
+	{ "allowGatewayUser",		"(I)I",										(void *)&wd_jni_allowGatewayUser },
+	{ "holdBoard",				"()I",										(void *)&wd_jni_holdBoard },
+	{ "startFusion",			"([FI)I",									(void *)&wd_jni_startFusion },
+	{ "stopFusion",				"()V",										(void *)&wd_jni_stopFusion },
+	{ "readFused",				"(Ljava/nio/ByteBuffer;)I",					(void *)&wd_jni_readFused },
+	{ "releaseBoards",			"()I",										(void *)&wd_jni_releaseBoards },
+};
+
+/* Binds wd_natives to the Java class.
+   Returns:
+	-1 if the class or one of the methods is missing,
+	 0 otherwise.
+*/
+static int wd_register_natives(JNIEnv *env)
+{
+	jclass cls;
+	int ret;
+
+	if ((cls = (*env)->FindClass(env, WD_JNI_CLASS)) == NULL) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_register_natives: No " WD_JNI_CLASS " class.");
+		return -1;
+	}
+	ret = (*env)->RegisterNatives(env, cls, wd_natives, sizeof wd_natives / sizeof wd_natives[0]);
+	(*env)->DeleteLocalRef(env, cls);
+	if (ret) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_register_natives: Registration failed.");
+		return -1;
+	}
+	return 0;
+}
+
+/* Makes the part of a session that outlives it: the wiimote with its pipes and mutexes. Called 
+   by wd_pool_init for every slot.
+   Returns:
+	NULL on error, nothing is left behind then,
+	the wiimote otherwise.
+*/
+static void *wd_slot_create(struct wd_pool_slot *slot)
 {
-	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Going to create a new wii device");
 	struct	wiimote *new_wiimote = NULL;
 	char	mesg_pipe_init = 0, 
 			status_pipe_init = 0, 
@@ -548,40 +1988,37 @@ wiimote_t *wd_create_new_wii(int ctl_socket, int int_socket, int flags)
 			state_mutex_init = 0, 
 			rw_mutex_init = 0, 
 			rpt_mutex_init = 0,
-			router_thread_init = 0, 
-			status_thread_init = 0;
-	void	*pthread_ret;
+			ctl_mutex_init = 0,
+			battery_init = 0,
+			link_init = 0;
 
 	/* Allocate wiimote */
 	if ((new_wiimote = malloc(sizeof *new_wiimote)) == NULL) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Could not allocate enough memory for a wiimote object.");
-		goto ERR_HND;
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Could not allocate enough memory for a wiimote object.");
+		return NULL;
 	}
-
-	/* set sockets and flags */
-	new_wiimote->ctl_socket = ctl_socket;
-	new_wiimote->int_socket = int_socket;
-	new_wiimote->flags = flags;
-
-	new_wiimote->id = 1;
+	memset(new_wiimote, 0, sizeof *new_wiimote);
+	new_wiimote->slot = slot;
+	new_wiimote->ctl_socket = -1;
+	new_wiimote->int_socket = -1;
 
 	/* Create pipes */
 	if (pipe(new_wiimote->mesg_pipe)) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in creating message pipe.");
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in creating message pipe.");
 		goto ERR_HND;
 	}
 	mesg_pipe_init = 1;
 	if (pipe(new_wiimote->status_pipe)) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in creating status pipe");
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in creating status pipe");
 		goto ERR_HND;
 	}
 	status_pipe_init = 1;
 	if (pipe(new_wiimote->rw_pipe)) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in creating read/write pipe");
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in creating read/write pipe");
 		goto ERR_HND;
 	}
 	rw_pipe_init = 1;
@@ -589,73 +2026,259 @@ wiimote_t *wd_create_new_wii(int ctl_socket, int int_socket, int flags)
 	/* Setup blocking */
 	if (fcntl(new_wiimote->mesg_pipe[1], F_SETFL, O_NONBLOCK)) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in setting the first message pipe as non-blocking.");
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in setting the first message pipe as non-blocking.");
+		goto ERR_HND;
+	}
+
+	/* Init mutexes */
+	if (pthread_mutex_init(&new_wiimote->state_mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of state mutex.");
 		goto ERR_HND;
 	}
-	if (new_wiimote->flags & WD_FLAG_NONBLOCK) 
+	if (pthread_cond_init(&new_wiimote->state_cond, NULL)) 
 	{
-		if (fcntl(new_wiimote->mesg_pipe[0], F_SETFL, O_NONBLOCK)) 
-		{
-			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in setting the zeroth message pipe as non-blocking.");
-			goto ERR_HND;
-		}
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of state mutex.");
+		pthread_mutex_destroy(&new_wiimote->state_mutex);
+		goto ERR_HND;
+	}
+	state_mutex_init = 1;
+	if (pthread_mutex_init(&new_wiimote->rw_mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of read/write mutex.");
+		goto ERR_HND;
+	}
+	rw_mutex_init = 1;
+	if (pthread_mutex_init(&new_wiimote->rpt_mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of report mutex.");
+		goto ERR_HND;
+	}
+	rpt_mutex_init = 1;
+	if (pthread_mutex_init(&new_wiimote->ctl_mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of control mutex.");
+		goto ERR_HND;
+	}
+	ctl_mutex_init = 1;
+	if (pthread_mutex_init(&new_wiimote->battery_mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of battery monitor.");
+		goto ERR_HND;
+	}
+	if (pthread_cond_init(&new_wiimote->battery_cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of battery monitor.");
+		pthread_mutex_destroy(&new_wiimote->battery_mutex);
+		goto ERR_HND;
+	}
+	battery_init = 1;
+	if (pthread_mutex_init(&new_wiimote->link_mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of link supervision.");
+		goto ERR_HND;
+	}
+	if (pthread_cond_init(&new_wiimote->link_cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_slot_create: Error in initialization of link supervision.");
+		pthread_mutex_destroy(&new_wiimote->link_mutex);
+		goto ERR_HND;
+	}
+	link_init = 1;
+	return new_wiimote;
+
+ERR_HND:
+	if (link_init) 
+	{
+		pthread_cond_destroy(&new_wiimote->link_cond);
+		pthread_mutex_destroy(&new_wiimote->link_mutex);
+	}
+	if (battery_init) 
+	{
+		pthread_cond_destroy(&new_wiimote->battery_cond);
+		pthread_mutex_destroy(&new_wiimote->battery_mutex);
+	}
+	if (ctl_mutex_init)
+		pthread_mutex_destroy(&new_wiimote->ctl_mutex);
+	if (rpt_mutex_init)
+		pthread_mutex_destroy(&new_wiimote->rpt_mutex);
+	if (rw_mutex_init)
+		pthread_mutex_destroy(&new_wiimote->rw_mutex);
+	if (state_mutex_init) 
+	{
+		pthread_cond_destroy(&new_wiimote->state_cond);
+		pthread_mutex_destroy(&new_wiimote->state_mutex);
+	}
+	if (rw_pipe_init) 
+	{
+		close(new_wiimote->rw_pipe[0]);
+		close(new_wiimote->rw_pipe[1]);
+	}
+	if (status_pipe_init) 
+	{
+		close(new_wiimote->status_pipe[0]);
+		close(new_wiimote->status_pipe[1]);
+	}
+	if (mesg_pipe_init) 
+	{
+		close(new_wiimote->mesg_pipe[0]);
+		close(new_wiimote->mesg_pipe[1]);
+	}
+	free(new_wiimote);
+	return NULL;
+}
+
+/* Undoes wd_slot_create as the pool goes, the workers of the slot have been stopped.
+*/
+static void wd_slot_destroy(void *data)
+{
+	struct wiimote *wiimote = data;
+
+	pthread_cond_destroy(&wiimote->link_cond);
+	pthread_mutex_destroy(&wiimote->link_mutex);
+	pthread_cond_destroy(&wiimote->battery_cond);
+	pthread_mutex_destroy(&wiimote->battery_mutex);
+	pthread_mutex_destroy(&wiimote->ctl_mutex);
+	pthread_mutex_destroy(&wiimote->rpt_mutex);
+	pthread_mutex_destroy(&wiimote->rw_mutex);
+	pthread_cond_destroy(&wiimote->state_cond);
+	pthread_mutex_destroy(&wiimote->state_mutex);
+	if (close(wiimote->mesg_pipe[0]) || close(wiimote->mesg_pipe[1])) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "PIPE CLOSE ERROR (MESSAGE PIPE)");
+	}
+	if (close(wiimote->status_pipe[0]) || close(wiimote->status_pipe[1])) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "PIPE CLOSE ERROR (STATUS PIPE)");
+	}
+	if (close(wiimote->rw_pipe[0]) || close(wiimote->rw_pipe[1])) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "PIPE CLOSE ERROR (RW PIPE)");
+	}
+	free(wiimote);
+}
+
+/* Throws away whatever a session has left unread in a pipe (a cancel nobody waited for, say).
+*/
+static void wd_drain_pipe(int fd)
+{
+	char buf[64];
+	int fl = fcntl(fd, F_GETFL);
+
+	if (fl == -1 || fcntl(fd, F_SETFL, fl | O_NONBLOCK)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_drain_pipe: File control error");
+		return;
+	}
+	while (read(fd, buf, sizeof buf) > 0);
+	fcntl(fd, F_SETFL, fl);
+}
+
+/* Starts a session on the sockets of a new connection, in a slot taken from the pool. Nothing is 
+   created but the sample ring and the time base, the threads of the slot are handed their jobs.
+   Returns:
+	NULL on error, the sockets are left to the caller then,
+	the wiimote otherwise.
+*/
+wiimote_t *wd_create_new_wii(int ctl_socket, int int_socket, int flags)
+{
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Going to create a new wii device");
+	struct	wd_pool_slot *slot;
+	struct	wiimote *new_wiimote;
+
+	if ((slot = wd_pool_take(&pool)) == NULL) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: No session slot left.");
+		return NULL;
 	}
+	new_wiimote = slot->data;
 
-	/* Init mutexes */
-	if (pthread_mutex_init(&new_wiimote->state_mutex, NULL)) 
+	/* set sockets and flags */
+	new_wiimote->ctl_socket = ctl_socket;
+	new_wiimote->int_socket = int_socket;
+	new_wiimote->flags = flags;
+
+	new_wiimote->id = 1;
+	new_wiimote->refs = 0;
+
+	/* The reading end follows the flags of the session */
+	if (fcntl(new_wiimote->mesg_pipe[0], F_SETFL, (new_wiimote->flags & WD_FLAG_NONBLOCK) ? O_NONBLOCK : 0)) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in initialization of state mutex.");
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in setting the blocking of the zeroth message pipe.");
 		goto ERR_HND;
 	}
-	state_mutex_init = 1;
-	if (pthread_mutex_init(&new_wiimote->rw_mutex, NULL)) 
+
+	new_wiimote->link_state = WD_LINK_UP;
+	new_wiimote->reconnect_count = 0;
+	new_wiimote->supervision_timeout = WD_SUPERVISION_TIMEOUT;
+	new_wiimote->watchdog_timeout = WD_WATCHDOG_TIMEOUT;
+	new_wiimote->stall_count = 0;
+
+	/* Until the board name is known, assume a balance board */
+	new_wiimote->battery_profile = &wd_battery_profiles[WD_BATTERY_DEFAULT_PROFILE];
+	new_wiimote->zero_corner_count = 0;
+	new_wiimote->listener = NULL;
+	new_wiimote->linkmon = NULL;
+	new_wiimote->journal = NULL;
+	new_wiimote->hci = NULL;
+	new_wiimote->clock = NULL;
+
+	/* The sample ring has to be there before the first report arrives */
+	if ((new_wiimote->samples = malloc(sizeof *new_wiimote->samples)) == NULL) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in initialization of read/write mutex.");
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Could not allocate the sample ring.");
 		goto ERR_HND;
 	}
-	rw_mutex_init = 1;
-	if (pthread_mutex_init(&new_wiimote->rpt_mutex, NULL)) 
+	if (wd_sample_ring_init(new_wiimote->samples)) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Error in initialization of report mutex.");
+		free(new_wiimote->samples);
+		new_wiimote->samples = NULL;
 		goto ERR_HND;
 	}
-	rpt_mutex_init = 1;
-
-	/* Set rw_status before starting router thread */
-	new_wiimote->rw_status = RW_IDLE;
-
-	blnShouldRouterThreadContinue = 1;
-	/* Launch interrupt socket listener and dispatch threads */
-	if (pthread_create(&new_wiimote->router_thread, NULL, (void *(*)(void *))&wd_router_thread, new_wiimote)) 
+	if ((new_wiimote->clock = malloc(sizeof *new_wiimote->clock)) == NULL) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Thread creation error (router thread)");
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Could not allocate the time base.");
 		goto ERR_HND;
 	}
-	router_thread_init = 1;
-
-	blnShouldStatusThreadContinue = 1;	
-	if (pthread_create(&new_wiimote->status_thread, NULL, (void *(*)(void *))&wd_status_thread, new_wiimote)) 
+	if (wd_clock_init(new_wiimote->clock)) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Thread creation error (status thread)");
+		free(new_wiimote->clock);
+		new_wiimote->clock = NULL;
 		goto ERR_HND;
 	}
-	status_thread_init = 1;
 
-	/* Success!  Update state */
+	/* The state of the last session goes before any thread looks at it */
 	memset(&new_wiimote->state, 0, sizeof new_wiimote->state);
 	new_wiimote->mesg_callback = NULL;
+
+	/* Set rw_status before starting router thread */
+	new_wiimote->rw_status = RW_IDLE;
+
+	/* Launch interrupt socket listener and dispatch threads */
+	new_wiimote->router_continue = 1;
+	new_wiimote->status_continue = 1;
+	new_wiimote->battery_continue = 1;
+	new_wiimote->supervisor_continue = 1;
+	wd_worker_run(&slot->worker[WD_WORKER_ROUTER], (void *(*)(void *))&wd_router_thread, new_wiimote);
+	wd_worker_run(&slot->worker[WD_WORKER_STATUS], (void *(*)(void *))&wd_status_thread, new_wiimote);
+	wd_worker_run(&slot->worker[WD_WORKER_BATTERY], (void *(*)(void *))&wd_battery_thread, new_wiimote);
+	wd_worker_run(&slot->worker[WD_WORKER_SUPERVISOR], (void *(*)(void *))&wd_supervisor_thread, new_wiimote);
+
+	/* Success! */
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_create_new_wii: Returning newly created mote.");
 	return new_wiimote;
 
 ERR_HND:
-	/*
-	TODO: This section needs to be edited in order to clean up the program after a fail.
-	*/
-	if (new_wiimote) 
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Error in creating Wiimote device.");
+	if (new_wiimote->samples) 
 	{
-		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "Error in creating Wiimote device.");
-		free(new_wiimote);
+		wd_sample_ring_destroy(new_wiimote->samples);
+		free(new_wiimote->samples);
+		new_wiimote->samples = NULL;
 	}
+	new_wiimote->ctl_socket = -1;
+	new_wiimote->int_socket = -1;
+	wd_pool_give(&pool, slot);
 	return NULL;
 }
 
@@ -751,18 +2374,30 @@ int wd_send_rpt(wiimote_t *wiimote, uint8_t flags, uint8_t report, size_t len, c
 		buf[2] |= wiimote->state.rumble;
 	}
 
+	/* The battery thread sends reports too; a report and its handshake must not interleave 
+	 * with another one on the control channel. */
+	if (pthread_mutex_lock(&wiimote->ctl_mutex)) 
+	{
+		free(buf);
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_send_rpt: Mutex lock error (ctl mutex)");
+		return -1;
+	}
 	if (write(wiimote->ctl_socket, buf, len+2) != (ssize_t)(len+2)) 
 	{
+		pthread_mutex_unlock(&wiimote->ctl_mutex);
 		free(buf);
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_send_rpt: error in calling write");
 		return -1;
 	}
 	else if (wd_verify_handshake(wiimote)) 
 	{
+		pthread_mutex_unlock(&wiimote->ctl_mutex);
 		free(buf);
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_send_rpt: error in calling verify handshake");
 		return -1;
 	}
+	pthread_mutex_unlock(&wiimote->ctl_mutex);
+	free(buf);
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_send_rpt: Done requesting. Going back.");
 	return 0;
 }
@@ -816,36 +2451,55 @@ void *wd_router_thread(struct wiimote *wiimote)
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_router_thread: Started wd_router_thread");
 	unsigned char buf[READ_BUF_LEN];
 	ssize_t len;
-	struct mesg_array ma;
-	char err, print_clock_err = 1;
+	struct mesg_buf ma;
+	char err;
+	int strikes = 0, watch;
 	
 	JNIEnv* env = 0;
 	(*jvm)->AttachCurrentThread(jvm,&env, NULL);
 	blnIsRouterThreadWorking = 1;
 	
-	while (blnShouldRouterThreadContinue) 
+	while (wiimote->router_continue) 
 	{
-		/* Read packet */
-		len = read(wiimote->int_socket, buf, READ_BUF_LEN);
-		ma.count = 0;
-		if (clock_gettime(CLOCK_REALTIME, &ma.timestamp)) 
+		/* Wait for the packet, no longer than the watchdog allows while the board is streaming */
+		watch = wd_stream_watchdog(wiimote, &strikes);
+		if (watch == 0)
+			continue;
+		if (watch == -1) 
 		{
-			if (print_clock_err) 
-			{
-				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_router_thread: clock_gettime error");
-				print_clock_err = 0;
-			}
+			if (wd_wait_for_link(wiimote) == 0)
+				continue;
+			/* Quit! */
+			break;
 		}
+
+		/* Read packet */
+		len = wd_clock_read(wiimote->clock, wiimote->int_socket, buf, READ_BUF_LEN, &ma.timestamp);
+		ma.count = 0;
+		ma.len = 0;
 		err = 0;
 		if ((len == -1) || (len == 0)) 
 		{
 			wd_process_error(wiimote, len, &ma);
-			wd_write_mesg_array(wiimote, &ma);
+			if ((wiimote->flags & WD_FLAG_RECONNECT) && wiimote->router_continue) 
+			{
+				/* Let the supervisor bring the link back and carry on with the new socket */
+				wd_update_state(wiimote, &ma);
+				if (wd_wait_for_link(wiimote) == 0)
+					continue;
+			}
+			else 
+			{
+				wd_write_mesg_buf(wiimote, &ma);
+			}
 			/* Quit! */
 			break;
 		}
 		else 
 		{
+			if (wiimote->linkmon)
+				wd_linkmon_report(wiimote->linkmon);
+
 			/* Verify first byte (DATA/INPUT) which should be 0xA1, refer to the wiki for more info. */
 			if (buf[0] != (BT_TRANS_DATA | BT_PARAM_INPUT)) 
 			{
@@ -869,7 +2523,8 @@ void *wd_router_thread(struct wiimote *wiimote)
 				// is set to zero. Therefore the calculated weight is not correct. The battery level is 
 				// received in packet type 0x20 (status report) at the 8th byte. Here I store the value 
 				// of the battery level, so the system can use it later.
-				intBatteryLevel = buf[7];
+				if (wiimote == wiimote_obj)
+					intBatteryLevel = buf[7];
 				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_router_thread: Battery level was %.2X ...", intBatteryLevel);
 			}
 			// Check the message type and act accordingly ...
@@ -940,10 +2595,11 @@ void *wd_router_thread(struct wiimote *wiimote)
 				{
 					__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"State update error");
 				}
+				wd_publish_samples(wiimote, &ma);
 				if (wiimote->flags & WD_FLAG_MESG_IFC) 
 				{
 					/* prints its own errors */
-					//wd_write_mesg_array(wiimote, &ma);
+					//wd_write_mesg_buf(wiimote, &ma);
 				}
 			}
 		}
@@ -961,19 +2617,21 @@ void *wd_status_thread(struct wiimote *wiimote)
 {
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_status_thread");
 	
-	struct mesg_array ma;
+	struct mesg_buf ma;
 	struct wd_status_mesg *status_mesg;
 	unsigned char buf[2];
 
-	ma.count = 1;
-	status_mesg = &ma.array[0].status_mesg;
+	/* The one record of the buffer, the status pipe refills it in place */
+	ma.count = 0;
+	ma.len = 0;
+	status_mesg = &wd_mesg_add(&ma, WD_MESG_STATUS)->status_mesg;
 	
 	JNIEnv* env = 0;
 	(*jvm)->AttachCurrentThread(jvm,&env, NULL);
 	
 	blnIsStatusThreadWorking = 1;
 
-	while (blnShouldStatusThreadContinue) 
+	while (wiimote->status_continue) 
 	{
 		if (wd_full_read(wiimote->status_pipe[0], status_mesg, sizeof *status_mesg)) 
 		{
@@ -1074,7 +2732,7 @@ void *wd_status_thread(struct wiimote *wiimote)
 		  (wiimote->flags & WD_FLAG_MESG_IFC)) 
 		{
 			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Condition 3");
-			if (wd_write_mesg_array(wiimote, &ma)) 
+			if (wd_write_mesg_buf(wiimote, &ma)) 
 			{
 				/* prints its own errors */
 			}
@@ -1089,9 +2747,315 @@ void *wd_status_thread(struct wiimote *wiimote)
 	return NULL;
 }
 
-int wd_process_ext(struct wiimote *wiimote, unsigned char *data, unsigned char len, struct mesg_array *ma)
+/* Called by the router thread when the link drops. Wakes the supervisor up and waits until it 
+   has reconnected to the board.
+   Returns:
+	-1 if the link could not be brought back or the driver is shutting down,
+	 0 once the new sockets are in place.
+*/
+int wd_wait_for_link(struct wiimote *wiimote)
 {
-	isBalanceDataValid = FALSE;
+	int ret;
+
+	pthread_mutex_lock(&wiimote->link_mutex);
+	if ((wiimote->link_state == WD_LINK_UP) || (wiimote->link_state == WD_LINK_STALLED)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_wait_for_link: Link to the board dropped");
+		wiimote->link_state = WD_LINK_RECONNECTING;
+		pthread_cond_broadcast(&wiimote->link_cond);
+	}
+	while ((wiimote->link_state == WD_LINK_RECONNECTING) && wiimote->supervisor_continue) 
+	{
+		pthread_cond_wait(&wiimote->link_cond, &wiimote->link_mutex);
+	}
+	ret = ((wiimote->link_state == WD_LINK_UP) && wiimote->supervisor_continue) ? 0 : -1;
+	pthread_mutex_unlock(&wiimote->link_mutex);
+	return ret;
+}
+
+/* Waits for the interrupt channel to have a packet. While the board is streaming, a report is 
+   due every few milliseconds; if none comes for watchdog_timeout milliseconds the stream is 
+   flagged as stalled, and after WD_WATCHDOG_STRIKES of those in a row the channels are shut down 
+   and the link is handed to the supervisor, well before the controller would notice through the 
+   supervision timeout.
+   Returns:
+	-1 if the link has to be recovered,
+	 0 if there is nothing to read yet,
+	 1 if the socket can be read (or has an error to report).
+*/
+static int wd_stream_watchdog(struct wiimote *wiimote, int *strikes)
+{
+	struct pollfd pfd;
+	int timeout = -1, ret;
+
+	if ((wiimote->state.rpt_mode & WD_RPT_BALANCE) && (wiimote->watchdog_timeout > 0))
+		timeout = wiimote->watchdog_timeout;
+	pfd.fd = wiimote->int_socket;
+	pfd.events = POLLIN;
+	if ((ret = poll(&pfd, 1, timeout)) < 0) 
+	{
+		/* Interrupted by disconnect, which the router loop will notice */
+		return (errno == EINTR) ? 0 : 1;
+	}
+
+	if (ret > 0) 
+	{
+		if (*strikes) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_stream_watchdog: Stream resumed");
+			*strikes = 0;
+			pthread_mutex_lock(&wiimote->link_mutex);
+			if (wiimote->link_state == WD_LINK_STALLED)
+				wiimote->link_state = WD_LINK_UP;
+			pthread_cond_broadcast(&wiimote->link_cond);
+			pthread_mutex_unlock(&wiimote->link_mutex);
+		}
+		return 1;
+	}
+
+	if (++(*strikes) == 1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_stream_watchdog: No report for %d ms, stream stalled", timeout);
+		pthread_mutex_lock(&wiimote->link_mutex);
+		wiimote->stall_count++;
+		if (wiimote->link_state == WD_LINK_UP)
+			wiimote->link_state = WD_LINK_STALLED;
+		pthread_cond_broadcast(&wiimote->link_cond);
+		pthread_mutex_unlock(&wiimote->link_mutex);
+	}
+	if ((*strikes < WD_WATCHDOG_STRIKES) || !(wiimote->flags & WD_FLAG_RECONNECT) || 
+	    !wiimote->router_continue)
+		return 0;
+
+	/* The board cannot take the channels again while the old ones are open. shutdown wakes up 
+	 * a handshake blocked on the control channel too; the sockets are closed by the supervisor 
+	 * once the new ones are in place. */
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_stream_watchdog: Handing the link over for recovery");
+	*strikes = 0;
+	shutdown(wiimote->int_socket, SHUT_RDWR);
+	shutdown(wiimote->ctl_socket, SHUT_RDWR);
+	return -1;
+}
+
+/* Sets the link supervision timeout of the session on the ACL connection to the board.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+static int wd_apply_supervision_timeout(struct wiimote *wiimote)
+{
+	uint16_t handle;
+
+	if (wiimote->supervision_timeout <= 0)
+		return 0;
+	if (!wiimote->hci || 
+	    wd_hci_conn_handle(wiimote->hci, &wiimote->bdaddr, &handle) || 
+	    wd_hci_write_link_supervision_timeout(wiimote->hci, handle, wiimote->supervision_timeout * 8 / 5)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_apply_supervision_timeout: Cannot set the supervision timeout");
+		return -1;
+	}
+	return 0;
+}
+
+/* Sleeps on the link condition for ms milliseconds, unless the driver is shutting down.
+   Must be called with link_mutex held.
+*/
+static void wd_link_sleep(struct wiimote *wiimote, int ms)
+{
+	struct timespec wakeup;
+
+	clock_gettime(CLOCK_REALTIME, &wakeup);
+	wakeup.tv_sec += ms / 1000;
+	wakeup.tv_nsec += (ms % 1000) * 1000000L;
+	if (wakeup.tv_nsec >= 1000000000L) 
+	{
+		wakeup.tv_sec++;
+		wakeup.tv_nsec -= 1000000000L;
+	}
+	while (wiimote->supervisor_continue &&
+	       (pthread_cond_timedwait(&wiimote->link_cond, &wiimote->link_mutex, &wakeup) != ETIMEDOUT));
+}
+
+/* Supervises the link to the board. When the router thread reports the link as dropped, this 
+   thread reconnects directly to the same board address (no discovery), backing off from 
+   WD_RECONNECT_MIN_DELAY up to WD_RECONNECT_MAX_DELAY milliseconds between the attempts, and 
+   gives up after WD_RECONNECT_TIMEOUT seconds. Once reconnected, the report mode is restored; the 
+   calibration data and the sample ring are kept, the first new sample is flagged as a gap.
+*/
+void *wd_supervisor_thread(struct wiimote *wiimote)
+{
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_supervisor_thread");
+	struct timespec started, now;
+	int ctl_socket, int_socket;
+	int delay;
+
+	blnIsSupervisorThreadWorking = 1;
+
+	pthread_mutex_lock(&wiimote->link_mutex);
+	while (wiimote->supervisor_continue) 
+	{
+		if (wiimote->link_state != WD_LINK_RECONNECTING) 
+		{
+			pthread_cond_wait(&wiimote->link_cond, &wiimote->link_mutex);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		delay = WD_RECONNECT_MIN_DELAY;
+		while (wiimote->supervisor_continue) 
+		{
+			pthread_mutex_unlock(&wiimote->link_mutex);
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_supervisor_thread: Reconnecting ...");
+			if (wd_l2cap_connect(&wiimote->adapter, &wiimote->bdaddr, &ctl_socket, &int_socket) == 0) 
+			{
+				/* No report may be sent on the old control socket while it is being replaced */
+				pthread_mutex_lock(&wiimote->ctl_mutex);
+				close(wiimote->ctl_socket);
+				close(wiimote->int_socket);
+				wiimote->ctl_socket = ctl_socket;
+				wiimote->int_socket = int_socket;
+				pthread_mutex_unlock(&wiimote->ctl_mutex);
+
+				wd_sample_ring_mark_gap(wiimote->samples);
+				/* A cancel raced by a read or write that finished on its own is still there */
+				wd_drain_pipe(wiimote->rw_pipe[0]);
+				/* The router waits for the link, the time base is not in use */
+				wd_clock_restart(wiimote->clock);
+				wd_apply_supervision_timeout(wiimote);
+				pthread_mutex_lock(&wiimote->link_mutex);
+				wiimote->link_state = WD_LINK_UP;
+				wiimote->reconnect_count++;
+				pthread_cond_broadcast(&wiimote->link_cond);
+				pthread_mutex_unlock(&wiimote->link_mutex);
+
+				/* The router thread is reading again, so the board can be told what to report */
+				if (wiimote->state.rpt_mode && wd_update_rpt_mode(wiimote, -1)) 
+				{
+					__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_supervisor_thread: Error restoring report mode");
+				}
+				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_supervisor_thread: Reconnected (%d)", wiimote->reconnect_count);
+				pthread_mutex_lock(&wiimote->link_mutex);
+				break;
+			}
+			pthread_mutex_lock(&wiimote->link_mutex);
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec - started.tv_sec >= WD_RECONNECT_TIMEOUT) 
+			{
+				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_supervisor_thread: Giving up on the board");
+				wiimote->link_state = WD_LINK_LOST;
+				pthread_cond_broadcast(&wiimote->link_cond);
+				break;
+			}
+			wd_link_sleep(wiimote, delay);
+			delay = (delay * 2 > WD_RECONNECT_MAX_DELAY) ? WD_RECONNECT_MAX_DELAY : delay * 2;
+		}
+	}
+	pthread_mutex_unlock(&wiimote->link_mutex);
+
+	blnIsSupervisorThreadWorking = 0;
+
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Finished wd_supervisor_thread");
+	return NULL;
+}
+
+/* Polls the board with a status request every WD_BATTERY_POLL_INTERVAL seconds. The answer (0x20) 
+   is handled by the router thread, which judges the battery byte in wd_process_status.
+*/
+void *wd_battery_thread(struct wiimote *wiimote)
+{
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_battery_thread");
+	struct timespec wakeup;
+
+	blnIsBatteryThreadWorking = 1;
+
+	pthread_mutex_lock(&wiimote->battery_mutex);
+	while (wiimote->battery_continue) 
+	{
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += WD_BATTERY_POLL_INTERVAL;
+		pthread_cond_timedwait(&wiimote->battery_cond, &wiimote->battery_mutex, &wakeup);
+		if (!wiimote->battery_continue)
+			break;
+
+		/* Nothing to guard before the board starts streaming */
+		if (!(wiimote->state.rpt_mode & WD_RPT_BALANCE))
+			continue;
+
+		pthread_mutex_unlock(&wiimote->battery_mutex);
+		if (wd_request_status(wiimote)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_battery_thread: Status request failed");
+		}
+		pthread_mutex_lock(&wiimote->battery_mutex);
+	}
+	pthread_mutex_unlock(&wiimote->battery_mutex);
+
+	blnIsBatteryThreadWorking = 0;
+
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Finished wd_battery_thread");
+	return NULL;
+}
+
+/* Asks the board for a status report (0x20).
+*/
+int wd_request_status(struct wiimote *wiimote)
+{
+	unsigned char buf = 0;
+
+	if (wd_send_rpt(wiimote, 0, RPT_STATUS_REQ, 1, &buf)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_request_status: Report send error (status request)");
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the battery profile matching the remote name of the board, or the balance board 
+   profile if the name is unknown.
+*/
+const struct wd_battery_profile *wd_find_battery_profile(const char *name)
+{
+	const struct wd_battery_profile *profile;
+
+	for (profile = wd_battery_profiles; name && profile->name; profile++) 
+	{
+		if (strcmp(profile->name, name) == 0)
+			return profile;
+	}
+	return &wd_battery_profiles[WD_BATTERY_DEFAULT_PROFILE];
+}
+
+/* Raises a battery message if the event is worse than the one already raised. Batteries do not 
+   recover during a session, so events never go back down.
+*/
+int wd_check_battery(struct wiimote *wiimote, enum wd_battery_event event, uint8_t level, struct mesg_buf *ma)
+{
+	union wd_mesg *mesg;
+	struct wd_battery_mesg *battery_mesg;
+
+	if (event <= wiimote->state.battery_event)
+		return 0;
+
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_check_battery: Battery event %d (level %.2X)", event, level);
+	if ((mesg = wd_mesg_add(ma, WD_MESG_BATTERY)) == NULL)
+		return -1;
+	battery_mesg = &mesg->battery_mesg;
+	battery_mesg->event = event;
+	battery_mesg->level = level;
+	return 0;
+}
+
+int wd_process_ext(struct wiimote *wiimote, unsigned char *data, unsigned char len, struct mesg_buf *ma)
+{
+	/* The legacy getters follow the connected board, not the held ones */
+	int is_current = (wiimote == wiimote_obj);
+	union wd_mesg *rec;
+	struct wd_balance_mesg *mesg;
+
+	if (is_current)
+		isBalanceDataValid = FALSE;
 //	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_process_ext: Set the balance data as invalid. Going to get a new set.");
 	int i;
 
@@ -1112,19 +3076,32 @@ int wd_process_ext(struct wiimote *wiimote, unsigned char *data, unsigned char l
 	case WD_EXT_BALANCE:
 		if (wiimote->state.rpt_mode & WD_RPT_BALANCE) 
 		{
-			balance_mesg = &ma->array[ma->count++].balance_mesg;
-			balance_mesg->type = WD_MESG_BALANCE;
-			balance_mesg->right_top = ((uint16_t)data[0]<<8 | (uint16_t)data[1]);
-			balance_mesg->right_bottom = ((uint16_t)data[2]<<8 | (uint16_t)data[3]);
-			balance_mesg->left_top = ((uint16_t)data[4]<<8 | (uint16_t)data[5]);
-			balance_mesg->left_bottom = ((uint16_t)data[6]<<8 | (uint16_t)data[7]);
+			/* A starving board sends a report with all the corners set to zero, refer to the 
+			 * comments in the router thread. Never hand it out as a weight. */
+			for (i = 0; i < 8 && data[i] == 0; i++);
+			if (i == 8) 
+			{
+				wiimote->zero_corner_count++;
+				wd_check_battery(wiimote, WD_BATTERY_SENSORS_DEAD, wiimote->state.battery, ma);
+				break;
+			}
+			wiimote->zero_corner_count = 0;
+
+			if ((rec = wd_mesg_add(ma, WD_MESG_BALANCE)) == NULL)
+				return -1;
+			mesg = &rec->balance_mesg;
+			mesg->right_top = ((uint16_t)data[0]<<8 | (uint16_t)data[1]);
+			mesg->right_bottom = ((uint16_t)data[2]<<8 | (uint16_t)data[3]);
+			mesg->left_top = ((uint16_t)data[4]<<8 | (uint16_t)data[5]);
+			mesg->left_bottom = ((uint16_t)data[6]<<8 | (uint16_t)data[7]);
 //			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Updated the weight again! RT: %d, RB: %d, LT: %d, LB: %d, COUNT: %d", 
-//					balance_mesg->right_top, 
-//					balance_mesg->right_bottom, 
-//					balance_mesg->left_top, 
-//					balance_mesg->left_bottom,
+//					mesg->right_top, 
+//					mesg->right_bottom, 
+//					mesg->left_top, 
+//					mesg->left_bottom,
 //					ma->count);
-			isBalanceDataValid = TRUE;
+			if (is_current)
+				isBalanceDataValid = TRUE;
 		}
 		break;
 	case WD_EXT_MOTIONPLUS:
@@ -1135,13 +3112,49 @@ int wd_process_ext(struct wiimote *wiimote, unsigned char *data, unsigned char l
 	return 0;
 }
 
-int wd_process_error(struct wiimote *wiimote, ssize_t len, struct mesg_array *ma)
+/* Hands the balance messages of the packet to the sample ring.
+*/
+int wd_publish_samples(struct wiimote *wiimote, struct mesg_buf *ma)
+{
+	uint16_t raw[WD_CORNER_COUNT];
+	union wd_mesg *mesg;
+	int stamped = 0;
+
+	for (mesg = wd_mesg_next(ma, NULL); mesg; mesg = wd_mesg_next(ma, mesg)) 
+	{
+		if (mesg->type != WD_MESG_BALANCE)
+			continue;
+		/* Balance reports come at the board's pace, the time base fits it */
+		if (!stamped) 
+		{
+			wd_clock_stamp(wiimote->clock, &ma->timestamp, &ma->timestamp);
+		}
+		raw[WD_CORNER_RIGHT_TOP]    = mesg->balance_mesg.right_top;
+		raw[WD_CORNER_RIGHT_BOTTOM] = mesg->balance_mesg.right_bottom;
+		raw[WD_CORNER_LEFT_TOP]     = mesg->balance_mesg.left_top;
+		raw[WD_CORNER_LEFT_BOTTOM]  = mesg->balance_mesg.left_bottom;
+		/* Reports lost before this one, bridged or flagged as a gap */
+		if (!stamped) 
+		{
+			if (wd_sample_ring_bridge(wiimote->samples, raw, &ma->timestamp, wiimote->clock->missed) < 0)
+				return -1;
+			stamped = 1;
+		}
+		if (wd_sample_ring_push(wiimote->samples, raw, &ma->timestamp))
+			return -1;
+	}
+	return 0;
+}
+
+int wd_process_error(struct wiimote *wiimote, ssize_t len, struct mesg_buf *ma)
 {
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_process_error: Started wd_process_error");
+	union wd_mesg *mesg;
 	struct wd_error_mesg *error_mesg;
 
-	error_mesg = &ma->array[ma->count++].error_mesg;
-	error_mesg->type = WD_MESG_ERROR;
+	if ((mesg = wd_mesg_add(ma, WD_MESG_ERROR)) == NULL)
+		return -1;
+	error_mesg = &mesg->error_mesg;
 	if (len == 0) 
 	{
 		error_mesg->error = WD_ERROR_DISCONNECT;
@@ -1151,7 +3164,9 @@ int wd_process_error(struct wiimote *wiimote, ssize_t len, struct mesg_array *ma
 		error_mesg->error = WD_ERROR_COMM;
 	}
 
-	if (wd_cancel_rw(wiimote)) 
+	/* Only a read or write in flight waits for an answer, a cancel nobody takes would fail the 
+	 * next one after a reconnect */
+	if ((wiimote->rw_status != RW_IDLE) && wd_cancel_rw(wiimote)) 
 	{
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_process_error: RW cancel error");
 	}
@@ -1176,10 +3191,10 @@ int wd_cancel_rw(struct wiimote *wiimote)
 	return 0;
 }
 
-int wd_write_mesg_array(struct wiimote *wiimote, struct mesg_array *ma)
+int wd_write_mesg_buf(struct wiimote *wiimote, struct mesg_buf *ma)
 {
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Called");
-	ssize_t len = (void *)&ma->array[ma->count] - (void *)ma;
+	ssize_t len = offsetof(struct mesg_buf, data) + ma->len;
 	int ret = 0;
 
 	/* This must remain a single write operation to ensure atomicity,
@@ -1216,6 +3231,60 @@ int wd_write_mesg_array(struct wiimote *wiimote, struct mesg_array *ma)
 	return ret;
 }
 
+/* Sizes of the message records, by type */
+static const uint8_t wd_mesg_len[] = 
+{
+	[WD_MESG_STATUS]		= sizeof(struct wd_status_mesg),
+	[WD_MESG_BTN]			= sizeof(struct wd_btn_mesg),
+	[WD_MESG_ACC]			= sizeof(struct wd_acc_mesg),
+	[WD_MESG_IR]			= sizeof(struct wd_ir_mesg),
+	[WD_MESG_NUNCHUK]		= sizeof(struct wd_nunchuk_mesg),
+	[WD_MESG_CLASSIC]		= sizeof(struct wd_classic_mesg),
+	[WD_MESG_BALANCE]		= sizeof(struct wd_balance_mesg),
+	[WD_MESG_MOTIONPLUS]	= sizeof(struct wd_motionplus_mesg),
+	[WD_MESG_BATTERY]		= sizeof(struct wd_battery_mesg),
+	[WD_MESG_ERROR]			= sizeof(struct wd_error_mesg),
+	[WD_MESG_UNKNOWN]		= sizeof(enum wd_mesg_type)
+};
+
+/* Appends a record of the given type behind the ones already in the buffer.
+   Returns:
+	NULL if the buffer has no room left for it,
+	the message, with its type set, otherwise.
+*/
+union wd_mesg *wd_mesg_add(struct mesg_buf *ma, enum wd_mesg_type type)
+{
+	union wd_mesg *mesg;
+
+	if (ma->len + wd_mesg_len[type] > WD_MESG_BUF_LEN) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_mesg_add: No room for message %d", type);
+		return NULL;
+	}
+	mesg = (union wd_mesg *)&ma->data[ma->len];
+	mesg->type = type;
+	ma->len += wd_mesg_len[type];
+	ma->count++;
+	return mesg;
+}
+
+/* Walks the records of the buffer, NULL gives the first one. Only the member named by the type 
+   of a record may be read, the record is no bigger than that.
+   Returns:
+	NULL past the last record,
+	the record following mesg otherwise.
+*/
+union wd_mesg *wd_mesg_next(struct mesg_buf *ma, union wd_mesg *mesg)
+{
+	size_t off = 0;
+
+	if (mesg)
+		off = (unsigned char *)mesg - ma->data + wd_mesg_len[mesg->type];
+	if (off >= ma->len)
+		return NULL;
+	return (union wd_mesg *)&ma->data[off];
+}
+
 int wd_write(wiimote_t *wiimote, uint8_t flags, uint32_t offset, uint16_t len, const void *data)
 {
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_write");
@@ -1303,9 +3372,8 @@ CODA:
 	return ret;
 }
 
-int wd_update_state(struct wiimote *wiimote, struct mesg_array *ma)
+int wd_update_state(struct wiimote *wiimote, struct mesg_buf *ma)
 {
-	int i;
 	union wd_mesg *mesg;
 
 	if (pthread_mutex_lock(&wiimote->state_mutex)) 
@@ -1314,10 +3382,8 @@ int wd_update_state(struct wiimote *wiimote, struct mesg_array *ma)
 		return -1;
 	}
 
-	for (i=0; i < ma->count; i++) 
+	for (mesg = wd_mesg_next(ma, NULL); mesg; mesg = wd_mesg_next(ma, mesg)) 
 	{
-		mesg = &ma->array[i];
-
 		switch (mesg->type) 
 		{
 		case WD_MESG_STATUS:
@@ -1327,6 +3393,8 @@ int wd_update_state(struct wiimote *wiimote, struct mesg_array *ma)
 				memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
 				wiimote->state.ext_type = mesg->status_mesg.ext_type;
 			}
+			wiimote->status_count++;
+			pthread_cond_broadcast(&wiimote->state_cond);
 			break;
 		case WD_MESG_BTN:
 			wiimote->state.buttons = mesg->btn_mesg.buttons;
@@ -1371,6 +3439,9 @@ int wd_update_state(struct wiimote *wiimote, struct mesg_array *ma)
 			       mesg->motionplus_mesg.low_speed,
 			       sizeof wiimote->state.ext.motionplus.low_speed);
 			break;
+		case WD_MESG_BATTERY:
+			wiimote->state.battery_event = mesg->battery_mesg.event;
+			break;
 		case WD_MESG_ERROR:
 			wiimote->state.error = mesg->error_mesg.error;
 			break;
@@ -1442,6 +3513,8 @@ int wd_update_rpt_mode(struct wiimote *wiimote, int8_t rpt_mode)
 	if (wd_send_rpt(wiimote, 0, RPT_RPT_MODE, RPT_MODE_BUF_LEN, buf)) 
 	{
 		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Send report error (report mode)");
+		/* The mutex stays with the slot for the next session, never leave it locked */
+		pthread_mutex_unlock(&wiimote->rpt_mutex);
 		return -1;
 	}
 
@@ -1516,10 +3589,10 @@ int wd_process_read(struct wiimote *wiimote, unsigned char *data)
 	return 0;
 }
 
-int wd_process_btn(struct wiimote *wiimote, const unsigned char *data, struct mesg_array *ma)
+int wd_process_btn(struct wiimote *wiimote, const unsigned char *data, struct mesg_buf *ma)
 {
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_process_btn");
-	struct wd_btn_mesg *btn_mesg;
+	union wd_mesg *mesg;
 	uint16_t buttons;
 
 	buttons = (data[0] & BTN_MASK_0)<<8 |
@@ -1529,9 +3602,9 @@ int wd_process_btn(struct wiimote *wiimote, const unsigned char *data, struct me
 		if ((wiimote->state.buttons != buttons) ||
 		  (wiimote->flags & WD_FLAG_REPEAT_BTN)) 
 		{
-			btn_mesg = &ma->array[ma->count++].btn_mesg;
-			btn_mesg->type = WD_MESG_BTN;
-			btn_mesg->buttons = buttons;
+			if ((mesg = wd_mesg_add(ma, WD_MESG_BTN)) == NULL)
+				return -1;
+			mesg->btn_mesg.buttons = buttons;
 		}
 	}
 
@@ -1539,15 +3612,17 @@ int wd_process_btn(struct wiimote *wiimote, const unsigned char *data, struct me
 	return 0;
 }
 
-int wd_process_acc(struct wiimote *wiimote, const unsigned char *data, struct mesg_array *ma)
+int wd_process_acc(struct wiimote *wiimote, const unsigned char *data, struct mesg_buf *ma)
 {
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_process_acc");
 	struct wd_acc_mesg *acc_mesg;
+	union wd_mesg *mesg;
 
 	if (wiimote->state.rpt_mode & WD_RPT_ACC) 
 	{
-		acc_mesg = &ma->array[ma->count++].acc_mesg;
-		acc_mesg->type = WD_MESG_ACC;
+		if ((mesg = wd_mesg_add(ma, WD_MESG_ACC)) == NULL)
+			return -1;
+		acc_mesg = &mesg->acc_mesg;
 		acc_mesg->acc[WD_X] = data[0];
 		acc_mesg->acc[WD_Y] = data[1];
 		acc_mesg->acc[WD_Z] = data[2];
@@ -1580,13 +3655,21 @@ int wd_process_write(struct wiimote *wiimote, unsigned char *data)
 	return 0;
 }
 
-int wd_process_status(struct wiimote *wiimote, const unsigned char *data, struct mesg_array *ma)
+int wd_process_status(struct wiimote *wiimote, const unsigned char *data, struct mesg_buf *ma)
 {
 	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_process_status: Started process_status");
 	struct wd_status_mesg status_mesg;
 
 	status_mesg.type = WD_MESG_STATUS;
 	status_mesg.battery = data[5];
+	if (data[5] <= wiimote->battery_profile->critical) 
+	{
+		wd_check_battery(wiimote, WD_BATTERY_CRITICAL, data[5], ma);
+	}
+	else if (data[5] <= wiimote->battery_profile->low) 
+	{
+		wd_check_battery(wiimote, WD_BATTERY_LOW, data[5], ma);
+	}
 	if (data[2] & 0x02) 
 	{
 		/* wd_status_thread will figure out what it is */
@@ -1606,7 +3689,7 @@ int wd_process_status(struct wiimote *wiimote, const unsigned char *data, struct
 	return 0;
 }
 
-/*jint Java_iEpi_Scale_BoardInterface_intSetMode( JNIEnv* env,jobject thiz,int mode)
+/*jint wd_jni_intSetMode( JNIEnv* env,jobject thiz,int mode)
 {
 	bdaddr_t 	btDevAddr;
 	bdaddr_t 	src, dst, dst_first;	
@@ -1641,93 +3724,3 @@ int wd_process_status(struct wiimote *wiimote, const unsigned char *data, struct
 }
 */
 
-/* Returns whether balance board calibration values are valid or not
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getIsCalibrationDataValid()
-{
-	return isCalibrationDataValid;
-}
-
-/* Returns the 0st value for right top of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalRightTop0()
-{
-	return (&cal_data)->right_top[0];
-}
-
-/* Returns the 1st value for right top of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalRightTop1()
-{
-	return (&cal_data)->right_top[1];
-}
-
-/* Returns the 2st value for right top of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalRightTop2()
-{
-	return (&cal_data)->right_top[2];
-}
-
-/* Returns the 0st value for left top of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalLeftTop0()
-{
-	return (&cal_data)->left_top[0];
-}
-
-/* Returns the 1st value for left top of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalLeftTop1()
-{
-	return (&cal_data)->left_top[1];
-}
-
-/* Returns the 2st value for right top of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalLeftTop2()
-{
-	return (&cal_data)->left_top[2];
-}
-
-/* Returns the 0st value for right bottom of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalRightBottom0()
-{
-	return (&cal_data)->right_bottom[0];
-}
-
-/* Returns the 1st value for right bottom of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalRightBottom1()
-{
-	return (&cal_data)->right_bottom[1];
-}
-
-/* Returns the 2st value for right bottom of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalRightBottom2()
-{
-	return (&cal_data)->right_bottom[2];
-}
-
-/* Returns the 0st value for left bottom of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalLeftBottom0()
-{
-	return (&cal_data)->left_bottom[0];
-}
-
-/* Returns the 1st value for left bottom of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalLeftBottom1()
-{
-	return (&cal_data)->left_bottom[1];
-}
-
-/* Returns the 2st value for left bottom of calibration data
-*/ 
-jint Java_iEpi_Scale_BoardInterface_getCalLeftBottom2()
-{
-	return (&cal_data)->left_bottom[2];
-}
@@ -0,0 +1,214 @@
+/* Measures what a balance report costs on the live path of the router thread: the message
+   records it is parsed into on the router stack, the board state update, the time base and the
+   sample ring. The bytes are counted by what actually changes, packets alternate between two
+   complementary payloads so that every byte written changes. See Makefile for the build.
+
+	mesg_bench [packets]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "../BTL.c"
+
+#define BENCH_PACKETS			200000
+#define BENCH_PATTERN			0xA5
+#define BENCH_ROUNDS			16
+
+/* The driver logs on every packet, which is not what is measured here */
+int __android_log_print(int prio, const char *tag, const char *fmt, ...)
+{
+	return 0;
+}
+
+static jint bench_attach(JavaVM *vm, JNIEnv **env, void *args)
+{
+	*env = NULL;
+	return JNI_OK;
+}
+
+static jint bench_detach(JavaVM *vm)
+{
+	return JNI_OK;
+}
+
+static struct JNIInvokeInterface bench_invoke;
+static JavaVM bench_vm;
+
+static long bench_ns(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+static int bench_changed(const void *before, const void *after, size_t len)
+{
+	const unsigned char *a = before, *b = after;
+	size_t i;
+	int count = 0;
+
+	for (i = 0; i < len; i++) 
+	{
+		if (a[i] != b[i])
+			count++;
+	}
+	return count;
+}
+
+/* A 0x32 report (buttons, then the 8 extension bytes of the corners), complemented on odd packets */
+static void bench_packet(unsigned char *buf, int n)
+{
+	static const unsigned char corners[8] = { 0x12, 0x34, 0x23, 0x45, 0x34, 0x56, 0x45, 0x67 };
+	int i;
+
+	memset(buf, 0, READ_BUF_LEN);
+	buf[0] = BT_TRANS_DATA | BT_PARAM_INPUT;
+	buf[1] = RPT_BTN_EXT8;
+	for (i = 0; i < 8; i++) 
+	{
+		buf[4 + i] = (n & 1) ? (unsigned char)~corners[i] : corners[i];
+	}
+}
+
+/* One packet through what the router does with it once read */
+static void bench_route(struct wiimote *wiimote, unsigned char *buf, struct mesg_buf *ma)
+{
+	clock_gettime(WD_SAMPLE_CLOCK, &ma->timestamp);
+	ma->count = 0;
+	ma->len = 0;
+	if (!wd_process_ext(wiimote, &buf[4], 8, ma) && (ma->count > 0)) 
+	{
+		wd_update_state(wiimote, ma);
+		wd_publish_samples(wiimote, ma);
+	}
+}
+
+static void bench_bytes(struct wiimote *wiimote)
+{
+	static struct wd_sample_ring ring;
+	struct mesg_buf ma, blank;
+	struct wd_state state;
+	struct wd_clock clock;
+	unsigned char buf[READ_BUF_LEN];
+	int n, records = 0, states = 0, clocks = 0, rings = 0;
+
+	for (n = 0; n < BENCH_ROUNDS; n++) 
+	{
+		bench_packet(buf, n);
+		memset(&ma, BENCH_PATTERN, sizeof ma);
+		blank = ma;
+		state = wiimote->state;
+		clock = *wiimote->clock;
+		/* The slot the sample goes to is about to be overwritten anyway */
+		memset(&wiimote->samples->samples[wiimote->samples->head & WD_SAMPLE_RING_MASK], BENCH_PATTERN, sizeof(struct wd_sample));
+		ring = *wiimote->samples;
+		bench_route(wiimote, buf, &ma);
+		/* The header and timestamp are written for every packet, the rest is the records */
+		records += bench_changed(&blank, &ma, sizeof ma);
+		states += bench_changed(&state, &wiimote->state, sizeof state);
+		clocks += bench_changed(&clock, wiimote->clock, sizeof clock);
+		rings += bench_changed(&ring, wiimote->samples, sizeof ring);
+	}
+	printf("router stack: report %d + message buffer %zu bytes\n", READ_BUF_LEN, sizeof ma);
+	printf("bytes changed per sample: records %.1f, state %.1f, time base %.1f, sample ring %.1f\n",
+			(double)records / BENCH_ROUNDS, (double)states / BENCH_ROUNDS,
+			(double)clocks / BENCH_ROUNDS, (double)rings / BENCH_ROUNDS);
+}
+
+static void bench_inline(struct wiimote *wiimote, int packets)
+{
+	unsigned char buf[2][READ_BUF_LEN];
+	struct mesg_buf ma;
+	struct timespec from, to;
+	int n;
+
+	bench_packet(buf[0], 0);
+	bench_packet(buf[1], 1);
+	clock_gettime(CLOCK_MONOTONIC, &from);
+	for (n = 0; n < packets; n++) 
+	{
+		bench_route(wiimote, buf[n & 1], &ma);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &to);
+	printf("parse + state + ring, in line: %.1f ns per packet\n", (double)bench_ns(&from, &to) / packets);
+}
+
+/* The same packets written to the interrupt socket, for the router thread to read */
+static void bench_router(struct wiimote *wiimote, int sock, int packets)
+{
+	unsigned char buf[2][READ_BUF_LEN];
+	struct timespec from, to;
+	uint32_t start, head;
+	int n;
+
+	bench_packet(buf[0], 0);
+	bench_packet(buf[1], 1);
+	pthread_mutex_lock(&wiimote->samples->mutex);
+	start = wiimote->samples->head;
+	pthread_mutex_unlock(&wiimote->samples->mutex);
+
+	clock_gettime(CLOCK_MONOTONIC, &from);
+	for (n = 0; n < packets; n++) 
+	{
+		if (write(sock, buf[n & 1], 12) != 12) 
+		{
+			perror("write");
+			return;
+		}
+	}
+	do 
+	{
+		pthread_mutex_lock(&wiimote->samples->mutex);
+		head = wiimote->samples->head;
+		pthread_mutex_unlock(&wiimote->samples->mutex);
+	} while (head - start < (uint32_t)packets);
+	clock_gettime(CLOCK_MONOTONIC, &to);
+	printf("through the router thread: %.1f ns per packet\n", (double)bench_ns(&from, &to) / packets);
+}
+
+int main(int argc, char **argv)
+{
+	int packets = (argc > 1) ? atoi(argv[1]) : BENCH_PACKETS;
+	int ctl[2], intr[2], i;
+	struct balance_cal cal;
+	struct wiimote *wiimote;
+
+	bench_invoke.AttachCurrentThread = &bench_attach;
+	bench_invoke.DetachCurrentThread = &bench_detach;
+	bench_vm = &bench_invoke;
+	jvm = &bench_vm;
+
+	if (wd_pool_init(&pool, 1, &wd_slot_create, &wd_slot_destroy)) 
+	{
+		fprintf(stderr, "Could not make the session pool\n");
+		return 1;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ctl) || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, intr)) 
+	{
+		perror("socketpair");
+		return 1;
+	}
+	if ((wiimote = wd_create_new_wii(ctl[0], intr[0], 0)) == NULL) 
+	{
+		fprintf(stderr, "Could not create the session\n");
+		return 1;
+	}
+	/* What the status report and the report mode would have set */
+	pthread_mutex_lock(&wiimote->state_mutex);
+	wiimote->state.ext_type = WD_EXT_BALANCE;
+	wiimote->state.rpt_mode = WD_RPT_BALANCE;
+	pthread_mutex_unlock(&wiimote->state_mutex);
+	/* Samples are calibrated as they come in, as they are once a session is going */
+	for (i = 0; i < 3; i++) 
+	{
+		cal.right_top[i] = cal.right_bottom[i] = cal.left_top[i] = cal.left_bottom[i] = 0x1000 * (i + 1);
+	}
+	wd_sample_ring_set_calibration(wiimote->samples, &cal);
+
+	bench_bytes(wiimote);
+	bench_inline(wiimote, packets);
+	bench_router(wiimote, intr[1], packets);
+
+	wd_disconnect(wiimote);
+	close(ctl[1]);
+	close(intr[1]);
+	wd_pool_destroy(&pool);
+	return 0;
+}
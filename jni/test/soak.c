@@ -0,0 +1,187 @@
+/* Connects and disconnects a session over and over, as a kiosk does all day, through the session
+   pool: socket pairs stand in for the board. Every cycle goes through wd_create_new_wii and the
+   disconnect JNI entry, with a status and a balance report on the way. The descriptors and threads
+   of the process must not grow across cycles, and after JNI_OnUnload only the main thread is left.
+   See Makefile for the build.
+
+	soak [cycles]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include "../BTL.c"
+
+#define SOAK_CYCLES				2000
+
+int __android_log_print(int prio, const char *tag, const char *fmt, ...)
+{
+	return 0;
+}
+
+static jint soak_attach(JavaVM *vm, JNIEnv **env, void *args)
+{
+	*env = NULL;
+	return JNI_OK;
+}
+
+static jint soak_detach(JavaVM *vm)
+{
+	return JNI_OK;
+}
+
+static struct JNIInvokeInterface soak_invoke;
+static JavaVM soak_vm;
+
+/* Number of entries of a /proc/self directory */
+static int soak_count(const char *dir)
+{
+	DIR *d;
+	int count = 0;
+
+	if ((d = opendir(dir)) == NULL)
+		return -1;
+	while (readdir(d))
+		count++;
+	closedir(d);
+	return count - 2;
+}
+
+static long soak_ns(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+static int soak_compare(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static void soak_report(const char *what, long *ns, int count)
+{
+	qsort(ns, count, sizeof *ns, &soak_compare);
+	printf("%s us: min %.1f median %.1f p99 %.1f max %.1f\n", what, ns[0] / 1e3, ns[count / 2] / 1e3,
+			ns[count * 99 / 100] / 1e3, ns[count - 1] / 1e3);
+}
+
+/* Connects a session over two new socket pairs, as intConnect and ConnectCalibrateRead would.
+   Returns:
+	the board end of the interrupt channel, -1 on error.
+*/
+static int soak_connect(int *ctl_peer, long *ns)
+{
+	struct timespec from, to;
+	struct wiimote *wiimote;
+	int ctl[2], intr[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ctl))
+		return -1;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, intr)) 
+	{
+		close(ctl[0]);
+		close(ctl[1]);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &from);
+	wiimote = wd_create_new_wii(ctl[0], intr[0], 0);
+	clock_gettime(CLOCK_MONOTONIC, &to);
+	if (!wiimote) 
+	{
+		close(ctl[0]);
+		close(ctl[1]);
+		close(intr[0]);
+		close(intr[1]);
+		return -1;
+	}
+	*ns = soak_ns(&from, &to);
+	wd_swap_board(wiimote);
+	wd_session_open(&session);
+	*ctl_peer = ctl[1];
+	return intr[1];
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned char status[8] = { 0xA1, RPT_STATUS, 0, 0, 0, 0, 0, 0xC0 };
+	static const unsigned char balance[12] = { 0xA1, RPT_BTN_EXT8, 0, 0, 0x12, 0x34, 0x23, 0x45, 0x34, 0x56, 0x45, 0x67 };
+	int cycles = (argc > 1) ? atoi(argv[1]) : SOAK_CYCLES;
+	int fds, threads, ctl, intr, i;
+	struct timespec from, to;
+	long *connect_ns, *disconnect_ns;
+
+	if ((cycles < 1) ||
+	    ((connect_ns = malloc(cycles * sizeof *connect_ns)) == NULL) ||
+	    ((disconnect_ns = malloc(cycles * sizeof *disconnect_ns)) == NULL)) 
+	{
+		fprintf(stderr, "usage: soak [cycles]\n");
+		return 1;
+	}
+	soak_invoke.AttachCurrentThread = &soak_attach;
+	soak_invoke.DetachCurrentThread = &soak_detach;
+	soak_vm = &soak_invoke;
+	fds = soak_count("/proc/self/fd");
+	threads = soak_count("/proc/self/task");
+
+	/* JNI_OnLoad, but for the natives */
+	jvm = &soak_vm;
+	if (wd_hci_init(&hci_ctl) || wd_hci_adapters_init(&hci_adapters))
+		return 1;
+	for (i = 0; i < WD_HCI_MAX_ADAPTERS; i++) 
+	{
+		if (wd_hci_init(&hci_links[i]))
+			return 1;
+	}
+	if (wd_session_init(&session, &wd_release_board, &wd_board_idle, NULL) ||
+	    wd_pool_init(&pool, WD_FUSION_MAX_BOARDS + 1, &wd_slot_create, &wd_slot_destroy)) 
+	{
+		fprintf(stderr, "Could not set the library up\n");
+		return 1;
+	}
+	printf("loaded: %d descriptors, %d threads more\n", soak_count("/proc/self/fd") - fds,
+			soak_count("/proc/self/task") - threads);
+
+	for (i = 0; i < cycles; i++) 
+	{
+		if ((intr = soak_connect(&ctl, &connect_ns[i])) < 0) 
+		{
+			fprintf(stderr, "Connect failed in cycle %d\n", i);
+			return 1;
+		}
+		if ((write(intr, status, sizeof status) != sizeof status) ||
+		    (write(intr, balance, sizeof balance) != sizeof balance)) 
+		{
+			fprintf(stderr, "Could not write the reports in cycle %d\n", i);
+			return 1;
+		}
+		usleep(200);
+		wd_jni_getLinkState();
+		clock_gettime(CLOCK_MONOTONIC, &from);
+		wd_jni_disconnect();
+		clock_gettime(CLOCK_MONOTONIC, &to);
+		disconnect_ns[i] = soak_ns(&from, &to);
+		close(ctl);
+		close(intr);
+		if ((i == cycles / 2) || (i == cycles - 1))
+			printf("cycle %d: %d descriptors, %d threads more\n", i, soak_count("/proc/self/fd") - fds,
+					soak_count("/proc/self/task") - threads);
+	}
+	soak_report("connect", connect_ns, cycles);
+	soak_report("disconnect", disconnect_ns, cycles);
+
+	/* The library goes with a session still up */
+	if ((intr = soak_connect(&ctl, &connect_ns[0])) < 0) 
+	{
+		fprintf(stderr, "Connect failed before the unload\n");
+		return 1;
+	}
+	JNI_OnUnload(&soak_vm, NULL);
+	close(ctl);
+	close(intr);
+	fds = soak_count("/proc/self/fd") - fds;
+	threads = soak_count("/proc/self/task") - threads;
+	printf("unloaded: %d descriptors, %d threads more\n", fds, threads);
+	free(connect_ns);
+	free(disconnect_ns);
+	return (fds || threads) ? 1 : 0;
+}
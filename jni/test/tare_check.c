@@ -0,0 +1,95 @@
+/* Feeds the sample ring an empty board whose zero has drifted, then a person stepping on it, and 
+   checks the tare: the drift is learned as the zero offsets and taken off, the person is not. 
+   See Makefile for the build.
+
+	tare_check
+*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "bluetooth.h"
+#include "wii_droid_defs.h"
+#include "wd_samples.h"
+
+#define CHECK_RATE				100		/* Samples per second */
+#define CHECK_RAW_PER_KG		100		/* Of the calibration below */
+#define CHECK_DRIFT				0.4f	/* KG, the whole board */
+#define CHECK_PERSON			70.0f
+#define CHECK_EPSILON			0.02f
+
+int __android_log_print(int prio, const char *tag, const char *fmt, ...)
+{
+	return 0;
+}
+
+/* Pushes seconds worth of samples weighing kg in all, spread evenly over the corners */
+static void check_feed(struct wd_sample_ring *ring, struct timespec *now, float kg, int seconds)
+{
+	uint16_t raw[WD_CORNER_COUNT];
+	int i, n;
+
+	for (i = 0; i < WD_CORNER_COUNT; i++) 
+		raw[i] = (uint16_t)lroundf(kg / WD_CORNER_COUNT * CHECK_RAW_PER_KG);
+	for (n = 0; n < seconds * CHECK_RATE; n++) 
+	{
+		now->tv_nsec += 1000000000L / CHECK_RATE;
+		if (now->tv_nsec >= 1000000000L) 
+		{
+			now->tv_sec++;
+			now->tv_nsec -= 1000000000L;
+		}
+		wd_sample_ring_push(ring, raw, now);
+	}
+}
+
+/* Returns the total of the last sample fed, and its flags in flags */
+static float check_last(struct wd_sample_ring *ring, uint16_t *flags)
+{
+	struct wd_sample sample;
+
+	while (wd_sample_ring_read(ring, &sample, 1) == 1)
+		;
+	*flags = sample.flags;
+	return sample.total;
+}
+
+int main(int argc, char **argv)
+{
+	static struct wd_sample_ring ring;
+	struct balance_cal cal;
+	struct timespec now = { 1000, 0 };
+	uint16_t flags;
+	float total;
+	int i, failed = 0;
+
+	for (i = 0; i < 3; i++) 
+	{
+		/* 0, 17 and 34 KG on the corner */
+		cal.right_top[i] = cal.right_bottom[i] = cal.left_top[i] = cal.left_bottom[i] = i * 17 * CHECK_RAW_PER_KG;
+	}
+	if (wd_sample_ring_init(&ring) || wd_sample_ring_set_calibration(&ring, &cal)) 
+	{
+		fprintf(stderr, "Could not set the ring up\n");
+		return 1;
+	}
+
+	/* Empty, but reading CHECK_DRIFT */
+	check_feed(&ring, &now, CHECK_DRIFT, 3);
+	total = check_last(&ring, &flags);
+	printf("empty board, %.1f KG off: total %.3f KG, %s\n", CHECK_DRIFT, total, (flags & WD_SAMPLE_TARED) ? "tared" : "not tared");
+	if (!(flags & WD_SAMPLE_TARED) || (fabsf(total) > CHECK_EPSILON))
+		failed = 1;
+
+	/* Somebody steps on, standing still, and is weighed without the offset */
+	check_feed(&ring, &now, CHECK_PERSON + CHECK_DRIFT, 5);
+	total = check_last(&ring, &flags);
+	printf("%.0f KG person: total %.3f KG\n", CHECK_PERSON, total);
+	if (fabsf(total - CHECK_PERSON) > CHECK_EPSILON)
+		failed = 1;
+
+	wd_sample_ring_destroy(&ring);
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
@@ -0,0 +1,277 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Time base of a session. Reports are timed on the monotonic clock, from the kernel receive 
+ *  time when the socket provides one, and the report period of the board is fitted online so 
+ *  that the samples come out evenly spaced.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_clock.h"
+
+static int64_t wd_clock_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void wd_clock_set(struct timespec *ts, int64_t ns)
+{
+	ts->tv_sec = ns / 1000000000LL;
+	ts->tv_nsec = ns % 1000000000LL;
+}
+
+static int64_t wd_clock_round(double x)
+{
+	return (int64_t)floor(x + 0.5);
+}
+
+/* Starts the time base of a session, taking the mapping from CLOCK_MONOTONIC to the wall clock.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_clock_init(struct wd_clock *clock)
+{
+	struct timespec mono, wall;
+
+	memset(clock, 0, sizeof *clock);
+	if (pthread_mutex_init(&clock->mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_clock_init: Error in initialization of clock mutex.");
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &wall);
+	clock->wall_offset = wd_clock_ns(&wall) - wd_clock_ns(&mono);
+	clock->period = WD_CLOCK_NOMINAL_PERIOD;
+	return 0;
+}
+
+void wd_clock_destroy(struct wd_clock *clock)
+{
+	pthread_mutex_destroy(&clock->mutex);
+}
+
+/* Drops the fit, e.g. when the link has been brought back and the reports have a new phase. The 
+   last period is kept as the first guess of the new fit.
+*/
+void wd_clock_restart(struct wd_clock *clock)
+{
+	clock->count = 0;
+	clock->fitted = 0;
+}
+
+/* Asks the kernel to time the packets of socket as they are received.
+   Returns:
+	-1 if the socket does not support it,
+	 0 otherwise.
+*/
+int wd_clock_enable_kernel_stamps(int socket)
+{
+#ifdef SO_TIMESTAMPNS
+	int on = 1;
+
+	if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on) == 0)
+		return 0;
+#endif
+	return -1;
+}
+
+/* read() for the interrupt channel, which also returns the CLOCK_MONOTONIC arrival time of the 
+   packet. If the kernel has timed the packet, the time it has spent in the socket is taken off, 
+   which leaves out the latency of the router thread.
+*/
+ssize_t wd_clock_read(struct wd_clock *clock, int socket, void *buf, size_t len, struct timespec *arrival)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct timespec wall, received;
+	int64_t latency;
+	int kernel_stamp = 0;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+
+	ret = recvmsg(socket, &msg, 0);
+	clock_gettime(CLOCK_MONOTONIC, arrival);
+	if (ret <= 0)
+		return ret;
+
+#ifdef SCM_TIMESTAMPNS
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) 
+	{
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) 
+		{
+			memcpy(&received, CMSG_DATA(cmsg), sizeof received);
+			kernel_stamp = 1;
+		}
+	}
+#endif
+	if (kernel_stamp) 
+	{
+		/* The kernel times on the wall clock; only the short time in between is carried over, 
+		 * so a jump of the wall clock costs this packet and no more */
+		clock_gettime(CLOCK_REALTIME, &wall);
+		latency = wd_clock_ns(&wall) - wd_clock_ns(&received);
+		if ((latency >= 0) && (latency <= WD_CLOCK_MAX_LATENCY * 1000000LL)) 
+		{
+			wd_clock_set(arrival, wd_clock_ns(arrival) - latency);
+			pthread_mutex_lock(&clock->mutex);
+			clock->stats.kernel_stamps++;
+			pthread_mutex_unlock(&clock->mutex);
+		}
+	}
+	return ret;
+}
+
+/* Least squares fit of the arrivals over the report index. Periods out of range are discarded, 
+   the previous fit stays.
+*/
+static void wd_clock_fit(struct wd_clock *clock)
+{
+	uint32_t n = (clock->count < WD_CLOCK_WINDOW) ? clock->count : WD_CLOCK_WINDOW, i;
+	double mean_index = 0, mean_offset = 0, sxx = 0, sxy = 0, dx, period, intercept, residual, sum = 0;
+
+	for (i = 0; i < n; i++) 
+	{
+		mean_index += clock->index[i];
+		mean_offset += clock->offset[i];
+	}
+	mean_index /= n;
+	mean_offset /= n;
+	for (i = 0; i < n; i++) 
+	{
+		dx = clock->index[i] - mean_index;
+		sxx += dx * dx;
+		sxy += dx * (clock->offset[i] - mean_offset);
+	}
+	if (sxx <= 0)
+		return;
+	period = sxy / sxx;
+	if ((period < WD_CLOCK_MIN_PERIOD) || (period > WD_CLOCK_MAX_PERIOD))
+		return;
+	intercept = mean_offset - period * mean_index;
+	for (i = 0; i < n; i++) 
+	{
+		residual = clock->offset[i] - (intercept + period * clock->index[i]);
+		sum += residual * residual;
+	}
+
+	clock->period = period;
+	clock->intercept = intercept;
+	clock->fitted = 1;
+	pthread_mutex_lock(&clock->mutex);
+	clock->stats.period = period / 1000000.0;
+	clock->stats.jitter = sqrt(sum / n) / 1000000.0;
+	pthread_mutex_unlock(&clock->mutex);
+}
+
+/* Files the arrival of a report and returns the time the samples of the report are stamped with, 
+   which is the fitted one once the fit is good. The index of the report is the number of periods 
+   since the start of the fit, so reports lost on the way leave holes in it; missed is set to the 
+   number of reports lost right before this one. The stamps always increase.
+*/
+void wd_clock_stamp(struct wd_clock *clock, const struct timespec *arrival, struct timespec *stamp)
+{
+	int64_t t = wd_clock_ns(arrival), index, s;
+	double predicted;
+
+	clock->missed = 0;
+	if (clock->count == 0) 
+	{
+		clock->base = t;
+		index = 0;
+	}
+	else 
+	{
+		/* Until the line is known every report is taken as the next one. Afterwards the line 
+		 * places the report, but a report only skips indices if it also came late on its 
+		 * predecessor, so that jitter alone does not open holes. */
+		index = clock->last_index + 1;
+		if (clock->fitted && (t - clock->last_arrival > 1.5 * clock->period)) 
+		{
+			index = wd_clock_round((t - clock->base - clock->intercept) / clock->period);
+			if (index <= clock->last_index)
+				index = clock->last_index + 1;
+		}
+
+		predicted = clock->base + clock->intercept + clock->period * index;
+		if (clock->fitted && (fabs(t - predicted) > WD_CLOCK_RESYNC * 1000000.0)) 
+		{
+			/* Off the line, the board or the radio changed pace. Start over from this report. */
+			pthread_mutex_lock(&clock->mutex);
+			clock->stats.resyncs++;
+			pthread_mutex_unlock(&clock->mutex);
+			index = clock->last_index + wd_clock_round((t - clock->last_arrival) / clock->period);
+			if (index > clock->last_index + 1)
+				clock->missed = index - clock->last_index - 1;
+			clock->count = 0;
+			clock->fitted = 0;
+			clock->base = t;
+			index = 0;
+		}
+		else
+			clock->missed = index - clock->last_index - 1;
+	}
+
+	clock->index[clock->count % WD_CLOCK_WINDOW] = index;
+	clock->offset[clock->count % WD_CLOCK_WINDOW] = t - clock->base;
+	clock->count++;
+	if (clock->count >= WD_CLOCK_MIN_FIT)
+		wd_clock_fit(clock);
+
+	s = clock->fitted ? clock->base + wd_clock_round(clock->intercept + clock->period * index) : t;
+	if (clock->last_stamp && (s <= clock->last_stamp))
+		s = clock->last_stamp + 1;
+	clock->last_index = index;
+	clock->last_arrival = t;
+	clock->last_stamp = s;
+	wd_clock_set(stamp, s);
+
+	pthread_mutex_lock(&clock->mutex);
+	clock->stats.reports++;
+	pthread_mutex_unlock(&clock->mutex);
+}
+
+void wd_clock_get_stats(struct wd_clock *clock, struct wd_clock_stats *stats)
+{
+	pthread_mutex_lock(&clock->mutex);
+	*stats = clock->stats;
+	pthread_mutex_unlock(&clock->mutex);
+}
@@ -0,0 +1,83 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_CLOCK_H
+#define WD_CLOCK_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Reports in the fit of the report period */
+#define WD_CLOCK_WINDOW			64
+/* Reports the fit needs before its times are used */
+#define WD_CLOCK_MIN_FIT		8
+/* ns, guess of the report period until the first fit */
+#define WD_CLOCK_NOMINAL_PERIOD	10000000L
+/* ns, fitted periods outside these are discarded */
+#define WD_CLOCK_MIN_PERIOD		2000000L
+#define WD_CLOCK_MAX_PERIOD		100000000L
+/* ms a report may arrive off the fitted line before the fit starts over */
+#define WD_CLOCK_RESYNC			50
+/* ms, kernel receive times further than this behind the read are not trusted */
+#define WD_CLOCK_MAX_LATENCY	1000
+
+/* Statistics of the time base */
+struct wd_clock_stats 
+{
+	uint32_t reports;					/* Reports stamped */
+	uint32_t kernel_stamps;				/* Reports with a kernel receive time */
+	uint32_t resyncs;					/* Times the fit started over */
+	float period;						/* ms, fitted report period, 0 until known */
+	float jitter;						/* ms, RMS distance of the arrivals to the fitted line */
+};
+
+/* Time base of a session. Samples are timed on CLOCK_MONOTONIC, which does not jump with the 
+ * wall clock; the wall clock is read once, when the session starts, to map them back. 
+ * Reports leave the board at a steady rate but reach the phone with the jitter of the radio and 
+ * of the scheduler, so the arrival times are fitted with a line over the report index, over the 
+ * last WD_CLOCK_WINDOW reports, and the samples are stamped from the line. Only the router thread 
+ * of the session feeds the clock. */
+struct wd_clock 
+{
+	pthread_mutex_t mutex;				/* Guards stats */
+	int64_t wall_offset;				/* ns, wall clock minus CLOCK_MONOTONIC */
+	int64_t base;						/* ns, arrival of the first report of the fit */
+	int64_t index[WD_CLOCK_WINDOW];		/* Report index and arrival (ns from base) of the fit */
+	int64_t offset[WD_CLOCK_WINDOW];
+	uint32_t count;						/* Reports since the fit started */
+	int64_t last_index;
+	int64_t last_arrival;
+	int64_t last_stamp;
+	double period;						/* ns */
+	double intercept;					/* ns from base */
+	int fitted;
+	uint32_t missed;					/* Reports lost before the last one, as the fit sees it */
+	struct wd_clock_stats stats;
+};
+
+int wd_clock_init(struct wd_clock *clock);
+void wd_clock_destroy(struct wd_clock *clock);
+void wd_clock_restart(struct wd_clock *clock);
+int wd_clock_enable_kernel_stamps(int socket);
+ssize_t wd_clock_read(struct wd_clock *clock, int socket, void *buf, size_t len, struct timespec *arrival);
+void wd_clock_stamp(struct wd_clock *clock, const struct timespec *arrival, struct timespec *stamp);
+void wd_clock_get_stats(struct wd_clock *clock, struct wd_clock_stats *stats);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Streaming filters on the calibrated samples. The stages of a chain run in order on every 
+ *  sample as it is calibrated, so consumers get smoothed values without filtering themselves.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <string.h>
+#include <stdint.h>
+
+#include "wd_filter.h"
+
+/* Replaces the stages of the chain and resets their state. Types and params come as given by 
+   Java, WD_FILTER_PARAMS params per stage.
+   Returns:
+	-1 if a stage is not valid, in which case the chain is left untouched,
+	 0 otherwise.
+*/
+int wd_filter_chain_set(struct wd_filter_chain *chain, const int *types, const float *params, int count)
+{
+	int i;
+
+	if ((count < 0) || (count > WD_FILTER_MAX_STAGES))
+		return -1;
+	for (i = 0; i < count; i++) 
+	{
+		const float *p = params + i * WD_FILTER_PARAMS;
+		switch (types[i]) 
+		{
+		case WD_FILTER_MEDIAN:
+			if ((p[0] < 1) || (p[0] > WD_FILTER_MAX_WINDOW) || !((int)p[0] & 1))
+				return -1;
+			break;
+		case WD_FILTER_EMA:
+			if ((p[0] <= 0) || (p[0] > 1))
+				return -1;
+			break;
+		case WD_FILTER_KALMAN:
+			if ((p[0] < 0) || (p[1] <= 0))
+				return -1;
+			break;
+		case WD_FILTER_OUTLIER:
+			if ((p[0] <= 0) || (p[1] < 1))
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	memset(chain, 0, sizeof *chain);
+	chain->count = count;
+	for (i = 0; i < count; i++) 
+	{
+		chain->stages[i].type = types[i];
+		memcpy(chain->stages[i].params, params + i * WD_FILTER_PARAMS, sizeof chain->stages[i].params);
+	}
+	return 0;
+}
+
+/* Forgets what the stages have seen so far, e.g. after a gap in the stream.
+*/
+void wd_filter_chain_reset(struct wd_filter_chain *chain)
+{
+	int i;
+
+	for (i = 0; i < chain->count; i++) 
+	{
+		chain->stages[i].primed = 0;
+		memset(&chain->stages[i].state, 0, sizeof chain->stages[i].state);
+	}
+}
+
+/* Sliding median over the last window values. The window is kept sorted, so each value costs 
+   one removal and one insertion in at most WD_FILTER_MAX_WINDOW slots.
+*/
+static float wd_median_apply(struct wd_median *median, int window, float value)
+{
+	int i, j;
+
+	if (median->count == window) 
+	{
+		/* Drop the oldest value from the sorted window */
+		float oldest = median->history[median->next];
+		for (i = 0; (i < median->count - 1) && (median->sorted[i] != oldest); i++);
+		for (; i < median->count - 1; i++) 
+			median->sorted[i] = median->sorted[i + 1];
+		median->count--;
+	}
+	median->history[median->next] = value;
+	median->next = (median->next + 1) % window;
+
+	for (j = median->count; (j > 0) && (median->sorted[j - 1] > value); j--) 
+		median->sorted[j] = median->sorted[j - 1];
+	median->sorted[j] = value;
+	median->count++;
+
+	return median->sorted[median->count / 2];
+}
+
+/* Runs the sample, WD_FILTER_CHANNELS values, through the stages of the chain.
+   Returns:
+	1 if a value has been rejected as an outlier,
+	0 otherwise.
+*/
+int wd_filter_chain_apply(struct wd_filter_chain *chain, float *values)
+{
+	struct wd_filter_stage *stage;
+	float dev;
+	int outlier = 0;
+	int i, c;
+
+	for (i = 0; i < chain->count; i++) 
+	{
+		stage = &chain->stages[i];
+		switch (stage->type) 
+		{
+		case WD_FILTER_MEDIAN:
+			for (c = 0; c < WD_FILTER_CHANNELS; c++) 
+				values[c] = wd_median_apply(&stage->state.median[c], (int)stage->params[0], values[c]);
+			break;
+
+		case WD_FILTER_EMA:
+			for (c = 0; c < WD_FILTER_CHANNELS; c++) 
+			{
+				if (stage->primed)
+					stage->state.ema[c] += stage->params[0] * (values[c] - stage->state.ema[c]);
+				else
+					stage->state.ema[c] = values[c];
+				values[c] = stage->state.ema[c];
+			}
+			break;
+
+		case WD_FILTER_KALMAN:
+			if (!stage->primed) 
+			{
+				stage->state.kalman.x = values[WD_FILTER_TOTAL];
+				stage->state.kalman.p = stage->params[1];
+			}
+			else 
+			{
+				/* Constant weight model: predict, then correct with the new total */
+				float k;
+				stage->state.kalman.p += stage->params[0];
+				k = stage->state.kalman.p / (stage->state.kalman.p + stage->params[1]);
+				stage->state.kalman.x += k * (values[WD_FILTER_TOTAL] - stage->state.kalman.x);
+				stage->state.kalman.p *= 1 - k;
+			}
+			values[WD_FILTER_TOTAL] = stage->state.kalman.x;
+			break;
+
+		case WD_FILTER_OUTLIER:
+			for (c = 0; c < WD_FILTER_CHANNELS; c++) 
+			{
+				if (!stage->primed) 
+				{
+					stage->state.outlier.mean[c] = values[c];
+					stage->state.outlier.dev[c] = 0;
+					continue;
+				}
+				dev = values[c] - stage->state.outlier.mean[c];
+				if (dev < 0)
+					dev = -dev;
+				if ((dev > stage->params[0] * stage->state.outlier.dev[c]) && (dev > WD_OUTLIER_MIN_DEV)) 
+				{
+					if (++stage->state.outlier.run[c] <= (int)stage->params[1]) 
+					{
+						values[c] = stage->state.outlier.mean[c];
+						outlier = 1;
+						continue;
+					}
+					/* Not a spike, the weight has moved: follow it */
+					stage->state.outlier.mean[c] = values[c];
+					stage->state.outlier.dev[c] = 0;
+					stage->state.outlier.run[c] = 0;
+					continue;
+				}
+				stage->state.outlier.run[c] = 0;
+				stage->state.outlier.mean[c] += WD_OUTLIER_ALPHA * (values[c] - stage->state.outlier.mean[c]);
+				stage->state.outlier.dev[c] += WD_OUTLIER_ALPHA * (dev - stage->state.outlier.dev[c]);
+			}
+			break;
+		}
+		stage->primed = 1;
+	}
+	return outlier;
+}
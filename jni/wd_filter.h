@@ -0,0 +1,84 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_FILTER_H
+#define WD_FILTER_H
+
+#include <stdint.h>
+
+/* Stage types, as passed from Java */
+#define WD_FILTER_MEDIAN		1	/* params: window (odd, up to WD_FILTER_MAX_WINDOW) */
+#define WD_FILTER_EMA			2	/* params: alpha (0, 1] */
+#define WD_FILTER_KALMAN		3	/* params: process noise q, measurement noise r; total only */
+#define WD_FILTER_OUTLIER		4	/* params: k, longest run of rejected values */
+
+#define WD_FILTER_MAX_STAGES	8
+#define WD_FILTER_MAX_WINDOW	15
+#define WD_FILTER_PARAMS		2	/* Per stage */
+
+/* Each stage works on every channel independently: the four corners, then the total */
+#define WD_FILTER_CHANNELS		5
+#define WD_FILTER_TOTAL			4
+
+/* Outlier rejection: a value is rejected when it is further than k mean absolute deviations 
+ * (but at least WD_OUTLIER_MIN_DEV KG) from the mean, both tracked with WD_OUTLIER_ALPHA. It is 
+ * replaced by the mean. A run of rejected values longer than the configured one is a real step, 
+ * e.g. someone stepping on the board, and restarts the tracking. */
+#define WD_OUTLIER_ALPHA		0.05f
+#define WD_OUTLIER_MIN_DEV		0.5f
+
+struct wd_median 
+{
+	float history[WD_FILTER_MAX_WINDOW];	/* Arrival order, circular */
+	float sorted[WD_FILTER_MAX_WINDOW];
+	int next, count;
+};
+
+struct wd_filter_stage 
+{
+	int type;
+	float params[WD_FILTER_PARAMS];
+	int primed;
+	union 
+	{
+		struct wd_median median[WD_FILTER_CHANNELS];
+		float ema[WD_FILTER_CHANNELS];
+		struct 
+		{
+			float x, p;
+		} kalman;
+		struct 
+		{
+			float mean[WD_FILTER_CHANNELS];
+			float dev[WD_FILTER_CHANNELS];
+			int run[WD_FILTER_CHANNELS];
+		} outlier;
+	} state;
+};
+
+struct wd_filter_chain 
+{
+	int count;
+	struct wd_filter_stage stages[WD_FILTER_MAX_STAGES];
+};
+
+int wd_filter_chain_set(struct wd_filter_chain *chain, const int *types, const float *params, int count);
+void wd_filter_chain_reset(struct wd_filter_chain *chain);
+int wd_filter_chain_apply(struct wd_filter_chain *chain, float *values);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Fusion of several balance boards into one platform. Every board streams on its own link and 
+ *  reports whenever its radio gets a slot, so two boards never sample at the same instant; the 
+ *  corners of each board are interpolated to a common tick before they are summed, which keeps 
+ *  the center of pressure from jumping as the load moves from one board to the other.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_samples.h"
+#include "wd_fusion.h"
+
+static void *wd_fusion_thread(struct wd_fusion *fusion);
+
+/* Sensor positions of an unrotated board, WD_CORNER_* order */
+static const float wd_board_corner_x[WD_CORNER_COUNT] = 
+	{WD_BOARD_SENSOR_X, WD_BOARD_SENSOR_X, -WD_BOARD_SENSOR_X, -WD_BOARD_SENSOR_X};
+static const float wd_board_corner_y[WD_CORNER_COUNT] = 
+	{WD_BOARD_SENSOR_Y, -WD_BOARD_SENSOR_Y, WD_BOARD_SENSOR_Y, -WD_BOARD_SENSOR_Y};
+
+/* Starts fusing the count boards streaming into rings, placed on the platform as geometry says, 
+   at rate ticks per second (WD_FUSION_RATE if 0). The rings must outlive the fusion.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_fusion_start(struct wd_fusion *fusion, struct wd_sample_ring **rings, const struct wd_fusion_geometry *geometry, 
+                    int count, int rate)
+{
+	struct wd_fusion_source *source;
+	float c, s;
+	int i, k;
+
+	if ((count < 1) || (count > WD_FUSION_MAX_BOARDS) || (rate < 0) || (rate > 1000)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_fusion_start: Invalid parameters (%d boards, %d Hz)", count, rate);
+		return -1;
+	}
+
+	memset(fusion, 0, sizeof *fusion);
+	fusion->count = count;
+	fusion->period = 1000000000L / (rate ? rate : WD_FUSION_RATE);
+	for (i = 0; i < count; i++) 
+	{
+		source = &fusion->source[i];
+		source->ring = rings[i];
+		/* Only what arrives from now on */
+		source->cursor = wd_sample_ring_cursor(rings[i]);
+		c = cosf(geometry[i].angle * (float)M_PI / 180.0f);
+		s = sinf(geometry[i].angle * (float)M_PI / 180.0f);
+		for (k = 0; k < WD_CORNER_COUNT; k++) 
+		{
+			source->corner_x[k] = geometry[i].x + c * wd_board_corner_x[k] - s * wd_board_corner_y[k];
+			source->corner_y[k] = geometry[i].y + s * wd_board_corner_x[k] + c * wd_board_corner_y[k];
+		}
+	}
+
+	if (pthread_mutex_init(&fusion->mutex, NULL) || pthread_cond_init(&fusion->cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_fusion_start: Error in initialization of fusion mutex.");
+		return -1;
+	}
+
+	fusion->running = 1;
+	if (pthread_create(&fusion->thread, NULL, (void *(*)(void *))&wd_fusion_thread, fusion)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_fusion_start: Thread creation error (fusion thread)");
+		fusion->running = 0;
+		pthread_cond_destroy(&fusion->cond);
+		pthread_mutex_destroy(&fusion->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+/* Stops the fusion thread and waits for it.
+*/
+void wd_fusion_stop(struct wd_fusion *fusion)
+{
+	pthread_mutex_lock(&fusion->mutex);
+	fusion->running = 0;
+	pthread_cond_broadcast(&fusion->cond);
+	pthread_mutex_unlock(&fusion->mutex);
+
+	if (pthread_join(fusion->thread, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (fusion thread)");
+	}
+	pthread_cond_destroy(&fusion->cond);
+	pthread_mutex_destroy(&fusion->mutex);
+}
+
+static int64_t wd_fusion_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Moves the samples that have arrived since the last tick into the history of the source.
+*/
+static void wd_fusion_collect(struct wd_fusion_source *source)
+{
+	struct wd_sample samples[WD_FUSION_HISTORY];
+	int n, i;
+
+	while ((n = wd_sample_ring_read_cursor(source->ring, &source->cursor, samples, WD_FUSION_HISTORY)) > 0) 
+	{
+		for (i = 0; i < n; i++) 
+		{
+			source->history[source->count % WD_FUSION_HISTORY] = samples[i];
+			source->count++;
+		}
+	}
+}
+
+/* Corner weights of the source at tick, interpolated between the last sample at or before it 
+   and the first one after it. If only one side is at hand, or the two sides are split by a gap, 
+   the nearest sample stands for the board as long as it is within WD_FUSION_MAX_SKEW.
+   Returns:
+	-1 if the board has no sample close enough to tick,
+	 0 otherwise, with flags updated.
+*/
+static int wd_fusion_interpolate(const struct wd_fusion_source *source, int64_t tick, float *weight, uint16_t *flags)
+{
+	const struct wd_sample *before = NULL, *after = NULL, *sample;
+	int64_t t, t_before = 0, t_after = 0;
+	uint32_t kept, i;
+	float f;
+	int k;
+
+	kept = (source->count < WD_FUSION_HISTORY) ? source->count : WD_FUSION_HISTORY;
+	/* Newest first */
+	for (i = 1; i <= kept; i++) 
+	{
+		sample = &source->history[(source->count - i) % WD_FUSION_HISTORY];
+		t = wd_fusion_ns(&sample->timestamp);
+		if (t > tick) 
+		{
+			after = sample;
+			t_after = t;
+			continue;
+		}
+		before = sample;
+		t_before = t;
+		break;
+	}
+
+	if (before && after && !(after->flags & WD_SAMPLE_GAP)) 
+	{
+		if ((tick - t_before <= WD_FUSION_MAX_SKEW * 1000000LL) || (t_after - tick <= WD_FUSION_MAX_SKEW * 1000000LL)) 
+		{
+			f = (float)(tick - t_before) / (float)(t_after - t_before);
+			for (k = 0; k < WD_CORNER_COUNT; k++)
+				weight[k] = before->weight[k] + (after->weight[k] - before->weight[k]) * f;
+			return 0;
+		}
+		return -1;
+	}
+
+	if (before && after) 
+	{
+		*flags |= WD_FUSED_GAP;
+		if (tick - t_before > t_after - tick)
+			before = NULL;
+		else
+			after = NULL;
+	}
+	if (before && (tick - t_before <= WD_FUSION_MAX_SKEW * 1000000LL)) 
+	{
+		memcpy(weight, before->weight, sizeof before->weight);
+		return 0;
+	}
+	if (after && (t_after - tick <= WD_FUSION_MAX_SKEW * 1000000LL)) 
+	{
+		memcpy(weight, after->weight, sizeof after->weight);
+		return 0;
+	}
+	return -1;
+}
+
+/* Builds the platform point of tick from every board.
+   Returns:
+	-1 if no board had a sample close enough to tick,
+	 0 otherwise.
+*/
+static int wd_fusion_tick(struct wd_fusion *fusion, int64_t tick, struct wd_fused *point)
+{
+	struct wd_fusion_source *source;
+	float weight[WD_CORNER_COUNT];
+	float moment_x = 0, moment_y = 0;
+	int i, k;
+
+	memset(point, 0, sizeof *point);
+	for (i = 0; i < fusion->count; i++) 
+	{
+		source = &fusion->source[i];
+		if (wd_fusion_interpolate(source, tick, weight, &point->flags)) 
+		{
+			point->flags |= WD_FUSED_PARTIAL;
+			continue;
+		}
+		point->boards |= 1 << i;
+		for (k = 0; k < WD_CORNER_COUNT; k++) 
+		{
+			point->board_total[i] += weight[k];
+			moment_x += weight[k] * source->corner_x[k];
+			moment_y += weight[k] * source->corner_y[k];
+		}
+		point->total += point->board_total[i];
+	}
+	if (!point->boards)
+		return -1;
+
+	if (point->total >= WD_FUSION_MIN_WEIGHT) 
+	{
+		point->cop_x = moment_x / point->total;
+		point->cop_y = moment_y / point->total;
+	}
+	else
+		point->flags |= WD_FUSED_NO_COP;
+	point->time.tv_sec = tick / 1000000000LL;
+	point->time.tv_nsec = tick % 1000000000LL;
+	return 0;
+}
+
+/* Sleeps until the clock of the samples reaches wake, or the fusion is stopped. The condition 
+   waits on CLOCK_REALTIME, so the time left is carried over from the sample clock.
+   Returns:
+	0 if the fusion is still running,
+	1 once it has been stopped.
+*/
+static int wd_fusion_sleep(struct wd_fusion *fusion, int64_t wake)
+{
+	struct timespec now, deadline;
+	int64_t left, at;
+	int running;
+
+	pthread_mutex_lock(&fusion->mutex);
+	while (fusion->running) 
+	{
+		clock_gettime(WD_SAMPLE_CLOCK, &now);
+		left = wake - wd_fusion_ns(&now);
+		if (left <= 0)
+			break;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		at = wd_fusion_ns(&deadline) + left;
+		deadline.tv_sec = at / 1000000000LL;
+		deadline.tv_nsec = at % 1000000000LL;
+		pthread_cond_timedwait(&fusion->cond, &fusion->mutex, &deadline);
+	}
+	running = fusion->running;
+	pthread_mutex_unlock(&fusion->mutex);
+	return !running;
+}
+
+static void *wd_fusion_thread(struct wd_fusion *fusion)
+{
+	struct wd_fused point;
+	struct timespec now;
+	int64_t tick, latest;
+	int i;
+
+	clock_gettime(WD_SAMPLE_CLOCK, &now);
+	tick = wd_fusion_ns(&now) / fusion->period * fusion->period;
+
+	for (;;) 
+	{
+		tick += fusion->period;
+		if (wd_fusion_sleep(fusion, tick + WD_FUSION_DELAY * 1000000LL))
+			break;
+
+		/* After a long stall (the thread starved or the clock jumped) start from the present 
+		   again instead of working through ticks whose samples are gone */
+		clock_gettime(WD_SAMPLE_CLOCK, &now);
+		latest = wd_fusion_ns(&now) - WD_FUSION_DELAY * 1000000LL;
+		if (latest - tick > WD_FUSION_HISTORY / 2 * fusion->period)
+			tick = latest / fusion->period * fusion->period;
+
+		for (i = 0; i < fusion->count; i++)
+			wd_fusion_collect(&fusion->source[i]);
+		if (wd_fusion_tick(fusion, tick, &point))
+			continue;
+
+		pthread_mutex_lock(&fusion->mutex);
+		point.seq = fusion->seq++;
+		fusion->points[fusion->head & (WD_FUSION_LEN - 1)] = point;
+		fusion->head++;
+		pthread_mutex_unlock(&fusion->mutex);
+	}
+	return NULL;
+}
+
+/* Copies the points fused since the last call, oldest first. Points older than WD_FUSION_LEN 
+   ticks are lost.
+   Returns:
+	the number of points copied.
+*/
+int wd_fusion_read(struct wd_fusion *fusion, struct wd_fused *points, int max)
+{
+	int count = 0;
+
+	pthread_mutex_lock(&fusion->mutex);
+	if (fusion->head - fusion->read > WD_FUSION_LEN)
+		fusion->read = fusion->head - WD_FUSION_LEN;
+	while ((fusion->read != fusion->head) && (count < max)) 
+	{
+		points[count++] = fusion->points[fusion->read & (WD_FUSION_LEN - 1)];
+		fusion->read++;
+	}
+	pthread_mutex_unlock(&fusion->mutex);
+	return count;
+}
+
+/* Writes the point in the WD_FUSED_RECORD_LEN bytes record layout described in wd_fusion.h
+*/
+void wd_fusion_pack(const struct wd_fused *point, unsigned char *record)
+{
+	int64_t time = (int64_t)point->time.tv_sec * 1000000000LL + point->time.tv_nsec;
+	int32_t seq = point->seq;
+
+	memcpy(record, &time, 8);
+	memcpy(record + 8, &seq, 4);
+	memcpy(record + 12, &point->flags, 2);
+	memcpy(record + 14, &point->boards, 2);
+	memcpy(record + 16, &point->total, 4);
+	memcpy(record + 20, &point->cop_x, 4);
+	memcpy(record + 24, &point->cop_y, 4);
+	memcpy(record + 28, point->board_total, 4 * WD_FUSION_MAX_BOARDS);
+}
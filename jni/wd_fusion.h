@@ -0,0 +1,121 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_FUSION_H
+#define WD_FUSION_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "wd_samples.h"
+
+/* Boards that can make up a platform */
+#define WD_FUSION_MAX_BOARDS	4
+/* Default ticks per second of the fused stream */
+#define WD_FUSION_RATE			100
+/* ms the tick lags behind the clock, so that the samples of every board around it have arrived */
+#define WD_FUSION_DELAY			40
+/* ms a sample may be from the tick to stand for its board; boards further off are left out */
+#define WD_FUSION_MAX_SKEW		25
+/* Samples kept per board for the interpolation, must cover WD_FUSION_DELAY at the report rate */
+#define WD_FUSION_HISTORY		16
+/* Fused points kept for Java, must be a power of two */
+#define WD_FUSION_LEN			256
+/* KG under which the platform has no center of pressure */
+#define WD_FUSION_MIN_WEIGHT	2.0f
+
+/* Positions of the corner sensors of a balance board, mm from its center */
+#define WD_BOARD_SENSOR_X		216.5f
+#define WD_BOARD_SENSOR_Y		119.0f
+
+/* Fused point flags */
+#define WD_FUSED_PARTIAL		0x0001	/* A board had no sample close enough to the tick */
+#define WD_FUSED_GAP			0x0002	/* The samples of a board around the tick span a gap */
+#define WD_FUSED_NO_COP			0x0004	/* Too little weight for a center of pressure */
+
+/* Where a board lies on the platform: its center in mm and its rotation in degrees, 
+ * counterclockwise, in platform coordinates. Unrotated, x points to the right of the board and y 
+ * to its top (the side away from the power button). */
+struct wd_fusion_geometry 
+{
+	float x;
+	float y;
+	float angle;
+};
+
+/* A tick of the platform */
+struct wd_fused 
+{
+	struct timespec time;				/* WD_SAMPLE_CLOCK, as the samples */
+	uint32_t seq;
+	uint16_t flags;
+	uint16_t boards;					/* Mask of the boards in the point */
+	float total;						/* KG */
+	float cop_x;						/* mm, platform coordinates */
+	float cop_y;
+	float board_total[WD_FUSION_MAX_BOARDS];
+};
+
+/* Layout of a fused point handed to Java (native byte order):
+ *	 0	int64	time (ns)
+ *	 8	int32	sequence number
+ *	12	uint16	flags
+ *	14	uint16	mask of the boards
+ *	16	float	total weight (KG)
+ *	20	float	center of pressure x, y (mm)
+ *	28	float	total weight of each board (KG)
+ */
+#define WD_FUSED_RECORD_LEN		44
+
+struct wd_fusion_source 
+{
+	struct wd_sample_ring *ring;
+	uint32_t cursor;
+	float corner_x[WD_CORNER_COUNT];	/* mm, platform coordinates */
+	float corner_y[WD_CORNER_COUNT];
+	struct wd_sample history[WD_FUSION_HISTORY];
+	uint32_t count;						/* Samples ever kept */
+};
+
+/* Merges the streams of several boards into one platform. A thread ticks at a fixed rate on the 
+ * clock of the samples; at each tick the corners of every board are interpolated to the tick 
+ * from the samples around it, and the platform weight and center of pressure are computed from 
+ * all the corners at once. */
+struct wd_fusion 
+{
+	struct wd_fusion_source source[WD_FUSION_MAX_BOARDS];
+	int count;
+	long period;						/* ns between two ticks */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+	struct wd_fused points[WD_FUSION_LEN];
+	uint32_t head;
+	uint32_t read;
+	uint32_t seq;
+};
+
+int wd_fusion_start(struct wd_fusion *fusion, struct wd_sample_ring **rings, const struct wd_fusion_geometry *geometry, 
+                    int count, int rate);
+void wd_fusion_stop(struct wd_fusion *fusion);
+int wd_fusion_read(struct wd_fusion *fusion, struct wd_fused *points, int max);
+void wd_fusion_pack(const struct wd_fused *point, unsigned char *record);
+
+#endif
@@ -0,0 +1,661 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Gateway serving the sample streams of the driver to other processes over a UNIX socket, 
+ *  see wd_gateway.h for the protocol.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_samples.h"
+#include "wd_gateway.h"
+
+static void *wd_gateway_thread(struct wd_gateway *gw);
+
+/* Starts serving on the abstract UNIX socket name (WD_GW_DEFAULT_NAME if NULL).
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_gateway_start(struct wd_gateway *gw, const char *name)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	int i;
+
+	memset(gw, 0, sizeof *gw);
+	gw->listen_fd = -1;
+	gw->wake_pipe[0] = gw->wake_pipe[1] = -1;
+	for (i = 0; i < WD_GW_MAX_CLIENTS; i++) 
+		gw->clients[i].fd = -1;
+	if (!name)
+		name = WD_GW_DEFAULT_NAME;
+	if (strlen(name) >= sizeof addr.sun_path - 1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_start: Socket name too long.");
+		return -1;
+	}
+
+	/* Abstract namespace, nothing to clean up on the file system */
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path + 1, name, strlen(name));
+	addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+	if ((gw->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_start: Socket creation error.");
+		goto ERR_HND;
+	}
+	if (bind(gw->listen_fd, (struct sockaddr *)&addr, addr_len) || listen(gw->listen_fd, WD_GW_MAX_CLIENTS)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_start: Cannot listen on %s (%d).", name, errno);
+		goto ERR_HND;
+	}
+	if (fcntl(gw->listen_fd, F_SETFL, O_NONBLOCK) || pipe(gw->wake_pipe)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_start: Error in setting up the gateway socket.");
+		goto ERR_HND;
+	}
+	if (pthread_mutex_init(&gw->mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_start: Error in initialization of gateway mutex.");
+		goto ERR_HND;
+	}
+
+	gw->running = 1;
+	if (pthread_create(&gw->thread, NULL, (void *(*)(void *))&wd_gateway_thread, gw)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_start: Thread creation error (gateway thread)");
+		gw->running = 0;
+		pthread_mutex_destroy(&gw->mutex);
+		goto ERR_HND;
+	}
+	return 0;
+
+ERR_HND:
+	if (gw->listen_fd != -1)
+		close(gw->listen_fd);
+	if (gw->wake_pipe[0] != -1) 
+	{
+		close(gw->wake_pipe[0]);
+		close(gw->wake_pipe[1]);
+	}
+	return -1;
+}
+
+static void wd_gateway_drop_client(struct wd_gateway *gw, struct wd_gw_client *client)
+{
+	int i;
+
+	/* The reader slots in the shared rings go with the client */
+	pthread_mutex_lock(&gw->mutex);
+	for (i = 0; i < WD_GW_MAX_STREAMS; i++) 
+	{
+		if (client->shared[i] && gw->streams[i].ring)
+			wd_sample_ring_unshare(gw->streams[i].ring, client->shared[i] - 1);
+		client->shared[i] = 0;
+	}
+	pthread_mutex_unlock(&gw->mutex);
+	close(client->fd);
+	client->fd = -1;
+}
+
+/* Stops the gateway thread, hangs up on every client and closes the socket.
+*/
+void wd_gateway_stop(struct wd_gateway *gw)
+{
+	char quit = 'q';
+	int i;
+
+	pthread_mutex_lock(&gw->mutex);
+	gw->running = 0;
+	pthread_mutex_unlock(&gw->mutex);
+	if (write(gw->wake_pipe[1], &quit, 1) != 1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_stop: Pipe write error (wake pipe)");
+	}
+	if (pthread_join(gw->thread, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (gateway thread)");
+	}
+
+	for (i = 0; i < WD_GW_MAX_CLIENTS; i++) 
+	{
+		if (gw->clients[i].fd != -1)
+			wd_gateway_drop_client(gw, &gw->clients[i]);
+	}
+	close(gw->listen_fd);
+	close(gw->wake_pipe[0]);
+	close(gw->wake_pipe[1]);
+	pthread_mutex_destroy(&gw->mutex);
+}
+
+/* Serves the samples of ring as stream, from the next one on. Replaces whatever was attached 
+   to the stream before.
+*/
+void wd_gateway_attach(struct wd_gateway *gw, int stream, struct wd_sample_ring *ring)
+{
+	int c;
+
+	if ((stream < 0) || (stream >= WD_GW_MAX_STREAMS))
+		return;
+	pthread_mutex_lock(&gw->mutex);
+	if (gw->streams[stream].ring != ring) 
+	{
+		for (c = 0; c < WD_GW_MAX_CLIENTS; c++) 
+		{
+			if (gw->clients[c].shared[stream] && gw->streams[stream].ring)
+				wd_sample_ring_unshare(gw->streams[stream].ring, gw->clients[c].shared[stream] - 1);
+			gw->clients[c].shared[stream] = 0;
+		}
+	}
+	gw->streams[stream].ring = ring;
+	gw->streams[stream].cursor = wd_sample_ring_cursor(ring);
+	gw->streams[stream].changed = 1;
+	pthread_mutex_unlock(&gw->mutex);
+}
+
+/* Takes ring off the stream it is attached to, if any. Once this returns the gateway does not 
+   touch the ring any more, so it can be destroyed.
+*/
+void wd_gateway_detach(struct wd_gateway *gw, struct wd_sample_ring *ring)
+{
+	int i, c;
+
+	pthread_mutex_lock(&gw->mutex);
+	for (i = 0; i < WD_GW_MAX_STREAMS; i++) 
+	{
+		if (gw->streams[i].ring == ring) 
+		{
+			gw->streams[i].ring = NULL;
+			gw->streams[i].changed = 1;
+			/* The shared ring goes with it, the readers see it closed */
+			for (c = 0; c < WD_GW_MAX_CLIENTS; c++) 
+				gw->clients[c].shared[i] = 0;
+		}
+	}
+	pthread_mutex_unlock(&gw->mutex);
+}
+
+/* Lets the processes of user uid connect, on top of our own (e.g. another application, which 
+   Android runs as a user of its own). Clients already connected are not affected.
+   Returns:
+	-1 if WD_GW_MAX_UIDS users are allowed already,
+	 0 otherwise.
+*/
+int wd_gateway_allow(struct wd_gateway *gw, uid_t uid)
+{
+	int i, err = 0;
+
+	pthread_mutex_lock(&gw->mutex);
+	for (i = 0; (i < gw->uid_count) && (gw->uids[i] != uid); i++);
+	if (i == gw->uid_count) 
+	{
+		if (gw->uid_count < WD_GW_MAX_UIDS)
+			gw->uids[gw->uid_count++] = uid;
+		else
+			err = -1;
+	}
+	pthread_mutex_unlock(&gw->mutex);
+	return err;
+}
+
+/* Queues a message for the client.
+   Returns:
+	-1 if it does not fit in what is left of the output buffer,
+	 0 otherwise.
+*/
+static int wd_gateway_queue(struct wd_gw_client *client, uint8_t type, uint8_t stream, const void *payload, uint16_t length)
+{
+	struct wd_gw_header header;
+
+	if (client->out_len + (int)sizeof header + length > WD_GW_OUT_LEN)
+		return -1;
+	header.type = type;
+	header.stream = stream;
+	header.length = length;
+	memcpy(client->out + client->out_len, &header, sizeof header);
+	if (length)
+		memcpy(client->out + client->out_len + sizeof header, payload, length);
+	client->out_len += sizeof header + length;
+	return 0;
+}
+
+/* Writes as much of the output buffer as the socket takes.
+   Returns:
+	-1 if the client has gone,
+	 0 otherwise.
+*/
+static int wd_gateway_flush(struct wd_gw_client *client)
+{
+	ssize_t len;
+
+	if (!client->out_len)
+		return 0;
+	len = send(client->fd, client->out, client->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (len == -1)
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1;
+	memmove(client->out, client->out + len, client->out_len - len);
+	client->out_len -= len;
+	return 0;
+}
+
+/* Queues an error for the client, which is hung up on once it has been flushed.
+*/
+static void wd_gateway_refuse(struct wd_gateway *gw, struct wd_gw_client *client, uint16_t code)
+{
+	wd_gateway_queue(client, WD_GW_ERROR, 0, &code, sizeof code);
+	wd_gateway_flush(client);
+	wd_gateway_drop_client(gw, client);
+}
+
+/* Must be called with the gateway mutex held */
+static uint16_t wd_gateway_streams_up(struct wd_gateway *gw)
+{
+	uint16_t mask = 0;
+	int i;
+
+	for (i = 0; i < WD_GW_MAX_STREAMS; i++) 
+	{
+		if (gw->streams[i].ring)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+/* Acts on the complete messages received from the client.
+   Returns:
+	-1 if the client has been hung up on,
+	 0 otherwise.
+*/
+static int wd_gateway_parse(struct wd_gateway *gw, struct wd_gw_client *client)
+{
+	struct wd_gw_header header;
+	struct wd_gw_subscription *sub;
+	unsigned char *payload;
+	uint16_t values[2];
+	int used = 0;
+
+	while (client->in_len - used >= (int)sizeof header) 
+	{
+		memcpy(&header, client->in + used, sizeof header);
+		if (header.length > WD_GW_IN_LEN - sizeof header) 
+		{
+			wd_gateway_refuse(gw, client, WD_GW_ERR_PROTOCOL);
+			return -1;
+		}
+		if (client->in_len - used < (int)(sizeof header + header.length))
+			break;
+		payload = client->in + used + sizeof header;
+		used += sizeof header + header.length;
+
+		if (!client->greeted) 
+		{
+			if ((header.type != WD_GW_HELLO) || (header.length < 2)) 
+			{
+				wd_gateway_refuse(gw, client, WD_GW_ERR_PROTOCOL);
+				return -1;
+			}
+			memcpy(&values[0], payload, 2);
+			if (values[0] != WD_GW_VERSION) 
+			{
+				wd_gateway_refuse(gw, client, WD_GW_ERR_VERSION);
+				return -1;
+			}
+			client->greeted = 1;
+			values[0] = WD_GW_VERSION;
+			pthread_mutex_lock(&gw->mutex);
+			values[1] = wd_gateway_streams_up(gw);
+			pthread_mutex_unlock(&gw->mutex);
+			wd_gateway_queue(client, WD_GW_WELCOME, 0, values, sizeof values);
+			continue;
+		}
+
+		if (header.stream >= WD_GW_MAX_STREAMS) 
+		{
+			wd_gateway_refuse(gw, client, WD_GW_ERR_PROTOCOL);
+			return -1;
+		}
+		sub = &client->subs[header.stream];
+		switch (header.type) 
+		{
+		case WD_GW_SUBSCRIBE:
+			if (header.length < 2) 
+			{
+				wd_gateway_refuse(gw, client, WD_GW_ERR_PROTOCOL);
+				return -1;
+			}
+			memcpy(&values[0], payload, 2);
+			memset(sub, 0, sizeof *sub);
+			sub->period = values[0] ? 1000000000L / values[0] : 0;
+			sub->active = 1;
+			break;
+		case WD_GW_UNSUBSCRIBE:
+			sub->active = 0;
+			break;
+		case WD_GW_SHARE:
+			if (!client->shared[header.stream])
+				client->share_pending |= 1 << header.stream;
+			break;
+		default:
+			wd_gateway_refuse(gw, client, WD_GW_ERR_PROTOCOL);
+			return -1;
+		}
+	}
+	memmove(client->in, client->in + used, client->in_len - used);
+	client->in_len -= used;
+	return 0;
+}
+
+/* Tells a connecting process why it is not taken, and hangs up.
+*/
+static void wd_gateway_turn_away(int fd, uint16_t code)
+{
+	struct wd_gw_header header = {WD_GW_ERROR, 0, 2};
+	unsigned char refusal[sizeof header + 2];
+
+	memcpy(refusal, &header, sizeof header);
+	memcpy(refusal + sizeof header, &code, 2);
+	send(fd, refusal, sizeof refusal, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+}
+
+/* Checks the credentials of the process at the other end of fd, as the kernel saw them when it 
+   connected.
+   Returns:
+	1 if it runs as our user or as one allowed with wd_gateway_allow,
+	0 otherwise.
+*/
+static int wd_gateway_trusted(struct wd_gateway *gw, int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	int trusted, i;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || (len != sizeof cred)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_trusted: Cannot get the peer credentials (%d).", errno);
+		return 0;
+	}
+	trusted = (cred.uid == getuid());
+	pthread_mutex_lock(&gw->mutex);
+	for (i = 0; (i < gw->uid_count) && !trusted; i++) 
+		trusted = (cred.uid == gw->uids[i]);
+	pthread_mutex_unlock(&gw->mutex);
+	if (!trusted) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_trusted: Refused pid %d, uid %d.", (int)cred.pid, (int)cred.uid);
+	}
+	return trusted;
+}
+
+static void wd_gateway_accept(struct wd_gateway *gw)
+{
+	int fd, i;
+
+	while ((fd = accept(gw->listen_fd, NULL, NULL)) != -1) 
+	{
+		if (!wd_gateway_trusted(gw, fd)) 
+		{
+			wd_gateway_turn_away(fd, WD_GW_ERR_DENIED);
+			continue;
+		}
+		for (i = 0; (i < WD_GW_MAX_CLIENTS) && (gw->clients[i].fd != -1); i++);
+		if (i == WD_GW_MAX_CLIENTS) 
+		{
+			wd_gateway_turn_away(fd, WD_GW_ERR_FULL);
+			continue;
+		}
+		memset(&gw->clients[i], 0, sizeof gw->clients[i]);
+		gw->clients[i].fd = fd;
+	}
+}
+
+/* Decides whether the subscription takes the sample, given its rate.
+*/
+static int wd_gateway_decimate(struct wd_gw_subscription *sub, const struct wd_sample *sample)
+{
+	const struct timespec *t = &sample->timestamp;
+
+	if (!sub->period)
+		return 1;
+	if ((t->tv_sec < sub->next.tv_sec) || ((t->tv_sec == sub->next.tv_sec) && (t->tv_nsec < sub->next.tv_nsec)))
+		return 0;
+	/* One period from this sample, so that a slow stream does not make up for lost time */
+	sub->next.tv_sec = t->tv_sec + (t->tv_nsec + sub->period) / 1000000000L;
+	sub->next.tv_nsec = (t->tv_nsec + sub->period) % 1000000000L;
+	return 1;
+}
+
+/* Hands the batch of stream out to the subscribers, each at its rate. A subscriber without the 
+   room for its share loses it.
+*/
+static void wd_gateway_fan_out(struct wd_gateway *gw, int stream, const struct wd_sample *samples, int count)
+{
+	unsigned char records[WD_GW_BATCH * WD_SAMPLE_RECORD_LEN];
+	struct wd_gw_client *client;
+	struct wd_gw_subscription *sub;
+	int i, c, n;
+
+	for (c = 0; c < WD_GW_MAX_CLIENTS; c++) 
+	{
+		client = &gw->clients[c];
+		sub = &client->subs[stream];
+		if ((client->fd == -1) || !client->greeted || !sub->active)
+			continue;
+		for (i = 0, n = 0; i < count; i++) 
+		{
+			if (wd_gateway_decimate(sub, &samples[i]))
+				wd_sample_pack(&samples[i], records + (n++) * WD_SAMPLE_RECORD_LEN);
+		}
+		if (!n)
+			continue;
+		if (sub->dropped && (wd_gateway_queue(client, WD_GW_DROPPED, stream, &sub->dropped, sizeof sub->dropped) == 0))
+			sub->dropped = 0;
+		if (sub->dropped || wd_gateway_queue(client, WD_GW_SAMPLES, stream, records, n * WD_SAMPLE_RECORD_LEN))
+			sub->dropped += n;
+	}
+}
+
+/* Passes the shared ring of stream to the client along with a WD_GW_SHARED message. Waits for 
+   the output buffer to be empty, so that the descriptors come with the right message.
+   Must be called with the gateway mutex held.
+*/
+static void wd_gateway_share(struct wd_gateway *gw, struct wd_gw_client *client, int stream)
+{
+	unsigned char buf[sizeof(struct wd_gw_header) + 2];
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct wd_gw_header header = {WD_GW_SHARED, stream, 2};
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fds[2];
+	uint16_t index;
+	int reader;
+
+	if (client->out_len || !gw->streams[stream].ring)
+		return;
+	if ((reader = wd_sample_ring_share(gw->streams[stream].ring, &fds[0], &fds[1])) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_share: No shared ring for stream %d.", stream);
+		client->share_pending &= ~(1 << stream);
+		return;
+	}
+	index = reader;
+	memcpy(buf, &header, sizeof header);
+	memcpy(buf + sizeof header, &index, 2);
+	iov.iov_base = buf;
+	iov.iov_len = sizeof buf;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+
+	/* The message is small enough to go whole or not at all, try again next tick */
+	if (sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof buf) 
+	{
+		wd_sample_ring_unshare(gw->streams[stream].ring, reader);
+		return;
+	}
+	client->shared[stream] = reader + 1;
+	client->share_pending &= ~(1 << stream);
+}
+
+/* Reads what is new in every stream and hands it out. Tells the clients about the streams which 
+   went up or down.
+*/
+static void wd_gateway_pump(struct wd_gateway *gw)
+{
+	struct wd_sample samples[WD_GW_BATCH];
+	struct wd_gw_stream *stream;
+	uint8_t up;
+	int s, c, count;
+
+	pthread_mutex_lock(&gw->mutex);
+	for (s = 0; s < WD_GW_MAX_STREAMS; s++) 
+	{
+		stream = &gw->streams[s];
+		if (stream->changed) 
+		{
+			up = stream->ring ? 1 : 0;
+			for (c = 0; c < WD_GW_MAX_CLIENTS; c++) 
+			{
+				if ((gw->clients[c].fd != -1) && gw->clients[c].greeted)
+					wd_gateway_queue(&gw->clients[c], WD_GW_STREAM, s, &up, 1);
+			}
+			stream->changed = 0;
+		}
+		if (!stream->ring)
+			continue;
+		for (c = 0; c < WD_GW_MAX_CLIENTS; c++) 
+		{
+			if ((gw->clients[c].fd != -1) && (gw->clients[c].share_pending & (1 << s)))
+				wd_gateway_share(gw, &gw->clients[c], s);
+		}
+		while ((count = wd_sample_ring_read_cursor(stream->ring, &stream->cursor, samples, WD_GW_BATCH)) > 0) 
+		{
+			wd_gateway_fan_out(gw, s, samples, count);
+		}
+	}
+	pthread_mutex_unlock(&gw->mutex);
+}
+
+static void *wd_gateway_thread(struct wd_gateway *gw)
+{
+	struct pollfd fds[2 + WD_GW_MAX_CLIENTS];
+	int slot[2 + WD_GW_MAX_CLIENTS];
+	struct wd_gw_client *client;
+	char quit;
+	ssize_t len;
+	int n, i, running = 1;
+
+	while (running) 
+	{
+		fds[0].fd = gw->wake_pipe[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = gw->listen_fd;
+		fds[1].events = POLLIN;
+		n = 2;
+		for (i = 0; i < WD_GW_MAX_CLIENTS; i++) 
+		{
+			if (gw->clients[i].fd == -1)
+				continue;
+			fds[n].fd = gw->clients[i].fd;
+			fds[n].events = POLLIN | (gw->clients[i].out_len ? POLLOUT : 0);
+			slot[n++] = i;
+		}
+
+		if (poll(fds, n, WD_GW_TICK) == -1) 
+		{
+			if (errno == EINTR)
+				continue;
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_thread: Poll error.");
+			break;
+		}
+		if (fds[0].revents & POLLIN) 
+		{
+			if (read(gw->wake_pipe[0], &quit, 1) != 1) 
+			{
+				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_gateway_thread: Pipe read error (wake pipe)");
+			}
+		}
+		pthread_mutex_lock(&gw->mutex);
+		running = gw->running;
+		pthread_mutex_unlock(&gw->mutex);
+		if (!running)
+			break;
+		if (fds[1].revents & POLLIN)
+			wd_gateway_accept(gw);
+
+		for (i = 2; i < n; i++) 
+		{
+			client = &gw->clients[slot[i]];
+			if (fds[i].revents & POLLIN) 
+			{
+				len = recv(client->fd, client->in + client->in_len, WD_GW_IN_LEN - client->in_len, MSG_DONTWAIT);
+				if ((len == 0) || ((len == -1) && (errno != EAGAIN) && (errno != EINTR))) 
+				{
+					wd_gateway_drop_client(gw, client);
+					continue;
+				}
+				if (len > 0) 
+				{
+					client->in_len += len;
+					if (wd_gateway_parse(gw, client))
+						continue;
+				}
+			}
+			else if (fds[i].revents & (POLLHUP | POLLERR)) 
+			{
+				wd_gateway_drop_client(gw, client);
+			}
+		}
+
+		wd_gateway_pump(gw);
+		for (i = 0; i < WD_GW_MAX_CLIENTS; i++) 
+		{
+			if ((gw->clients[i].fd != -1) && wd_gateway_flush(&gw->clients[i]))
+				wd_gateway_drop_client(gw, &gw->clients[i]);
+		}
+	}
+	return NULL;
+}
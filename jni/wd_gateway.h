@@ -0,0 +1,146 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_GATEWAY_H
+#define WD_GATEWAY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+struct wd_sample_ring;
+
+/* Name of the socket in the abstract namespace, when none is given */
+#define WD_GW_DEFAULT_NAME		"iepiscale.gateway"
+#define WD_GW_VERSION			1
+/* Streams: 0 is the connected board, 1 to 4 the held ones */
+#define WD_GW_MAX_STREAMS		5
+#define WD_GW_MAX_CLIENTS		8
+/* Users besides our own whose processes may connect (see wd_gateway_allow) */
+#define WD_GW_MAX_UIDS			8
+/* ms between two looks at the rings. Boards report about every 10 ms, so a batch holds one or 
+ * two samples per stream. */
+#define WD_GW_TICK				10
+/* Bytes a client may have waiting in the gateway. A client that does not keep up loses whole 
+ * batches, and is told how many samples it lost once it has caught up. */
+#define WD_GW_OUT_LEN			32768
+#define WD_GW_IN_LEN			256
+/* Samples per WD_GW_SAMPLES message at most */
+#define WD_GW_BATCH				64
+
+/* Protocol. Every message is a struct wd_gw_header followed by length bytes of payload, all in 
+ * native byte order (both ends are on the same device).
+ *
+ * Client to gateway:
+ *	WD_GW_HELLO			uint16 version; must be the first message
+ *	WD_GW_SUBSCRIBE		uint16 rate, samples per second, 0 for every sample; to stream
+ *	WD_GW_UNSUBSCRIBE	no payload; from stream
+ *	WD_GW_SHARE			no payload; asks for the shared ring of stream (see wd_shm.h), to read 
+ *						its samples straight from memory instead of the socket
+ *
+ * Gateway to client:
+ *	WD_GW_WELCOME		uint16 version, uint16 mask of the streams up
+ *	WD_GW_SAMPLES		WD_SAMPLE_RECORD_LEN bytes records (see wd_samples.h) of stream
+ *	WD_GW_DROPPED		uint32 samples of stream lost because the client fell behind
+ *	WD_GW_STREAM		uint8 1 if stream came up, 0 if it went down
+ *	WD_GW_SHARED		uint16 reader index, with the shared memory and eventfd descriptors of 
+ *						stream as SCM_RIGHTS, in that order; sent once stream is up. The reader 
+ *						slot is the client's until it hangs up or the stream goes down
+ *	WD_GW_ERROR			uint16 code (WD_GW_ERR_*), the gateway hangs up after it
+ *
+ * The abstract namespace has no permissions, so the gateway asks the kernel for the credentials 
+ * of each peer (SO_PEERCRED) and only takes processes of its own user or of a user allowed with 
+ * wd_gateway_allow; the others are told WD_GW_ERR_DENIED.
+ */
+#define WD_GW_HELLO				0x01
+#define WD_GW_SUBSCRIBE			0x02
+#define WD_GW_UNSUBSCRIBE		0x03
+#define WD_GW_SHARE				0x04
+#define WD_GW_WELCOME			0x81
+#define WD_GW_SAMPLES			0x82
+#define WD_GW_DROPPED			0x83
+#define WD_GW_STREAM			0x84
+#define WD_GW_SHARED			0x85
+#define WD_GW_ERROR				0x8F
+
+#define WD_GW_ERR_VERSION		1
+#define WD_GW_ERR_PROTOCOL		2
+#define WD_GW_ERR_FULL			3
+#define WD_GW_ERR_DENIED		4
+
+struct wd_gw_header 
+{
+	uint8_t type;
+	uint8_t stream;
+	uint16_t length;
+};
+
+struct wd_gw_subscription 
+{
+	int active;
+	long period;						/* ns between two samples, 0 for every sample */
+	struct timespec next;				/* Time of the next sample to forward */
+	uint32_t dropped;					/* Samples lost and not reported yet */
+};
+
+struct wd_gw_client 
+{
+	int fd;								/* -1 if the slot is free */
+	int greeted;
+	struct wd_gw_subscription subs[WD_GW_MAX_STREAMS];
+	int shared[WD_GW_MAX_STREAMS];		/* Reader index + 1 in the shared ring, 0 if none */
+	int share_pending;					/* Mask of the streams asked for with WD_GW_SHARE */
+	unsigned char in[WD_GW_IN_LEN];
+	int in_len;
+	unsigned char out[WD_GW_OUT_LEN];
+	int out_len;
+};
+
+struct wd_gw_stream 
+{
+	struct wd_sample_ring *ring;		/* NULL if the stream is down */
+	uint32_t cursor;
+	int changed;						/* Went up or down since the clients were told */
+};
+
+/* Serves the sample streams of the driver to the other processes of the device, over a UNIX 
+ * socket. Whoever owns the driver attaches the ring of each session to a stream, and every client 
+ * subscribes to the streams it wants, each at its own rate; one link to a board feeds them all. 
+ * A single thread does the work: it reads each ring once per tick and hands the samples out to 
+ * the clients without ever blocking on one of them. */
+struct wd_gateway 
+{
+	int listen_fd;
+	int wake_pipe[2];
+	pthread_t thread;
+	pthread_mutex_t mutex;				/* Guards streams, uids and running */
+	int running;
+	uid_t uids[WD_GW_MAX_UIDS];
+	int uid_count;
+	struct wd_gw_stream streams[WD_GW_MAX_STREAMS];
+	struct wd_gw_client clients[WD_GW_MAX_CLIENTS];
+};
+
+int wd_gateway_start(struct wd_gateway *gw, const char *name);
+void wd_gateway_stop(struct wd_gateway *gw);
+void wd_gateway_attach(struct wd_gateway *gw, int stream, struct wd_sample_ring *ring);
+void wd_gateway_detach(struct wd_gateway *gw, struct wd_sample_ring *ring);
+int wd_gateway_allow(struct wd_gateway *gw, uid_t uid);
+
+#endif
@@ -0,0 +1,1160 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  The HCI controller context. The BlueZ helpers open a raw socket and allocate a device list on 
+ *  every call; here a single socket, bound to the adapter, serves discovery, name lookups and 
+ *  link management for as long as the library is loaded. hci_send_req swaps the socket filter 
+ *  and blocks for its own answer on each command, dropping every other event; here the filter is 
+ *  set once and a reader thread dispatches the events to the commands in flight.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/poll.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "bluetooth.h"
+#include "hci.h"
+#include "hci_lib.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_hci.h"
+
+static void *wd_hci_reader_thread(struct wd_hci *hci);
+static void wd_hci_fail_all(struct wd_hci *hci, int err);
+
+int wd_hci_init(struct wd_hci *hci)
+{
+	memset(hci, 0, sizeof *hci);
+	hci->dd = -1;
+	hci->dev_id = -1;
+	if (pthread_mutex_init(&hci->mutex, NULL) || 
+	    pthread_mutex_init(&hci->req_mutex, NULL) || 
+	    pthread_cond_init(&hci->req_cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_init: Error in initialization of HCI mutex.");
+		return -1;
+	}
+	return 0;
+}
+
+void wd_hci_destroy(struct wd_hci *hci)
+{
+	wd_hci_close(hci);
+	pthread_cond_destroy(&hci->req_cond);
+	pthread_mutex_destroy(&hci->req_mutex);
+	pthread_mutex_destroy(&hci->mutex);
+}
+
+/* Opens the first adapter which is up, unless it is open already. The device list, the device 
+   information and the bind all go through the same socket.
+   Returns:
+	-1 if there is no adapter up or it cannot be opened,
+	 0 otherwise.
+*/
+int wd_hci_open(struct wd_hci *hci)
+{
+	return wd_hci_open_dev(hci, -1);
+}
+
+/* Same as wd_hci_open, on the adapter dev_id (-1 for the first one that is up). A context whose 
+   reader has given up on the socket, or which is bound to another adapter than dev_id, is closed 
+   and opened again. The caller holds hci->mutex.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_hci_open_dev(struct wd_hci *hci, int dev_id)
+{
+	struct 
+	{
+		struct hci_dev_list_req list;
+		struct hci_dev_req devs[HCI_MAX_DEV];
+	} dl;
+	struct sockaddr_hci addr;
+	struct hci_filter filter;
+	int failed, i;
+
+	if (hci->dd >= 0) 
+	{
+		pthread_mutex_lock(&hci->req_mutex);
+		failed = hci->failed;
+		pthread_mutex_unlock(&hci->req_mutex);
+		if (failed) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Reopening hci%d after a socket error.", hci->dev_id);
+		}
+		else if ((dev_id >= 0) && (hci->dev_id != dev_id)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Bound to hci%d, reopening on hci%d.", hci->dev_id, dev_id);
+		}
+		else 
+		{
+			return 0;
+		}
+		wd_hci_close(hci);
+	}
+	hci->inquiry_mode = -1;
+
+	if ((hci->dd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI)) < 0) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Socket creation error.");
+		return -1;
+	}
+
+	memset(&dl, 0, sizeof dl);
+	dl.list.dev_num = HCI_MAX_DEV;
+	if (ioctl(hci->dd, HCIGETDEVLIST, (void *)&dl) < 0) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Cannot get the device list.");
+		goto ERR_HND;
+	}
+	for (i = 0; i < dl.list.dev_num; i++) 
+	{
+		memset(&hci->info, 0, sizeof hci->info);
+		hci->info.dev_id = dl.devs[i].dev_id;
+		if ((dev_id >= 0) && (hci->info.dev_id != dev_id))
+			continue;
+		if (ioctl(hci->dd, HCIGETDEVINFO, (void *)&hci->info))
+			continue;
+		if (hci_test_bit(HCI_UP, &hci->info.flags) && !hci_test_bit(HCI_RAW, &hci->info.flags))
+			break;
+	}
+	if (i == dl.list.dev_num) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: No adapter is up.");
+		goto ERR_HND;
+	}
+	hci->dev_id = hci->info.dev_id;
+	bacpy(&hci->bdaddr, &hci->info.bdaddr);
+	memcpy(hci->features, hci->info.features, sizeof hci->features);
+
+	memset(&addr, 0, sizeof addr);
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = hci->dev_id;
+	if (bind(hci->dd, (struct sockaddr *)&addr, sizeof addr) < 0) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Cannot bind to hci%d.", hci->dev_id);
+		goto ERR_HND;
+	}
+
+	/* Every event goes to the reader thread, which sorts them out */
+	hci_filter_clear(&filter);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+	hci_filter_all_events(&filter);
+	if (setsockopt(hci->dd, SOL_HCI, HCI_FILTER, &filter, sizeof filter) < 0) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Cannot set the event filter.");
+		goto ERR_HND;
+	}
+	if (pipe(hci->wake_pipe)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Error opening wake pipe.");
+		goto ERR_HND;
+	}
+	hci->failed = 0;
+	if (pthread_create(&hci->reader_thread, NULL, (void *(*)(void *))&wd_hci_reader_thread, hci)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Thread creation error (HCI reader thread)");
+		close(hci->wake_pipe[0]);
+		close(hci->wake_pipe[1]);
+		goto ERR_HND;
+	}
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_open: Using hci%d.", hci->dev_id);
+	return 0;
+
+ERR_HND:
+	close(hci->dd);
+	hci->dd = -1;
+	hci->dev_id = -1;
+	return -1;
+}
+
+/* Completes a request. Callbacks are called without req_mutex, which is held on entry and on 
+   return.
+*/
+static void wd_hci_complete(struct wd_hci *hci, struct wd_hci_request *req, int err, const uint8_t *rparam, int rlen)
+{
+	uint8_t data[HCI_MAX_EVENT_SIZE];
+	wd_hci_callback callback = req->callback;
+	void *arg = req->arg;
+
+	if (rlen > HCI_MAX_EVENT_SIZE)
+		rlen = HCI_MAX_EVENT_SIZE;
+	if (!callback) 
+	{
+		/* The caller in wd_hci_send_req picks it up and frees the slot */
+		req->err = err;
+		req->rlen = rlen;
+		if (rlen > 0)
+			memcpy(req->rparam, rparam, rlen);
+		req->state = WD_HCI_REQ_DONE;
+		pthread_cond_broadcast(&hci->req_cond);
+		return;
+	}
+
+	if (rlen > 0)
+		memcpy(data, rparam, rlen);
+	req->state = WD_HCI_REQ_FREE;
+	pthread_cond_broadcast(&hci->req_cond);
+	pthread_mutex_unlock(&hci->req_mutex);
+	callback(arg, err, data, rlen);
+	pthread_mutex_lock(&hci->req_mutex);
+}
+
+void wd_hci_close(struct wd_hci *hci)
+{
+	char c = WD_HCI_WAKE_QUIT;
+
+	if (hci->dd < 0)
+		return;
+
+	if (write(hci->wake_pipe[1], &c, 1) != 1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_close: Wake pipe write error");
+	}
+	if (pthread_join(hci->reader_thread, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (HCI reader thread)");
+	}
+	close(hci->wake_pipe[0]);
+	close(hci->wake_pipe[1]);
+
+	pthread_mutex_lock(&hci->req_mutex);
+	close(hci->dd);
+	hci->dd = -1;
+	hci->dev_id = -1;
+	hci->failed = 0;
+	/* Nothing is going to answer the commands still in flight */
+	wd_hci_fail_all(hci, ENODEV);
+	pthread_mutex_unlock(&hci->req_mutex);
+}
+
+/* Fails every command in flight with err. Must be called with req_mutex held.
+*/
+static void wd_hci_fail_all(struct wd_hci *hci, int err)
+{
+	int i;
+
+	for (i = 0; i < WD_HCI_MAX_PENDING; i++) 
+	{
+		if (hci->pending[i].state == WD_HCI_REQ_PENDING)
+			wd_hci_complete(hci, &hci->pending[i], err, NULL, 0);
+	}
+}
+
+/* Looks for devices for at most 1.28 * len seconds. The results are left in hci->results, their 
+   RSSI in hci->rssi if the controller can report it. flags only apply to controllers which 
+   cannot, whose inquiry goes through the kernel. A controller that went away (e.g. Bluetooth turned off and on) is reopened once.
+   Returns:
+	-1 on error,
+	the number of devices found otherwise.
+*/
+int wd_hci_inquiry(struct wd_hci *hci, int len, long flags)
+{
+	uint8_t status;
+	inquiry_cp cp;
+	struct hci_request rq;
+	int retry, i;
+
+	for (retry = 0; retry < 2; retry++) 
+	{
+		if (wd_hci_open(hci))
+			return -1;
+
+		/* Controllers from 1.2 on report the RSSI of the responses if asked to. The inquiry is 
+		 * then run as a command, its results are gathered by the reader thread. */
+		if ((hci->inquiry_mode < 0) && (hci->features[3] & LMP_RSSI_INQ)) 
+		{
+			if (wd_hci_write_inquiry_mode(hci, 1) == 0)
+				hci->inquiry_mode = 1;
+			else
+				hci->inquiry_mode = 0;
+		}
+		if (hci->inquiry_mode == 1) 
+		{
+			memset(&cp, 0, sizeof cp);
+			cp.lap[0] = 0x33;				/* General inquiry access code */
+			cp.lap[1] = 0x8b;
+			cp.lap[2] = 0x9e;
+			cp.length = len;
+			cp.num_rsp = 0;
+
+			memset(&rq, 0, sizeof rq);
+			rq.ogf = OGF_LINK_CTL;
+			rq.ocf = OCF_INQUIRY;
+			rq.cparam = &cp;
+			rq.clen = INQUIRY_CP_SIZE;
+			rq.event = EVT_INQUIRY_COMPLETE;
+			rq.rparam = &status;
+			rq.rlen = 1;
+
+			pthread_mutex_lock(&hci->req_mutex);
+			hci->num_results = 0;
+			hci->collecting = 1;
+			pthread_mutex_unlock(&hci->req_mutex);
+			i = wd_hci_send_req(hci, &rq, len * 1280 + WD_HCI_INQUIRY_MARGIN);
+			pthread_mutex_lock(&hci->req_mutex);
+			hci->collecting = 0;
+			pthread_mutex_unlock(&hci->req_mutex);
+			if ((i == 0) && status)
+				errno = EIO;
+			else if (i == 0)
+				return hci->num_results;
+		}
+		else 
+		{
+
+			memset(&hci->inquiry.req, 0, sizeof hci->inquiry.req);
+			hci->inquiry.req.dev_id = hci->dev_id;
+			hci->inquiry.req.num_rsp = 0;		/* Unlimited, up to WD_HCI_MAX_RSP */
+			hci->inquiry.req.length = len;
+			hci->inquiry.req.flags = flags;
+			hci->inquiry.req.lap[0] = 0x33;		/* General inquiry access code */
+			hci->inquiry.req.lap[1] = 0x8b;
+			hci->inquiry.req.lap[2] = 0x9e;
+			if (ioctl(hci->dd, HCIINQUIRY, (unsigned long)&hci->inquiry) >= 0) 
+			{
+				memcpy(hci->results, hci->inquiry.info, hci->inquiry.req.num_rsp * sizeof(inquiry_info));
+				memset(hci->rssi, WD_HCI_NO_RSSI, hci->inquiry.req.num_rsp);
+				return hci->inquiry.req.num_rsp;
+			}
+		}
+		if ((errno != ENODEV) && (errno != ENETDOWN) && (errno != EBADF) && (errno != EHOSTDOWN))
+			break;
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_inquiry: Adapter went away, reopening.");
+		wd_hci_close(hci);
+	}
+	return -1;
+}
+
+/* Returns the oldest request in flight matching opcode (if not 0) and event (if not 0), NULL if 
+   there is none. Must be called with req_mutex held.
+*/
+static struct wd_hci_request *wd_hci_find(struct wd_hci *hci, uint16_t opcode, int event)
+{
+	struct wd_hci_request *found = NULL;
+	int i;
+
+	for (i = 0; i < WD_HCI_MAX_PENDING; i++) 
+	{
+		struct wd_hci_request *req = &hci->pending[i];
+		if ((req->state != WD_HCI_REQ_PENDING) || 
+		    (opcode && (req->opcode != opcode)) || 
+		    (event && (req->event != event)))
+			continue;
+		if (!found || ((int32_t)(req->serial - found->serial) < 0))
+			found = req;
+	}
+	return found;
+}
+
+/* Adds the responses of an inquiry result event to the results of the running inquiry, keeping 
+   the last RSSI of a device that answers more than once. Must be called with req_mutex held.
+*/
+static void wd_hci_collect(struct wd_hci *hci, uint8_t evt, const uint8_t *ptr, int len)
+{
+	inquiry_info info;
+	int8_t rssi;
+	int num_rsp, size, i, j;
+
+	if (!hci->collecting || (len < 1) || !(num_rsp = ptr[0]))
+		return;
+	ptr++;
+	len--;
+	/* Results with RSSI come in two layouts, told apart by their size */
+	if (evt == EVT_INQUIRY_RESULT)
+		size = INQUIRY_INFO_SIZE;
+	else if (evt == EVT_EXTENDED_INQUIRY_RESULT)
+		size = EXTENDED_INQUIRY_INFO_SIZE;
+	else
+		size = len / num_rsp;
+	if ((size < INQUIRY_INFO_SIZE) || (size * num_rsp > len))
+		return;
+
+	for (i = 0; i < num_rsp; i++, ptr += size) 
+	{
+		memset(&info, 0, sizeof info);
+		rssi = WD_HCI_NO_RSSI;
+		if (evt == EVT_INQUIRY_RESULT) 
+		{
+			memcpy(&info, ptr, INQUIRY_INFO_SIZE);
+		}
+		else if (size == INQUIRY_INFO_WITH_RSSI_AND_PSCAN_MODE_SIZE) 
+		{
+			const inquiry_info_with_rssi_and_pscan_mode *r = (const void *)ptr;
+			bacpy(&info.bdaddr, &r->bdaddr);
+			info.pscan_rep_mode = r->pscan_rep_mode;
+			info.pscan_period_mode = r->pscan_period_mode;
+			info.pscan_mode = r->pscan_mode;
+			memcpy(info.dev_class, r->dev_class, 3);
+			info.clock_offset = r->clock_offset;
+			rssi = r->rssi;
+		}
+		else 
+		{
+			/* Same head for extended results */
+			const inquiry_info_with_rssi *r = (const void *)ptr;
+			bacpy(&info.bdaddr, &r->bdaddr);
+			info.pscan_rep_mode = r->pscan_rep_mode;
+			info.pscan_period_mode = r->pscan_period_mode;
+			memcpy(info.dev_class, r->dev_class, 3);
+			info.clock_offset = r->clock_offset;
+			rssi = r->rssi;
+		}
+
+		for (j = 0; (j < hci->num_results) && bacmp(&hci->results[j].bdaddr, &info.bdaddr); j++);
+		if (j == hci->num_results) 
+		{
+			if (hci->num_results == WD_HCI_MAX_RSP)
+				continue;
+			hci->num_results++;
+		}
+		hci->results[j] = info;
+		hci->rssi[j] = rssi;
+	}
+}
+
+/* Hands an event to the request it answers, see hci_send_req for the rules.
+   Must be called with req_mutex held.
+*/
+static void wd_hci_dispatch(struct wd_hci *hci, const uint8_t *buf, int len)
+{
+	const hci_event_hdr *hdr = (const void *)(buf + 1);
+	const uint8_t *ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
+	struct wd_hci_request *req = NULL;
+	int i;
+
+	if ((len < 1 + HCI_EVENT_HDR_SIZE) || (buf[0] != HCI_EVENT_PKT))
+		return;
+	len -= 1 + HCI_EVENT_HDR_SIZE;
+
+	switch (hdr->evt) 
+	{
+	case EVT_CMD_STATUS:
+	{
+		const evt_cmd_status *cs = (const void *)ptr;
+		/* The oldest command of that opcode not acknowledged yet */
+		for (i = 0; i < WD_HCI_MAX_PENDING; i++) 
+		{
+			struct wd_hci_request *r = &hci->pending[i];
+			if ((r->state == WD_HCI_REQ_PENDING) && (r->opcode == cs->opcode) && !r->status_seen && 
+			    (!req || ((int32_t)(r->serial - req->serial) < 0)))
+				req = r;
+		}
+		if (!req)
+			return;
+		if (req->event == EVT_CMD_STATUS)
+			wd_hci_complete(hci, req, 0, ptr, len);
+		else if (cs->status)
+			wd_hci_complete(hci, req, EIO, NULL, 0);
+		else
+			req->status_seen = 1;
+		return;
+	}
+
+	case EVT_CMD_COMPLETE:
+	{
+		const evt_cmd_complete *cc = (const void *)ptr;
+		if ((req = wd_hci_find(hci, cc->opcode, 0)) != NULL)
+			wd_hci_complete(hci, req, 0, ptr + EVT_CMD_COMPLETE_SIZE, len - EVT_CMD_COMPLETE_SIZE);
+		return;
+	}
+
+	case EVT_REMOTE_NAME_REQ_COMPLETE:
+	{
+		const evt_remote_name_req_complete *rn = (const void *)ptr;
+		for (i = 0; i < WD_HCI_MAX_PENDING; i++) 
+		{
+			struct wd_hci_request *r = &hci->pending[i];
+			if ((r->state == WD_HCI_REQ_PENDING) && (r->event == EVT_REMOTE_NAME_REQ_COMPLETE) && 
+			    !bacmp(&r->bdaddr, &rn->bdaddr)) 
+			{
+				wd_hci_complete(hci, r, 0, ptr, len);
+				return;
+			}
+		}
+		return;
+	}
+
+	case EVT_INQUIRY_RESULT:
+	case EVT_INQUIRY_RESULT_WITH_RSSI:
+	case EVT_EXTENDED_INQUIRY_RESULT:
+		wd_hci_collect(hci, hdr->evt, ptr, len);
+		return;
+
+	default:
+		if ((req = wd_hci_find(hci, 0, hdr->evt)) != NULL)
+			wd_hci_complete(hci, req, 0, ptr, len);
+		return;
+	}
+}
+
+/* Milliseconds until the nearest deadline of the requests in flight, after failing the ones 
+   that have expired; -1 if there is none. Must be called with req_mutex held.
+*/
+static int wd_hci_expire(struct wd_hci *hci)
+{
+	struct timespec now;
+	int64_t left, nearest = -1;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < WD_HCI_MAX_PENDING; i++) 
+	{
+		struct wd_hci_request *req = &hci->pending[i];
+		if (req->state != WD_HCI_REQ_PENDING)
+			continue;
+		left = (int64_t)(req->deadline.tv_sec - now.tv_sec) * 1000 + 
+		       (req->deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (left <= 0) 
+		{
+			wd_hci_complete(hci, req, ETIMEDOUT, NULL, 0);
+			continue;
+		}
+		if ((nearest < 0) || (left < nearest))
+			nearest = left;
+	}
+	return (int)nearest;
+}
+
+static void *wd_hci_reader_thread(struct wd_hci *hci)
+{
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_hci_reader_thread");
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	struct pollfd fds[2];
+	int timeout, len, i, err = 0;
+
+	fds[0].fd = hci->dd;
+	fds[0].events = POLLIN;
+	fds[1].fd = hci->wake_pipe[0];
+	fds[1].events = POLLIN;
+	for (;;) 
+	{
+		pthread_mutex_lock(&hci->req_mutex);
+		timeout = wd_hci_expire(hci);
+		pthread_mutex_unlock(&hci->req_mutex);
+
+		if (poll(fds, 2, timeout) < 0) 
+		{
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			err = errno;
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_hci_reader_thread: poll error");
+			break;
+		}
+		if (fds[1].revents) 
+		{
+			/* New deadlines or the end */
+			if ((len = read(hci->wake_pipe[0], buf, sizeof buf)) <= 0) 
+			{
+				err = len ? errno : EPIPE;
+				break;
+			}
+			for (i = 0; (i < len) && (buf[i] != WD_HCI_WAKE_QUIT); i++);
+			if (i < len)
+				break;
+			continue;
+		}
+		if (!(fds[0].revents & POLLIN)) 
+		{
+			if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) 
+			{
+				err = ENETDOWN;
+				__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_hci_reader_thread: Socket error");
+				break;
+			}
+			continue;
+		}
+
+		if ((len = read(hci->dd, buf, sizeof buf)) < 0) 
+		{
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			err = errno;
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_hci_reader_thread: Read error");
+			break;
+		}
+		pthread_mutex_lock(&hci->req_mutex);
+		wd_hci_dispatch(hci, buf, len);
+		pthread_mutex_unlock(&hci->req_mutex);
+	}
+
+	if (err) 
+	{
+		/* Nothing is going to answer the commands in flight or the ones still to come, until 
+		 * the next open rebuilds the context (e.g. the adapter has been turned off) */
+		pthread_mutex_lock(&hci->req_mutex);
+		hci->failed = 1;
+		wd_hci_fail_all(hci, err);
+		pthread_mutex_unlock(&hci->req_mutex);
+	}
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Finished wd_hci_reader_thread");
+	return NULL;
+}
+
+/* Takes a free slot for the command and sends it. Must be called with req_mutex held.
+   Returns:
+	NULL if the command cannot be sent (errno is set),
+	the request otherwise.
+*/
+static struct wd_hci_request *wd_hci_queue(struct wd_hci *hci, struct hci_request *r, int timeout, wd_hci_callback callback, void *arg)
+{
+	struct wd_hci_request *req = NULL;
+	char c = WD_HCI_WAKE_DEADLINE;
+	int i;
+
+	if (timeout <= 0)
+		timeout = WD_HCI_DEFAULT_TIMEOUT;
+
+	if ((hci->dd < 0) || hci->failed) 
+	{
+		errno = ENODEV;
+		return NULL;
+	}
+	for (i = 0; (i < WD_HCI_MAX_PENDING) && !req; i++) 
+	{
+		if (hci->pending[i].state == WD_HCI_REQ_FREE)
+			req = &hci->pending[i];
+	}
+	if (!req) 
+	{
+		errno = EBUSY;
+		return NULL;
+	}
+
+	memset(req, 0, sizeof *req);
+	req->state = WD_HCI_REQ_PENDING;
+	req->serial = hci->serial++;
+	req->opcode = htobs(cmd_opcode_pack(r->ogf, r->ocf));
+	req->event = r->event;
+	if ((r->event == EVT_REMOTE_NAME_REQ_COMPLETE) && r->cparam)
+		bacpy(&req->bdaddr, &((remote_name_req_cp *)r->cparam)->bdaddr);
+	req->callback = callback;
+	req->arg = arg;
+	clock_gettime(CLOCK_MONOTONIC, &req->deadline);
+	req->deadline.tv_sec += timeout / 1000;
+	req->deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (req->deadline.tv_nsec >= 1000000000L) 
+	{
+		req->deadline.tv_sec++;
+		req->deadline.tv_nsec -= 1000000000L;
+	}
+
+	if (hci_send_cmd(hci->dd, r->ogf, r->ocf, r->clen, r->cparam) < 0) 
+	{
+		req->state = WD_HCI_REQ_FREE;
+		return NULL;
+	}
+
+	/* The reader has to know about the new deadline */
+	if (write(hci->wake_pipe[1], &c, 1) != 1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_queue: Wake pipe write error");
+	}
+	return req;
+}
+
+/* Sends a command without waiting for its answer. The callback is called on the reader thread 
+   once the command completes, fails or has not completed within timeout milliseconds (0 for 
+   WD_HCI_DEFAULT_TIMEOUT). r->rparam and r->rlen are not used, the answer goes to the callback.
+   Returns:
+	-1 if the command cannot be sent (errno is set),
+	 0 otherwise.
+*/
+int wd_hci_submit(struct wd_hci *hci, struct hci_request *r, int timeout, wd_hci_callback callback, void *arg)
+{
+	struct wd_hci_request *req;
+
+	pthread_mutex_lock(&hci->req_mutex);
+	req = wd_hci_queue(hci, r, timeout, callback, arg);
+	pthread_mutex_unlock(&hci->req_mutex);
+	return req ? 0 : -1;
+}
+
+/* Same as hci_send_req, through the multiplexer: blocks until the answer of the command is in 
+   r->rparam, while other commands can be in flight. The wait ends at the deadline of the command 
+   even if the reader thread is not there to expire it.
+   Returns:
+	-1 on error or timeout (errno is set),
+	 0 otherwise.
+*/
+int wd_hci_send_req(struct wd_hci *hci, struct hci_request *r, int timeout)
+{
+	struct wd_hci_request *req;
+	struct timespec deadline;
+	int err;
+
+	if (timeout <= 0)
+		timeout = WD_HCI_DEFAULT_TIMEOUT;
+	/* req->deadline is on CLOCK_MONOTONIC, the condition waits on CLOCK_REALTIME */
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) 
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&hci->req_mutex);
+	if (!(req = wd_hci_queue(hci, r, timeout, NULL, NULL))) 
+	{
+		pthread_mutex_unlock(&hci->req_mutex);
+		return -1;
+	}
+	while (req->state == WD_HCI_REQ_PENDING) 
+	{
+		if (pthread_cond_timedwait(&hci->req_cond, &hci->req_mutex, &deadline) == ETIMEDOUT) 
+		{
+			if (req->state == WD_HCI_REQ_PENDING) 
+			{
+				req->err = ETIMEDOUT;
+				req->rlen = 0;
+				req->state = WD_HCI_REQ_DONE;
+			}
+		}
+	}
+
+	err = req->err;
+	if (!err) 
+	{
+		if (r->rlen > req->rlen)
+			r->rlen = req->rlen;
+		memcpy(r->rparam, req->rparam, r->rlen);
+	}
+	req->state = WD_HCI_REQ_FREE;
+	pthread_mutex_unlock(&hci->req_mutex);
+
+	if (err) 
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* Reads the user friendly name of a remote device, name holds len bytes.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_hci_read_remote_name(struct wd_hci *hci, const bdaddr_t *bdaddr, char *name, int len)
+{
+	evt_remote_name_req_complete rn;
+	remote_name_req_cp cp;
+	struct hci_request rq;
+
+	if (wd_hci_open(hci))
+		return -1;
+
+	memset(&cp, 0, sizeof(cp));
+	bacpy(&cp.bdaddr, bdaddr);
+	cp.pscan_rep_mode = 0x02;
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LINK_CTL;
+	rq.ocf = OCF_REMOTE_NAME_REQ;
+	rq.cparam = &cp;
+	rq.clen = REMOTE_NAME_REQ_CP_SIZE;
+	rq.event = EVT_REMOTE_NAME_REQ_COMPLETE;
+	rq.rparam = &rn;
+	rq.rlen = EVT_REMOTE_NAME_REQ_COMPLETE_SIZE;
+
+	if (wd_hci_send_req(hci, &rq, 0) < 0)
+		return -1;
+	if (rn.status) 
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	rn.name[247] = 0;
+	strncpy(name, (char *)rn.name, len);
+	return 0;
+}
+
+/* Asks for the name of a remote device without waiting for it; the callback gets the 
+   evt_remote_name_req_complete event.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_hci_read_remote_name_async(struct wd_hci *hci, const bdaddr_t *bdaddr, wd_hci_callback callback, void *arg)
+{
+	remote_name_req_cp cp;
+	struct hci_request rq;
+
+	memset(&cp, 0, sizeof(cp));
+	bacpy(&cp.bdaddr, bdaddr);
+	cp.pscan_rep_mode = 0x02;
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LINK_CTL;
+	rq.ocf = OCF_REMOTE_NAME_REQ;
+	rq.cparam = &cp;
+	rq.clen = REMOTE_NAME_REQ_CP_SIZE;
+	rq.event = EVT_REMOTE_NAME_REQ_COMPLETE;
+
+	return wd_hci_submit(hci, &rq, 0, callback, arg);
+}
+
+/* Looks up the handle of the ACL connection to a remote device.
+   Returns:
+	-1 if there is no such connection,
+	 0 otherwise.
+*/
+int wd_hci_conn_handle(struct wd_hci *hci, const bdaddr_t *bdaddr, uint16_t *handle)
+{
+	struct {
+		struct hci_conn_info_req req;
+		struct hci_conn_info info;
+	} cr;
+	int err = -1;
+
+	pthread_mutex_lock(&hci->mutex);
+	if (hci->dd >= 0) 
+	{
+		memset(&cr, 0, sizeof cr);
+		bacpy(&cr.req.bdaddr, bdaddr);
+		cr.req.type = ACL_LINK;
+		if (ioctl(hci->dd, HCIGETCONNINFO, (unsigned long)&cr) == 0) 
+		{
+			*handle = cr.info.handle;
+			err = 0;
+		}
+	}
+	pthread_mutex_unlock(&hci->mutex);
+	return err;
+}
+
+/* Reads the RSSI of the ACL connection with the given handle, in dB from the golden receive 
+   power range, waiting at most timeout milliseconds (0 for WD_HCI_DEFAULT_TIMEOUT).
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_hci_read_rssi(struct wd_hci *hci, uint16_t handle, int8_t *rssi, int timeout)
+{
+	read_rssi_rp rp;
+	struct hci_request rq;
+
+	handle = htobs(handle);
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_STATUS_PARAM;
+	rq.ocf = OCF_READ_RSSI;
+	rq.cparam = &handle;
+	rq.clen = 2;
+	rq.rparam = &rp;
+	rq.rlen = READ_RSSI_RP_SIZE;
+
+	if (wd_hci_send_req(hci, &rq, timeout) < 0)
+		return -1;
+	if (rp.status) 
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	*rssi = rp.rssi;
+	return 0;
+}
+
+/* Reads the link quality (0-255, vendor specific) of the ACL connection with the given handle, 
+   waiting at most timeout milliseconds (0 for WD_HCI_DEFAULT_TIMEOUT).
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_hci_read_link_quality(struct wd_hci *hci, uint16_t handle, uint8_t *link_quality, int timeout)
+{
+	read_link_quality_rp rp;
+	struct hci_request rq;
+
+	handle = htobs(handle);
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_STATUS_PARAM;
+	rq.ocf = OCF_READ_LINK_QUALITY;
+	rq.cparam = &handle;
+	rq.clen = 2;
+	rq.rparam = &rp;
+	rq.rlen = READ_LINK_QUALITY_RP_SIZE;
+
+	if (wd_hci_send_req(hci, &rq, timeout) < 0)
+		return -1;
+	if (rp.status) 
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	*link_quality = rp.link_quality;
+	return 0;
+}
+
+/* Sets the link policy (HCI_LP_*) of the ACL connection with the given handle.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_hci_write_link_policy(struct wd_hci *hci, uint16_t handle, uint16_t policy)
+{
+	write_link_policy_cp cp;
+	write_link_policy_rp rp;
+	struct hci_request rq;
+
+	cp.handle = htobs(handle);
+	cp.policy = htobs(policy);
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LINK_POLICY;
+	rq.ocf = OCF_WRITE_LINK_POLICY;
+	rq.cparam = &cp;
+	rq.clen = WRITE_LINK_POLICY_CP_SIZE;
+	rq.rparam = &rp;
+	rq.rlen = WRITE_LINK_POLICY_RP_SIZE;
+
+	if (wd_hci_send_req(hci, &rq, 0) < 0)
+		return -1;
+	if (rp.status) 
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Sets the link supervision timeout of the ACL connection with the given handle, in baseband 
+   slots (0.625 ms). Only the master of the link can change it.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_hci_write_link_supervision_timeout(struct wd_hci *hci, uint16_t handle, uint16_t timeout)
+{
+	write_link_supervision_timeout_cp cp;
+	write_link_supervision_timeout_rp rp;
+	struct hci_request rq;
+
+	cp.handle = htobs(handle);
+	cp.timeout = htobs(timeout);
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_HOST_CTL;
+	rq.ocf = OCF_WRITE_LINK_SUPERVISION_TIMEOUT;
+	rq.cparam = &cp;
+	rq.clen = WRITE_LINK_SUPERVISION_TIMEOUT_CP_SIZE;
+	rq.rparam = &rp;
+	rq.rlen = WRITE_LINK_SUPERVISION_TIMEOUT_RP_SIZE;
+
+	if (wd_hci_send_req(hci, &rq, 0) < 0)
+		return -1;
+	if (rp.status) 
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Sets the inquiry mode of the controller: 0 for the standard results, 1 for results with RSSI, 
+   2 for extended results.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_hci_write_inquiry_mode(struct wd_hci *hci, uint8_t mode)
+{
+	write_inquiry_mode_cp cp;
+	write_inquiry_mode_rp rp;
+	struct hci_request rq;
+
+	cp.mode = mode;
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_HOST_CTL;
+	rq.ocf = OCF_WRITE_INQUIRY_MODE;
+	rq.cparam = &cp;
+	rq.clen = WRITE_INQUIRY_MODE_CP_SIZE;
+	rq.rparam = &rp;
+	rq.rlen = WRITE_INQUIRY_MODE_RP_SIZE;
+
+	if (wd_hci_send_req(hci, &rq, 0) < 0)
+		return -1;
+	if (rp.status) 
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+int wd_hci_adapters_init(struct wd_hci_adapters *adapters)
+{
+	memset(adapters, 0, sizeof *adapters);
+	if (pthread_mutex_init(&adapters->mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_adapters_init: Error in initialization of adapters mutex.");
+		return -1;
+	}
+	return 0;
+}
+
+void wd_hci_adapters_destroy(struct wd_hci_adapters *adapters)
+{
+	pthread_mutex_destroy(&adapters->mutex);
+}
+
+/* hci_for_each_dev callback: updates the load of adapter dev_id in the table passed as arg. Must 
+   be called with the adapters mutex held.
+*/
+static int wd_hci_adapter_load(int dd, int dev_id, long arg)
+{
+	struct wd_hci_adapters *adapters = (struct wd_hci_adapters *)arg;
+	struct wd_hci_adapter *adapter = NULL;
+	struct 
+	{
+		struct hci_conn_list_req list;
+		struct hci_conn_info conn[WD_HCI_MAX_CONN];
+	} cl;
+	struct hci_dev_info info;
+	struct timespec now;
+	uint32_t bytes;
+	float elapsed;
+	int acl_count = 0, i;
+
+	memset(&info, 0, sizeof info);
+	info.dev_id = dev_id;
+	if (ioctl(dd, HCIGETDEVINFO, (void *)&info) || hci_test_bit(HCI_RAW, &info.flags))
+		return 0;
+	memset(&cl, 0, sizeof cl);
+	cl.list.dev_id = dev_id;
+	cl.list.conn_num = WD_HCI_MAX_CONN;
+	if (ioctl(dd, HCIGETCONNLIST, (void *)&cl))
+		return 0;
+	for (i = 0; i < cl.list.conn_num; i++) 
+	{
+		if (cl.conn[i].type == ACL_LINK)
+			acl_count++;
+	}
+
+	for (i = 0; (i < adapters->count) && (adapters->adapter[i].dev_id != dev_id); i++);
+	if (i == adapters->count) 
+	{
+		if (adapters->count == WD_HCI_MAX_ADAPTERS)
+			return 0;
+		adapter = &adapters->adapter[adapters->count++];
+		memset(adapter, 0, sizeof *adapter);
+		adapter->dev_id = dev_id;
+	}
+	else 
+	{
+		adapter = &adapters->adapter[i];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bytes = info.stat.byte_rx + info.stat.byte_tx;
+	if (adapter->seen.tv_sec || adapter->seen.tv_nsec) 
+	{
+		elapsed = (now.tv_sec - adapter->seen.tv_sec) + (now.tv_nsec - adapter->seen.tv_nsec) / 1e9f;
+		if (elapsed > 0)
+			adapter->rate = (bytes - adapter->bytes) / elapsed;
+	}
+	bacpy(&adapter->bdaddr, &info.bdaddr);
+	adapter->acl_count = acl_count;
+	adapter->bytes = bytes;
+	adapter->seen = now;
+	adapter->pass = adapters->pass;
+	return 0;
+}
+
+/* Takes a look at the load of the adapters that are up, and forgets the ones which went down. 
+   Must be called with the adapters mutex held.
+   Returns:
+	the milliseconds since the look before, -1 if there was none.
+*/
+static int wd_hci_adapters_look(struct wd_hci_adapters *adapters)
+{
+	struct timespec now;
+	int since = -1;
+	int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (adapters->looked.tv_sec || adapters->looked.tv_nsec)
+		since = (now.tv_sec - adapters->looked.tv_sec) * 1000 + (now.tv_nsec - adapters->looked.tv_nsec) / 1000000;
+	adapters->looked = now;
+
+	adapters->pass++;
+	hci_for_each_dev(HCI_UP, wd_hci_adapter_load, (long)adapters);
+	for (i = 0, j = 0; i < adapters->count; i++) 
+	{
+		if (adapters->adapter[i].pass == adapters->pass)
+			adapters->adapter[j++] = adapters->adapter[i];
+	}
+	adapters->count = j;
+	return since;
+}
+
+/* Looks at the load of the adapters that are up and picks the one a new board should be 
+   connected through: the one with the fewest ACL connections, then with the lowest throughput. 
+   A throughput measured since a look older than WD_HCI_RATE_MAX_AGE (e.g. the previous connect) 
+   says nothing about the current load, so it is measured again over WD_HCI_RATE_WINDOW.
+   Returns:
+	-1 if no adapter is up,
+	 0 otherwise.
+*/
+int wd_hci_pick_adapter(struct wd_hci_adapters *adapters, struct wd_hci_adapter *picked)
+{
+	struct wd_hci_adapter *best = NULL;
+	int since, i;
+
+	pthread_mutex_lock(&adapters->mutex);
+	since = wd_hci_adapters_look(adapters);
+	if ((since < 0) || (since > WD_HCI_RATE_MAX_AGE)) 
+	{
+		usleep(WD_HCI_RATE_WINDOW * 1000);
+		wd_hci_adapters_look(adapters);
+	}
+
+	for (i = 0; i < adapters->count; i++) 
+	{
+		struct wd_hci_adapter *adapter = &adapters->adapter[i];
+		if (!best || (adapter->acl_count < best->acl_count) || 
+		    ((adapter->acl_count == best->acl_count) && (adapter->rate < best->rate)))
+			best = adapter;
+	}
+	if (best) 
+	{
+		*picked = *best;
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_hci_pick_adapter: hci%d, %d ACL, %u B/s", 
+		                    best->dev_id, best->acl_count, best->rate);
+	}
+	pthread_mutex_unlock(&adapters->mutex);
+	return best ? 0 : -1;
+}
@@ -0,0 +1,154 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_HCI_H
+#define WD_HCI_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Most devices an inquiry reports */
+#define WD_HCI_MAX_RSP			255
+/* ms before a command gives up when the caller does not say */
+#define WD_HCI_DEFAULT_TIMEOUT	10000
+/* Commands in flight at once */
+#define WD_HCI_MAX_PENDING		8
+
+/* RSSI of an inquiry result when the controller does not report it (as in the specification) */
+#define WD_HCI_NO_RSSI			127
+/* ms on top of the inquiry length before the inquiry is given up */
+#define WD_HCI_INQUIRY_MARGIN	2000
+
+/* Local adapters the boards can be spread over, and ACL connections looked at per adapter */
+#define WD_HCI_MAX_ADAPTERS		4
+#define WD_HCI_MAX_CONN			16
+/* ms over which the throughput of the adapters is measured when picking one, and age of a 
+ * measurement past which it is taken again */
+#define WD_HCI_RATE_WINDOW		250
+#define WD_HCI_RATE_MAX_AGE		2000
+
+/* Bytes written to the wake pipe of the reader thread */
+#define WD_HCI_WAKE_DEADLINE	'd'
+#define WD_HCI_WAKE_QUIT		'q'
+
+/* Called on the reader thread when a command completes; err is 0 or an errno value (e.g. 
+ * ETIMEDOUT), rparam holds the return parameters of the command or the event it waited for. */
+typedef void (*wd_hci_callback)(void *arg, int err, const uint8_t *rparam, int rlen);
+
+enum wd_hci_req_state 
+{
+	WD_HCI_REQ_FREE,
+	WD_HCI_REQ_PENDING,
+	WD_HCI_REQ_DONE
+};
+
+/* A command in flight. Completions are matched by opcode in the order the commands have been 
+ * sent, remote name requests by address. */
+struct wd_hci_request 
+{
+	enum wd_hci_req_state state;
+	uint32_t serial;
+	uint16_t opcode;
+	int event;							/* Completing event, see struct hci_request */
+	int status_seen;
+	bdaddr_t bdaddr;
+	struct timespec deadline;
+	wd_hci_callback callback;			/* NULL for a caller blocked in wd_hci_send_req */
+	void *arg;
+	int err;
+	uint8_t rparam[HCI_MAX_EVENT_SIZE];
+	int rlen;
+};
+
+/* Long lived handle on the local Bluetooth controller. It is opened once and kept across 
+ * connections: the socket is bound to the adapter and its information is cached, and the 
+ * buffers of the inquiry are part of it, so discovery does not allocate. The socket keeps one 
+ * event filter for its lifetime; a reader thread hands the events to the commands in flight, so 
+ * several of them (e.g. name requests or RSSI reads for several boards) can run at once. */
+struct wd_hci 
+{
+	pthread_mutex_t mutex;
+	int dd;									/* Device descriptor, -1 while closed */
+	int dev_id;
+	struct hci_dev_info info;
+	bdaddr_t bdaddr;
+	uint8_t features[8];
+	struct 
+	{
+		struct hci_inquiry_req req;
+		inquiry_info info[WD_HCI_MAX_RSP];
+	} inquiry;
+	inquiry_info results[WD_HCI_MAX_RSP];	/* Of the last inquiry */
+	int8_t rssi[WD_HCI_MAX_RSP];			/* Of the results, WD_HCI_NO_RSSI if unknown */
+	int inquiry_mode;						/* Set on the controller, -1 if not known */
+
+	/* Command multiplexer, under req_mutex */
+	pthread_mutex_t req_mutex;
+	pthread_cond_t req_cond;
+	pthread_t reader_thread;
+	int wake_pipe[2];
+	int failed;								/* The reader has given up on the socket, the next open rebuilds it */
+	uint32_t serial;
+	struct wd_hci_request pending[WD_HCI_MAX_PENDING];
+	int collecting;							/* Inquiry results go to results */
+	int num_results;
+};
+
+/* Load of a local adapter, as of the last look */
+struct wd_hci_adapter 
+{
+	int dev_id;
+	bdaddr_t bdaddr;
+	int acl_count;						/* ACL connections, of any application */
+	uint32_t bytes;						/* Received and sent since the adapter came up */
+	uint32_t rate;						/* Bytes per second between the last two looks */
+	struct timespec seen;				/* CLOCK_MONOTONIC */
+	uint32_t pass;
+};
+
+/* The adapters that are up, with their load */
+struct wd_hci_adapters 
+{
+	pthread_mutex_t mutex;
+	uint32_t pass;
+	struct timespec looked;				/* CLOCK_MONOTONIC, of the last look */
+	int count;
+	struct wd_hci_adapter adapter[WD_HCI_MAX_ADAPTERS];
+};
+
+int wd_hci_init(struct wd_hci *hci);
+void wd_hci_destroy(struct wd_hci *hci);
+int wd_hci_open(struct wd_hci *hci);
+int wd_hci_open_dev(struct wd_hci *hci, int dev_id);
+void wd_hci_close(struct wd_hci *hci);
+int wd_hci_inquiry(struct wd_hci *hci, int len, long flags);
+int wd_hci_submit(struct wd_hci *hci, struct hci_request *r, int timeout, wd_hci_callback callback, void *arg);
+int wd_hci_send_req(struct wd_hci *hci, struct hci_request *r, int timeout);
+int wd_hci_read_remote_name(struct wd_hci *hci, const bdaddr_t *bdaddr, char *name, int len);
+int wd_hci_read_remote_name_async(struct wd_hci *hci, const bdaddr_t *bdaddr, wd_hci_callback callback, void *arg);
+int wd_hci_conn_handle(struct wd_hci *hci, const bdaddr_t *bdaddr, uint16_t *handle);
+int wd_hci_read_rssi(struct wd_hci *hci, uint16_t handle, int8_t *rssi, int timeout);
+int wd_hci_read_link_quality(struct wd_hci *hci, uint16_t handle, uint8_t *link_quality, int timeout);
+int wd_hci_write_link_policy(struct wd_hci *hci, uint16_t handle, uint16_t policy);
+int wd_hci_write_inquiry_mode(struct wd_hci *hci, uint8_t mode);
+int wd_hci_write_link_supervision_timeout(struct wd_hci *hci, uint16_t handle, uint16_t timeout);
+int wd_hci_adapters_init(struct wd_hci_adapters *adapters);
+void wd_hci_adapters_destroy(struct wd_hci_adapters *adapters);
+int wd_hci_pick_adapter(struct wd_hci_adapters *adapters, struct wd_hci_adapter *picked);
+
+#endif
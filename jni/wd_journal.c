@@ -0,0 +1,452 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Crash proof journal of the samples. The router thread writes every calibrated sample into a 
+ *  file mapped in memory and the records reach the permanent sample log in batches, so the 
+ *  samples of a session survive the process being killed without a sync per sample.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_samples.h"
+#include "wd_storage.h"
+#include "wd_journal.h"
+
+#define WD_JOURNAL_SLOT_LEN		(sizeof(struct wd_journal_slot) + WD_SAMPLE_RECORD_LEN)
+
+static void *wd_journal_thread(struct wd_journal *journal);
+
+static void wd_journal_path(const char *prefix, const char *ext, const bdaddr_t *bdaddr, char *path, size_t len)
+{
+	/* Same naming as the calibration cache */
+	snprintf(path, len, "%s/%s%.2X%.2X%.2X%.2X%.2X%.2X%s", 
+	         wd_storage_get_dir(), prefix, 
+	         bdaddr->b[5], bdaddr->b[4], bdaddr->b[3], 
+	         bdaddr->b[2], bdaddr->b[1], bdaddr->b[0], ext);
+}
+
+static struct wd_journal_slot *wd_journal_slot(struct wd_journal *journal, uint32_t seq)
+{
+	return (struct wd_journal_slot *)(journal->slots + (seq & (WD_JOURNAL_CAPACITY - 1)) * WD_JOURNAL_SLOT_LEN);
+}
+
+static uint32_t wd_journal_crc(const struct wd_journal_slot *slot)
+{
+	return wd_crc32(wd_crc32(0, &slot->seq, sizeof slot->seq), slot->record, WD_SAMPLE_RECORD_LEN);
+}
+
+/* Maps the journal of the board, creating it if needed. A journal which is not ours (or not 
+   a journal at all) is started over. The journal is locked until it is unmapped, so that a 
+   session still going (lingering, say) is never salvaged under its feet.
+   Returns:
+	-1 on error, or if the journal is in use,
+	 0 otherwise.
+*/
+static int wd_journal_map(struct wd_journal *journal, const bdaddr_t *bdaddr)
+{
+	char path[WD_STORAGE_PATH_LEN + 32];
+	struct wd_journal_header *header;
+	struct stat st;
+	void *base;
+
+	memset(journal, 0, sizeof *journal);
+	journal->log_fd = -1;
+	journal->size = WD_JOURNAL_HEADER_LEN + (size_t)WD_JOURNAL_CAPACITY * WD_JOURNAL_SLOT_LEN;
+	wd_journal_path(WD_JOURNAL_PREFIX, WD_JOURNAL_EXT, bdaddr, path, sizeof path);
+	if ((journal->fd = open(path, O_RDWR | O_CREAT, 0600)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_map: Cannot open %s (%d)", path, errno);
+		return -1;
+	}
+	if (flock(journal->fd, LOCK_EX | LOCK_NB)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_map: %s is in use", path);
+		close(journal->fd);
+		return -1;
+	}
+	/* Never shrink it under records we may still need, a short file is a new one */
+	if (fstat(journal->fd, &st) || (((size_t)st.st_size < journal->size) && ftruncate(journal->fd, journal->size))) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_map: Cannot size %s (%d)", path, errno);
+		close(journal->fd);
+		return -1;
+	}
+	if ((base = mmap(NULL, journal->size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0)) == MAP_FAILED) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_map: Cannot map %s (%d)", path, errno);
+		close(journal->fd);
+		return -1;
+	}
+	journal->header = header = base;
+	journal->slots = (unsigned char *)base + WD_JOURNAL_HEADER_LEN;
+
+	if ((header->magic != WD_JOURNAL_MAGIC) || (header->version != WD_JOURNAL_VERSION) || 
+	    (header->record_len != WD_SAMPLE_RECORD_LEN) || (header->capacity != WD_JOURNAL_CAPACITY) || 
+	    (header->slot_len != WD_JOURNAL_SLOT_LEN) || bacmp(&header->bdaddr, bdaddr)) 
+	{
+		memset(base, 0, journal->size);
+		header->version = WD_JOURNAL_VERSION;
+		header->record_len = WD_SAMPLE_RECORD_LEN;
+		header->capacity = WD_JOURNAL_CAPACITY;
+		header->slot_len = WD_JOURNAL_SLOT_LEN;
+		bacpy(&header->bdaddr, bdaddr);
+		header->committed = 0;
+		header->magic = WD_JOURNAL_MAGIC;
+	}
+	journal->head = header->committed;
+	return 0;
+}
+
+static void wd_journal_unmap(struct wd_journal *journal)
+{
+	munmap(journal->header, journal->size);
+	close(journal->fd);
+	if (journal->log_fd != -1)
+		close(journal->log_fd);
+}
+
+static int wd_journal_open_log(struct wd_journal *journal)
+{
+	char path[WD_STORAGE_PATH_LEN + 32];
+
+	wd_journal_path(WD_SAMPLE_LOG_PREFIX, WD_SAMPLE_LOG_EXT, &journal->header->bdaddr, path, sizeof path);
+	if ((journal->log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_open_log: Cannot open %s (%d)", path, errno);
+		return -1;
+	}
+	return 0;
+}
+
+/* Moves committed up to seq, unless it is there already; the appender and the flusher both 
+   move it.
+   Returns:
+	1 if it has been moved,
+	0 otherwise.
+*/
+static int wd_journal_commit(struct wd_journal *journal, uint32_t seq)
+{
+	uint32_t committed = __atomic_load_n(&journal->header->committed, __ATOMIC_ACQUIRE);
+
+	while ((int32_t)(seq - committed) > 0) 
+	{
+		if (__atomic_compare_exchange_n(&journal->header->committed, &committed, seq, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+	return 0;
+}
+
+/* Appends the records from committed up to head to the sample log. With sync, they are on 
+   disk when this returns, otherwise in the page cache, which is as good unless the device 
+   itself goes down. A crash between the write and the move of committed only costs these 
+   records twice in the log, never their loss. Records are copied out of the slots the way a 
+   seqlock is read, so this can run while samples are appended; a record the appender laps 
+   meanwhile is left out, the appender counts it lost.
+   Returns:
+	-1 on error,
+	the number of records written otherwise.
+*/
+int wd_journal_flush(struct wd_journal *journal, int sync)
+{
+	unsigned char buf[64 * WD_SAMPLE_RECORD_LEN];
+	struct wd_journal_slot *slot;
+	uint32_t head = __atomic_load_n(&journal->head, __ATOMIC_ACQUIRE);
+	uint32_t seq = __atomic_load_n(&journal->header->committed, __ATOMIC_ACQUIRE);
+	int count = 0, n, len;
+
+	while (seq != head) 
+	{
+		for (n = 0, len = 0; (n < 64) && (seq + n != head); n++) 
+		{
+			slot = wd_journal_slot(journal, seq + n);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + n)
+				continue;
+			memcpy(buf + len, slot->record, WD_SAMPLE_RECORD_LEN);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq + n)
+				len += WD_SAMPLE_RECORD_LEN;
+		}
+		if (len && (write(journal->log_fd, buf, len) != len)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_flush: Log write error (%d)", errno);
+			return -1;
+		}
+		seq += n;
+		count += len / WD_SAMPLE_RECORD_LEN;
+		wd_journal_commit(journal, seq);
+		/* Past the records the appender has given up on, if it lapped us */
+		n = __atomic_load_n(&journal->header->committed, __ATOMIC_ACQUIRE) - seq;
+		if (n > 0)
+			seq += n;
+	}
+	if (sync) 
+	{
+		if (fdatasync(journal->log_fd)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_flush: Log sync error (%d)", errno);
+			return -1;
+		}
+		msync(journal->header, WD_JOURNAL_HEADER_LEN, MS_SYNC);
+	}
+	return count;
+}
+
+/* Finds the records a dead process left behind: from committed on, for as long as each slot 
+   holds the next sequence number and its checksum holds. The first record which does not is 
+   the one the process was writing (or an older lap), so the scan stops there.
+*/
+static void wd_journal_scan(struct wd_journal *journal)
+{
+	struct wd_journal_slot *slot;
+	uint32_t seq = journal->header->committed;
+
+	while (seq - journal->header->committed < WD_JOURNAL_CAPACITY) 
+	{
+		slot = wd_journal_slot(journal, seq);
+		if ((slot->seq != seq) || (slot->crc != wd_journal_crc(slot)))
+			break;
+		seq++;
+	}
+	journal->head = seq;
+}
+
+/* Salvages what is left in the journal into the sample log.
+   Returns:
+	-1 on error,
+	the number of records salvaged otherwise.
+*/
+static int wd_journal_salvage(struct wd_journal *journal)
+{
+	int count;
+
+	wd_journal_scan(journal);
+	if (journal->head == journal->header->committed)
+		return 0;
+	if ((journal->log_fd == -1) && wd_journal_open_log(journal))
+		return -1;
+	if ((count = wd_journal_flush(journal, 1)) > 0) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_salvage: %d samples recovered", count);
+	}
+	return count;
+}
+
+/* Opens the journal of the board for a new session, after salvaging whatever the last one left 
+   in it.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_journal_open(struct wd_journal *journal, const bdaddr_t *bdaddr)
+{
+	if (wd_journal_map(journal, bdaddr))
+		return -1;
+	if ((journal->recovered = wd_journal_salvage(journal)) == -1) 
+	{
+		/* The log cannot take them, so they stay where they are for the next time */
+		wd_journal_unmap(journal);
+		return -1;
+	}
+	if ((journal->log_fd == -1) && wd_journal_open_log(journal)) 
+	{
+		wd_journal_unmap(journal);
+		return -1;
+	}
+	journal->head = journal->header->committed;
+
+	if (pthread_mutex_init(&journal->mutex, NULL) || pthread_cond_init(&journal->cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_open: Error in initialization of journal mutex.");
+		wd_journal_unmap(journal);
+		return -1;
+	}
+	journal->running = 1;
+	if (pthread_create(&journal->thread, NULL, (void *(*)(void *))&wd_journal_thread, journal)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_open: Thread creation error (journal flusher thread)");
+		pthread_cond_destroy(&journal->cond);
+		pthread_mutex_destroy(&journal->mutex);
+		wd_journal_unmap(journal);
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes the records to the log whenever WD_JOURNAL_FLUSH_AT of them have piled up, and backs 
+   off after an error so that a full or broken storage is not hammered.
+*/
+static void *wd_journal_thread(struct wd_journal *journal)
+{
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_journal_thread");
+	struct timespec retry;
+	uint32_t pending;
+	int backoff = 0;
+
+	pthread_mutex_lock(&journal->mutex);
+	while (journal->running) 
+	{
+		pending = __atomic_load_n(&journal->head, __ATOMIC_ACQUIRE) - 
+		          __atomic_load_n(&journal->header->committed, __ATOMIC_ACQUIRE);
+		if (pending < WD_JOURNAL_FLUSH_AT) 
+		{
+			pthread_cond_wait(&journal->cond, &journal->mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&journal->mutex);
+		if (wd_journal_flush(journal, 0) == -1) 
+		{
+			backoff = backoff ? backoff * 2 : WD_JOURNAL_RETRY_MIN;
+			if (backoff > WD_JOURNAL_RETRY_MAX)
+				backoff = WD_JOURNAL_RETRY_MAX;
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_journal_thread: Trying the log again in %d ms", backoff);
+		}
+		else 
+		{
+			backoff = 0;
+		}
+		pthread_mutex_lock(&journal->mutex);
+
+		if (backoff) 
+		{
+			clock_gettime(CLOCK_REALTIME, &retry);
+			retry.tv_sec += backoff / 1000;
+			retry.tv_nsec += (backoff % 1000) * 1000000L;
+			if (retry.tv_nsec >= 1000000000L) 
+			{
+				retry.tv_sec++;
+				retry.tv_nsec -= 1000000000L;
+			}
+			while (journal->running && 
+			       (pthread_cond_timedwait(&journal->cond, &journal->mutex, &retry) != ETIMEDOUT));
+		}
+	}
+	pthread_mutex_unlock(&journal->mutex);
+
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Finished wd_journal_thread");
+	return NULL;
+}
+
+/* Stops the flusher, writes what is left to the log, on disk this time, and closes the journal. 
+   The journal must not be appended to any more.
+*/
+void wd_journal_close(struct wd_journal *journal)
+{
+	pthread_mutex_lock(&journal->mutex);
+	journal->running = 0;
+	pthread_cond_broadcast(&journal->cond);
+	pthread_mutex_unlock(&journal->mutex);
+	if (pthread_join(journal->thread, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (journal flusher thread)");
+	}
+	pthread_cond_destroy(&journal->cond);
+	pthread_mutex_destroy(&journal->mutex);
+
+	if (wd_journal_flush(journal, 1) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_journal_close: %u samples left in the journal", 
+		                    journal->head - journal->header->committed);
+	}
+	wd_journal_unmap(journal);
+}
+
+/* Writes a WD_SAMPLE_RECORD_LEN bytes record to the journal. This only touches memory; every 
+   WD_JOURNAL_FLUSH_AT records the flusher thread is woken to append them to the log. Only one 
+   thread may append at a time.
+*/
+void wd_journal_append(struct wd_journal *journal, const unsigned char *record)
+{
+	struct wd_journal_slot *slot;
+	uint32_t head = journal->head;
+
+	/* The log has not been taking records, make room with the oldest */
+	if ((head - __atomic_load_n(&journal->header->committed, __ATOMIC_ACQUIRE) >= WD_JOURNAL_CAPACITY) && 
+	    wd_journal_commit(journal, head + 1 - WD_JOURNAL_CAPACITY))
+		journal->lost++;
+
+	/* The new sequence number goes first, so a flusher copying the old record sees it changed */
+	slot = wd_journal_slot(journal, head);
+	__atomic_store_n(&slot->seq, head, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot->record, record, WD_SAMPLE_RECORD_LEN);
+	slot->crc = wd_journal_crc(slot);
+	__atomic_store_n(&journal->head, head + 1, __ATOMIC_RELEASE);
+
+	if (((head + 1) % WD_JOURNAL_FLUSH_AT) == 0) 
+	{
+		pthread_mutex_lock(&journal->mutex);
+		pthread_cond_signal(&journal->cond);
+		pthread_mutex_unlock(&journal->mutex);
+	}
+}
+
+/* Salvages the journals of every board, for the boards which will not be connected to again 
+   soon. Meant for the start of the application, before any session is opened.
+   Returns:
+	-1 if the storage directory cannot be read,
+	the number of records salvaged otherwise.
+*/
+int wd_journal_recover_all(void)
+{
+	struct wd_journal journal;
+	struct dirent *entry;
+	unsigned int b[6];
+	bdaddr_t bdaddr;
+	char ext[8];
+	DIR *dir;
+	int i, count, total = 0;
+
+	if ((dir = opendir(wd_storage_get_dir())) == NULL)
+		return -1;
+	while ((entry = readdir(dir)) != NULL) 
+	{
+		if ((sscanf(entry->d_name, WD_JOURNAL_PREFIX "%2X%2X%2X%2X%2X%2X%7s", 
+		            &b[5], &b[4], &b[3], &b[2], &b[1], &b[0], ext) != 7) || strcmp(ext, WD_JOURNAL_EXT))
+			continue;
+		for (i = 0; i < 6; i++) 
+			bdaddr.b[i] = b[i];
+		if (wd_journal_map(&journal, &bdaddr))
+			continue;
+		if ((count = wd_journal_salvage(&journal)) > 0)
+			total += count;
+		wd_journal_unmap(&journal);
+	}
+	closedir(dir);
+	return total;
+}
@@ -0,0 +1,100 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_JOURNAL_H
+#define WD_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "bluetooth.h"
+
+/* Journal of the samples of a board, kept next to the calibration cache (see wd_storage.h) */
+#define WD_JOURNAL_MAGIC		0x314A4457	/* "WDJ1" */
+#define WD_JOURNAL_VERSION		1
+#define WD_JOURNAL_PREFIX		"journal_"
+#define WD_JOURNAL_EXT			".bin"
+/* Records kept in a journal, must be a power of two; about 80 s at 100 Hz */
+#define WD_JOURNAL_CAPACITY		8192
+/* Records that may pile up in the journal before they are written to the sample log */
+#define WD_JOURNAL_FLUSH_AT		1024
+/* ms the flusher waits before trying the log again after an error, doubling up to the maximum */
+#define WD_JOURNAL_RETRY_MIN	1000
+#define WD_JOURNAL_RETRY_MAX	60000
+#define WD_JOURNAL_HEADER_LEN	64
+
+/* Permanent log of the board: WD_SAMPLE_RECORD_LEN bytes records (see wd_samples.h), appended 
+ * in the order they were received. */
+#define WD_SAMPLE_LOG_PREFIX	"samples_"
+#define WD_SAMPLE_LOG_EXT		".log"
+
+/* The journal is a fixed size file mapped in memory: a header, then WD_JOURNAL_CAPACITY slots. 
+ * Record n lives in slot n % WD_JOURNAL_CAPACITY until it is overwritten. Samples are written to 
+ * the mapping only, the kernel keeps the pages when the process dies, so nothing is lost and 
+ * nothing is synced per sample. Every WD_JOURNAL_FLUSH_AT records, and when the session ends, 
+ * the records past committed are appended to the sample log and committed moves up. The log is 
+ * written by a flusher thread of the journal, never by the thread appending the samples (which 
+ * holds the sample ring); after a write error the flusher backs off, from WD_JOURNAL_RETRY_MIN 
+ * up to WD_JOURNAL_RETRY_MAX, and the journal keeps the newest records meanwhile. 
+ * After a crash the records from committed on, as long as their sequence numbers follow and 
+ * their checksums hold, are salvaged into the log. */
+struct wd_journal_header 
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_len;
+	uint32_t capacity;
+	uint32_t slot_len;
+	bdaddr_t bdaddr;
+	uint8_t reserved[2];
+	uint32_t committed;					/* Sequence number of the first record not in the log */
+};
+
+struct wd_journal_slot 
+{
+	uint32_t seq;
+	uint32_t crc;						/* Of seq and record */
+	unsigned char record[];
+};
+
+struct wd_journal 
+{
+	int fd;
+	int log_fd;
+	size_t size;
+	struct wd_journal_header *header;
+	unsigned char *slots;
+	uint32_t head;						/* Sequence number of the next record */
+	uint32_t lost;						/* Records overwritten before they made it to the log */
+	int recovered;						/* Records salvaged when the journal was opened */
+
+	/* Flusher */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+};
+
+int wd_journal_open(struct wd_journal *journal, const bdaddr_t *bdaddr);
+void wd_journal_close(struct wd_journal *journal);
+void wd_journal_append(struct wd_journal *journal, const unsigned char *record);
+int wd_journal_flush(struct wd_journal *journal, int sync);
+int wd_journal_recover_all(void);
+
+#endif
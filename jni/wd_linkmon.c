@@ -0,0 +1,295 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  The link monitor. Every second or so it reads the RSSI and link quality of the ACL connection 
+ *  to the board and sets them against the gaps and jitter of the reports the router thread saw in 
+ *  the meantime. A stalled stream over a weak radio points at the distance to the phone, a stall 
+ *  over a good one at the board itself.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "bluetooth.h"
+#include "hci.h"
+#include "hci_lib.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_hci.h"
+#include "wd_samples.h"
+#include "wd_linkmon.h"
+
+static void *wd_linkmon_thread(struct wd_linkmon *mon);
+
+/* Starts monitoring the link to the board at bdaddr, through the controller hci.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_linkmon_start(struct wd_linkmon *mon, struct wd_hci *hci, const bdaddr_t *bdaddr)
+{
+	memset(mon, 0, sizeof *mon);
+	mon->hci = hci;
+	bacpy(&mon->bdaddr, bdaddr);
+	if (pthread_mutex_init(&mon->mutex, NULL) || pthread_cond_init(&mon->cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_linkmon_start: Error in initialization of monitor mutex.");
+		return -1;
+	}
+
+	mon->running = 1;
+	if (pthread_create(&mon->thread, NULL, (void *(*)(void *))&wd_linkmon_thread, mon)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_linkmon_start: Thread creation error (link monitor thread)");
+		mon->running = 0;
+		pthread_cond_destroy(&mon->cond);
+		pthread_mutex_destroy(&mon->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+/* Stops the monitor thread and waits for it. A reading in progress gives up after the HCI 
+   command it is waiting for, which takes at most WD_LINKMON_HCI_TIMEOUT.
+*/
+void wd_linkmon_stop(struct wd_linkmon *mon)
+{
+	pthread_mutex_lock(&mon->mutex);
+	mon->running = 0;
+	pthread_cond_broadcast(&mon->cond);
+	pthread_mutex_unlock(&mon->mutex);
+
+	if (pthread_join(mon->thread, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (link monitor thread)");
+	}
+	pthread_cond_destroy(&mon->cond);
+	pthread_mutex_destroy(&mon->mutex);
+}
+
+static float wd_elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0f + (to->tv_nsec - from->tv_nsec) / 1000000.0f;
+}
+
+/* Called by the router thread for every packet read from the board.
+*/
+void wd_linkmon_report(struct wd_linkmon *mon)
+{
+	struct timespec now;
+	float interval;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&mon->mutex);
+	if (mon->last.tv_sec || mon->last.tv_nsec) 
+	{
+		interval = wd_elapsed_ms(&mon->last, &now);
+		/* Stalls only go to max_gap, the mean and jitter are those of the live stream */
+		if (interval < WD_LINKMON_STALL_GAP) 
+		{
+			if (mon->mean_interval == 0)
+				mon->mean_interval = interval;
+			mon->jitter += (fabsf(interval - mon->mean_interval) - mon->jitter) * WD_LINKMON_GAIN;
+			mon->mean_interval += (interval - mon->mean_interval) * WD_LINKMON_GAIN;
+		}
+		if (interval > mon->max_gap)
+			mon->max_gap = interval;
+	}
+	mon->last = now;
+	mon->reports++;
+	pthread_mutex_unlock(&mon->mutex);
+}
+
+/* Copies the points filed since the last call, oldest first. Points older than 
+   WD_LINKMON_HISTORY readings are lost.
+   Returns:
+	the number of points copied.
+*/
+int wd_linkmon_read(struct wd_linkmon *mon, struct wd_link_point *points, int max)
+{
+	int count = 0;
+
+	pthread_mutex_lock(&mon->mutex);
+	while ((mon->read != mon->head) && (count < max)) 
+	{
+		points[count++] = mon->history[mon->read % WD_LINKMON_HISTORY];
+		mon->read++;
+	}
+	pthread_mutex_unlock(&mon->mutex);
+	return count;
+}
+
+/* Alerts of the last point filed.
+*/
+uint16_t wd_linkmon_alerts(struct wd_linkmon *mon)
+{
+	uint16_t alerts;
+
+	pthread_mutex_lock(&mon->mutex);
+	alerts = mon->alerts;
+	pthread_mutex_unlock(&mon->mutex);
+	return alerts;
+}
+
+void wd_linkmon_pack(const struct wd_link_point *point, unsigned char *record)
+{
+	int64_t time = (int64_t)point->time.tv_sec * 1000000000LL + point->time.tv_nsec;
+	int32_t reports = point->reports;
+
+	memcpy(record, &time, 8);
+	memcpy(record + 8, &reports, 4);
+	memcpy(record + 12, &point->mean_interval, 4);
+	memcpy(record + 16, &point->jitter, 4);
+	memcpy(record + 20, &point->max_gap, 4);
+	memcpy(record + 24, &point->rssi, 1);
+	memcpy(record + 25, &point->link_quality, 1);
+	memcpy(record + 26, &point->alerts, 2);
+}
+
+/* Files a reading of the radio along with the router statistics since the previous one, and 
+   judges the link. Must be called with the monitor mutex held.
+*/
+static void wd_linkmon_file(struct wd_linkmon *mon, struct wd_link_point *point)
+{
+	struct timespec now;
+	float gap;
+
+	/* A stream that stopped altogether has no interval yet to show it */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (mon->last.tv_sec || mon->last.tv_nsec) 
+	{
+		gap = wd_elapsed_ms(&mon->last, &now);
+		if (gap > mon->max_gap)
+			mon->max_gap = gap;
+	}
+
+	clock_gettime(WD_SAMPLE_CLOCK, &point->time);
+	point->reports = mon->reports;
+	point->mean_interval = mon->mean_interval;
+	point->jitter = mon->jitter;
+	point->max_gap = mon->max_gap;
+	if (mon->max_gap >= WD_LINKMON_STALL_GAP) 
+	{
+		point->alerts |= WD_LINK_ALERT_STALL;
+		if (point->alerts & (WD_LINK_ALERT_NO_RADIO | WD_LINK_ALERT_WEAK))
+			point->alerts |= WD_LINK_ALERT_RANGE;
+		else
+			point->alerts |= WD_LINK_ALERT_BOARD;
+	}
+	mon->reports = 0;
+	mon->max_gap = 0;
+
+	mon->history[mon->head % WD_LINKMON_HISTORY] = *point;
+	mon->head++;
+	if (mon->head - mon->read > WD_LINKMON_HISTORY)
+		mon->read = mon->head - WD_LINKMON_HISTORY;
+
+	if (point->alerts != mon->alerts) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_linkmon: Alerts %.2X, RSSI %d, link quality %d, %u reports, max gap %.0f ms, jitter %.1f ms", 
+		                    point->alerts, point->rssi, point->link_quality, point->reports, point->max_gap, point->jitter);
+	}
+	mon->alerts = point->alerts;
+}
+
+static void *wd_linkmon_thread(struct wd_linkmon *mon)
+{
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_linkmon_thread");
+	struct wd_link_point point;
+	struct timespec wakeup;
+	uint16_t handle;
+	int8_t rssi;
+	uint8_t link_quality;
+	int err;
+
+	pthread_mutex_lock(&mon->mutex);
+	while (mon->running) 
+	{
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += WD_LINKMON_INTERVAL / 1000;
+		wakeup.tv_nsec += (WD_LINKMON_INTERVAL % 1000) * 1000000L;
+		if (wakeup.tv_nsec >= 1000000000L) 
+		{
+			wakeup.tv_sec++;
+			wakeup.tv_nsec -= 1000000000L;
+		}
+		while (mon->running && 
+		       (pthread_cond_timedwait(&mon->cond, &mon->mutex, &wakeup) != ETIMEDOUT));
+		if (!mon->running)
+			break;
+
+		memset(&point, 0, sizeof point);
+		if (!mon->has_handle) 
+		{
+			pthread_mutex_unlock(&mon->mutex);
+			err = wd_hci_conn_handle(mon->hci, &mon->bdaddr, &handle);
+			pthread_mutex_lock(&mon->mutex);
+			if (!err) 
+			{
+				mon->conn_handle = handle;
+				mon->has_handle = 1;
+			}
+		}
+
+		/* The radio is read without the lock, so the router thread is never held up by HCI; 
+		 * a stop between the two commands does not wait for the second */
+		err = !mon->has_handle;
+		handle = mon->conn_handle;
+		if (!err) 
+		{
+			pthread_mutex_unlock(&mon->mutex);
+			err = wd_hci_read_rssi(mon->hci, handle, &rssi, WD_LINKMON_HCI_TIMEOUT);
+			pthread_mutex_lock(&mon->mutex);
+		}
+		if (!err && mon->running) 
+		{
+			pthread_mutex_unlock(&mon->mutex);
+			err = wd_hci_read_link_quality(mon->hci, handle, &link_quality, WD_LINKMON_HCI_TIMEOUT);
+			pthread_mutex_lock(&mon->mutex);
+		}
+		if (!mon->running)
+			break;
+
+		if (err) 
+		{
+			mon->has_handle = 0;
+			point.alerts |= WD_LINK_ALERT_NO_RADIO;
+		}
+		else 
+		{
+			mon->rssi = point.rssi = rssi;
+			mon->link_quality = point.link_quality = link_quality;
+			if ((rssi <= WD_LINKMON_WEAK_RSSI) || (link_quality < WD_LINKMON_WEAK_QUALITY))
+				point.alerts |= WD_LINK_ALERT_WEAK;
+		}
+		wd_linkmon_file(mon, &point);
+	}
+	pthread_mutex_unlock(&mon->mutex);
+
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Finished wd_linkmon_thread");
+	return NULL;
+}
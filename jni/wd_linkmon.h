@@ -0,0 +1,106 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_LINKMON_H
+#define WD_LINKMON_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "bluetooth.h"
+
+struct wd_hci;
+
+/* ms between two readings of the radio */
+#define WD_LINKMON_INTERVAL		1000
+/* ms a reading waits for each of its HCI commands (RSSI, link quality) */
+#define WD_LINKMON_HCI_TIMEOUT	500
+/* Readings kept for Java */
+#define WD_LINKMON_HISTORY		64
+/* ms without a report that make a stall, a continuous board reports every 10 ms or so */
+#define WD_LINKMON_STALL_GAP	200
+/* RSSI (dB off the golden receive power range) and link quality under which the radio is weak */
+#define WD_LINKMON_WEAK_RSSI	-10
+#define WD_LINKMON_WEAK_QUALITY	180
+/* Gain of the running mean interval and jitter, as for RTP (RFC 3550) */
+#define WD_LINKMON_GAIN			(1.0f / 16)
+
+/* Alerts, as a mask */
+#define WD_LINK_ALERT_NO_RADIO	0x01	/* RSSI or link quality could not be read */
+#define WD_LINK_ALERT_WEAK		0x02	/* The radio is weak */
+#define WD_LINK_ALERT_STALL		0x04	/* The stream stalled for WD_LINKMON_STALL_GAP or more */
+#define WD_LINK_ALERT_RANGE		0x08	/* Stall with a weak radio: the phone is too far or shielded */
+#define WD_LINK_ALERT_BOARD		0x10	/* Stall with a good radio: the board stopped sending */
+
+/* A reading, and what the router thread saw since the previous one */
+struct wd_link_point 
+{
+	struct timespec time;			/* WD_SAMPLE_CLOCK, as the samples */
+	uint32_t reports;
+	float mean_interval;			/* ms */
+	float jitter;					/* ms */
+	float max_gap;					/* ms */
+	int8_t rssi;
+	uint8_t link_quality;
+	uint16_t alerts;
+};
+
+/* Layout of a point for Java, in native byte order:
+ *	int64 time (ns), int32 reports, float mean interval, float jitter, float max gap, 
+ *	int8 rssi, uint8 link quality, uint16 alerts */
+#define WD_LINKMON_RECORD_LEN	28
+
+/* Monitors the link to one board. The router thread reports every packet it reads, the monitor 
+ * thread reads the radio at a low rate and files both into a time series. */
+struct wd_linkmon 
+{
+	struct wd_hci *hci;
+	bdaddr_t bdaddr;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+
+	/* Last reading of the radio; the handle is looked up again once a reading fails */
+	int has_handle;
+	uint16_t conn_handle;
+	int8_t rssi;
+	uint8_t link_quality;
+
+	/* From the router thread, since the last reading */
+	struct timespec last;			/* CLOCK_MONOTONIC */
+	uint32_t reports;
+	float mean_interval;
+	float jitter;
+	float max_gap;
+
+	struct wd_link_point history[WD_LINKMON_HISTORY];
+	uint32_t head;					/* Points ever filed */
+	uint32_t read;					/* Next point for Java */
+	uint16_t alerts;				/* Of the last point */
+};
+
+int wd_linkmon_start(struct wd_linkmon *mon, struct wd_hci *hci, const bdaddr_t *bdaddr);
+void wd_linkmon_stop(struct wd_linkmon *mon);
+void wd_linkmon_report(struct wd_linkmon *mon);
+int wd_linkmon_read(struct wd_linkmon *mon, struct wd_link_point *points, int max);
+uint16_t wd_linkmon_alerts(struct wd_linkmon *mon);
+void wd_linkmon_pack(const struct wd_link_point *point, unsigned char *record);
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  The delivery thread pushes the samples to a Java listener. It sleeps on the sample ring while 
+ *  there is nothing to deliver and batches whatever arrives in between, so that the listener is 
+ *  not called more often than the frequency it asked for.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <jni.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_samples.h"
+#include "wd_listener.h"
+
+static void *wd_listener_thread(struct wd_listener *listener);
+
+/* onSamples of the listener interface, the same for every implementation */
+static jmethodID on_samples_id = NULL;
+
+/* Looks the listener method up, once for all listeners. Meant for JNI_OnLoad.
+   Returns:
+	-1 if the interface is not there,
+	 0 otherwise.
+*/
+int wd_listener_cache_ids(JNIEnv *env)
+{
+	jclass cls;
+
+	if ((cls = (*env)->FindClass(env, WD_LISTENER_CLASS)) == NULL) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_listener_cache_ids: No " WD_LISTENER_CLASS " class.");
+		return -1;
+	}
+	on_samples_id = (*env)->GetMethodID(env, cls, WD_LISTENER_METHOD, WD_LISTENER_SIGNATURE);
+	(*env)->DeleteLocalRef(env, cls);
+	return on_samples_id ? 0 : -1;
+}
+
+/* Registers the Java listener obj and starts delivering the samples of ring to it, in batches 
+   written to buffer (a direct buffer of WD_SAMPLE_RECORD_LEN bytes per sample). The listener is 
+   called at most max_frequency times per second, 0 means as soon as the samples arrive.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_listener_start(struct wd_listener *listener, JavaVM *jvm, JNIEnv *env, struct wd_sample_ring *ring, 
+                      jobject obj, jobject buffer, int max_frequency)
+{
+	jclass cls;
+	jlong capacity;
+
+	memset(listener, 0, sizeof *listener);
+	listener->jvm = jvm;
+	listener->ring = ring;
+	listener->wakeups = wd_sample_ring_wakeups(ring);
+
+	listener->records = (*env)->GetDirectBufferAddress(env, buffer);
+	capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+	if (!listener->records || capacity < WD_SAMPLE_RECORD_LEN) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_listener_start: Not a direct buffer, or too small.");
+		return -1;
+	}
+	listener->capacity = capacity / WD_SAMPLE_RECORD_LEN;
+	listener->min_interval = (max_frequency > 0) ? 1000000000L / max_frequency : 0;
+
+	if ((listener->on_samples = on_samples_id) == NULL) 
+	{
+		cls = (*env)->GetObjectClass(env, obj);
+		listener->on_samples = (*env)->GetMethodID(env, cls, WD_LISTENER_METHOD, WD_LISTENER_SIGNATURE);
+		(*env)->DeleteLocalRef(env, cls);
+	}
+	if (!listener->on_samples) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_listener_start: Listener has no onSamples method.");
+		return -1;
+	}
+
+	if ((listener->batch = malloc(listener->capacity * sizeof *listener->batch)) == NULL) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_listener_start: Could not allocate the batch.");
+		return -1;
+	}
+	if (pthread_mutex_init(&listener->mutex, NULL) || pthread_cond_init(&listener->cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_listener_start: Error in initialization of listener mutex.");
+		free(listener->batch);
+		return -1;
+	}
+
+	/* The thread drops the references once it is done with them */
+	listener->listener = (*env)->NewGlobalRef(env, obj);
+	listener->buffer = (*env)->NewGlobalRef(env, buffer);
+	listener->running = 1;
+	if (pthread_create(&listener->thread, NULL, (void *(*)(void *))&wd_listener_thread, listener)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_listener_start: Thread creation error (listener thread)");
+		listener->running = 0;
+		(*env)->DeleteGlobalRef(env, listener->listener);
+		(*env)->DeleteGlobalRef(env, listener->buffer);
+		pthread_cond_destroy(&listener->cond);
+		pthread_mutex_destroy(&listener->mutex);
+		free(listener->batch);
+		return -1;
+	}
+	return 0;
+}
+
+/* Stops the delivery thread and waits for it. A batch being delivered is completed first, so this 
+   must not be called from within the listener.
+*/
+void wd_listener_stop(struct wd_listener *listener)
+{
+	pthread_mutex_lock(&listener->mutex);
+	listener->running = 0;
+	pthread_cond_broadcast(&listener->cond);
+	pthread_mutex_unlock(&listener->mutex);
+	wd_sample_ring_wakeup(listener->ring);
+
+	if (pthread_join(listener->thread, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (listener thread)");
+	}
+	pthread_cond_destroy(&listener->cond);
+	pthread_mutex_destroy(&listener->mutex);
+	free(listener->batch);
+}
+
+static void wd_add_ns(struct timespec *ts, long ns)
+{
+	ts->tv_sec += ns / 1000000000L;
+	ts->tv_nsec += ns % 1000000000L;
+	if (ts->tv_nsec >= 1000000000L) 
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void *wd_listener_thread(struct wd_listener *listener)
+{
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Started wd_listener_thread");
+	JNIEnv *env;
+	struct timespec next;
+	int count, i;
+
+	(*listener->jvm)->AttachCurrentThread(listener->jvm, &env, NULL);
+
+	while (listener->running) 
+	{
+		/* Nothing to do until the router thread calibrates a new sample */
+		if (wd_sample_ring_wait(listener->ring, listener->cursor, &listener->wakeups, NULL) != 1)
+			continue;
+
+		count = wd_sample_ring_read_cursor(listener->ring, &listener->cursor, listener->batch, listener->capacity);
+		if (count <= 0)
+			continue;
+		for (i = 0; i < count; i++) 
+		{
+			wd_sample_pack(&listener->batch[i], listener->records + i * WD_SAMPLE_RECORD_LEN);
+		}
+		(*env)->CallVoidMethod(env, listener->listener, listener->on_samples, listener->buffer, count);
+		if ((*env)->ExceptionCheck(env)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"wd_listener_thread: Exception thrown by the listener");
+			(*env)->ExceptionDescribe(env);
+			(*env)->ExceptionClear(env);
+		}
+
+		/* Let the samples pile up in the ring until the next batch is due */
+		if (listener->min_interval) 
+		{
+			clock_gettime(CLOCK_REALTIME, &next);
+			wd_add_ns(&next, listener->min_interval);
+			pthread_mutex_lock(&listener->mutex);
+			while (listener->running && 
+			       (pthread_cond_timedwait(&listener->cond, &listener->mutex, &next) != ETIMEDOUT));
+			pthread_mutex_unlock(&listener->mutex);
+		}
+	}
+
+	(*env)->DeleteGlobalRef(env, listener->listener);
+	(*env)->DeleteGlobalRef(env, listener->buffer);
+	(*listener->jvm)->DetachCurrentThread(listener->jvm);
+
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG,"Finished wd_listener_thread");
+	return NULL;
+}
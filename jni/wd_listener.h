@@ -0,0 +1,61 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_LISTENER_H
+#define WD_LISTENER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <jni.h>
+
+struct wd_sample_ring;
+struct wd_sample;
+
+/* Java side of a listener: void onSamples(java.nio.ByteBuffer samples, int count) */
+#define WD_LISTENER_CLASS		"iEpi/Scale/BoardInterface$SampleListener"
+#define WD_LISTENER_METHOD		"onSamples"
+#define WD_LISTENER_SIGNATURE	"(Ljava/nio/ByteBuffer;I)V"
+
+/* A Java listener and the thread that delivers the samples to it. The direct buffer is handed 
+ * over by Java once and reused for every batch, the method ID is looked up once when the library 
+ * is loaded (wd_listener_cache_ids). */
+struct wd_listener 
+{
+	JavaVM *jvm;
+	struct wd_sample_ring *ring;
+	jobject listener;				/* Global reference */
+	jobject buffer;					/* Global reference to the direct buffer */
+	jmethodID on_samples;
+	unsigned char *records;
+	int capacity;					/* In samples */
+	long min_interval;				/* ns between two batches, 0 for no limit */
+	uint32_t cursor;
+	uint32_t wakeups;
+	struct wd_sample *batch;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+};
+
+int wd_listener_cache_ids(JNIEnv *env);
+int wd_listener_start(struct wd_listener *listener, JavaVM *jvm, JNIEnv *env, struct wd_sample_ring *ring, 
+                      jobject obj, jobject buffer, int max_frequency);
+void wd_listener_stop(struct wd_listener *listener);
+
+#endif
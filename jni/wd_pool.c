@@ -0,0 +1,256 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Session slots made up front, with parked threads to run the session on. Connecting takes a 
+ *  slot and hands its threads their jobs, disconnecting waits for the jobs and gives it back.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <string.h>
+#include <pthread.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_pool.h"
+
+static void *wd_worker_thread(struct wd_worker *worker);
+
+/* Starts the thread of a worker, parked until it is handed a job.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_worker_start(struct wd_worker *worker)
+{
+	memset(worker, 0, sizeof *worker);
+	if (pthread_mutex_init(&worker->mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_worker_start: Error in initialization of worker mutex.");
+		return -1;
+	}
+	if (pthread_cond_init(&worker->cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_worker_start: Error in initialization of worker condition.");
+		pthread_mutex_destroy(&worker->mutex);
+		return -1;
+	}
+	worker->running = 1;
+	if (pthread_create(&worker->thread, NULL, (void *(*)(void *))&wd_worker_thread, worker)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_worker_start: Thread creation error (worker thread)");
+		worker->running = 0;
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+/* Hands a started worker its job. A job still running is waited for first.
+*/
+void wd_worker_run(struct wd_worker *worker, void *(*job)(void *arg), void *arg)
+{
+	pthread_mutex_lock(&worker->mutex);
+	while (worker->job)
+		pthread_cond_wait(&worker->cond, &worker->mutex);
+	worker->job = job;
+	worker->arg = arg;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+/* Waits for the job of the worker to return. Returns at once if it is parked.
+*/
+void wd_worker_wait(struct wd_worker *worker)
+{
+	pthread_mutex_lock(&worker->mutex);
+	while (worker->job)
+		pthread_cond_wait(&worker->cond, &worker->mutex);
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+/* Ends the thread of the worker once its job has returned, and joins it.
+*/
+void wd_worker_stop(struct wd_worker *worker)
+{
+	if (!worker->running)
+		return;
+	pthread_mutex_lock(&worker->mutex);
+	worker->running = 0;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+	if (pthread_join(worker->thread, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_worker_stop: THREAD JOIN ERROR (worker thread)");
+	}
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->mutex);
+}
+
+static void *wd_worker_thread(struct wd_worker *worker)
+{
+	void *(*job)(void *arg);
+	void *arg;
+
+	pthread_mutex_lock(&worker->mutex);
+	/* A job handed over before the stop is still run */
+	while (worker->running || worker->job) 
+	{
+		if (!worker->job) 
+		{
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+			continue;
+		}
+		job = worker->job;
+		arg = worker->arg;
+		pthread_mutex_unlock(&worker->mutex);
+		job(arg);
+		pthread_mutex_lock(&worker->mutex);
+		worker->job = NULL;
+		pthread_cond_broadcast(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->mutex);
+	return NULL;
+}
+
+/* Makes count slots, each with its workers started and its data made by create. destroy is 
+   called on the data of every slot as the pool goes.
+   Returns:
+	-1 on error, nothing is left behind then,
+	 0 otherwise.
+*/
+int wd_pool_init(struct wd_pool *pool, int count, void *(*create)(struct wd_pool_slot *slot), void (*destroy)(void *data))
+{
+	struct wd_pool_slot *slot;
+	int i;
+
+	memset(pool, 0, sizeof *pool);
+	if (count < 1 || count > WD_POOL_MAX_SLOTS) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_pool_init: Bad slot count %d", count);
+		return -1;
+	}
+	if (pthread_mutex_init(&pool->mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_pool_init: Error in initialization of pool mutex.");
+		return -1;
+	}
+	if (pthread_cond_init(&pool->cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_pool_init: Error in initialization of pool condition.");
+		pthread_mutex_destroy(&pool->mutex);
+		return -1;
+	}
+	pool->destroy = destroy;
+	for (pool->count = 0; pool->count < count; ) 
+	{
+		/* Counted first, so that a half made slot is undone with the others */
+		slot = &pool->slot[pool->count++];
+		for (i = 0; i < WD_POOL_WORKERS; i++) 
+		{
+			if (wd_worker_start(&slot->worker[i]))
+				goto ERR_HND;
+		}
+		if ((slot->data = create(slot)) == NULL)
+			goto ERR_HND;
+	}
+	return 0;
+
+ERR_HND:
+	wd_pool_destroy(pool);
+	return -1;
+}
+
+/* Stops the workers of the pool and destroys the data of its slots. The sessions on the pool must 
+   have been ended by then; a slot still taken is waited for, as a disconnect may be giving it back 
+   meanwhile.
+*/
+void wd_pool_destroy(struct wd_pool *pool)
+{
+	struct wd_pool_slot *slot;
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (slot = pool->slot; slot < pool->slot + pool->count; slot++) 
+	{
+		if (!slot->taken)
+			continue;
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_pool_destroy: Waiting for slot %d to be given back", (int)(slot - pool->slot));
+		while (slot->taken)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (slot = pool->slot; slot < pool->slot + pool->count; slot++) 
+	{
+		for (i = 0; i < WD_POOL_WORKERS; i++) 
+		{
+			wd_worker_stop(&slot->worker[i]);
+		}
+		if (slot->data && pool->destroy)
+			pool->destroy(slot->data);
+		slot->data = NULL;
+	}
+	pool->count = 0;
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+/* Takes a free slot, its workers are parked.
+   Returns:
+	NULL if all the slots are taken,
+	the slot otherwise.
+*/
+struct wd_pool_slot *wd_pool_take(struct wd_pool *pool)
+{
+	struct wd_pool_slot *slot;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (slot = pool->slot; slot < pool->slot + pool->count; slot++) 
+	{
+		if (!slot->taken) 
+		{
+			slot->taken = 1;
+			pthread_mutex_unlock(&pool->mutex);
+			return slot;
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_pool_take: No free slot");
+	return NULL;
+}
+
+/* Gives a slot back once the jobs of its workers have returned.
+*/
+void wd_pool_give(struct wd_pool *pool, struct wd_pool_slot *slot)
+{
+	int i;
+
+	for (i = 0; i < WD_POOL_WORKERS; i++) 
+	{
+		wd_worker_wait(&slot->worker[i]);
+	}
+	pthread_mutex_lock(&pool->mutex);
+	slot->taken = 0;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
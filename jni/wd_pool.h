@@ -0,0 +1,68 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_POOL_H
+#define WD_POOL_H
+
+#include <pthread.h>
+
+#define WD_POOL_MAX_SLOTS	8
+#define WD_POOL_WORKERS		4		/* Threads of a session: router, status, battery, supervisor */
+
+/* A thread parked between jobs. wd_worker_run hands it a job, wd_worker_wait waits for the job 
+ * to return, as pthread_join would for a thread of its own. The thread only ends on 
+ * wd_worker_stop. */
+struct wd_worker 
+{
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;				/* Signalled as a job is handed over and as it returns */
+	void *(*job)(void *arg);			/* NULL while parked */
+	void *arg;
+	int running;
+};
+
+/* What a connection needs besides its sockets, made once and handed from session to session. 
+ * data is made by the create callback of the pool and stays with the slot until the pool goes. */
+struct wd_pool_slot 
+{
+	int taken;
+	void *data;
+	struct wd_worker worker[WD_POOL_WORKERS];
+};
+
+struct wd_pool 
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;				/* Signalled as a slot is given back */
+	int count;
+	void (*destroy)(void *data);
+	struct wd_pool_slot slot[WD_POOL_MAX_SLOTS];
+};
+
+int wd_worker_start(struct wd_worker *worker);
+void wd_worker_run(struct wd_worker *worker, void *(*job)(void *arg), void *arg);
+void wd_worker_wait(struct wd_worker *worker);
+void wd_worker_stop(struct wd_worker *worker);
+
+int wd_pool_init(struct wd_pool *pool, int count, void *(*create)(struct wd_pool_slot *slot), void (*destroy)(void *data));
+void wd_pool_destroy(struct wd_pool *pool);
+struct wd_pool_slot *wd_pool_take(struct wd_pool *pool);
+void wd_pool_give(struct wd_pool *pool, struct wd_pool_slot *slot);
+
+#endif
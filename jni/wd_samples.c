@@ -0,0 +1,903 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  The sample ring sits between the router thread and whoever consumes the weights. Raw corner 
+ *  values are stored as they arrive, so the board can start streaming before its calibration 
+ *  data has been read; those samples are calibrated retroactively once the data lands.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_samples.h"
+#include "wd_shm.h"
+#include "wd_journal.h"
+
+static int wd_sample_ring_wait_on(struct wd_sample_ring *ring, const uint32_t *position, const uint32_t *cursor, 
+                                  uint32_t *wakeups, const struct timespec *deadline);
+
+int wd_sample_ring_init(struct wd_sample_ring *ring)
+{
+	memset(ring, 0, sizeof *ring);
+	ring->gap_fill = WD_GAP_FILL_LINEAR;
+	ring->gap_max_fill = WD_GAP_MAX_FILL;
+	if (pthread_mutex_init(&ring->mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_init: Error in initialization of ring mutex.");
+		return -1;
+	}
+	if (pthread_cond_init(&ring->cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_init: Error in initialization of ring condition.");
+		pthread_mutex_destroy(&ring->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+/* Releases the threads waiting on the ring, which return -1 from then on, and waits for them 
+   and for the consumers holding the ring to leave. Called before the ring is destroyed.
+*/
+void wd_sample_ring_close(struct wd_sample_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->closed = 1;
+	pthread_cond_broadcast(&ring->cond);
+	if (ring->shm)
+		wd_shm_close(ring->shm);
+	while (ring->waiters || ring->readers) 
+	{
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	}
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Holds the ring for a consumer that works on it outside of wd_sample_ring_wait (reading, say), 
+   so that it is not closed under it. Every successful call is matched by wd_sample_ring_release.
+   Returns:
+	-1 if the ring has been closed,
+	 0 otherwise.
+*/
+int wd_sample_ring_acquire(struct wd_sample_ring *ring)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&ring->mutex);
+	if (!ring->closed) 
+	{
+		ring->readers++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+	return ret;
+}
+
+void wd_sample_ring_release(struct wd_sample_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->readers--;
+	/* wd_sample_ring_close may be waiting for the last one to leave */
+	if (ring->closed)
+		pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Returns the wakeups count a consumer starts waiting with, see wd_sample_ring_wait.
+*/
+uint32_t wd_sample_ring_wakeups(struct wd_sample_ring *ring)
+{
+	uint32_t wakeups;
+
+	pthread_mutex_lock(&ring->mutex);
+	wakeups = ring->wakeups;
+	pthread_mutex_unlock(&ring->mutex);
+	return wakeups;
+}
+
+void wd_sample_ring_destroy(struct wd_sample_ring *ring)
+{
+	if (ring->shm) 
+	{
+		wd_shm_destroy(ring->shm);
+		free(ring->shm);
+	}
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->mutex);
+}
+
+/* Converts a raw corner value to KG, interpolating between the three calibration points 
+   (0, 17 and 34 KG) of the corner.
+*/
+float wd_calibrate_corner(uint16_t raw, const uint16_t *cal)
+{
+	if (raw < cal[1]) 
+	{
+		return WD_CAL_WEIGHT_1 * ((float)raw - (float)cal[0]) / ((float)cal[1] - (float)cal[0]);
+	}
+	return WD_CAL_WEIGHT_1 + 
+	       (WD_CAL_WEIGHT_2 - WD_CAL_WEIGHT_1) * ((float)raw - (float)cal[1]) / ((float)cal[2] - (float)cal[1]);
+}
+
+/* Learns and tracks the zero offsets of the corners from the calibrated, untared sample (see 
+   WD_TARE_*), then takes them off the sample.
+   Must be called with the ring mutex held.
+*/
+static void wd_sample_tare(struct wd_sample_ring *ring, struct wd_sample *sample)
+{
+	float alpha;
+	int64_t elapsed;
+	int i;
+
+	/* Against the factory zero, so that an offset yet to be learned cannot keep the board loaded */
+	if ((sample->total >= WD_TARE_MAX_WEIGHT) || (sample->flags & WD_SAMPLE_GAP) || !ring->tare_count || 
+	    (sample->total - ring->tare_ref > WD_TARE_TOLERANCE) || (ring->tare_ref - sample->total > WD_TARE_TOLERANCE)) 
+	{
+		/* Loaded or moving, start over */
+		ring->tare_start = sample->timestamp;
+		ring->tare_ref = sample->total;
+		ring->tare_count = (sample->total < WD_TARE_MAX_WEIGHT) ? 1 : 0;
+		memcpy(ring->tare_sum, sample->weight, sizeof ring->tare_sum);
+	}
+	else 
+	{
+		ring->tare_count++;
+		for (i = 0; i < WD_CORNER_COUNT; i++) 
+			ring->tare_sum[i] += sample->weight[i];
+
+		elapsed = (int64_t)(sample->timestamp.tv_sec - ring->tare_start.tv_sec) * 1000 + 
+		          (sample->timestamp.tv_nsec - ring->tare_start.tv_nsec) / 1000000;
+		if (elapsed >= WD_TARE_WINDOW) 
+		{
+			if (!ring->has_tare) 
+			{
+				for (i = 0; i < WD_CORNER_COUNT; i++) 
+					ring->tare[i] = ring->tare_sum[i] / ring->tare_count;
+				ring->has_tare = 1;
+			}
+			else 
+			{
+				/* Exponential smoothing over time: alpha = dt / (tau + dt) */
+				elapsed = (int64_t)(sample->timestamp.tv_sec - ring->tare_last.tv_sec) * 1000 + 
+				          (sample->timestamp.tv_nsec - ring->tare_last.tv_nsec) / 1000000;
+				if (elapsed > 0) 
+				{
+					alpha = (float)elapsed / (float)(WD_TARE_TIME_CONSTANT + elapsed);
+					for (i = 0; i < WD_CORNER_COUNT; i++) 
+						ring->tare[i] += alpha * (sample->weight[i] - ring->tare[i]);
+				}
+			}
+		}
+	}
+	ring->tare_last = sample->timestamp;
+
+	if (ring->has_tare) 
+	{
+		sample->total = 0;
+		for (i = 0; i < WD_CORNER_COUNT; i++) 
+		{
+			sample->weight[i] -= ring->tare[i];
+			sample->total += sample->weight[i];
+		}
+		sample->flags |= WD_SAMPLE_TARED;
+	}
+}
+
+/* Runs the calibrated sample through the filter chain of the session, if any.
+   Must be called with the ring mutex held.
+*/
+static void wd_sample_filter(struct wd_sample_ring *ring, struct wd_sample *sample)
+{
+	float values[WD_FILTER_CHANNELS];
+
+	if (!ring->filters.count)
+		return;
+	if (sample->flags & WD_SAMPLE_GAP) 
+	{
+		/* What came before the gap says nothing about what comes after */
+		wd_filter_chain_reset(&ring->filters);
+	}
+	memcpy(values, sample->weight, sizeof sample->weight);
+	values[WD_FILTER_TOTAL] = sample->total;
+	if (wd_filter_chain_apply(&ring->filters, values))
+		sample->flags |= WD_SAMPLE_OUTLIER;
+	memcpy(sample->weight, values, sizeof sample->weight);
+	sample->total = values[WD_FILTER_TOTAL];
+	sample->flags |= WD_SAMPLE_FILTERED;
+}
+
+/* Adds the sample to the current block of the tap, emitting the block first if the sample is 
+   past its end.
+*/
+static void wd_tap_feed(struct wd_tap *tap, const struct wd_sample *sample)
+{
+	struct wd_sample *out;
+	int i;
+
+	if (tap->count && ((sample->flags & WD_SAMPLE_GAP) || 
+	    (sample->timestamp.tv_sec > tap->block_end.tv_sec) || 
+	     ((sample->timestamp.tv_sec == tap->block_end.tv_sec) && (sample->timestamp.tv_nsec >= tap->block_end.tv_nsec)))) 
+	{
+		out = &tap->samples[tap->head & WD_TAP_MASK];
+		out->seq = tap->head;
+		out->flags = tap->flags;
+		out->timestamp = tap->last;
+		out->total = tap->total / tap->count;
+		for (i = 0; i < WD_CORNER_COUNT; i++) 
+		{
+			out->weight[i] = tap->weight[i] / tap->count;
+			out->raw[i] = tap->raw[i] / tap->count;
+		}
+		tap->head++;
+
+		/* Blocks follow each other unless the stream has stopped for longer than a block */
+		tap->block_end.tv_nsec += tap->period;
+		tap->block_end.tv_sec += tap->block_end.tv_nsec / 1000000000L;
+		tap->block_end.tv_nsec %= 1000000000L;
+		if ((sample->flags & WD_SAMPLE_GAP) || (sample->timestamp.tv_sec > tap->block_end.tv_sec) || 
+		    ((sample->timestamp.tv_sec == tap->block_end.tv_sec) && (sample->timestamp.tv_nsec >= tap->block_end.tv_nsec)))
+			tap->count = 0;
+		else
+			tap->count = -1;
+	}
+	if (tap->count <= 0) 
+	{
+		if (tap->count == 0) 
+		{
+			tap->block_end.tv_sec = sample->timestamp.tv_sec + (sample->timestamp.tv_nsec + tap->period) / 1000000000L;
+			tap->block_end.tv_nsec = (sample->timestamp.tv_nsec + tap->period) % 1000000000L;
+		}
+		tap->count = 0;
+		tap->flags = 0;
+		tap->total = 0;
+		memset(tap->weight, 0, sizeof tap->weight);
+		memset(tap->raw, 0, sizeof tap->raw);
+	}
+
+	tap->count++;
+	tap->flags |= sample->flags;
+	tap->total += sample->total;
+	for (i = 0; i < WD_CORNER_COUNT; i++) 
+	{
+		tap->weight[i] += sample->weight[i];
+		tap->raw[i] += sample->raw[i];
+	}
+	tap->last = sample->timestamp;
+}
+
+/* Must be called with the ring mutex held */
+static void wd_sample_calibrate(struct wd_sample_ring *ring, struct wd_sample *sample)
+{
+	int i;
+
+	sample->total = 0;
+	for (i = 0; i < WD_CORNER_COUNT; i++) 
+	{
+		sample->weight[i] = wd_calibrate_corner(sample->raw[i], ring->cal[i]);
+		sample->total += sample->weight[i];
+	}
+	sample->flags &= ~(WD_SAMPLE_TARED | WD_SAMPLE_FILTERED | WD_SAMPLE_OUTLIER);
+	sample->flags |= WD_SAMPLE_CALIBRATED;
+	wd_sample_tare(ring, sample);
+	wd_sample_filter(ring, sample);
+
+	/* Samples calibrated again after a calibration change have been fed already */
+	if ((int32_t)(sample->seq - ring->tapped) >= 0) 
+	{
+		for (i = 0; i < WD_MAX_TAPS; i++) 
+		{
+			if (ring->taps[i].period)
+				wd_tap_feed(&ring->taps[i], sample);
+		}
+		if (ring->shm || ring->journal) 
+		{
+			unsigned char record[WD_SAMPLE_RECORD_LEN];
+
+			wd_sample_pack(sample, record);
+			if (ring->shm)
+				wd_shm_publish(ring->shm, record);
+			if (ring->journal)
+				wd_journal_append(ring->journal, record);
+		}
+		ring->tapped = sample->seq + 1;
+	}
+}
+
+static int64_t wd_sample_interval(const struct timespec *from, const struct timespec *to)
+{
+	return (int64_t)(to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+}
+
+/* Counts a gap of duration ns.
+   Must be called with the ring mutex held.
+*/
+static void wd_sample_count_gap(struct wd_sample_ring *ring, int64_t duration, int filled)
+{
+	ring->gaps++;
+	if (filled)
+		ring->filled_gaps++;
+	ring->gap_time += duration;
+	if (duration > ring->longest_gap)
+		ring->longest_gap = duration;
+}
+
+/* Stores a sample at head, calibrating it if the calibration data is known already.
+   Must be called with the ring mutex held.
+*/
+static void wd_sample_store(struct wd_sample_ring *ring, const uint16_t *raw, const struct timespec *timestamp, uint16_t flags)
+{
+	struct wd_sample *sample;
+
+	sample = &ring->samples[ring->head & WD_SAMPLE_RING_MASK];
+	sample->seq = ring->head;
+	sample->flags = ring->next_flags | flags;
+	ring->next_flags = 0;
+	memcpy(sample->raw, raw, sizeof sample->raw);
+	sample->timestamp = *timestamp;
+	if ((sample->flags & WD_SAMPLE_GAP) && ring->head) 
+	{
+		wd_sample_count_gap(ring, wd_sample_interval(&ring->samples[(ring->head - 1) & WD_SAMPLE_RING_MASK].timestamp, timestamp), 0);
+	}
+	if (ring->has_cal) 
+	{
+		wd_sample_calibrate(ring, sample);
+	}
+	ring->head++;
+}
+
+/* Stores a new set of raw corner values (WD_CORNER_* order). The sample is calibrated right 
+   away if the calibration data is known already.
+*/
+int wd_sample_ring_push(struct wd_sample_ring *ring, const uint16_t *raw, const struct timespec *timestamp)
+{
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_push: Mutex lock error (ring mutex)");
+		return -1;
+	}
+
+	wd_sample_store(ring, raw, timestamp, 0);
+
+	if (ring->has_cal) 
+	{
+		ring->calibrated = ring->head;
+		pthread_cond_broadcast(&ring->cond);
+		if (ring->shm)
+			wd_shm_notify(ring->shm);
+	}
+	else if (ring->head - ring->calibrated > WD_SAMPLE_RING_LEN) 
+	{
+		/* Calibration is taking far longer than it should, the oldest raw samples are lost */
+		ring->dropped += ring->head - ring->calibrated - WD_SAMPLE_RING_LEN;
+		ring->calibrated = ring->head - WD_SAMPLE_RING_LEN;
+	}
+
+	pthread_mutex_unlock(&ring->mutex);
+	return 0;
+}
+
+/* Value of a corner at s (0 to 1) between p1 and p2, n + 1 steps apart. The cubic follows the 
+   slope p0 to p1 out of p1, and arrives at p2 along the chord.
+*/
+static uint16_t wd_sample_interpolate(int mode, const uint16_t *p0, uint16_t p1, uint16_t p2, int n, float s)
+{
+	float m1, m2, v;
+
+	if ((mode == WD_GAP_FILL_CUBIC) && p0) 
+	{
+		m1 = ((float)p1 - *p0) * (n + 1);
+		m2 = (float)p2 - p1;
+		v = (2 * s * s * s - 3 * s * s + 1) * p1 + (s * s * s - 2 * s * s + s) * m1 + 
+		    (-2 * s * s * s + 3 * s * s) * p2 + (s * s * s - s * s) * m2;
+	}
+	else
+		v = p1 + ((float)p2 - p1) * s;
+	if (v < 0)
+		return 0;
+	if (v > 65535)
+		return 65535;
+	return (uint16_t)(v + 0.5f);
+}
+
+/* Called before the sample (raw, timestamp) is pushed, when missed reports have been lost 
+   right before it. Bridges the gap with missed synthetic samples, evenly spaced in between, if 
+   it is short enough (see WD_GAP_*); otherwise flags the sample as the first one after a gap.
+   Returns:
+	-1 on error,
+	the number of synthetic samples stored otherwise.
+*/
+int wd_sample_ring_bridge(struct wd_sample_ring *ring, const uint16_t *raw, const struct timespec *timestamp, int missed)
+{
+	const struct wd_sample *prev, *prev2 = NULL;
+	uint16_t values[WD_CORNER_COUNT];
+	struct timespec at;
+	int64_t duration, t;
+	int i, k, count = 0;
+
+	if (missed <= 0)
+		return 0;
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_bridge: Mutex lock error (ring mutex)");
+		return -1;
+	}
+
+	/* Nothing to bridge from, or the gap is open already */
+	if (!ring->head || (ring->next_flags & WD_SAMPLE_GAP)) 
+	{
+		pthread_mutex_unlock(&ring->mutex);
+		return 0;
+	}
+
+	prev = &ring->samples[(ring->head - 1) & WD_SAMPLE_RING_MASK];
+	duration = wd_sample_interval(&prev->timestamp, timestamp);
+	if ((ring->gap_fill == WD_GAP_FILL_NONE) || (duration <= 0) || 
+	    (duration > (int64_t)ring->gap_max_fill * 1000000LL) || (missed >= WD_SAMPLE_RING_LEN / 2)) 
+	{
+		ring->next_flags |= WD_SAMPLE_GAP;
+		pthread_mutex_unlock(&ring->mutex);
+		return 0;
+	}
+
+	if ((ring->head > 1) && !(prev->flags & WD_SAMPLE_GAP))
+		prev2 = &ring->samples[(ring->head - 2) & WD_SAMPLE_RING_MASK];
+	wd_sample_count_gap(ring, duration, 1);
+	/* prev and prev2 stay in place, the ring is far from going round */
+	for (i = 1; i <= missed; i++) 
+	{
+		for (k = 0; k < WD_CORNER_COUNT; k++) 
+		{
+			values[k] = wd_sample_interpolate(ring->gap_fill, prev2 ? &prev2->raw[k] : NULL, prev->raw[k], raw[k], 
+			                                  missed, (float)i / (missed + 1));
+		}
+		t = prev->timestamp.tv_nsec + duration * i / (missed + 1);
+		at.tv_sec = prev->timestamp.tv_sec + t / 1000000000LL;
+		at.tv_nsec = t % 1000000000LL;
+		wd_sample_store(ring, values, &at, WD_SAMPLE_SYNTHETIC);
+		count++;
+	}
+	ring->synthetic += count;
+	if (ring->has_cal) 
+	{
+		ring->calibrated = ring->head;
+		pthread_cond_broadcast(&ring->cond);
+		if (ring->shm)
+			wd_shm_notify(ring->shm);
+	}
+
+	pthread_mutex_unlock(&ring->mutex);
+	return count;
+}
+
+/* Sets how gaps are bridged (WD_GAP_FILL_*) and the longest gap, in milliseconds, that is.
+   Returns:
+	-1 if the mode is not valid,
+	 0 otherwise.
+*/
+int wd_sample_ring_set_gap_fill(struct wd_sample_ring *ring, int mode, int max_fill)
+{
+	if ((mode < WD_GAP_FILL_NONE) || (mode > WD_GAP_FILL_CUBIC) || (max_fill < 0))
+		return -1;
+	pthread_mutex_lock(&ring->mutex);
+	ring->gap_fill = mode;
+	ring->gap_max_fill = max_fill;
+	pthread_mutex_unlock(&ring->mutex);
+	return 0;
+}
+
+/* Gives a new reader access to the calibrated samples from other processes, through the shared 
+   ring (see wd_shm.h), which is set up on the first call. shm_fd and event_fd belong to the ring, 
+   the caller hands copies of them to the reader.
+   Returns:
+	-1 on error,
+	the index of the reader in the shared ring otherwise.
+*/
+int wd_sample_ring_share(struct wd_sample_ring *ring, int *shm_fd, int *event_fd)
+{
+	int reader = -1;
+
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_share: Mutex lock error (ring mutex)");
+		return -1;
+	}
+	if (!ring->shm && !ring->closed) 
+	{
+		if ((ring->shm = malloc(sizeof *ring->shm)) && wd_shm_create(ring->shm)) 
+		{
+			free(ring->shm);
+			ring->shm = NULL;
+		}
+	}
+	if (ring->shm && !ring->closed) 
+	{
+		reader = wd_shm_add_reader(ring->shm, event_fd);
+		*shm_fd = ring->shm->reader_fd;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+	return reader;
+}
+
+/* Frees the slot of a reader that has gone away.
+*/
+void wd_sample_ring_unshare(struct wd_sample_ring *ring, int reader)
+{
+	pthread_mutex_lock(&ring->mutex);
+	if (ring->shm)
+		wd_shm_remove_reader(ring->shm, reader);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Starts (or with NULL, stops) writing the calibrated samples to journal. Once this returns 
+   the ring does not touch the previous journal any more.
+*/
+void wd_sample_ring_set_journal(struct wd_sample_ring *ring, struct wd_journal *journal)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->journal = journal;
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Sets the calibration data and calibrates every raw sample buffered so far, which makes them 
+   visible to the consumers.
+*/
+int wd_sample_ring_set_calibration(struct wd_sample_ring *ring, const struct balance_cal *balance_cal)
+{
+	uint32_t seq;
+	int i;
+
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_set_calibration: Mutex lock error (ring mutex)");
+		return -1;
+	}
+
+	for (i = 0; i < 3; i++) 
+	{
+		ring->cal[WD_CORNER_RIGHT_TOP][i]    = balance_cal->right_top[i];
+		ring->cal[WD_CORNER_RIGHT_BOTTOM][i] = balance_cal->right_bottom[i];
+		ring->cal[WD_CORNER_LEFT_TOP][i]     = balance_cal->left_top[i];
+		ring->cal[WD_CORNER_LEFT_BOTTOM][i]  = balance_cal->left_bottom[i];
+	}
+
+	/* A new calibration (e.g. the cached one was stale) applies to what has been buffered too, 
+	 * and the offsets learned with the old one are worthless */
+	ring->has_tare = 0;
+	ring->tare_count = 0;
+	wd_filter_chain_reset(&ring->filters);
+	seq = ring->has_cal ? ring->read : ring->calibrated;
+	if (ring->head - seq > WD_SAMPLE_RING_LEN)
+		seq = ring->head - WD_SAMPLE_RING_LEN;
+	for (; seq != ring->head; seq++) 
+	{
+		wd_sample_calibrate(ring, &ring->samples[seq & WD_SAMPLE_RING_MASK]);
+	}
+	ring->has_cal = 1;
+	ring->calibrated = ring->head;
+	pthread_cond_broadcast(&ring->cond);
+	if (ring->shm)
+		wd_shm_notify(ring->shm);
+
+	pthread_mutex_unlock(&ring->mutex);
+	return 0;
+}
+
+/* Copies up to max calibrated samples that have not been read by the consumer owning cursor, 
+   and moves the cursor past them. A new consumer starts with a zero cursor, i.e. with the oldest 
+   sample still in the ring. If the consumer has fallen more than a ring behind, it continues with 
+   the oldest sample still in the ring.
+   Must be called with the ring mutex held.
+*/
+static int wd_sample_ring_copy(struct wd_sample_ring *ring, uint32_t *cursor, struct wd_sample *samples, int max)
+{
+	int count = 0;
+
+	if (ring->calibrated - *cursor > WD_SAMPLE_RING_LEN) 
+	{
+		*cursor = ring->calibrated - WD_SAMPLE_RING_LEN;
+	}
+	while ((count < max) && (*cursor != ring->calibrated)) 
+	{
+		samples[count++] = ring->samples[*cursor & WD_SAMPLE_RING_MASK];
+		(*cursor)++;
+	}
+	return count;
+}
+
+/* Copies up to max calibrated samples that have not been read yet by readSamples. Samples it 
+   has missed by falling more than a ring behind are counted in dropped.
+   Returns:
+	-1 on error,
+	the number of samples copied otherwise.
+*/
+int wd_sample_ring_read(struct wd_sample_ring *ring, struct wd_sample *samples, int max)
+{
+	int count;
+
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_read: Mutex lock error (ring mutex)");
+		return -1;
+	}
+
+	if (ring->calibrated - ring->read > WD_SAMPLE_RING_LEN) 
+	{
+		ring->dropped += ring->calibrated - ring->read - WD_SAMPLE_RING_LEN;
+	}
+	count = wd_sample_ring_copy(ring, &ring->read, samples, max);
+
+	pthread_mutex_unlock(&ring->mutex);
+	return count;
+}
+
+/* Same as wd_sample_ring_read, for a consumer which keeps its own cursor.
+*/
+int wd_sample_ring_read_cursor(struct wd_sample_ring *ring, uint32_t *cursor, struct wd_sample *samples, int max)
+{
+	int count;
+
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_read_cursor: Mutex lock error (ring mutex)");
+		return -1;
+	}
+	count = wd_sample_ring_copy(ring, cursor, samples, max);
+	pthread_mutex_unlock(&ring->mutex);
+	return count;
+}
+
+/* Blocks until there is a calibrated sample past cursor, the (CLOCK_REALTIME) deadline passes or 
+   wd_sample_ring_wakeup has been called since the consumer last saw the wakeups count. The count 
+   is updated, so a wakeup that comes in between two waits is not lost. A NULL deadline waits 
+   forever.
+   Returns:
+	-1 on error or if the ring has been closed,
+	 0 on timeout or wakeup,
+	 1 if there are samples to read.
+*/
+int wd_sample_ring_wait(struct wd_sample_ring *ring, uint32_t cursor, uint32_t *wakeups, const struct timespec *deadline)
+{
+	return wd_sample_ring_wait_on(ring, &ring->calibrated, &cursor, wakeups, deadline);
+}
+
+/* Same as wd_sample_ring_wait, for the samples not read yet by wd_sample_ring_read.
+*/
+int wd_sample_ring_wait_unread(struct wd_sample_ring *ring, uint32_t *wakeups, const struct timespec *deadline)
+{
+	return wd_sample_ring_wait_on(ring, &ring->calibrated, &ring->read, wakeups, deadline);
+}
+
+/* Same as wd_sample_ring_wait, for the samples of a tap not read yet.
+*/
+int wd_sample_ring_wait_tap(struct wd_sample_ring *ring, int tap, uint32_t *wakeups, const struct timespec *deadline)
+{
+	if ((tap < 0) || (tap >= WD_MAX_TAPS))
+		return -1;
+	return wd_sample_ring_wait_on(ring, &ring->taps[tap].head, &ring->taps[tap].read, wakeups, deadline);
+}
+
+/* Waits until *position moves away from *cursor, see wd_sample_ring_wait. Both are looked at 
+   with the ring mutex held only, any reader may move the cursor meanwhile.
+*/
+static int wd_sample_ring_wait_on(struct wd_sample_ring *ring, const uint32_t *position, const uint32_t *cursor, 
+                                  uint32_t *wakeups, const struct timespec *deadline)
+{
+	int ret = 0;
+
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_wait: Mutex lock error (ring mutex)");
+		return -1;
+	}
+	ring->waiters++;
+	while (!ring->closed && (*position == *cursor) && (ring->wakeups == *wakeups) && (ret == 0)) 
+	{
+		if (deadline)
+			ret = pthread_cond_timedwait(&ring->cond, &ring->mutex, deadline);
+		else
+			ret = pthread_cond_wait(&ring->cond, &ring->mutex);
+	}
+	ring->waiters--;
+	*wakeups = ring->wakeups;
+	if (ring->closed) 
+	{
+		/* wd_sample_ring_close is waiting for the last one to leave */
+		pthread_cond_broadcast(&ring->cond);
+		ret = -1;
+	}
+	else 
+	{
+		ret = (*position != *cursor) ? 1 : 0;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+	return ret;
+}
+
+/* Returns a cursor for a consumer which is only interested in the samples to come.
+*/
+uint32_t wd_sample_ring_cursor(struct wd_sample_ring *ring)
+{
+	uint32_t cursor;
+
+	pthread_mutex_lock(&ring->mutex);
+	cursor = ring->calibrated;
+	pthread_mutex_unlock(&ring->mutex);
+	return cursor;
+}
+
+/* Releases every thread blocked in wd_sample_ring_wait, e.g. when a consumer is being stopped.
+*/
+void wd_sample_ring_wakeup(struct wd_sample_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->wakeups++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Flags the next sample as the first one after a gap in the stream.
+*/
+void wd_sample_ring_mark_gap(struct wd_sample_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->next_flags |= WD_SAMPLE_GAP;
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Replaces the filter chain of the session (see wd_filter.h). It applies to the samples 
+   calibrated from now on.
+   Returns:
+	-1 if the chain is not valid,
+	 0 otherwise.
+*/
+int wd_sample_ring_set_filters(struct wd_sample_ring *ring, const int *types, const float *params, int count)
+{
+	int ret;
+
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_set_filters: Mutex lock error (ring mutex)");
+		return -1;
+	}
+	ret = wd_filter_chain_set(&ring->filters, types, params, count);
+	pthread_mutex_unlock(&ring->mutex);
+	return ret;
+}
+
+/* Adds a tap emitting frequency samples per second (see struct wd_tap), fed with the samples 
+   calibrated from now on.
+   Returns:
+	-1 if the frequency is not valid or all the taps are in use,
+	the index of the tap otherwise.
+*/
+int wd_sample_ring_add_tap(struct wd_sample_ring *ring, int frequency)
+{
+	int i;
+
+	if (frequency <= 0)
+		return -1;
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_add_tap: Mutex lock error (ring mutex)");
+		return -1;
+	}
+	for (i = 0; (i < WD_MAX_TAPS) && ring->taps[i].period; i++);
+	if (i < WD_MAX_TAPS) 
+	{
+		memset(&ring->taps[i], 0, sizeof ring->taps[i]);
+		ring->taps[i].period = 1000000000L / frequency;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+	return (i < WD_MAX_TAPS) ? i : -1;
+}
+
+/* Copies up to max samples of the tap that have not been read yet. A reader that has fallen 
+   more than WD_TAP_LEN samples behind continues with the oldest one still there.
+   Returns:
+	-1 on error,
+	the number of samples copied otherwise.
+*/
+int wd_sample_ring_read_tap(struct wd_sample_ring *ring, int tap, struct wd_sample *samples, int max)
+{
+	struct wd_tap *t;
+	int count = 0;
+
+	if ((tap < 0) || (tap >= WD_MAX_TAPS))
+		return -1;
+	if (pthread_mutex_lock(&ring->mutex)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_sample_ring_read_tap: Mutex lock error (ring mutex)");
+		return -1;
+	}
+	t = &ring->taps[tap];
+	if (!t->period) 
+	{
+		pthread_mutex_unlock(&ring->mutex);
+		return -1;
+	}
+	if (t->head - t->read > WD_TAP_LEN)
+		t->read = t->head - WD_TAP_LEN;
+	while ((count < max) && (t->read != t->head)) 
+	{
+		samples[count++] = t->samples[t->read & WD_TAP_MASK];
+		t->read++;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+	return count;
+}
+
+/* Writes the sample in the WD_SAMPLE_RECORD_LEN bytes record layout described in wd_samples.h
+*/
+void wd_sample_pack(const struct wd_sample *sample, unsigned char *record)
+{
+	int64_t timestamp = (int64_t)sample->timestamp.tv_sec * 1000000000LL + sample->timestamp.tv_nsec;
+	int32_t seq = sample->seq;
+	int32_t flags = sample->flags;
+
+	memcpy(record, &timestamp, 8);
+	memcpy(record + 8, &seq, 4);
+	memcpy(record + 12, &flags, 4);
+	memcpy(record + 16, &sample->total, 4);
+	memcpy(record + 20, sample->weight, 4 * WD_CORNER_COUNT);
+	memcpy(record + 36, sample->raw, 2 * WD_CORNER_COUNT);
+}
+
+void wd_stability_reset(struct wd_stability *stability)
+{
+	memset(stability, 0, sizeof *stability);
+}
+
+/* Adds a sample to the current window of steady weights. The window starts over with the sample 
+   if the total goes out of WD_STABLE_TOLERANCE, or if the sample comes after a gap.
+   Returns:
+	1 if the window spans WD_STABLE_WINDOW milliseconds, weight is then the mean of the window,
+	0 otherwise.
+*/
+int wd_stability_feed(struct wd_stability *stability, const struct wd_sample *sample, float *weight)
+{
+	float min = sample->total < stability->min ? sample->total : stability->min;
+	float max = sample->total > stability->max ? sample->total : stability->max;
+	int64_t elapsed;
+
+	if (!stability->count || (sample->flags & WD_SAMPLE_GAP) || (max - min > WD_STABLE_TOLERANCE)) 
+	{
+		stability->start = sample->timestamp;
+		stability->min = stability->max = stability->sum = sample->total;
+		stability->count = 1;
+		return 0;
+	}
+	stability->min = min;
+	stability->max = max;
+	stability->sum += sample->total;
+	stability->count++;
+
+	elapsed = (int64_t)(sample->timestamp.tv_sec - stability->start.tv_sec) * 1000 + 
+	          (sample->timestamp.tv_nsec - stability->start.tv_nsec) / 1000000;
+	if (elapsed < WD_STABLE_WINDOW)
+		return 0;
+	*weight = stability->sum / stability->count;
+	return 1;
+}
@@ -0,0 +1,211 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_SAMPLES_H
+#define WD_SAMPLES_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wd_filter.h"
+
+/* Sample ring length, must be a power of two. A few seconds at the report rate of the board, 
+ * which is far more than a calibration read takes. */
+#define WD_SAMPLE_RING_LEN		1024
+#define WD_SAMPLE_RING_MASK		(WD_SAMPLE_RING_LEN - 1)
+
+/* Calibration points of each corner sensor, in KG */
+#define WD_CAL_WEIGHT_1			17.0f
+#define WD_CAL_WEIGHT_2			34.0f
+
+/* Clock of the sample timestamps, which is the timeline every board is put on. See wd_clock.h 
+ * for the mapping to the wall clock. */
+#define WD_SAMPLE_CLOCK			CLOCK_MONOTONIC
+
+/* Corner indices, same order as the report of the board */
+#define WD_CORNER_RIGHT_TOP		0
+#define WD_CORNER_RIGHT_BOTTOM	1
+#define WD_CORNER_LEFT_TOP		2
+#define WD_CORNER_LEFT_BOTTOM	3
+#define WD_CORNER_COUNT			4
+
+/* Sample flags */
+#define WD_SAMPLE_CALIBRATED	0x0001
+#define WD_SAMPLE_GAP			0x0002	/* First sample after the link has been down */
+#define WD_SAMPLE_TARED			0x0004	/* Zero drift of the corners has been taken off */
+#define WD_SAMPLE_FILTERED		0x0008	/* Went through the filter chain */
+#define WD_SAMPLE_OUTLIER		0x0010	/* A value has been rejected by the filter chain */
+#define WD_SAMPLE_SYNTHETIC		0x0020	/* Interpolated over a short gap, the report was lost */
+
+/* Gaps. Reports lost on the way are told by the time base (see wd_clock.h). A gap of up to 
+ * WD_GAP_MAX_FILL milliseconds is bridged with synthetic samples, interpolated between the 
+ * samples either side of it; a longer one is left open and the sample after it is flagged 
+ * WD_SAMPLE_GAP, which starts the windowed computations (tare, filters, taps, stability) over. */
+#define WD_GAP_FILL_NONE		0
+#define WD_GAP_FILL_LINEAR		1
+#define WD_GAP_FILL_CUBIC		2		/* Hermite, with the slope before the gap */
+#define WD_GAP_MAX_FILL			50
+
+/* Tare. The board is taken as unloaded while the untared total, against the factory zero of the 
+ * calibration, is below WD_TARE_MAX_WEIGHT KG: less than anyone standing on it. Once the untared 
+ * total has stayed within WD_TARE_TOLERANCE KG for WD_TARE_WINDOW milliseconds on an unloaded 
+ * board, the mean corner weights of the window become the zero offsets; from then on the offsets 
+ * follow slow drift through a low-pass filter with a time constant of WD_TARE_TIME_CONSTANT 
+ * milliseconds, as long as the board stays unloaded and steady. The filter goes by the time 
+ * between samples, not their count, so gaps and rate changes do not speed it up. A light load 
+ * left still on the board for the window (a bag, say) is zeroed like drift; a person never is, 
+ * and nobody stands still enough to stay within the tolerance for long. */
+#define WD_TARE_MAX_WEIGHT		5.0f
+#define WD_TARE_TOLERANCE		0.2f
+#define WD_TARE_WINDOW			2000
+#define WD_TARE_TIME_CONSTANT	(5 * 60 * 1000)
+
+/* A weight is stable once the total has stayed within WD_STABLE_TOLERANCE KG for 
+ * WD_STABLE_WINDOW milliseconds */
+#define WD_STABLE_WINDOW		1000
+#define WD_STABLE_TOLERANCE		0.5f
+
+/* Layout of a sample handed to Java (native byte order):
+ *	 0	int64	timestamp (ns)
+ *	 8	int32	sequence number
+ *	12	int32	flags
+ *	16	float	total weight (KG)
+ *	20	float	corner weights (KG), WD_CORNER_* order
+ *	36	uint16	raw corner values, WD_CORNER_* order
+ */
+#define WD_SAMPLE_RECORD_LEN	44
+
+struct balance_cal;
+struct wd_shm_ring;
+struct wd_journal;
+
+struct wd_sample 
+{
+	uint32_t seq;
+	uint16_t flags;
+	uint16_t raw[WD_CORNER_COUNT];
+	struct timespec timestamp;
+	float weight[WD_CORNER_COUNT];
+	float total;
+};
+
+/* Decimated outputs. Each tap averages the samples over blocks of 1/frequency seconds and emits 
+ * one sample per block; the averaging is the anti-aliasing filter. A tap keeps its own short 
+ * history and read cursor, so a slow consumer costs the full rate path one accumulation per 
+ * sample and nothing more. */
+#define WD_MAX_TAPS				4
+#define WD_TAP_LEN				64		/* Power of two */
+#define WD_TAP_MASK				(WD_TAP_LEN - 1)
+
+struct wd_tap 
+{
+	long period;					/* ns, 0 if the tap is not in use */
+	struct timespec block_end;
+	int count;						/* Samples in the current block */
+	uint16_t flags;
+	float weight[WD_CORNER_COUNT];
+	float total;
+	uint32_t raw[WD_CORNER_COUNT];
+	struct timespec last;
+	struct wd_sample samples[WD_TAP_LEN];
+	uint32_t head;
+	uint32_t read;
+};
+
+/* Raw samples are written at head as soon as they arrive. They are only handed to consumers 
+ * once they have been calibrated, i.e. up to calibrated. Until the calibration data is known 
+ * calibrated stays behind, and wd_sample_ring_set_calibration catches it up with head. */
+struct wd_sample_ring 
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;			/* Broadcast whenever calibrated moves or wakeups changes */
+	uint32_t wakeups;
+	int waiters;					/* Threads in wd_sample_ring_wait */
+	int readers;					/* Consumers holding the ring, see wd_sample_ring_acquire */
+	int closed;
+	struct wd_sample samples[WD_SAMPLE_RING_LEN];
+	uint32_t head;
+	uint32_t calibrated;
+	uint32_t read;
+	uint32_t dropped;
+	/* Gaps, see WD_GAP_*. Durations run from the sample before the gap to the one after it. */
+	int gap_fill;
+	int gap_max_fill;				/* ms */
+	uint32_t gaps;					/* Every gap, bridged or not */
+	uint32_t filled_gaps;
+	uint32_t synthetic;				/* Samples made up to bridge gaps */
+	int64_t gap_time;				/* ns */
+	int64_t longest_gap;			/* ns */
+	uint16_t next_flags;
+	int has_cal;
+	uint16_t cal[WD_CORNER_COUNT][3];
+	/* Tare, see WD_TARE_* */
+	int has_tare;
+	float tare[WD_CORNER_COUNT];
+	struct timespec tare_start;
+	struct timespec tare_last;		/* Last sample fed to the drift filter */
+	float tare_ref;
+	float tare_sum[WD_CORNER_COUNT];
+	int tare_count;
+	struct wd_filter_chain filters;
+	struct wd_tap taps[WD_MAX_TAPS];
+	uint32_t tapped;				/* Next sequence number to be fed to the taps */
+	struct wd_shm_ring *shm;		/* Copy for other processes, once one has asked for it */
+	struct wd_journal *journal;		/* Where the samples are kept safe, if anywhere */
+};
+
+/* Tracks how long the total weight has been steady */
+struct wd_stability 
+{
+	struct timespec start;
+	float min, max;
+	float sum;
+	int count;
+};
+
+int wd_sample_ring_init(struct wd_sample_ring *ring);
+void wd_sample_ring_close(struct wd_sample_ring *ring);
+int wd_sample_ring_acquire(struct wd_sample_ring *ring);
+void wd_sample_ring_release(struct wd_sample_ring *ring);
+uint32_t wd_sample_ring_wakeups(struct wd_sample_ring *ring);
+uint32_t wd_sample_ring_cursor(struct wd_sample_ring *ring);
+void wd_sample_ring_destroy(struct wd_sample_ring *ring);
+int wd_sample_ring_push(struct wd_sample_ring *ring, const uint16_t *raw, const struct timespec *timestamp);
+int wd_sample_ring_bridge(struct wd_sample_ring *ring, const uint16_t *raw, const struct timespec *timestamp, int missed);
+int wd_sample_ring_set_gap_fill(struct wd_sample_ring *ring, int mode, int max_fill);
+int wd_sample_ring_share(struct wd_sample_ring *ring, int *shm_fd, int *event_fd);
+void wd_sample_ring_unshare(struct wd_sample_ring *ring, int reader);
+void wd_sample_ring_set_journal(struct wd_sample_ring *ring, struct wd_journal *journal);
+int wd_sample_ring_set_calibration(struct wd_sample_ring *ring, const struct balance_cal *balance_cal);
+int wd_sample_ring_read(struct wd_sample_ring *ring, struct wd_sample *samples, int max);
+int wd_sample_ring_read_cursor(struct wd_sample_ring *ring, uint32_t *cursor, struct wd_sample *samples, int max);
+int wd_sample_ring_wait(struct wd_sample_ring *ring, uint32_t cursor, uint32_t *wakeups, const struct timespec *deadline);
+int wd_sample_ring_wait_unread(struct wd_sample_ring *ring, uint32_t *wakeups, const struct timespec *deadline);
+void wd_sample_ring_wakeup(struct wd_sample_ring *ring);
+void wd_sample_ring_mark_gap(struct wd_sample_ring *ring);
+int wd_sample_ring_set_filters(struct wd_sample_ring *ring, const int *types, const float *params, int count);
+int wd_sample_ring_add_tap(struct wd_sample_ring *ring, int frequency);
+int wd_sample_ring_read_tap(struct wd_sample_ring *ring, int tap, struct wd_sample *samples, int max);
+int wd_sample_ring_wait_tap(struct wd_sample_ring *ring, int tap, uint32_t *wakeups, const struct timespec *deadline);
+float wd_calibrate_corner(uint16_t raw, const uint16_t *cal);
+void wd_sample_pack(const struct wd_sample *sample, unsigned char *record);
+void wd_stability_reset(struct wd_stability *stability);
+int wd_stability_feed(struct wd_stability *stability, const struct wd_sample *sample, float *weight);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Lifetime of the connection to a board, shared by the clients that use it. The link outlives 
+ *  its last client for a while, so that a client coming back finds it warm.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_session.h"
+
+static void *wd_session_thread(struct wd_session *session);
+
+/* Sets up an empty session; release is what ends it, idle is what the last client leaves.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_session_init(struct wd_session *session, void (*release)(void *arg), void (*idle)(void *arg), void *arg)
+{
+	memset(session, 0, sizeof *session);
+	session->linger = WD_SESSION_LINGER;
+	session->release = release;
+	session->idle = idle;
+	session->arg = arg;
+	if (pthread_mutex_init(&session->mutex, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_session_init: Error in initialization of session mutex.");
+		return -1;
+	}
+	if (pthread_cond_init(&session->cond, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_session_init: Error in initialization of session condition.");
+		pthread_mutex_destroy(&session->mutex);
+		return -1;
+	}
+	session->running = 1;
+	if (pthread_create(&session->thread, NULL, (void *(*)(void *))&wd_session_thread, session)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_session_init: Thread creation error (session thread)");
+		pthread_cond_destroy(&session->cond);
+		pthread_mutex_destroy(&session->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+/* Ends the session if it is still there and stops the linger thread.
+*/
+void wd_session_destroy(struct wd_session *session)
+{
+	wd_session_close(session);
+	pthread_mutex_lock(&session->mutex);
+	session->running = 0;
+	pthread_cond_broadcast(&session->cond);
+	pthread_mutex_unlock(&session->mutex);
+	if (pthread_join(session->thread, NULL)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "THREAD JOIN ERROR (session thread)");
+	}
+	pthread_cond_destroy(&session->cond);
+	pthread_mutex_destroy(&session->mutex);
+}
+
+/* Calls release with the mutex let go, so that it may take its time (e.g. join threads). Clients 
+   asking for the session meanwhile wait for it to be over.
+   Must be called with the session mutex held.
+*/
+static void wd_session_end(struct wd_session *session)
+{
+	session->live = 0;
+	session->refs = 0;
+	session->lingering = 0;
+	session->releasing = 1;
+	pthread_mutex_unlock(&session->mutex);
+	session->release(session->arg);
+	pthread_mutex_lock(&session->mutex);
+	session->releasing = 0;
+	pthread_cond_broadcast(&session->cond);
+}
+
+/* Marks the session as up, held by the client which has just set it up.
+*/
+void wd_session_open(struct wd_session *session)
+{
+	pthread_mutex_lock(&session->mutex);
+	while (session->releasing) 
+		pthread_cond_wait(&session->cond, &session->mutex);
+	session->live = 1;
+	session->refs = 1;
+	session->lingering = 0;
+	pthread_mutex_unlock(&session->mutex);
+}
+
+/* Takes a reference on the session, which stops it from lingering.
+   Returns:
+	-1 if there is no session (anymore),
+	the number of references otherwise.
+*/
+int wd_session_retain(struct wd_session *session)
+{
+	int refs = -1;
+
+	pthread_mutex_lock(&session->mutex);
+	while (session->releasing) 
+		pthread_cond_wait(&session->cond, &session->mutex);
+	if (session->live) 
+	{
+		refs = ++session->refs;
+		session->lingering = 0;
+	}
+	pthread_mutex_unlock(&session->mutex);
+	return refs;
+}
+
+/* Gives a reference back. The last one starts the linger, or ends the session right away if 
+   there is no linger.
+   Returns:
+	-1 if no reference was held,
+	the number of references left otherwise.
+*/
+int wd_session_release(struct wd_session *session)
+{
+	int refs;
+
+	pthread_mutex_lock(&session->mutex);
+	if (!session->live || !session->refs) 
+	{
+		pthread_mutex_unlock(&session->mutex);
+		return -1;
+	}
+	if ((refs = --session->refs) == 0) 
+	{
+		if (session->linger) 
+		{
+			clock_gettime(CLOCK_REALTIME, &session->deadline);
+			session->deadline.tv_sec += session->linger / 1000;
+			session->deadline.tv_nsec += (session->linger % 1000) * 1000000L;
+			if (session->deadline.tv_nsec >= 1000000000L) 
+			{
+				session->deadline.tv_sec++;
+				session->deadline.tv_nsec -= 1000000000L;
+			}
+			session->lingering = 1;
+			pthread_cond_broadcast(&session->cond);
+		}
+		else
+			wd_session_end(session);
+	}
+	pthread_mutex_unlock(&session->mutex);
+	/* Not under the mutex, idle may wait for a callback which retains the session */
+	if ((refs == 0) && session->idle)
+		session->idle(session->arg);
+	return refs;
+}
+
+/* Ends the session now, whoever holds it. Once this returns release has run.
+*/
+void wd_session_close(struct wd_session *session)
+{
+	pthread_mutex_lock(&session->mutex);
+	while (session->releasing) 
+		pthread_cond_wait(&session->cond, &session->mutex);
+	if (session->live)
+		wd_session_end(session);
+	pthread_mutex_unlock(&session->mutex);
+}
+
+/* Sets for how long (ms) the session outlives its last client, from the next release on.
+   Returns:
+	-1 if linger is out of range,
+	 0 otherwise.
+*/
+int wd_session_set_linger(struct wd_session *session, int linger)
+{
+	if ((linger < 0) || (linger > WD_SESSION_MAX_LINGER))
+		return -1;
+	pthread_mutex_lock(&session->mutex);
+	session->linger = linger;
+	pthread_mutex_unlock(&session->mutex);
+	return 0;
+}
+
+/* Returns the number of clients holding the session, 0 if there is none or no session.
+*/
+int wd_session_clients(struct wd_session *session)
+{
+	int refs;
+
+	pthread_mutex_lock(&session->mutex);
+	refs = session->live ? session->refs : 0;
+	pthread_mutex_unlock(&session->mutex);
+	return refs;
+}
+
+/* Must be called with the session mutex held */
+static int wd_session_due(struct wd_session *session)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (now.tv_sec > session->deadline.tv_sec) || 
+	       ((now.tv_sec == session->deadline.tv_sec) && (now.tv_nsec >= session->deadline.tv_nsec));
+}
+
+static void *wd_session_thread(struct wd_session *session)
+{
+	pthread_mutex_lock(&session->mutex);
+	while (session->running) 
+	{
+		if (!session->lingering) 
+		{
+			pthread_cond_wait(&session->cond, &session->mutex);
+			continue;
+		}
+		pthread_cond_timedwait(&session->cond, &session->mutex, &session->deadline);
+		/* A client may have come back meanwhile, which stops the linger or moves it on */
+		if (session->lingering && session->running && wd_session_due(session)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_session_thread: No client came back, ending the session.");
+			wd_session_end(session);
+		}
+	}
+	pthread_mutex_unlock(&session->mutex);
+	return NULL;
+}
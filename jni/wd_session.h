@@ -0,0 +1,64 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_SESSION_H
+#define WD_SESSION_H
+
+#include <pthread.h>
+#include <time.h>
+
+/* ms the link is kept up after the last client has gone, by default */
+#define WD_SESSION_LINGER		30000
+#define WD_SESSION_MAX_LINGER	600000
+
+/* Reference count on whatever a connection to a board holds (threads, sockets, calibration). 
+ * Every client retains the session while it uses it and releases it once done; after the last 
+ * release the session lingers for linger ms, so that a client coming back meanwhile (an activity 
+ * recreated on rotation, say) picks it up as it is. Only once the linger runs out, or when the 
+ * session is closed, is release called, always on one thread at a time and never while a 
+ * client holds the session. idle is for what only makes sense while someone is there (e.g. 
+ * callbacks). It is called after the last release with the session mutex let go, so it may 
+ * join threads which call back into the session; a client may have come back by then, which 
+ * wd_session_clients tells. */
+struct wd_session 
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;					/* Waits for the linger to run out */
+	int running;
+	int live;							/* There is something to retain */
+	int refs;
+	int linger;							/* ms */
+	int lingering;
+	struct timespec deadline;			/* End of the linger, CLOCK_REALTIME */
+	int releasing;						/* release is running */
+	void (*release)(void *arg);
+	void (*idle)(void *arg);			/* Called after the last client has gone, may be NULL */
+	void *arg;
+};
+
+int wd_session_init(struct wd_session *session, void (*release)(void *arg), void (*idle)(void *arg), void *arg);
+void wd_session_destroy(struct wd_session *session);
+void wd_session_open(struct wd_session *session);
+int wd_session_retain(struct wd_session *session);
+int wd_session_release(struct wd_session *session);
+void wd_session_close(struct wd_session *session);
+int wd_session_set_linger(struct wd_session *session, int linger);
+int wd_session_clients(struct wd_session *session);
+
+#endif
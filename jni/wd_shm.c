@@ -0,0 +1,366 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Sample ring shared with other processes. The ring lives in a memfd (ashmem on older 
+ *  kernels) mapped by the producer and by every reader; readers take no lock and make no 
+ *  system call per sample, see wd_shm.h for the layout and the protocol.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_samples.h"
+#include "wd_shm.h"
+
+/* ashmem ioctls, for the kernels without memfd_create */
+#ifndef ASHMEM_SET_SIZE
+#define ASHMEM_NAME_LEN			256
+#define ASHMEM_SET_NAME			_IOW(0x77, 1, char[ASHMEM_NAME_LEN])
+#define ASHMEM_SET_SIZE			_IOW(0x77, 3, size_t)
+#define ASHMEM_SET_PROT_MASK	_IOW(0x77, 5, unsigned long)
+#endif
+
+#define WD_SHM_SLOT_LEN			((8 + WD_SAMPLE_RECORD_LEN + 7) & ~7)
+
+/* Opens an anonymous shared memory region of size bytes; is_memfd tells how.
+   Returns:
+	-1 on error,
+	the file descriptor of the region otherwise.
+*/
+static int wd_shm_open_region(size_t size, int *is_memfd)
+{
+	int fd = -1;
+
+#ifdef __NR_memfd_create
+	if ((fd = syscall(__NR_memfd_create, "wd_samples", 0)) != -1) 
+	{
+		*is_memfd = 1;
+		if (ftruncate(fd, size) == 0)
+			return fd;
+		close(fd);
+	}
+#endif
+	*is_memfd = 0;
+	if ((fd = open("/dev/ashmem", O_RDWR)) == -1)
+		return -1;
+	if ((ioctl(fd, ASHMEM_SET_NAME, "wd_samples") < 0) || (ioctl(fd, ASHMEM_SET_SIZE, size) < 0)) 
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Opens the read-only descriptor of the region for the readers, once the producer has its own 
+   writable mapping.
+   Returns:
+	-1 on error,
+	the descriptor otherwise.
+*/
+static int wd_shm_open_reader_fd(int fd, int is_memfd)
+{
+	char path[32];
+
+	if (is_memfd) 
+	{
+		/* A memfd opened again through /proc keeps the access mode it is opened with */
+		snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+		return open(path, O_RDONLY);
+	}
+	/* The mask of an ashmem region applies to every mapping made from now on, ours is made */
+	if (ioctl(fd, ASHMEM_SET_PROT_MASK, (unsigned long)PROT_READ) < 0)
+		return -1;
+	return fd;
+}
+
+/* Creates an empty shared ring.
+   Returns:
+	-1 on error,
+	 0 otherwise.
+*/
+int wd_shm_create(struct wd_shm_ring *shm)
+{
+	struct wd_shm_header *header;
+	void *base;
+	int is_memfd, i;
+
+	shm->size = WD_SHM_HEADER_LEN + (size_t)WD_SHM_CAPACITY * WD_SHM_SLOT_LEN;
+	if ((shm->fd = wd_shm_open_region(shm->size, &is_memfd)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_shm_create: No shared memory (%d).", errno);
+		return -1;
+	}
+	if ((base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0)) == MAP_FAILED) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_shm_create: Cannot map the shared ring (%d).", errno);
+		close(shm->fd);
+		return -1;
+	}
+	if ((shm->reader_fd = wd_shm_open_reader_fd(shm->fd, is_memfd)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_shm_create: No read-only descriptor for the readers (%d).", errno);
+		munmap(base, shm->size);
+		close(shm->fd);
+		return -1;
+	}
+
+	memset(base, 0, shm->size);
+	header = base;
+	header->magic = WD_SHM_MAGIC;
+	header->version = WD_SHM_VERSION;
+	header->record_len = WD_SAMPLE_RECORD_LEN;
+	header->capacity = WD_SHM_CAPACITY;
+	header->slots = WD_SHM_HEADER_LEN;
+	header->slot_len = WD_SHM_SLOT_LEN;
+	/* No slot holds record 0 yet */
+	for (i = 0; i < WD_SHM_CAPACITY; i++) 
+		*(uint32_t *)((unsigned char *)base + WD_SHM_HEADER_LEN + i * WD_SHM_SLOT_LEN) = WD_SHM_BUSY;
+	shm->header = header;
+	shm->slots = (unsigned char *)base + WD_SHM_HEADER_LEN;
+	for (i = 0; i < WD_SHM_MAX_READERS; i++) 
+		shm->event_fds[i] = -1;
+	return 0;
+}
+
+/* Tells the readers that nothing more will come, and wakes them up.
+*/
+void wd_shm_close(struct wd_shm_ring *shm)
+{
+	int i;
+	uint64_t one = 1;
+
+	__atomic_store_n(&shm->header->closed, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < WD_SHM_MAX_READERS; i++) 
+	{
+		if ((shm->event_fds[i] != -1) && (write(shm->event_fds[i], &one, sizeof one) != sizeof one)) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_shm_close: eventfd write error");
+		}
+	}
+}
+
+/* Unmaps the ring. Readers keep their own mappings, which stay valid until they let them go.
+*/
+void wd_shm_destroy(struct wd_shm_ring *shm)
+{
+	int i;
+
+	for (i = 0; i < WD_SHM_MAX_READERS; i++) 
+	{
+		if (shm->event_fds[i] != -1)
+			close(shm->event_fds[i]);
+	}
+	munmap(shm->header, shm->size);
+	if (shm->reader_fd != shm->fd)
+		close(shm->reader_fd);
+	close(shm->fd);
+}
+
+/* Takes a reader slot, with a new eventfd for its wakeups. The eventfd belongs to the ring, the 
+   caller hands a copy to the reader.
+   Returns:
+	-1 if there is no free slot or no eventfd,
+	the index of the reader slot otherwise.
+*/
+int wd_shm_add_reader(struct wd_shm_ring *shm, int *event_fd)
+{
+	int i;
+
+	for (i = 0; (i < WD_SHM_MAX_READERS) && (shm->event_fds[i] != -1); i++);
+	if (i == WD_SHM_MAX_READERS)
+		return -1;
+	if ((shm->event_fds[i] = eventfd(0, EFD_NONBLOCK)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_shm_add_reader: eventfd creation error (%d)", errno);
+		return -1;
+	}
+	*event_fd = shm->event_fds[i];
+	return i;
+}
+
+void wd_shm_remove_reader(struct wd_shm_ring *shm, int index)
+{
+	if ((index < 0) || (index >= WD_SHM_MAX_READERS) || (shm->event_fds[index] == -1))
+		return;
+	close(shm->event_fds[index]);
+	shm->event_fds[index] = -1;
+}
+
+/* Writes the WD_SAMPLE_RECORD_LEN bytes record in the next slot and moves head past it. Only one 
+   thread may publish at a time.
+*/
+void wd_shm_publish(struct wd_shm_ring *shm, const unsigned char *record)
+{
+	uint32_t head = shm->header->head;
+	unsigned char *slot = shm->slots + (head & (WD_SHM_CAPACITY - 1)) * WD_SHM_SLOT_LEN;
+
+	__atomic_store_n((uint32_t *)slot, WD_SHM_BUSY, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot + 8, record, WD_SAMPLE_RECORD_LEN);
+	__atomic_store_n((uint32_t *)slot, head, __ATOMIC_RELEASE);
+	__atomic_store_n(&shm->header->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Wakes the readers sleeping on their eventfd. Called once per batch of published samples, after 
+   head has been moved; a reader which is not asleep finds the count on its eventfd when it next 
+   waits, and does not sleep.
+*/
+void wd_shm_notify(struct wd_shm_ring *shm)
+{
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < WD_SHM_MAX_READERS; i++) 
+	{
+		if (shm->event_fds[i] == -1)
+			continue;
+		if (write(shm->event_fds[i], &one, sizeof one) != sizeof one) 
+		{
+			__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_shm_notify: eventfd write error");
+		}
+	}
+}
+
+/* Maps the ring of fd, read-only, as reader index, with event_fd for the wakeups; both 
+   descriptors are handed over by the gateway and owned by the reader from then on. Reading 
+   starts with the next record.
+   Returns:
+	-1 if the region is not a shared ring,
+	 0 otherwise.
+*/
+int wd_shm_attach(struct wd_shm_reader *reader, int fd, int event_fd, int index)
+{
+	struct wd_shm_header header;
+	void *base;
+
+	if ((index < 0) || (index >= WD_SHM_MAX_READERS))
+		return -1;
+	if (pread(fd, &header, sizeof header, 0) != sizeof header) 
+	{
+		/* ashmem regions cannot be read, only mapped */
+		if ((base = mmap(NULL, WD_SHM_HEADER_LEN, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+			return -1;
+		memcpy(&header, base, sizeof header);
+		munmap(base, WD_SHM_HEADER_LEN);
+	}
+	if ((header.magic != WD_SHM_MAGIC) || (header.version != WD_SHM_VERSION) || 
+	    (header.record_len != WD_SAMPLE_RECORD_LEN))
+		return -1;
+
+	reader->size = header.slots + (size_t)header.capacity * header.slot_len;
+	if ((base = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return -1;
+	reader->fd = fd;
+	reader->event_fd = event_fd;
+	reader->index = index;
+	reader->header = base;
+	reader->slots = (unsigned char *)base + header.slots;
+	reader->cursor = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+	reader->lost = 0;
+	return 0;
+}
+
+void wd_shm_detach(struct wd_shm_reader *reader)
+{
+	munmap(reader->header, reader->size);
+	close(reader->fd);
+	close(reader->event_fd);
+}
+
+/* Copies up to max records past the cursor of the reader, WD_SAMPLE_RECORD_LEN bytes each. 
+   Records overwritten before they could be copied are counted in lost.
+   Returns:
+	the number of records copied.
+*/
+int wd_shm_read(struct wd_shm_reader *reader, unsigned char *records, int max)
+{
+	struct wd_shm_header *header = reader->header;
+	uint32_t head, seq;
+	unsigned char *slot;
+	int count = 0;
+
+	head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	if (head - reader->cursor > header->capacity) 
+	{
+		reader->lost += head - reader->cursor - header->capacity;
+		reader->cursor = head - header->capacity;
+	}
+	while ((count < max) && (reader->cursor != head)) 
+	{
+		slot = reader->slots + (reader->cursor & (header->capacity - 1)) * header->slot_len;
+		seq = __atomic_load_n((uint32_t *)slot, __ATOMIC_ACQUIRE);
+		if (seq == reader->cursor) 
+		{
+			memcpy(records + count * WD_SAMPLE_RECORD_LEN, slot + 8, WD_SAMPLE_RECORD_LEN);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			seq = __atomic_load_n((uint32_t *)slot, __ATOMIC_RELAXED);
+		}
+		if (seq == reader->cursor)
+			count++;
+		else
+			reader->lost++;		/* Overwritten under our feet */
+		reader->cursor++;
+	}
+	return count;
+}
+
+/* Sleeps until a record past the cursor is published, for timeout milliseconds at most (-1 
+   for no limit).
+   Returns:
+	-1 if the producer has gone and everything has been read,
+	 0 on timeout,
+	 1 if there are records to read.
+*/
+int wd_shm_wait(struct wd_shm_reader *reader, int timeout)
+{
+	struct wd_shm_header *header = reader->header;
+	struct pollfd pfd;
+	uint64_t count;
+
+	/* Clears the signals of the batches seen already; one that comes after the look at head 
+	 * stays on the eventfd and ends the poll. The eventfd is non-blocking. */
+	while (read(reader->event_fd, &count, sizeof count) == sizeof count);
+	if ((__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) == reader->cursor) && 
+	    !__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) 
+	{
+		pfd.fd = reader->event_fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, timeout);
+	}
+
+	if (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) != reader->cursor)
+		return 1;
+	return __atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) ? -1 : 0;
+}
@@ -0,0 +1,107 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_SHM_H
+#define WD_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Records kept in a shared ring, must be a power of two */
+#define WD_SHM_CAPACITY			1024
+/* Readers, each with its own eventfd */
+#define WD_SHM_MAX_READERS		8
+#define WD_SHM_MAGIC			0x52534457	/* "WDSR" */
+#define WD_SHM_VERSION			2
+#define WD_SHM_HEADER_LEN		64
+/* Sequence number of a slot while it is being written */
+#define WD_SHM_BUSY				0xFFFFFFFF
+
+/* Layout of the shared mapping (native byte order):
+ *	 0	uint32	magic, WD_SHM_MAGIC
+ *	 4	uint16	version
+ *	 6	uint16	record length, WD_SAMPLE_RECORD_LEN (see wd_samples.h)
+ *	 8	uint32	capacity in slots, a power of two
+ *	12	uint32	offset of slot 0
+ *	16	uint32	slot length
+ *	20	uint32	head: sequence number of the next record, stored with release semantics once 
+ *				the records below it are in place
+ *	24	uint32	closed: 1 once the producer has gone, nothing more will come
+ *	28	uint32	reserved, up to WD_SHM_HEADER_LEN
+ *
+ * Slot n % capacity holds record n: a uint32 sequence number, 4 bytes of padding, then the 
+ * record. The producer sets the sequence number to WD_SHM_BUSY, writes the record and stores n 
+ * with release semantics. A reader loads the sequence number (acquire), copies the record and 
+ * loads it again after an acquire fence; the copy is good if both are n. A reader keeps its own 
+ * cursor and takes no lock, it only makes a system call to sleep.
+ *
+ * The readers never write to the region: they are handed a read-only descriptor of it (a memfd 
+ * reopened read-only, or an ashmem region whose protection mask has been cut down to PROT_READ), 
+ * so a reader cannot corrupt the stream of the others. The producer signals every reader's 
+ * eventfd once per batch; the eventfd counter folds the signals of a reader that is not asleep. */
+struct wd_shm_header 
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_len;
+	uint32_t capacity;
+	uint32_t slots;
+	uint32_t slot_len;
+	uint32_t head;
+	uint32_t closed;
+	uint32_t reserved;
+};
+
+/* Producer side */
+struct wd_shm_ring 
+{
+	int fd;								/* memfd or ashmem region */
+	int reader_fd;						/* Read-only descriptor of it, handed to the readers */
+	size_t size;
+	struct wd_shm_header *header;
+	unsigned char *slots;
+	int event_fds[WD_SHM_MAX_READERS];	/* -1 if the reader slot is free */
+};
+
+/* Reader side */
+struct wd_shm_reader 
+{
+	int fd;
+	int event_fd;
+	int index;							/* Reader slot */
+	size_t size;
+	struct wd_shm_header *header;
+	unsigned char *slots;
+	uint32_t cursor;
+	uint32_t lost;						/* Records overwritten before they could be read */
+};
+
+int wd_shm_create(struct wd_shm_ring *shm);
+void wd_shm_destroy(struct wd_shm_ring *shm);
+int wd_shm_add_reader(struct wd_shm_ring *shm, int *event_fd);
+void wd_shm_remove_reader(struct wd_shm_ring *shm, int index);
+void wd_shm_publish(struct wd_shm_ring *shm, const unsigned char *record);
+void wd_shm_notify(struct wd_shm_ring *shm);
+void wd_shm_close(struct wd_shm_ring *shm);
+
+int wd_shm_attach(struct wd_shm_reader *reader, int fd, int event_fd, int index);
+void wd_shm_detach(struct wd_shm_reader *reader);
+int wd_shm_read(struct wd_shm_reader *reader, unsigned char *records, int max);
+int wd_shm_wait(struct wd_shm_reader *reader, int timeout);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ *
+ *  Wii Balance Board Controller for Android
+ *
+ *  Copyright (C) 2011 Mohammad Hashemian (m.hashemian@gmail.com)
+ *
+ *  Files the driver keeps between two runs of the application. For now this is the 
+ *  calibration block of every board we have connected to, keyed by its Bluetooth address. 
+ *  Calibration is factory data, so once it is read from a board it never has to be read again.
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *   
+ *  All rights reserved.
+ */ 
+
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "bluetooth.h"
+#include "android/log.h"
+#include "wii_droid_defs.h"
+#include "wd_storage.h"
+
+static char storage_dir[WD_STORAGE_PATH_LEN] = WD_STORAGE_DIR;
+
+/* Sets the directory in which the driver keeps its files.
+   Returns:
+	-1 if the path does not fit,
+	 0 otherwise.
+*/
+int wd_storage_set_dir(const char *dir)
+{
+	if (!dir || strlen(dir) >= sizeof storage_dir) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_storage_set_dir: Invalid storage directory");
+		return -1;
+	}
+	strcpy(storage_dir, dir);
+	return 0;
+}
+
+const char *wd_storage_get_dir(void)
+{
+	return storage_dir;
+}
+
+/* Plain CRC-32 (IEEE 802.3). Pass 0 as the initial crc, or the previous result to continue.
+*/
+uint32_t wd_crc32(uint32_t crc, const void *data, size_t len)
+{
+	const unsigned char *cursor = data;
+	int bit;
+
+	crc = ~crc;
+	while (len--) 
+	{
+		crc ^= *cursor++;
+		for (bit = 0; bit < 8; bit++) 
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static void wd_cal_cache_path(const bdaddr_t *bdaddr, char *path, size_t len)
+{
+	/* bdaddr is stored little endian, print it the way people read it */
+	snprintf(path, len, "%s/" WD_CAL_CACHE_PREFIX "%.2X%.2X%.2X%.2X%.2X%.2X" WD_CAL_CACHE_EXT, 
+	         storage_dir, 
+	         bdaddr->b[5], bdaddr->b[4], bdaddr->b[3], 
+	         bdaddr->b[2], bdaddr->b[1], bdaddr->b[0]);
+}
+
+/* Loads the cached calibration block of the board.
+   Returns:
+	-1 if there is no valid entry for the board,
+	 0 if data has been filled.
+*/
+int wd_cal_cache_load(const bdaddr_t *bdaddr, unsigned char *data)
+{
+	char path[WD_STORAGE_PATH_LEN + 32];
+	struct wd_cal_cache_entry entry;
+	int fd;
+	ssize_t len;
+
+	wd_cal_cache_path(bdaddr, path, sizeof path);
+	if ((fd = open(path, O_RDONLY)) == -1) 
+	{
+		/* Never seen this board before */
+		return -1;
+	}
+	len = read(fd, &entry, sizeof entry);
+	close(fd);
+
+	if (len != sizeof entry) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_cal_cache_load: Truncated cache entry %s", path);
+		return -1;
+	}
+	if ((entry.magic != WD_CAL_CACHE_MAGIC) || bacmp(&entry.bdaddr, bdaddr) ||
+	    (entry.crc != wd_crc32(0, &entry, offsetof(struct wd_cal_cache_entry, crc)))) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_cal_cache_load: Corrupted cache entry %s", path);
+		return -1;
+	}
+
+	memcpy(data, entry.data, sizeof entry.data);
+	return 0;
+}
+
+/* Stores the calibration block of the board. The entry is written aside, synced and renamed
+   over the old one, so a crash or a power loss never leaves a half written entry behind.
+   Returns:
+	-1 on failure,
+	 0 otherwise.
+*/
+int wd_cal_cache_store(const bdaddr_t *bdaddr, const unsigned char *data)
+{
+	char path[WD_STORAGE_PATH_LEN + 32];
+	char tmp_path[WD_STORAGE_PATH_LEN + 36];
+	struct wd_cal_cache_entry entry;
+	int fd;
+
+	memset(&entry, 0, sizeof entry);
+	entry.magic = WD_CAL_CACHE_MAGIC;
+	bacpy(&entry.bdaddr, bdaddr);
+	memcpy(entry.data, data, sizeof entry.data);
+	entry.crc = wd_crc32(0, &entry, offsetof(struct wd_cal_cache_entry, crc));
+
+	wd_cal_cache_path(bdaddr, path, sizeof path);
+	snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+	if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_cal_cache_store: Cannot create %s (%d)", tmp_path, errno);
+		return -1;
+	}
+	if (write(fd, &entry, sizeof entry) != sizeof entry) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_cal_cache_store: Write error (%d)", errno);
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	/* Or the rename may reach the disk before the data does */
+	if (fsync(fd)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_cal_cache_store: Sync error (%d)", errno);
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp_path, path)) 
+	{
+		__android_log_print(ANDROID_LOG_DEBUG, DEBUG_TAG, "wd_cal_cache_store: Cannot rename %s (%d)", tmp_path, errno);
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Forgets the cached calibration block of the board.
+*/
+int wd_cal_cache_remove(const bdaddr_t *bdaddr)
+{
+	char path[WD_STORAGE_PATH_LEN + 32];
+
+	wd_cal_cache_path(bdaddr, path, sizeof path);
+	if (unlink(path) && errno != ENOENT) 
+	{
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,54 @@
+/* Copyright (C) 2011 L. Mohammad Hashemian <m.hashemian@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef WD_STORAGE_H
+#define WD_STORAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bluetooth.h"
+
+/* Default location of the files kept by the driver, until Java tells us the real one */
+#define WD_STORAGE_DIR			"/data/data/iEpi.Scale/files"
+#define WD_STORAGE_PATH_LEN		256
+
+/* Calibration cache */
+#define WD_CAL_CACHE_MAGIC		0x31434457	/* "WDC1" */
+#define WD_CAL_CACHE_PREFIX		"cal_"
+#define WD_CAL_CACHE_EXT		".bin"
+#define WD_CAL_CACHE_DATA_LEN	24			/* Same as the calibration block of the board */
+
+/* On-disk layout of one cached calibration block. The checksum covers everything before it. */
+struct wd_cal_cache_entry 
+{
+	uint32_t magic;
+	bdaddr_t bdaddr;
+	uint8_t reserved[2];
+	unsigned char data[WD_CAL_CACHE_DATA_LEN];
+	uint32_t crc;
+};
+
+int wd_storage_set_dir(const char *dir);
+const char *wd_storage_get_dir(void);
+uint32_t wd_crc32(uint32_t crc, const void *data, size_t len);
+int wd_cal_cache_load(const bdaddr_t *bdaddr, unsigned char *data);
+int wd_cal_cache_store(const bdaddr_t *bdaddr, const unsigned char *data);
+int wd_cal_cache_remove(const bdaddr_t *bdaddr);
+
+#endif
@@ -20,6 +20,7 @@
 #define WII_DROID_DEFS_H
 
 #define DEBUG_TAG "iEpiScaleJNI89"
+#define WD_JNI_CLASS "iEpi/Scale/BoardInterface"
 #define RPT_READ_REQ_LEN 6
 #define READ_BUF_LEN 23
 #define RPT_WRITE_LEN 21
@@ -27,6 +28,9 @@
 #define toggle_bit(bf,b) (bf) = ((bf) & b) ? ((bf) & ~(b)) : ((bf) | (b))
 #define MAX_READ_TRIAL 2
 #define MAX_CAL_TRIAL 2
+#define WD_BALANCE_CAL_OFFSET 0xa40024
+#define WD_BALANCE_CAL_LEN 24
+#define WD_BALANCE_CAL_CHECK_LEN 8	/* 0 KG row only, fits in a single read report */
 #define FALSE 0
 #define TRUE 1
 
@@ -36,6 +40,7 @@
 #define WD_FLAG_REPEAT_BTN	0x04
 #define WD_FLAG_NONBLOCK	0x08
 #define WD_FLAG_MOTIONPLUS	0x10
+#define WD_FLAG_RECONNECT	0x20
 
 /* Button Mask (masks unknown bits in button bytes) */
 #define BTN_MASK_0			0x1F
@@ -102,8 +107,61 @@
 #define WD_IR_X_MAX		1024
 #define WD_IR_Y_MAX		768
 
-/* Callback Maximum Message Count */
-#define WD_MAX_MESG_COUNT	100
+/* Workers of a session slot */
+#define WD_WORKER_ROUTER		0
+#define WD_WORKER_STATUS		1
+#define WD_WORKER_BATTERY		2
+#define WD_WORKER_SUPERVISOR	3
+
+/* Bytes of message records a packet or a status change may produce */
+#define WD_MESG_BUF_LEN		128
+
+/* Battery monitor */
+#define WD_BATTERY_POLL_INTERVAL	30	/* Seconds between two RPT_STATUS_REQ polls */
+#define WD_BATTERY_DEFAULT_PROFILE	0	/* Index of the balance board in wd_battery_profiles */
+
+/* Link supervision */
+#define WD_RECONNECT_MIN_DELAY		250		/* ms before the second reconnection attempt */
+#define WD_RECONNECT_MAX_DELAY		4000	/* ms, upper bound of the backoff */
+#define WD_RECONNECT_TIMEOUT		120		/* Seconds before the board is given up */
+#define WD_SUPERVISION_TIMEOUT		2000	/* ms of silence before the controller drops the link */
+#define WD_WATCHDOG_TIMEOUT			300		/* ms without a report while streaming, for a stall */
+#define WD_WATCHDOG_STRIKES			2		/* Stalls in a row before the link is given to the supervisor */
+
+/* Discovery */
+#define WD_RANK_CACHED_BONUS		10		/* dB added to the RSSI of a board connected before */
+#define WD_RANK_UNKNOWN_RSSI		-90		/* dB assumed when the controller does not report it */
+
+/* Layout of the session statistics handed to Java (native byte order):
+ *	 0	int32	reports stamped by the time base
+ *	 4	int32	reports timed by the kernel
+ *	 8	int32	restarts of the period fit
+ *	12	float	report period (ms)
+ *	16	float	jitter of the arrivals (ms)
+ *	20	int32	gaps
+ *	24	int32	gaps bridged with synthetic samples
+ *	28	int32	synthetic samples
+ *	32	int32	samples dropped by a slow reader
+ *	36	int32	reconnections
+ *	40	int64	total duration of the gaps (ns)
+ *	48	int64	longest gap (ns)
+ *	56	int32	stalls caught by the stream watchdog
+ */
+#define WD_SESSION_RECORD_LEN		60
+
+/* Indices of the state snapshot handed to Java as an int array (readState) */
+#define WD_STATE_BALANCE_VALID		0
+#define WD_STATE_RIGHT_TOP			1		/* Raw sensor values of the last report */
+#define WD_STATE_RIGHT_BOTTOM		2
+#define WD_STATE_LEFT_TOP			3
+#define WD_STATE_LEFT_BOTTOM		4
+#define WD_STATE_BATTERY_LEVEL		5
+#define WD_STATE_BATTERY_EVENT		6
+#define WD_STATE_LINK_STATE			7
+#define WD_STATE_LINK_ALERTS		8
+#define WD_STATE_CAL_VALID			9
+#define WD_STATE_CAL				10		/* right top, right bottom, left top, left bottom; 0, 17, 34 kg each */
+#define WD_STATE_LEN				22
 
 /* Extension Values */
 #define EXT_NONE		0x2E2E
@@ -148,6 +206,7 @@ enum wd_mesg_type
 	WD_MESG_CLASSIC,
 	WD_MESG_BALANCE,
 	WD_MESG_MOTIONPLUS,
+	WD_MESG_BATTERY,
 	WD_MESG_ERROR,
 	WD_MESG_UNKNOWN
 };
@@ -168,6 +227,22 @@ enum wd_error
 	WD_ERROR_COMM
 };
 
+enum wd_link_state 
+{
+	WD_LINK_UP,
+	WD_LINK_RECONNECTING,
+	WD_LINK_LOST,
+	WD_LINK_STALLED
+};
+
+enum wd_battery_event 
+{
+	WD_BATTERY_OK,
+	WD_BATTERY_LOW,
+	WD_BATTERY_CRITICAL,
+	WD_BATTERY_SENSORS_DEAD
+};
+
 enum wd_ext_type 
 {
 	WD_EXT_NONE,
@@ -252,12 +327,28 @@ struct wd_motionplus_mesg
 	uint8_t low_speed[3];
 };
 
+struct wd_battery_mesg 
+{
+	enum wd_mesg_type type;
+	enum wd_battery_event event;
+	uint8_t level;
+};
+
 struct wd_error_mesg 
 {
 	enum wd_mesg_type type;
 	enum wd_error error;
 };
 
+/* Battery byte thresholds of a board model, matched by its remote name */
+struct wd_battery_profile 
+{
+	const char *name;
+	uint8_t full;
+	uint8_t low;
+	uint8_t critical;
+};
+
 struct write_seq 
 {
 	enum write_seq_type type;
@@ -316,6 +407,7 @@ struct wd_state {
 	struct wd_ir_src ir_src[WD_IR_SRC_COUNT];
 	enum wd_ext_type ext_type;
 	union ext_state ext;
+	enum wd_battery_event battery_event;
 	enum wd_error error;
 };
 
@@ -339,9 +431,18 @@ union wd_mesg
 	struct wd_classic_mesg classic_mesg;
 	struct wd_balance_mesg balance_mesg;
 	struct wd_motionplus_mesg motionplus_mesg;
+	struct wd_battery_mesg battery_mesg;
 	struct wd_error_mesg error_mesg;
 };
 
+struct wd_sample_ring;
+struct wd_listener;
+struct wd_linkmon;
+struct wd_clock;
+struct wd_journal;
+struct wd_hci;
+struct wd_pool_slot;
+
 /* Typedefs */
 typedef struct wiimote wiimote_t;
 typedef void cwiid_mesg_callback_t(wiimote_t *, int, union wd_mesg [], struct timespec *);
@@ -352,9 +453,13 @@ struct wiimote
 	int flags;
 	int ctl_socket;
 	int int_socket;
-	pthread_t router_thread;
-	pthread_t status_thread;
+	struct wd_pool_slot *slot;		/* Pool slot the session runs on, its workers are the threads */
+	int refs;						/* JNI calls inside, under board_mutex (BTL.c) */
 	pthread_t mesg_callback_thread;
+	int router_continue;			/* Cleared to stop the threads of the session */
+	int status_continue;
+	int battery_continue;
+	int supervisor_continue;
 	int mesg_pipe[2];
 	int status_pipe[2];
 	int rw_pipe[2];
@@ -362,18 +467,42 @@ struct wiimote
 	enum rw_status rw_status;
 	cwiid_mesg_callback_t *mesg_callback;
 	pthread_mutex_t state_mutex;
+	pthread_cond_t state_cond;		/* Signalled as a status report is taken in */
+	int status_count;				/* Status reports taken in, under state_mutex */
 	pthread_mutex_t rw_mutex;
 	pthread_mutex_t rpt_mutex;
+	pthread_mutex_t ctl_mutex;
+	pthread_mutex_t battery_mutex;
+	pthread_cond_t battery_cond;
+	pthread_mutex_t link_mutex;
+	pthread_cond_t link_cond;
+	enum wd_link_state link_state;
+	int reconnect_count;
+	int supervision_timeout;		/* ms, 0 for the controller default */
+	int watchdog_timeout;			/* ms, 0 for none */
+	int stall_count;			/* Stalls caught by the stream watchdog, under link_mutex */
+	const struct wd_battery_profile *battery_profile;
+	uint16_t zero_corner_count;
+	bdaddr_t bdaddr;
+	bdaddr_t adapter;				/* Local adapter the board is connected through */
+	struct wd_hci *hci;				/* Controller context of that adapter */
+	struct wd_sample_ring *samples;
+	struct wd_listener *listener;	/* Under board_mutex (BTL.c), see wd_swap_listener */
+	struct wd_linkmon *linkmon;
+	struct wd_clock *clock;			/* Time base of the samples */
+	struct wd_journal *journal;		/* Keeps the samples through a crash */
 	int id;
 	const void *data;
 };
 
-/* Message arrays */
-struct mesg_array 
+/* Message records. Each message only takes the size of its own struct, the records follow each 
+ * other in data and the type at the head of every record tells the size of the next step. */
+struct mesg_buf 
 {
 	uint8_t count;
+	uint16_t len;					/* Bytes of data in use */
 	struct timespec timestamp;
-	union wd_mesg array[WD_MAX_MESG_COUNT];
+	unsigned char data[WD_MESG_BUF_LEN];	/* Aligned by the timestamp ahead of it */
 };
 
 struct balance_cal 
@@ -386,23 +515,37 @@ struct balance_cal
                                    
 wiimote_t *wd_create_new_wii(int ctl_socket, int int_socket, int flags);
 int wd_get_board_calibration_data(wiimote_t *wiimote, struct balance_cal *balance_cal);
+void wd_parse_balance_cal(const unsigned char *buf, struct balance_cal *balance_cal);
+int wd_load_cached_calibration(wiimote_t *wiimote, struct balance_cal *balance_cal);
+int wd_validate_calibration(wiimote_t *wiimote, const struct balance_cal *balance_cal);
 int wd_read(wiimote_t *wiimote, uint8_t flags, uint32_t offset, uint16_t len, void *data);
 int wd_send_rpt(wiimote_t *wiimote, uint8_t flags, uint8_t report, size_t len, const void *data);
 int wd_verify_handshake(struct wiimote *wiimote);
 int wd_full_read(int fd, void *buf, size_t len);
 void *wd_router_thread(struct wiimote *wiimote);
 void *wd_status_thread(struct wiimote *wiimote);
-int wd_process_ext(struct wiimote *wiimote, unsigned char *data, unsigned char len, struct mesg_array *ma);
-int wd_process_error(struct wiimote *wiimote, ssize_t len, struct mesg_array *ma);
+int wd_process_ext(struct wiimote *wiimote, unsigned char *data, unsigned char len, struct mesg_buf *ma);
+int wd_process_error(struct wiimote *wiimote, ssize_t len, struct mesg_buf *ma);
+int wd_publish_samples(struct wiimote *wiimote, struct mesg_buf *ma);
 int wd_cancel_rw(struct wiimote *wiimote);
-int wd_write_mesg_array(struct wiimote *wiimote, struct mesg_array *ma);
+int wd_write_mesg_buf(struct wiimote *wiimote, struct mesg_buf *ma);
+union wd_mesg *wd_mesg_add(struct mesg_buf *ma, enum wd_mesg_type type);
+union wd_mesg *wd_mesg_next(struct mesg_buf *ma, union wd_mesg *mesg);
 int wd_write(wiimote_t *wiimote, uint8_t flags, uint32_t offset, uint16_t len, const void *data);
-int wd_update_state(struct wiimote *wiimote, struct mesg_array *ma);
+int wd_update_state(struct wiimote *wiimote, struct mesg_buf *ma);
 int wd_update_rpt_mode(struct wiimote *wiimote, int8_t rpt_mode);
 int wd_process_read(struct wiimote *wiimote, unsigned char *data);
-int wd_process_btn(struct wiimote *wiimote, const unsigned char *data, struct mesg_array *ma);
-int wd_process_acc(struct wiimote *wiimote, const unsigned char *data, struct mesg_array *ma);
+int wd_process_btn(struct wiimote *wiimote, const unsigned char *data, struct mesg_buf *ma);
+int wd_process_acc(struct wiimote *wiimote, const unsigned char *data, struct mesg_buf *ma);
 int wd_process_write(struct wiimote *wiimote, unsigned char *data);
-int wd_process_status(struct wiimote *wiimote, const unsigned char *data, struct mesg_array *ma);
+int wd_process_status(struct wiimote *wiimote, const unsigned char *data, struct mesg_buf *ma);
+void *wd_battery_thread(struct wiimote *wiimote);
+void *wd_supervisor_thread(struct wiimote *wiimote);
+int wd_wait_for_link(struct wiimote *wiimote);
+void wd_disconnect(struct wiimote *wiimote);
+int wd_l2cap_connect(const bdaddr_t *src, const bdaddr_t *bdaddr, int *ctl_socket, int *int_socket);
+int wd_request_status(struct wiimote *wiimote);
+const struct wd_battery_profile *wd_find_battery_profile(const char *name);
+int wd_check_battery(struct wiimote *wiimote, enum wd_battery_event event, uint8_t level, struct mesg_buf *ma);
  
 #endif
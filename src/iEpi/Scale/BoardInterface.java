@@ -1,5 +1,8 @@
 package iEpi.Scale;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
 /**
  * This class provides an interface between native C code which is in charge of connection to the 
  * balance board, and the iEpiScale activity which acts as the user interface.
@@ -11,6 +14,189 @@ public class BoardInterface
 {
 	private static final String LOG_TAG = "BoardInterface";
 	
+	/**
+	 * Battery events raised by the native battery monitor (see getBatteryEvent).
+	 */
+	public static final int BATTERY_OK				= 0;
+	public static final int BATTERY_LOW				= 1;
+	public static final int BATTERY_CRITICAL		= 2;
+	public static final int BATTERY_SENSORS_DEAD	= 3;
+	
+	/**
+	 * States of the link to the board (see getLinkState).
+	 */
+	public static final int LINK_UP					= 0;
+	public static final int LINK_RECONNECTING		= 1;
+	public static final int LINK_LOST				= 2;
+	public static final int LINK_STALLED			= 3;	// no report for a while, recovery follows
+	/**
+	 * Alerts of the native link monitor (see getLinkAlerts), as a mask.
+	 */
+	public static final int LINK_ALERT_NO_RADIO		= 0x01;	// RSSI or link quality could not be read
+	public static final int LINK_ALERT_WEAK			= 0x02;	// weak radio
+	public static final int LINK_ALERT_STALL		= 0x04;	// no report for 200 ms or more
+	public static final int LINK_ALERT_RANGE		= 0x08;	// stall with a weak radio, phone too far from the board
+	public static final int LINK_ALERT_BOARD		= 0x10;	// stall with a good radio, the board stopped sending
+	/**
+	 * Layout of the link monitor readings filled by readLinkStats, in native byte order. Each 
+	 * reading covers the reports received since the previous one, about a second earlier.
+	 */
+	public static final int LINK_RECORD_SIZE		= 28;
+	public static final int LINK_TIME_OFFSET		= 0;	// long, nanoseconds, same clock as the samples
+	public static final int LINK_REPORTS_OFFSET		= 8;	// int
+	public static final int LINK_INTERVAL_OFFSET	= 12;	// float, mean interval between reports, ms
+	public static final int LINK_JITTER_OFFSET		= 16;	// float, ms
+	public static final int LINK_MAX_GAP_OFFSET		= 20;	// float, ms
+	public static final int LINK_RSSI_OFFSET		= 24;	// byte, dB off the golden receive power range
+	public static final int LINK_QUALITY_OFFSET		= 25;	// unsigned byte
+	public static final int LINK_ALERTS_OFFSET		= 26;	// short
+	/**
+	 * The native side keeps this many link monitor readings.
+	 */
+	public static final int MAX_LINK_RECORDS		= 64;
+	
+	/**
+	 * Layout of the sample records filled by readSamples, in native byte order. Corner values are 
+	 * in right top, right bottom, left top, left bottom order. Timestamps are on the monotonic clock 
+	 * and evenly spaced at the report period of the board (see getReportPeriod); add 
+	 * getWallClockOffset to get the wall clock time.
+	 */
+	public static final int SAMPLE_RECORD_SIZE		= 44;
+	public static final int SAMPLE_TIMESTAMP_OFFSET	= 0;	// long, nanoseconds
+	public static final int SAMPLE_SEQ_OFFSET		= 8;	// int
+	public static final int SAMPLE_FLAGS_OFFSET		= 12;	// int
+	public static final int SAMPLE_TOTAL_OFFSET		= 16;	// float, KG
+	public static final int SAMPLE_WEIGHT_OFFSET	= 20;	// 4 floats, KG
+	public static final int SAMPLE_RAW_OFFSET		= 36;	// 4 unsigned shorts
+	/**
+	 * Sample flags
+	 */
+	public static final int SAMPLE_FLAG_CALIBRATED	= 0x0001;
+	public static final int SAMPLE_FLAG_GAP			= 0x0002;	// first sample after a reconnection or a gap too long to bridge
+	public static final int SAMPLE_FLAG_TARED		= 0x0004;	// zero drift of the corners taken off
+	public static final int SAMPLE_FLAG_FILTERED	= 0x0008;	// went through the filter chain
+	public static final int SAMPLE_FLAG_OUTLIER		= 0x0010;	// a value has been rejected as an outlier
+	public static final int SAMPLE_FLAG_SYNTHETIC	= 0x0020;	// interpolated over a lost report
+	/**
+	 * How short gaps in the stream are bridged (see setGapFill).
+	 */
+	public static final int GAP_FILL_NONE			= 0;
+	public static final int GAP_FILL_LINEAR			= 1;
+	public static final int GAP_FILL_CUBIC			= 2;
+	/**
+	 * Indices of the snapshot filled by readState.
+	 */
+	public static final int STATE_SIZE				= 22;
+	public static final int STATE_BALANCE_VALID		= 0;	// 1 once the board has reported
+	public static final int STATE_RIGHT_TOP			= 1;	// raw sensor values of the last report
+	public static final int STATE_RIGHT_BOTTOM		= 2;
+	public static final int STATE_LEFT_TOP			= 3;
+	public static final int STATE_LEFT_BOTTOM		= 4;
+	public static final int STATE_BATTERY_LEVEL		= 5;	// battery byte of the last status report
+	public static final int STATE_BATTERY_EVENT		= 6;	// see getBatteryEvent
+	public static final int STATE_LINK_STATE		= 7;	// see getLinkState
+	public static final int STATE_LINK_ALERTS		= 8;	// see getLinkAlerts
+	public static final int STATE_CAL_VALID			= 9;	// 1 once the calibration data is known
+	public static final int STATE_CAL				= 10;	// 0, 17 and 34 kg for right top, right bottom, 
+															// left top and left bottom in turn
+	/**
+	 * Layout of the session statistics filled by readSessionStats, in native byte order.
+	 */
+	public static final int SESSION_RECORD_SIZE		= 60;
+	public static final int SESSION_REPORTS_OFFSET	= 0;	// int
+	public static final int SESSION_KERNEL_OFFSET	= 4;	// int, reports timed by the kernel
+	public static final int SESSION_RESYNCS_OFFSET	= 8;	// int, restarts of the period fit
+	public static final int SESSION_PERIOD_OFFSET	= 12;	// float, ms
+	public static final int SESSION_JITTER_OFFSET	= 16;	// float, ms
+	public static final int SESSION_GAPS_OFFSET		= 20;	// int
+	public static final int SESSION_FILLED_OFFSET	= 24;	// int, gaps bridged
+	public static final int SESSION_SYNTHETIC_OFFSET= 28;	// int, samples made up to bridge them
+	public static final int SESSION_DROPPED_OFFSET	= 32;	// int, samples lost by a slow reader
+	public static final int SESSION_RECONNECT_OFFSET= 36;	// int
+	public static final int SESSION_GAP_TIME_OFFSET	= 40;	// long, ns
+	public static final int SESSION_LONGEST_OFFSET	= 48;	// long, ns
+	public static final int SESSION_STALLS_OFFSET	= 56;	// int, stalls caught by the stream watchdog
+	/**
+	 * Filter stages (see setFilters), followed by what their two parameters are.
+	 */
+	public static final int FILTER_MEDIAN			= 1;	// window (odd, up to 15), unused
+	public static final int FILTER_EMA				= 2;	// alpha (0, 1], unused
+	public static final int FILTER_KALMAN			= 3;	// process noise, measurement noise; total only
+	public static final int FILTER_OUTLIER			= 4;	// k (deviations), longest run of rejected samples
+	/**
+	 * The native side keeps this many samples for the readers which are behind.
+	 */
+	public static final int MAX_SAMPLES_PER_READ	= 1024;
+	
+	/**
+	 * Boards that can be held for the platform (see holdBoard).
+	 */
+	public static final int MAX_BOARDS				= 4;
+	/**
+	 * Layout of the platform points filled by readFused, in native byte order. Positions are in mm 
+	 * in platform coordinates, as the geometry handed to startFusion.
+	 */
+	public static final int FUSED_RECORD_SIZE		= 44;
+	public static final int FUSED_TIME_OFFSET		= 0;	// long, nanoseconds, same clock as the samples
+	public static final int FUSED_SEQ_OFFSET		= 8;	// int
+	public static final int FUSED_FLAGS_OFFSET		= 12;	// short
+	public static final int FUSED_BOARDS_OFFSET		= 14;	// short, mask of the boards in the point
+	public static final int FUSED_TOTAL_OFFSET		= 16;	// float, KG
+	public static final int FUSED_COP_X_OFFSET		= 20;	// float, mm
+	public static final int FUSED_COP_Y_OFFSET		= 24;	// float, mm
+	public static final int FUSED_BOARD_OFFSET		= 28;	// MAX_BOARDS floats, KG per board
+	/**
+	 * Platform point flags
+	 */
+	public static final int FUSED_FLAG_PARTIAL		= 0x0001;	// a board had no sample near the tick and is left out
+	public static final int FUSED_FLAG_GAP			= 0x0002;	// a board reconnected around the tick
+	public static final int FUSED_FLAG_NO_COP		= 0x0004;	// too little weight for a center of pressure
+	/**
+	 * The native side keeps this many platform points.
+	 */
+	public static final int MAX_FUSED_RECORDS		= 256;
+	
+	/**
+	 * Gateway protocol (see startGateway). A client opens an android.net.LocalSocket on the 
+	 * abstract name and exchanges messages made of a 4 bytes header (byte type, byte stream, 
+	 * unsigned short payload length) and the payload, in native byte order. It says GATEWAY_HELLO 
+	 * with GATEWAY_VERSION first, then subscribes to the streams it wants. A native client may 
+	 * instead ask for GATEWAY_SHARE and read the samples of a stream straight from shared memory, 
+	 * laid out as described in wd_shm.h. Only the processes of this application, and of the ones 
+	 * let in with allowGatewayUser, are taken; the others get GATEWAY_ERR_DENIED.
+	 */
+	public static final String GATEWAY_DEFAULT_NAME	= "iepiscale.gateway";
+	public static final int GATEWAY_VERSION			= 1;
+	public static final int GATEWAY_STREAM_BOARD	= 0;	// the connected board, held boards follow from 1
+	public static final int GATEWAY_HELLO			= 0x01;	// short version
+	public static final int GATEWAY_SUBSCRIBE		= 0x02;	// short samples per second, 0 for all
+	public static final int GATEWAY_UNSUBSCRIBE		= 0x03;	// no payload
+	public static final int GATEWAY_SHARE			= 0x04;	// no payload, asks for the shared ring of the stream
+	public static final int GATEWAY_WELCOME			= 0x81;	// short version, short mask of the streams up
+	public static final int GATEWAY_SAMPLES			= 0x82;	// SAMPLE_RECORD_SIZE bytes records
+	public static final int GATEWAY_DROPPED			= 0x83;	// int samples lost by a client falling behind
+	public static final int GATEWAY_STREAM			= 0x84;	// byte 1 if the stream came up, 0 if it went down
+	public static final int GATEWAY_SHARED			= 0x85;	// short reader index, memory and eventfd descriptors attached
+	public static final int GATEWAY_ERROR			= 0x8F;	// short code, the gateway hangs up after it
+	public static final int GATEWAY_ERR_DENIED		= 4;	// the user of the client is not allowed
+	
+	/**
+	 * Receives the samples pushed by the native side (see setSampleListener). 
+	 */
+	public interface SampleListener
+	{
+		/**
+		 * Called on the native delivery thread with the samples received since the previous call. 
+		 * The buffer is reused for the next call, so anything needed later has to be copied out 
+		 * of it before returning; the UI has to be updated through a Handler.
+		 * @param samples
+		 * The batch, SAMPLE_RECORD_SIZE bytes per sample in native byte order.
+		 * @param count
+		 * The number of samples in the batch.
+		 */
+		public void onSamples(ByteBuffer samples, int count);
+	}
+	
 	// -- import native code -- // 
 	/**
 	 * Retrieves the version information from the native module
@@ -39,6 +225,18 @@ public class BoardInterface
 	 * 1 if the connection to the board established successfully. 
 	 */
 	public native int		intConnect			( int scantime );
+	/**
+	 * Tells the native module where it can keep its files, e.g. the calibration data of the boards 
+	 * it has already connected to. Boards found in there start streaming without waiting for their 
+	 * calibration data to be read again. The samples of every session are kept there too, in 
+	 * samples_&lt;address&gt;.log as SAMPLE_RECORD_SIZE bytes records; those of a session which 
+	 * ended with the process being killed are recovered from its journal by this call.
+	 * @param path
+	 * The files directory of the application.
+	 * @return
+	 * 1 if the directory is accepted, -1 otherwise.
+	 */
+	public native int		setStorageDirectory	( String path );
 	/**
 	 * Retrieves the calibration data from the board and fills the relevant data structures.
 	 * @return
@@ -58,106 +256,316 @@ public class BoardInterface
 	 */
 	public native void 		stopReadingData		( );
 	/**
-	 * Disconnects from the board and releases the created resources.
+	 * Disconnects from the board and releases the created resources, even if other clients still 
+	 * use them. To only let go of the board, see release.
 	 * @return 0 if the device disconnects the board successfully, -1 otherwise.
 	 */
 	public native int 		disconnect			( );
+	/**
+	 * The native side of attach and release.
+	 */
+	private native int		intAttach			( );
+	private native int		intRelease			( );
+	/**
+	 * Sets for how long the board stays connected after the last client has released it, so that 
+	 * a client coming back (e.g. the activity recreated after a rotation) finds it ready. 
+	 * @param linger
+	 * In ms, from 0 (disconnect on the last release) to 600000; 30000 by default.
+	 * @return
+	 * 1 if the time is accepted, -1 otherwise.
+	 */
+	public native int		setSessionLinger	( int linger );
 
 	/**
-	 * Returns whether balance board calibration values are valid or not
-	 * @return 1 if the calibration data are valid, 0 otherwise.
+	 * Fills state with a snapshot of the board, one int per STATE_* index: the raw values of 
+	 * the last report, the battery, the link and the calibration data.
+	 * @param state
+	 * At least STATE_SIZE long.
+	 * @return
+	 * 1 if state has been filled, -1 if it is too short.
 	 */
-	public native int	 	getIsCalibrationDataValid();
+	public native int		readState			( int[] state );
 	/**
-	 * Returns the 0st value for right top of calibration data
+	 * Returns the worst battery event raised by the native battery monitor since the connection. 
+	 * The board is polled for its status periodically, and a board which starts sending all-zero 
+	 * sensor values is reported as BATTERY_SENSORS_DEAD before any of those values is handed out.
 	 * @return
+	 * One of BATTERY_OK, BATTERY_LOW, BATTERY_CRITICAL or BATTERY_SENSORS_DEAD.
 	 */
-	public native int	 	getCalRightTop0();
+	public native int		getBatteryEvent();
 	/**
-	 * Returns the 1st value for right top of calibration data
+	 * Adds a decimated output of the samples, e.g. a few samples per second for a display. Each of 
+	 * its samples is the average of the full rate samples over 1/frequency seconds, and it is read 
+	 * with its own cursor, independent of readSamples and of the other taps. Up to 4 taps per 
+	 * connection.
+	 * @param frequency
+	 * Samples per second.
 	 * @return
+	 * The tap number, -1 if not connected, the frequency is not valid or all the taps are in use.
 	 */
-	public native int	 	getCalRightTop1();
+	public native int		addTap				( int frequency );
 	/**
-	 * Returns the 2nd value for right top of calibration data
+	 * Same as readSamples, for the samples of a tap.
+	 */
+	public native int		readTap				( int tap, ByteBuffer buffer );
+	/**
+	 * Same as awaitSamples, for the samples of a tap.
+	 */
+	public native int		awaitTap			( int tap, ByteBuffer buffer, int timeoutMs );
+	/**
+	 * Sets the chain of filters the samples of this session go through natively, before they reach 
+	 * readSamples, the listener and the await calls. The stages run in the given order, each on the 
+	 * four corners and the total separately (the Kalman filter only on the total).
+	 * @param types
+	 * One of the FILTER_* constants per stage, up to 8 stages. An empty array removes the filters.
+	 * @param params
+	 * Two parameters per stage, see the FILTER_* constants.
 	 * @return
-	 */	
-	public native int	 	getCalRightTop2();
+	 * 1 if successful, -1 if not connected or the chain is not valid.
+	 */
+	public native int		setFilters			( int[] types, float[] params );
 	/**
-	 * Returns the 0st value for left top of calibration data
+	 * Returns the state of the link to the board. When the link drops, the native side reconnects 
+	 * to the same board on its own and resumes the session with the calibration data it already 
+	 * has; the first sample after that is flagged with SAMPLE_FLAG_GAP.
 	 * @return
+	 * One of LINK_UP, LINK_RECONNECTING or LINK_LOST.
 	 */
-	public native int	 	getCalLeftTop0();
+	public native int		getLinkState();
 	/**
-	 * Returns the 1st value for left top of calibration data
+	 * Sets how long the Bluetooth controller waits for the board before it drops the link, 
+	 * 2 seconds by default. Kept across the reconnections of the session.
+	 * @param timeoutMs
+	 * In milliseconds, up to 40900; 0 leaves the controller default from the next connection on.
 	 * @return
+	 * 1 if successful, -1 if not connected or the controller refuses it.
 	 */
-	public native int	 	getCalLeftTop1();
+	public native int		setSupervisionTimeout( int timeoutMs );
 	/**
-	 * Returns the 2nd value for left top of calibration data
+	 * Sets how long the stream of weights may stay silent before the link is flagged as 
+	 * LINK_STALLED, 300 ms by default. If it stays silent for as long again, the native side drops 
+	 * the link and reconnects.
+	 * @param timeoutMs
+	 * In milliseconds, 0 to turn the watchdog off.
 	 * @return
+	 * 1 if successful, -1 if not connected.
 	 */
-	public native int	 	getCalLeftTop2();
+	public native int		setWatchdogTimeout	( int timeoutMs );
 	/**
-	 * Returns the 0st value for right bottom of calibration data
+	 * Returns the alerts of the last reading of the link monitor, which tells a stream stalled by 
+	 * the radio (phone too far from the board) from one stalled by the board.
 	 * @return
+	 * A mask of LINK_ALERT_* values, 0 if not connected.
 	 */
-	public native int	 	getCalRightBottom0();
+	public native int		getLinkAlerts();
 	/**
-	 * Returns the 1st value for right bottom of calibration data
+	 * Fills the buffer with the readings of the link monitor filed since the last call: RSSI and 
+	 * link quality of the connection, along with the gaps and jitter of the reports in between.
+	 * @param buffer
+	 * A direct buffer in native byte order, holding LINK_RECORD_SIZE bytes per reading.
 	 * @return
+	 * The number of readings written to the buffer, -1 if not connected.
 	 */
-	public native int	 	getCalRightBottom1();
+	public native int		readLinkStats		( ByteBuffer buffer );
 	/**
-	 * Returns the 2nd value for right bottom of calibration data
+	 * Sets the connected board aside for the platform. It keeps streaming, and the next intConnect 
+	 * or ConnectCalibrateRead looks for another board; the per board calls (readSamples, 
+	 * getLinkState, ...) then apply to that one. The board has to be calibrated.
 	 * @return
+	 * The index of the board on the platform, -1 if not connected, not calibrated or MAX_BOARDS 
+	 * boards are held already.
 	 */
-	public native int	 	getCalRightBottom2();
+	public native int		holdBoard();
 	/**
-	 * Returns the 0st value for left bottom of calibration data
+	 * Returns the report period of the board, as fitted over the arrival times of the last reports. 
+	 * The sample timestamps are taken from this fit rather than from the arrivals, which carry 
+	 * the jitter of the radio and of the scheduler.
 	 * @return
+	 * The period in milliseconds, 0 until it is known or if not connected.
 	 */
-	public native int	 	getCalLeftBottom0();
+	public native float		getReportPeriod();
 	/**
-	 * Returns the 1st value for left bottom of calibration data
+	 * Returns what to add to a sample timestamp to get the wall clock time, in nanoseconds since 
+	 * the epoch. It is taken once when the connection is made, so the timestamps of a session do 
+	 * not jump when the wall clock is adjusted.
 	 * @return
+	 * The offset in nanoseconds, 0 if not connected.
 	 */
-	public native int	 	getCalLeftBottom1();
+	public native long		getWallClockOffset();
 	/**
-	 * Returns the 2nd value for left bottom of calibration data
+	 * Sets how reports lost on the way are made up for. A gap of up to maxGapMs is bridged with 
+	 * samples flagged SAMPLE_FLAG_SYNTHETIC, interpolated between the samples either side of it; 
+	 * after a longer one the next sample is flagged SAMPLE_FLAG_GAP, and windowed computations 
+	 * should start over. Linear bridging of gaps up to 50 ms by default.
+	 * @param mode
+	 * One of GAP_FILL_*.
 	 * @return
+	 * 1 if successful, -1 if not connected or the mode is not valid.
 	 */
-	public native int	 	getCalLeftBottom2();
+	public native int		setGapFill			( int mode, int maxGapMs );
 	/**
-	 * Returns whether balance board weight values are valid or not
+	 * Fills the buffer with the statistics of the session: time base, gaps and reconnections.
+	 * @param buffer
+	 * A direct buffer in native byte order, of SESSION_RECORD_SIZE bytes at least.
 	 * @return
+	 * 1 if successful, -1 if not connected.
 	 */
-	public native int	 	getIsBalanceDataValid();
+	public native int		readSessionStats	( ByteBuffer buffer );
 	/**
-	 * Returns the top right value of the board
+	 * Serves the samples to the other applications of the device over a local socket, so that 
+	 * they all share the connection of this one instead of each owning the board. Every client 
+	 * subscribes to the streams it needs at its own rate; a client that does not keep up loses 
+	 * samples, which it is told about, and never holds the others up. See GATEWAY_*.
+	 * @param name
+	 * Name of the socket in the abstract namespace, null for GATEWAY_DEFAULT_NAME.
 	 * @return
+	 * 1 if successful, -4 if the socket cannot be opened.
+	 */
+	public native int		startGateway		( String name );
+	/**
+	 * Hangs up on the gateway clients and stops serving.
 	 */
-	public native int	 	getTopRightValue();
+	public native void		stopGateway();
 	/**
-	 * Returns the top left value of the board
+	 * Lets the applications running as the given user (see ApplicationInfo.uid) connect to the 
+	 * gateway started with startGateway.
 	 * @return
+	 * 1 if successful, -1 if the gateway is not running or too many users are allowed.
 	 */
-	public native int	 	getTopLeftValue();
+	public native int		allowGatewayUser	( int uid );
 	/**
-	 * Returns the bottom right value of the board
+	 * Starts fusing the held boards into one platform. The boards report at slightly different 
+	 * moments; the native side interpolates each of them to a common tick, a few tens of 
+	 * milliseconds behind real time, and computes the total weight and the center of pressure 
+	 * of the platform from all the corners at once.
+	 * @param geometry
+	 * x, y (mm) and angle (degrees, counterclockwise) of the center of every held board on the 
+	 * platform, in the order they have been held. Unrotated, x points to the right of a board.
+	 * @param rate
+	 * Points per second, 0 for 100.
 	 * @return
+	 * 1 if successful, -1 if no board is held or the geometry does not match them.
+	 */
+	public native int		startFusion			( float[] geometry, int rate );
+	/**
+	 * Stops the platform, the held boards keep streaming.
 	 */
-	public native int	 	getBottomRightValue();
+	public native void		stopFusion();
 	/**
-	 * Returns the bottom left value of the board
+	 * Fills the buffer with the platform points fused since the last call.
+	 * @param buffer
+	 * A direct buffer in native byte order, holding FUSED_RECORD_SIZE bytes per point.
 	 * @return
+	 * The number of points written to the buffer, -1 if the platform is not running.
 	 */
-	public native int	 	getBottomLeftValue();
+	public native int		readFused			( ByteBuffer buffer );
 	/**
-	 * Returns the battery level of the balance board, received from Wii message 0x20.
+	 * Stops the platform and disconnects from every held board.
+	 */
+	public native int		releaseBoards();
+	/**
+	 * Fills the buffer with the calibrated samples received since the last call. The board starts 
+	 * streaming before its calibration data is read, so the first samples of a connection show up 
+	 * here once the calibration data is known, none of them is dropped.
+	 * @param buffer
+	 * A direct buffer in native byte order, holding SAMPLE_RECORD_SIZE bytes per sample.
+	 * @return
+	 * The number of samples written to the buffer, -1 if not connected.
+	 */
+	public native int		readSamples			( ByteBuffer buffer );
+	/**
+	 * Same as readSamples, but if no sample has arrived since the last call, blocks until one 
+	 * arrives or the timeout expires. 
+	 * @param buffer
+	 * A direct buffer in native byte order, holding SAMPLE_RECORD_SIZE bytes per sample.
+	 * @param timeoutMs
+	 * Longest time to wait, in milliseconds.
+	 * @return
+	 * The number of samples written to the buffer, 0 on timeout, -1 if not connected or 
+	 * disconnected while waiting.
+	 */
+	public native int		awaitSamples		( ByteBuffer buffer, int timeoutMs );
+	/**
+	 * Blocks until the total weight of the samples that arrive from now on stays steady for a 
+	 * second, within half a KG, or the timeout expires. 
+	 * @param timeoutMs
+	 * Longest time to wait, in milliseconds.
 	 * @return
+	 * The mean of the steady weights in KG, NaN on timeout or if not connected.
+	 */
+	public native float		awaitStableWeight	( int timeoutMs );
+	/**
+	 * The native side of setSampleListener. buffer is the direct buffer handed to the listener.
 	 */
-	public native int		getBatteryLevel();
+	private native int		intSetSampleListener( SampleListener listener, ByteBuffer buffer, int maxFrequency );
+	/**
+	 * Registers the listener that the samples are pushed to, replacing the one registered before. 
+	 * Nothing wakes up while no samples arrive; otherwise the samples are handed over as soon as 
+	 * they are calibrated, batched so that the listener is called at most maxFrequency times per 
+	 * second. The listener is removed on disconnection.
+	 * @param listener
+	 * The listener, or null to remove the current one.
+	 * @param maxFrequency
+	 * Maximum number of calls per second, 0 for no limit.
+	 * @return
+	 * 1 if successful, -1 if not connected or the listener cannot be registered.
+	 */
+	public int setSampleListener(SampleListener listener, int maxFrequency)
+	{
+		ByteBuffer buffer = null;
+		if(listener != null)
+			buffer = ByteBuffer.allocateDirect(SAMPLE_RECORD_SIZE * MAX_SAMPLES_PER_READ)
+								.order(ByteOrder.nativeOrder());
+		return intSetSampleListener(listener, buffer, maxFrequency);
+	}
+
+	/**
+	 * Whether this object holds the native session, so that it is released once only.
+	 */
+	private boolean blnAttached = false;
+	
+	/**
+	 * Connects to the board, or takes the current session if the board is still connected 
+	 * (see ConnectCalibrateRead). Has to be matched by release.
+	 * @return
+	 * The result of ConnectCalibrateRead.
+	 */
+	public int connect(int scantime)
+	{
+		if(blnAttached)
+			return 1;
+		int result = ConnectCalibrateRead(scantime);
+		blnAttached = (result == 1);
+		return result;
+	}
+	
+	/**
+	 * Takes the session of a board which is still connected, without searching for one.
+	 * @return
+	 * 1 if there was a session to take, -1 otherwise.
+	 */
+	public int attach()
+	{
+		if(blnAttached)
+			return 1;
+		int result = intAttach();
+		blnAttached = (result == 1);
+		return result;
+	}
+	
+	/**
+	 * Lets go of the session. Once no client is left the board stays connected for the linger 
+	 * time (see setSessionLinger), then it is disconnected. Safe to call more than once.
+	 * @return
+	 * 1 if the session was held, -1 otherwise.
+	 */
+	public int release()
+	{
+		if(!blnAttached)
+			return -1;
+		blnAttached = false;
+		return intRelease();
+	}
 
 	public BoardInterface()
 	{	}
@@ -51,6 +51,8 @@ import android.widget.RadioButton;
 import android.widget.TextView;
 
 import java.io.*;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 
 import junit.framework.Assert;
 
@@ -78,9 +80,15 @@ public class iEpiScale extends Activity
 	 */
 	private static final String	DATA_FILE_EXT		= ".scaledat";
 	/**
-	 * Interval between each weight update operation in milliseconds
+	 * Longest time in milliseconds to wait for a stable weight, before the state of the board is 
+	 * checked again
 	 */
 	private static final int	WEIGHT_UPDATE_INTERVAL = 3000;
+	/**
+	 * Maximum number of times per second the displayed weight is refreshed with the samples pushed 
+	 * by the board.
+	 */
+	private static final int	WEIGHT_DISPLAY_FREQUENCY = 10;
 	/**
 	 * The value here shows the minimum total weight that sensors can show, while we still can 
 	 * interpret it as the correct value (e.g. due to holding the sensors upside down, etc.)
@@ -130,6 +138,10 @@ public class iEpiScale extends Activity
 	 * the thread stops reading data.
 	 */
 	private static boolean 		blnShouldStop		= false;
+	/**
+	 * The task reading the weight, null while there is none.
+	 */
+	private			WeightRep	weightRep			= null;
 	/**
 	 * GUI elements
 	 */
@@ -144,14 +156,6 @@ public class iEpiScale extends Activity
 	 * BoardInterface object which allows this activity to connect to the board.
 	 */
 	static BoardInterface		boardInterface;
-	/**
-	 * The following arrays hold the calibration data for the board. Each cell of the board has 3 
-	 * calibration values, being held at the relevant array.
-	 */
-	private int[] 				calibrationDataLT 	= new int[3];
-	private int[] 				calibrationDataLB 	= new int[3];
-	private int[] 				calibrationDataRT 	= new int[3];
-	private int[] 				calibrationDataRB 	= new int[3];
 	/**
 	 * Determines whether the program is already connected to a board (true) or not (false).
 	 */
@@ -177,6 +181,10 @@ public class iEpiScale extends Activity
 			boardInterface = new BoardInterface();
 		else 
 			Log.d(LOG_TAG,"The Native Bluetooth Interface object already exist!");
+		boardInterface.setStorageDirectory(getFilesDir().getAbsolutePath());
+		// The board may still be connected from before, e.g. a rotation; take it as it is
+		if(boardInterface.attach() == 1)
+			setTextView(1);
 		
 		// Retrieving device MAC address and recording it ...
 		BluetoothAdapter btAdapter = BluetoothAdapter.getDefaultAdapter();
@@ -294,7 +302,7 @@ public class iEpiScale extends Activity
 							{
 								public void run() 
 								{
-									final int result = boardInterface.ConnectCalibrateRead(3);
+									final int result = boardInterface.connect(3);
 									mHandler.post(new Runnable()
 										{
 											public void run()
@@ -338,25 +346,16 @@ public class iEpiScale extends Activity
 	
 	public void PostConnectionProcess()
 	{
-		calibrationDataLT[0] = boardInterface.getCalLeftTop0();
-		calibrationDataLT[1] = boardInterface.getCalLeftTop1();
-		calibrationDataLT[2] = boardInterface.getCalLeftTop2();
-		
-		calibrationDataLB[0] = boardInterface.getCalLeftBottom0();
-		calibrationDataLB[1] = boardInterface.getCalLeftBottom1();
-		calibrationDataLB[2] = boardInterface.getCalLeftBottom2();
-		
-		calibrationDataRT[0] = boardInterface.getCalRightTop0();
-		calibrationDataRT[1] = boardInterface.getCalRightTop1();
-		calibrationDataRT[2] = boardInterface.getCalRightTop2();
-		
-		calibrationDataRB[0] = boardInterface.getCalRightBottom0();
-		calibrationDataRB[1] = boardInterface.getCalRightBottom1();
-		calibrationDataRB[2] = boardInterface.getCalRightBottom2();
-			
 		Log.d(LOG_TAG,"Going to start the thread!");
 		blnShouldStop = false;
-		new WeightRep().execute();
+		// Spikes are dropped and the rest smoothed before anything is shown or recorded
+		if(boardInterface.setFilters(new int[] {BoardInterface.FILTER_OUTLIER, BoardInterface.FILTER_MEDIAN}, 
+									 new float[] {4, 10, 5, 0}) != 1)
+			Log.d(LOG_TAG,"Could not set the filters!");
+		weightRep = new WeightRep();
+		weightRep.execute();
+		if(boardInterface.setSampleListener(new WeightListener(), WEIGHT_DISPLAY_FREQUENCY) != 1)
+			Log.d(LOG_TAG,"Could not register the sample listener!");
 		blnIsConnected = true;
 	}
 	
@@ -364,7 +363,7 @@ public class iEpiScale extends Activity
 	{
 		public void onClick(View v) 
 		{
-			blnShouldStop = true;
+			StopWeightRep();
 			
 			// Now disconnect from the board ...
 			
@@ -373,6 +372,20 @@ public class iEpiScale extends Activity
 		}
 	};    
 
+	/**
+	 * Stops the task reading the weight. It has to be stopped before the board interface is released, 
+	 * so that it does not go on calling the board afterwards.
+	 */
+	private void StopWeightRep()
+	{
+		blnShouldStop = true;
+		if(weightRep != null)
+		{
+			weightRep.cancel(false);
+			weightRep = null;
+		}
+	}
+	
 	private void Disconnect()
 	{
 		int result = boardInterface.disconnect();
@@ -384,10 +397,58 @@ public class iEpiScale extends Activity
 			txtvInfo.setText(R.string.UnknownErrorMessage);		
 	}
 	
+	/**
+	 * Shows the weight as soon as the board sends it. Recording and the checks on the board are left 
+	 * to WeightRep.
+	 */
+	private class WeightListener implements BoardInterface.SampleListener
+	{
+		public void onSamples(ByteBuffer samples, int count)
+		{
+			// Only the latest sample of the batch is shown
+			final float total = samples.getFloat((count - 1) * BoardInterface.SAMPLE_RECORD_SIZE + 
+												 BoardInterface.SAMPLE_TOTAL_OFFSET);
+			mHandler.post(new Runnable()
+			{
+				public void run()
+				{
+					if(!blnShouldStop && total >= MIN_TOTAL_WEIGHT_FROM_SENSORS)
+						ShowWeight(total);
+				}
+			});
+		}
+	}
+	
+	private void ShowWeight(double weight)
+	{
+		int intScaleResourceId;
+		if(rbtnKg.isChecked())
+			intScaleResourceId = R.string.kilogram;
+		else
+		{
+			intScaleResourceId = R.string.pound;
+			weight *= KG_TO_LBS_RATIO;
+		}
+		txtResult.setText(dfmTwoDecimalFormat.format(weight) + " " + getResources().getString(intScaleResourceId));
+	}
+	
 	private class WeightRep extends AsyncTask<Void,Void,Void>
 	{
 		double totalWeight = 0.0;
 		int sampleCounter = 0;
+		int batteryEvent = BoardInterface.BATTERY_OK;
+		int linkState = BoardInterface.LINK_UP;
+		boolean blnGap = false;
+		/**
+		 * The interface the task was started with, the activity may let go of its own meanwhile.
+		 */
+		final BoardInterface board = boardInterface;
+		/**
+		 * Receives the samples from the native side, reused for every read.
+		 */
+		ByteBuffer sampleBuffer = ByteBuffer.allocateDirect(BoardInterface.SAMPLE_RECORD_SIZE * 
+															BoardInterface.MAX_SAMPLES_PER_READ)
+											.order(ByteOrder.nativeOrder());
 		
 		public WeightRep()
 		{
@@ -397,119 +458,88 @@ public class iEpiScale extends Activity
 		@Override
 		protected Void doInBackground(Void... params) 
 		{
-			try
+			// No sleeping here, the native side blocks until there is something to show
+			while(!blnShouldStop && !isCancelled())
 			{
-				while(!blnShouldStop)
-				{
-					UpdateWeight();
+				if(UpdateWeight())
 					publishProgress();
-					Thread.sleep(WEIGHT_UPDATE_INTERVAL);
-				}
-			}
-			catch(InterruptedException ex)
-			{
-				Log.d(LOG_TAG,"ERROR: " + ex.toString());
 			}
 			return null;
 		}
 
-		public void UpdateWeight()
+		/**
+		 * Waits for the next stable weight.
+		 * @return
+		 * true if there is something to report, i.e. a new weight or a problem with the board.
+		 */
+		public boolean UpdateWeight()
 		{
-			if(boardInterface.getIsBalanceDataValid() == 1)
+			batteryEvent = board.getBatteryEvent();
+			if(batteryEvent >= BoardInterface.BATTERY_CRITICAL)
 			{
-				int tlValue = boardInterface.getTopLeftValue();
-				int trValue = boardInterface.getTopRightValue();
-				int blValue = boardInterface.getBottomLeftValue();
-				int brValue = boardInterface.getBottomRightValue();
-				
-				double tlWeight, trWeight, blWeight, brWeight;
-				if(tlValue < calibrationDataLT[1])
-				{
-					tlWeight = 0 + 
-						(((((double)tlValue - (double)calibrationDataLT[0]) * 17.0) - 
-						  (((double)tlValue - (double)calibrationDataLT[0]) *  0.0)) / 
-								((double)calibrationDataLT[1] - (double)calibrationDataLT[0]));
-				}
-				else
-				{
-					tlWeight = 17.0 + 
-					(((((double)tlValue - (double)calibrationDataLT[1]) * 34.0) - 
-					  (((double)tlValue - (double)calibrationDataLT[1]) * 17.0)) / 
-							((double)calibrationDataLT[2] - (double)calibrationDataLT[1]));
-				}
-				
-				if(trValue < calibrationDataRT[1])
-				{
-					trWeight = 0 + 
-					(((((double)trValue - (double)calibrationDataRT[0]) * 17.0) - 
-							  (((double)trValue - (double)calibrationDataRT[0]) *  0.0)) / 
-									((double)calibrationDataRT[1] - (double)calibrationDataRT[0]));
-				}
-				else
-				{
-					trWeight = 17.0 + 
-					(((((double)trValue - (double)calibrationDataRT[1]) * 34.0) - 
-							  (((double)trValue - (double)calibrationDataRT[1]) * 17.0)) / 
-									((double)calibrationDataRT[2] - (double)calibrationDataRT[1]));
-				}
-				
-				if(blValue < calibrationDataLB[1])
-				{
-					blWeight = 0 + 
-					(((((double)blValue - (double)calibrationDataLB[0]) * 17.0) - 
-							  (((double)blValue - (double)calibrationDataLB[0]) *  0.0)) / 
-									((double)calibrationDataLB[1] - (double)calibrationDataLB[0]));
-				}
-				else
-				{
-					blWeight = 17.0 + 
-					(((((double)blValue - (double)calibrationDataLB[1]) * 34.0) - 
-							  (((double)blValue - (double)calibrationDataLB[1]) * 17.0)) / 
-									((double)calibrationDataLB[2] - (double)calibrationDataLB[1]));
-				}
-				
-				if(brValue < calibrationDataRB[1])
-				{
-					brWeight = 0 + 
-					(((((double)brValue - (double)calibrationDataRB[0]) * 17.0) - 
-							  (((double)brValue - (double)calibrationDataRB[0]) *  0.0)) / 
-									((double)calibrationDataRB[1] - (double)calibrationDataRB[0]));
-				}
-				else
-				{
-					brWeight = 17.0 + 
-					(((((double)brValue - (double)calibrationDataRB[1]) * 34.0) - 
-							  (((double)brValue - (double)calibrationDataRB[1]) * 17.0)) / 
-									((double)calibrationDataRB[2] - (double)calibrationDataRB[1]));
-				}
-				
-				totalWeight = trWeight + tlWeight + brWeight + blWeight;				
+				// The native monitor saw the board degrade; whatever the sensors say now is garbage.
+				totalWeight = -1;
+				return true;
 			}
-			else
+			
+			// Samples come calibrated from the native side; a weight is only recorded once it 
+			// has settled.
+			float weight = board.awaitStableWeight(WEIGHT_UPDATE_INTERVAL);
+			linkState = board.getLinkState();
+			
+			// Go through what has been received meanwhile, for the gaps in the stream
+			int count = board.readSamples(sampleBuffer);
+			for(int i = 0; i < count; i++)
 			{
-				totalWeight = -1;
+				if((sampleBuffer.getInt(i * BoardInterface.SAMPLE_RECORD_SIZE + 
+										BoardInterface.SAMPLE_FLAGS_OFFSET) & BoardInterface.SAMPLE_FLAG_GAP) != 0)
+					blnGap = true;
 			}
+			
+			if(Float.isNaN(weight))
+			{
+				// Still moving, or nothing received
+				return linkState != BoardInterface.LINK_UP;
+			}
+			totalWeight = weight;
+			return true;
 		}
 		
 		protected void onProgressUpdate(Void... params) 
 		{
+			// Released meanwhile, the board is not ours any more
+			if(isCancelled())
+				return;
 			try
 			{
-				int intScaleResourceId;
-				double weightToDisplay = totalWeight;
-				if(rbtnKg.isChecked())
-					intScaleResourceId = R.string.kilogram;
-				else
+				if(batteryEvent >= BoardInterface.BATTERY_CRITICAL)
 				{
-					intScaleResourceId = R.string.pound;
-					weightToDisplay *= KG_TO_LBS_RATIO;
+					blnShouldStop = true;
+					board.disconnect();
+					txtResult.setText("");
+					txtvInfo.setText(R.string.LowBatteryErrorMessage);
 				}
-				if(totalWeight != -1)
+				else if(linkState == BoardInterface.LINK_LOST)
 				{
+					blnShouldStop = true;
+					board.disconnect();
+					txtResult.setText("");
+					txtvInfo.setText(R.string.LinkLostMessage);
+				}
+				else if(linkState == BoardInterface.LINK_RECONNECTING || 
+						linkState == BoardInterface.LINK_STALLED)
+				{
+					txtvInfo.setText(R.string.ReconnectingMessage);
+				}
+				else if(totalWeight != -1)
+				{
+					if(batteryEvent == BoardInterface.BATTERY_LOW)
+						txtvInfo.setText(R.string.LowBatteryWarningMessage);
+					
 					if(totalWeight < MIN_TOTAL_WEIGHT_FROM_SENSORS)
 					{
 						blnShouldStop = true;
-						boardInterface.disconnect();
+						board.disconnect();
 						txtvInfo.setText(R.string.LowBatteryErrorMessage);
 					}
 					else
@@ -517,7 +547,7 @@ public class iEpiScale extends Activity
 						if(totalWeight > MIN_HUMAN_WEIGHT)
 							sampleCounter++;
 						
-						txtResult.setText(dfmTwoDecimalFormat.format(weightToDisplay) + " " + getResources().getString(intScaleResourceId));
+						ShowWeight(totalWeight);
 						if(!chkNotRecord.isChecked())
 						{
 							Date dtCurrentTime = Calendar.getInstance().getTime();
@@ -526,6 +556,12 @@ public class iEpiScale extends Activity
 														sdfFileDateFormat.format(dtCurrentTime) + 
 														DATA_FILE_EXT);
 							FileWriter fwStorage = new FileWriter(flRecord, true);
+							if(blnGap)
+							{
+								// The board was out of reach for a while, keep it apparent in the record
+								fwStorage.append(sdfStorageDateFormat.format(dtCurrentTime) + "\tgap\n");
+								blnGap = false;
+							}
 							fwStorage.append(sdfStorageDateFormat.format(dtCurrentTime) + "\t" + totalWeight + "\n");
 							fwStorage.close();
 						}
@@ -554,14 +590,15 @@ public class iEpiScale extends Activity
 	{
 		super.onPause();
 		Log.d(LOG_TAG, "onPause called.");
+		StopWeightRep();
 		if(boardInterface != null)
 		{
-			Log.d(LOG_TAG, "onPause: Interface is not null. Going to call disconnect!");
-			boardInterface.disconnect();
+			Log.d(LOG_TAG, "onPause: Interface is not null. Going to call release!");
+			boardInterface.release();
 			boardInterface = null;
 		}
 		else
-			Log.d(LOG_TAG, "onPause: Interface was null. Skipped disconnection.");
+			Log.d(LOG_TAG, "onPause: Interface was null. Skipped release.");
 		finish();
 	}
 	
@@ -575,16 +612,16 @@ public class iEpiScale extends Activity
 	{
 		super.onStop();
 		Log.d(LOG_TAG, "onStop called");
-		blnShouldStop = true;
+		StopWeightRep();
 		
 		if(boardInterface != null)
 		{
-			Log.d(LOG_TAG, "onStop: Interface is not null. Going to call disconnect!");
-			boardInterface.disconnect();
+			Log.d(LOG_TAG, "onStop: Interface is not null. Going to call release!");
+			boardInterface.release();
 			boardInterface = null;
 		}
 		else
-			Log.d(LOG_TAG, "onStop: Interface was null. Skipped disconnection.");
+			Log.d(LOG_TAG, "onStop: Interface was null. Skipped release.");
 		finish();
 	}
 	
@@ -592,14 +629,15 @@ public class iEpiScale extends Activity
 	{
 	    if ((keyCode == KeyEvent.KEYCODE_BACK) || (keyCode == KeyEvent.KEYCODE_HOME))
 	    {
+			StopWeightRep();
 			if(boardInterface != null)
 			{
-				Log.d(LOG_TAG, "onKeyDown: Interface is not null. Going to call disconnect!");
-				boardInterface.disconnect();
+				Log.d(LOG_TAG, "onKeyDown: Interface is not null. Going to call release!");
+				boardInterface.release();
 				boardInterface = null;
 			}
 			else
-				Log.d(LOG_TAG, "onKeyDown: Interface was null. Skipped disconnection.");
+				Log.d(LOG_TAG, "onKeyDown: Interface was null. Skipped release.");
 	        finish();
 	    }
 	    return super.onKeyDown(keyCode, event);
@@ -609,19 +647,19 @@ public class iEpiScale extends Activity
 	{
 		super.onDestroy();
 		Log.d(LOG_TAG, "onDestroy called.");
-		blnShouldStop = true;
+		StopWeightRep();
 		
 		if(boardInterface != null)
 		{
 			if(blnIsConnected)
 			{
-				Log.d(LOG_TAG, "onDestroy: Interface is not null. Going to call disconnect!");
-				boardInterface.disconnect();
+				Log.d(LOG_TAG, "onDestroy: Interface is not null. Going to call release!");
+				boardInterface.release();
 			}
 			boardInterface = null;
 		}
 		else
-			Log.d(LOG_TAG, "onDestroy: Interface was null. Skipped disconnection.");
+			Log.d(LOG_TAG, "onDestroy: Interface was null. Skipped release.");
 	}
 	
 	public static final long convertMacToLong(String mac)